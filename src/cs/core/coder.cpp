@@ -17,6 +17,7 @@
  */
 
 #include "coder.hpp"
+#include "../trace.hpp"
 #include "jsoncons/json.hpp"
 #include "cs/obytestream.hpp"
 #include <cassert>
@@ -37,7 +38,8 @@ public:
     CoderImpl(CoderImpl&&) = default;
     CoderImpl() = default;
     virtual std::unique_ptr<Message> decode_msg(bool, const char*, size_t, const char*, size_t) = 0;
-    virtual std::string encode_msg(const Message&) = 0;
+    /// appends the encoded frame to the given string
+    virtual void encode_msg(const Message&, std::string&) = 0;
 };
 
 namespace coder
@@ -47,6 +49,359 @@ namespace coder
 namespace jsoni
 {
 
+/*** streaming decode ***/
+
+/**
+ * Read only streambuf over the encoded message, so the json reader consumes it in place from the
+ * ProtocolState input buffer instead of from a std::string copy
+ */
+class Imembuf: public std::streambuf
+{
+public:
+    Imembuf(const char* data, size_t sz)
+    {
+        char* p = const_cast<char*>(data);
+        setg(p, p, p + sz);
+    }
+};
+
+/**
+ * Streaming input handler for messages.
+ *
+ * The top level "files" array of Update messages can be several MB, so instead of building a DOM
+ * for it, its elements are decoded directly into a vector of MFile. Every other member is small and
+ * is forwarded to a regular json_deserializer, the resulting DOM is used by the decode functions
+ * below.
+ *
+ * The message type is not known until the "type" member is read, which can come after "files", so
+ * errors in the files are not thrown here but saved in m_files_error and reported only when
+ * decoding an Update.
+ */
+class MsgInputHandler: public jsoncons::json_input_handler
+{
+    enum class FileField: unsigned
+    {
+        NONE = 0,
+        CHECKSUM,
+        PATH,
+        LAST_CHANGED_BY,
+        LAST_CHANGED_REV,
+        MTIME,
+        SIZE,
+        DELETED,
+        MODE,
+    };
+
+    /// fields that must be present in every file, deleted is optional
+    static const unsigned s_required_fields =
+          1u << static_cast<unsigned>(FileField::CHECKSUM)
+        | 1u << static_cast<unsigned>(FileField::PATH)
+        | 1u << static_cast<unsigned>(FileField::LAST_CHANGED_BY)
+        | 1u << static_cast<unsigned>(FileField::LAST_CHANGED_REV)
+        | 1u << static_cast<unsigned>(FileField::MTIME)
+        | 1u << static_cast<unsigned>(FileField::SIZE)
+        | 1u << static_cast<unsigned>(FileField::MODE);
+
+    /// lower bound of the encoded size of a file, used to reserve the files vector
+    static const size_t s_encoded_mfile_sz_min = 192;
+
+public:
+    explicit MsgInputHandler(size_t encoded_sz):
+          m_dom()
+        , m_files()
+        , m_files_error()
+        , m_encoded_sz(encoded_sz)
+        , m_depth()
+        , m_files_pending()
+        , m_in_files()
+        , m_field(FileField::NONE)
+        , m_fields_seen()
+    {}
+
+    jsoncons::json& root()
+    {
+        return m_dom.root();
+    }
+
+    void begin_json() override
+    {
+    }
+
+    void end_json() override
+    {
+    }
+
+    void begin_object(const jsoncons::parsing_context& context) override
+    {
+        ++m_depth;
+        if (m_in_files)
+        {
+            if (m_depth == 3)
+            {
+                m_files.emplace_back();
+                m_files.back().deleted = false;
+                m_fields_seen = 0;
+            }
+            else
+                nested_in_file();
+            return;
+        }
+        forward_pending_files_name(context);
+        m_dom.begin_object(context);
+    }
+
+    void end_object(const jsoncons::parsing_context& context) override
+    {
+        if (m_in_files)
+        {
+            if (m_depth == 3 && (m_fields_seen & s_required_fields) != s_required_fields)
+                set_files_error(fs("file #" << m_files.size() - 1 << " is missing required fields"));
+            --m_depth;
+            return;
+        }
+        m_dom.end_object(context);
+        --m_depth;
+    }
+
+    void begin_array(const jsoncons::parsing_context& context) override
+    {
+        ++m_depth;
+        if (m_files_pending)
+        {
+            assert(m_depth == 2);
+            m_files_pending = false;
+            m_in_files = true;
+            m_files.reserve(std::max(context.minimum_structure_capacity(), m_encoded_sz / s_encoded_mfile_sz_min));
+            return;
+        }
+        if (m_in_files)
+        {
+            if (m_depth == 3)
+                set_files_error("unexpected array in files");
+            else
+                nested_in_file();
+            return;
+        }
+        m_dom.begin_array(context);
+    }
+
+    void end_array(const jsoncons::parsing_context& context) override
+    {
+        if (m_in_files)
+        {
+            if (m_depth == 2)
+                m_in_files = false;
+            --m_depth;
+            return;
+        }
+        m_dom.end_array(context);
+        --m_depth;
+    }
+
+    void name(const std::string& name, const jsoncons::parsing_context& context) override
+    {
+        if (m_in_files)
+        {
+            if (m_depth == 3)
+                m_field = file_field(name);
+            return;
+        }
+        if (m_depth == 1 && name == "files")
+        {
+            m_files_pending = true;
+            return;
+        }
+        m_dom.name(name, context);
+    }
+
+    void value(const std::string& value, const jsoncons::parsing_context& context) override
+    {
+        if (! file_value(context))
+        {
+            m_dom.value(value, context);
+            return;
+        }
+        switch (m_field)
+        {
+        case FileField::CHECKSUM:
+            m_files.back().checksum = value;
+            break;
+        case FileField::PATH:
+            m_files.back().path = value;
+            break;
+        case FileField::LAST_CHANGED_BY:
+            m_files.back().last_changed_by = value;
+            break;
+        case FileField::MTIME:
+            m_files.back().mtime = value;
+            break;
+        case FileField::NONE:
+            return;
+        default:
+            set_files_error("unexpected string value in file");
+            return;
+        }
+        seen(m_field);
+    }
+
+    void value(double value, const jsoncons::parsing_context& context) override
+    {
+        if (! file_value(context))
+            m_dom.value(value, context);
+        else if (m_field != FileField::NONE)
+            set_files_error("unexpected floating point value in file");
+    }
+
+    void value(long long value, const jsoncons::parsing_context& context) override
+    {
+        if (! file_value(context))
+            m_dom.value(value, context);
+        else if (m_field != FileField::NONE)
+            set_files_error("unexpected negative value in file");
+    }
+
+    void value(unsigned long long value, const jsoncons::parsing_context& context) override
+    {
+        if (! file_value(context))
+        {
+            m_dom.value(value, context);
+            return;
+        }
+        switch (m_field)
+        {
+        case FileField::LAST_CHANGED_REV:
+            m_files.back().last_changed_rev = value;
+            break;
+        case FileField::SIZE:
+            m_files.back().size = value;
+            break;
+        case FileField::MODE:
+            m_files.back().mode = static_cast<u16>(value);
+            break;
+        case FileField::NONE:
+            return;
+        default:
+            set_files_error("unexpected integer value in file");
+            return;
+        }
+        seen(m_field);
+    }
+
+    void value(bool value, const jsoncons::parsing_context& context) override
+    {
+        if (! file_value(context))
+        {
+            m_dom.value(value, context);
+            return;
+        }
+        if (m_field == FileField::DELETED)
+        {
+            m_files.back().deleted = value;
+            seen(m_field);
+        }
+        else if (m_field != FileField::NONE)
+            set_files_error("unexpected boolean value in file");
+    }
+
+    void null_value(const jsoncons::parsing_context& context) override
+    {
+        if (! file_value(context))
+            m_dom.null_value(context);
+        else if (m_field != FileField::NONE)
+            set_files_error("unexpected null value in file");
+    }
+
+private:
+    static FileField file_field(const std::string& name)
+    {
+        if (name == "checksum")
+            return FileField::CHECKSUM;
+        if (name == "path")
+            return FileField::PATH;
+        if (name == "last_changed_by")
+            return FileField::LAST_CHANGED_BY;
+        if (name == "last_changed_rev")
+            return FileField::LAST_CHANGED_REV;
+        if (name == "mtime")
+            return FileField::MTIME;
+        if (name == "size")
+            return FileField::SIZE;
+        if (name == "deleted")
+            return FileField::DELETED;
+        if (name == "mode")
+            return FileField::MODE;
+        return FileField::NONE;
+    }
+
+    /// "files" is not an array, the message is not a valid Update so just keep it in the DOM
+    void forward_pending_files_name(const jsoncons::parsing_context& context)
+    {
+        if (m_files_pending)
+        {
+            set_files_error("files is not an array");
+            m_files_pending = false;
+            m_dom.name("files", context);
+        }
+    }
+
+    /// @returns true if the value belongs to the files array, false if it goes to the DOM
+    bool file_value(const jsoncons::parsing_context& context)
+    {
+        forward_pending_files_name(context);
+        if (! m_in_files)
+            return false;
+        if (m_depth == 2)
+        {
+            set_files_error("unexpected value in files");
+            m_field = FileField::NONE;
+        }
+        else if (m_depth > 3)
+            // inside a member we don't know, @sa nested_in_file
+            m_field = FileField::NONE;
+        return true;
+    }
+
+    /**
+     * An object or array inside a file, members we don't know are skipped for forward
+     * compatibility, otherwise it's an error.
+     */
+    void nested_in_file()
+    {
+        if (m_depth == 4 && m_field != FileField::NONE)
+            set_files_error("unexpected object or array value in file");
+    }
+
+    void seen(FileField field)
+    {
+        m_fields_seen |= 1u << static_cast<unsigned>(field);
+    }
+
+    void set_files_error(const std::string& error)
+    {
+        if (m_files_error.empty())
+            m_files_error = error;
+    }
+
+    jsoncons::json_deserializer m_dom;
+
+public:
+    std::vector<MFile> m_files;
+    /// first error found decoding files, empty if none
+    std::string m_files_error;
+
+private:
+    size_t m_encoded_sz;
+    /// nesting level of the current object or array, 1 is the message itself
+    size_t m_depth;
+    /// the top level "files" name was read, its array is next
+    bool m_files_pending;
+    /// we are inside the top level files array
+    bool m_in_files;
+    FileField m_field;
+    unsigned m_fields_seen;
+};
+
+
 /*** decode json -> msg ***/
 
 void decode(const jsoncons::json& json, Unknown& msg)
@@ -107,170 +462,327 @@ void decode(const jsoncons::json& json, GetUpdates& msg)
 void decode(const jsoncons::json& json, Get& msg)
 {
     msg.m_checksum = json["checksum"].as_string();
+    if (json.has_member("stream"))
+        msg.m_stream = json["stream"].as_uint();
+    if (json.has_member("length"))
+    {
+        msg.m_offset = json["offset"].as_ulonglong();
+        msg.m_length = json["length"].as_ulonglong();
+    }
 }
 
 void decode(const jsoncons::json& json, FileData& msg)
 {
     msg.m_checksum = json["checksum"].as_string();
+    if (json.has_member("stream"))
+        msg.m_stream = json["stream"].as_uint();
+    if (json.has_member("offset"))
+        msg.m_offset = json["offset"].as_ulonglong();
 }
 
 void decode(const jsoncons::json& json, NoSuchFile& msg)
 {
     msg.m_checksum = json["checksum"].as_string();
+    if (json.has_member("stream"))
+        msg.m_stream = json["stream"].as_uint();
+}
+
+void decode(const jsoncons::json& json, Cancel& msg)
+{
+    msg.m_checksum = json["checksum"].as_string();
+    msg.m_stream = json["stream"].as_uint();
 }
 
 void decode(const jsoncons::json& json, Update& msg)
 {
+    // the files are decoded by MsgInputHandler while parsing
     msg.m_revision = json["revision"].as_ulonglong();
     msg.m_partial = json.has_member("partial") && json["partial"].as_bool() == true;
-
-    auto files = json["files"];
-    for (auto i = files.begin_elements(); i != files.end_elements(); ++i)
-    {
-        const auto& file = *i;
-        msg.m_files.emplace_back(
-            file["checksum"].as_string(),
-            file["path"].as_string(),
-            file["last_changed_by"].as_string(),
-            static_cast<u64>(file["last_changed_rev"].as_ulonglong()),
-            file["mtime"].as_string(),
-            static_cast<u64>(file["size"].as_ulonglong()),
-            file.has_member("deleted") && file["deleted"].as_bool() == true,
-            static_cast<u16>(file["mode"].as_ulong())
-        );
-    }
 }
 
 
 /*** encode msg -> json ***/
 
-void encode_type(const Message& msg, jsoncons::json& json)
+/*
+ * The encoders below stream straight into a jsoncons::json_output_handler instead of building
+ * a DOM first. Members are emitted in std::string lexicographic order, the same order a
+ * jsoncons::json object keeps them in, so the output is byte-identical to serializing a DOM.
+ * Keys are preallocated to avoid constructing a std::string per member.
+ */
+namespace key
+{
+const std::string access = "access";
+const std::string checksum = "checksum";
+const std::string deleted = "deleted";
+const std::string features = "features";
+const std::string files = "files";
+const std::string id = "id";
+const std::string last_changed_by = "last_changed_by";
+const std::string last_changed_rev = "last_changed_rev";
+const std::string length = "length";
+const std::string mode = "mode";
+const std::string mtime = "mtime";
+const std::string name = "name";
+const std::string offset = "offset";
+const std::string partial = "partial";
+const std::string path = "path";
+const std::string peer = "peer";
+const std::string protocol = "protocol";
+const std::string revision = "revision";
+const std::string share_id = "share_id";
+const std::string since = "since";
+const std::string size = "size";
+const std::string software = "software";
+const std::string stream = "stream";
+const std::string time = "time";
+const std::string timeout = "timeout";
+const std::string type = "type";
+}
+
+void encode_type(const Message& msg, jsoncons::json_output_handler& out)
 {
-    namespace jc = jsoncons;
-    json = jc::json::an_object;
-    json["type"] = mtype_to_string(msg.type());
+    out.name(key::type);
+    out.value(mtype_to_string(msg.type()));
 }
 
-void encode(const Unknown& msg, jsoncons::json& json)
+void encode(const Unknown& msg, jsoncons::json_output_handler& out)
 {
     assert(0);
 }
 
-void encode(const InternalSendStart& msg, jsoncons::json& json)
+void encode(const InternalSendStart& msg, jsoncons::json_output_handler& out)
 {
-    using namespace jsoncons;
-    encode_type(msg, json);
-    json["share_id"] = msg.m_share_id;
+    out.begin_object();
+    out.name(key::share_id);
+    out.value(msg.m_share_id);
+    encode_type(msg, out);
+    out.end_object();
 }
 
-void encode(const Ping& msg, jsoncons::json& json)
+void encode(const Ping& msg, jsoncons::json_output_handler& out)
 {
-    using namespace jsoncons;
-    encode_type(msg, json);
-    json["timeout"] = msg.m_timeout;
+    out.begin_object();
+    out.name(key::timeout);
+    out.value(static_cast<unsigned long long>(msg.m_timeout));
+    encode_type(msg, out);
+    out.end_object();
 }
 
-void encode(const Start& msg, jsoncons::json& json)
+/// Start and Go share the same fields
+template<typename T>
+void encode_start(const T& msg, jsoncons::json_output_handler& out)
 {
-    using namespace jsoncons;
-    encode_type(msg, json);
-    json["software"] = msg.m_software;
-    json["protocol"] = msg.m_protocol;
-    json["features"] = jsoncons::json(msg.m_features.begin(), msg.m_features.end());
-    json["id"] = msg.m_share_id;
-    json["access"] = msg.m_access;
-    json["peer"] = msg.m_peer;
-    json["name"] = msg.m_name;
-    json["time"] = msg.m_time;
+    out.begin_object();
+    out.name(key::access);
+    out.value(msg.m_access);
+    out.name(key::features);
+    out.begin_array();
+    for (const auto& feature: msg.m_features)
+        out.value(feature);
+    out.end_array();
+    out.name(key::id);
+    out.value(msg.m_share_id);
+    out.name(key::name);
+    out.value(msg.m_name);
+    out.name(key::peer);
+    out.value(msg.m_peer);
+    out.name(key::protocol);
+    out.value(static_cast<long long>(msg.m_protocol));
+    out.name(key::software);
+    out.value(msg.m_software);
+    out.name(key::time);
+    out.value(msg.m_time);
+    encode_type(msg, out);
+    out.end_object();
 }
 
-void encode(const Go& msg, jsoncons::json& json)
+void encode(const Start& msg, jsoncons::json_output_handler& out)
 {
-    using namespace jsoncons;
-    encode_type(msg, json);
-    json["software"] = msg.m_software;
-    json["protocol"] = msg.m_protocol;
-    json["features"] = jsoncons::json(msg.m_features.begin(), msg.m_features.end());
-    json["id"] = msg.m_share_id;
-    json["access"] = msg.m_access;
-    json["peer"] = msg.m_peer;
-    json["name"] = msg.m_name;
-    json["time"] = msg.m_time;
+    encode_start(msg, out);
 }
 
-void encode(const CannotStart& msg, jsoncons::json& json)
+void encode(const Go& msg, jsoncons::json_output_handler& out)
 {
-    encode_type(msg, json);
+    encode_start(msg, out);
 }
 
-void encode(const GetUpdates& msg, jsoncons::json& json)
+void encode(const CannotStart& msg, jsoncons::json_output_handler& out)
 {
-    using namespace jsoncons;
-    encode_type(msg, json);
-    json["since"] = json::an_object;
+    out.begin_object();
+    encode_type(msg, out);
+    out.end_object();
+}
+
+void encode(const GetUpdates& msg, jsoncons::json_output_handler& out)
+{
+    out.begin_object();
+    out.name(key::since);
+    out.begin_object();
+    // std::map is already ordered by std::string::operator<
     for (const auto& x: msg.m_since)
-        json["since"][x.first] = x.second;
+    {
+        out.name(x.first);
+        out.value(static_cast<unsigned long long>(x.second));
+    }
+    out.end_object();
+    encode_type(msg, out);
+    out.end_object();
 }
 
-void encode(const Get& msg, jsoncons::json& json)
+/// Get, FileData, NoSuchFile and Cancel are about a file by checksum, in a stream when pipelined
+template<typename T>
+void encode_checksum(const T& msg, jsoncons::json_output_handler& out)
 {
-    using namespace jsoncons;
-    encode_type(msg, json);
-    json["checksum"] = msg.m_checksum;
+    out.name(key::checksum);
+    out.value(msg.m_checksum);
 }
 
-void encode(const FileData& msg, jsoncons::json& json)
+void encode_stream(u32 stream, jsoncons::json_output_handler& out)
 {
-    using namespace jsoncons;
-    encode_type(msg, json);
-    json["checksum"] = msg.m_checksum;
+    if (stream)
+    {
+        out.name(key::stream);
+        out.value(static_cast<unsigned long long>(stream));
+    }
 }
 
-void encode(const NoSuchFile& msg, jsoncons::json& json)
+void encode(const Get& msg, jsoncons::json_output_handler& out)
 {
-    using namespace jsoncons;
-    encode_type(msg, json);
-    json["checksum"] = msg.m_checksum;
+    out.begin_object();
+    encode_checksum(msg, out);
+    if (msg.m_length)
+    {
+        out.name(key::length);
+        out.value(static_cast<unsigned long long>(msg.m_length));
+        out.name(key::offset);
+        out.value(static_cast<unsigned long long>(msg.m_offset));
+    }
+    encode_stream(msg.m_stream, out);
+    encode_type(msg, out);
+    out.end_object();
 }
 
+void encode(const FileData& msg, jsoncons::json_output_handler& out)
+{
+    out.begin_object();
+    encode_checksum(msg, out);
+    if (msg.m_offset)
+    {
+        out.name(key::offset);
+        out.value(static_cast<unsigned long long>(msg.m_offset));
+    }
+    encode_stream(msg.m_stream, out);
+    encode_type(msg, out);
+    out.end_object();
+}
+
+void encode(const NoSuchFile& msg, jsoncons::json_output_handler& out)
+{
+    out.begin_object();
+    encode_checksum(msg, out);
+    encode_stream(msg.m_stream, out);
+    encode_type(msg, out);
+    out.end_object();
+}
+
+void encode(const Cancel& msg, jsoncons::json_output_handler& out)
+{
+    out.begin_object();
+    encode_checksum(msg, out);
+    encode_stream(msg.m_stream, out);
+    encode_type(msg, out);
+    out.end_object();
+}
+
+void encode(const MFile& mfile, jsoncons::json_output_handler& out)
+{
+    out.begin_object();
+    out.name(key::checksum);
+    out.value(mfile.checksum);
+    out.name(key::deleted);
+    out.value(mfile.deleted);
+    out.name(key::last_changed_by);
+    out.value(mfile.last_changed_by);
+    out.name(key::last_changed_rev);
+    out.value(static_cast<unsigned long long>(mfile.last_changed_rev));
+    out.name(key::mode);
+    out.value(static_cast<unsigned long long>(mfile.mode));
+    out.name(key::mtime);
+    out.value(mfile.mtime);
+    out.name(key::path);
+    out.value(mfile.path);
+    out.name(key::size);
+    out.value(static_cast<unsigned long long>(mfile.size));
+    out.end_object();
+}
 
-void encode(const Update& msg, jsoncons::json& jmsg)
+void encode(const Update& msg, jsoncons::json_output_handler& out)
 {
-    using namespace jsoncons;
-    encode_type(msg, jmsg);
-    jmsg["revision"] = msg.m_revision;
-    jmsg["partial"] = msg.m_partial;
-    jmsg["files"] = json::make_array();
+    out.begin_object();
+    out.name(key::files);
+    out.begin_array();
     for (const auto& mfile: msg.m_files)
+        encode(mfile, out);
+    out.end_array();
+    out.name(key::partial);
+    out.value(msg.m_partial);
+    out.name(key::revision);
+    out.value(static_cast<unsigned long long>(msg.m_revision));
+    encode_type(msg, out);
+    out.end_object();
+}
+
+
+/**
+ * Write-only streambuf that appends to a std::string owned by somebody else, so the serializer
+ * writes the message body directly into the output frame.
+ */
+class Ostringbuf: public std::streambuf
+{
+public:
+    Ostringbuf():
+        r_out()
+    {}
+
+    void target(std::string* out)
     {
-        json file;
-        file["checksum"] = mfile.checksum;
-        file["path"] = mfile.path;
-        file["last_changed_by"] = mfile.last_changed_by;
-        file["last_changed_rev"] = mfile.last_changed_rev;
-        file["mtime"] = mfile.mtime;
-        file["size"] = mfile.size;
-        file["deleted"] = mfile.deleted;
-        file["mode"] = mfile.mode;
-        jmsg["files"].add(move(file));
+        r_out = out;
+    }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        assert(r_out);
+        if (! traits_type::eq_int_type(c, traits_type::eof()))
+            r_out->push_back(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
     }
-}
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override
+    {
+        assert(r_out);
+        r_out->append(s, n);
+        return n;
+    }
+
+private:
+    std::string* r_out;
+};
+
 
 class JSONCoder: public CoderImpl, public ConstMessageVisitor
 {
 friend class Message;
 public:
     JSONCoder():
-        m_encoded_msg()
+        m_buf()
+        , m_os(&m_buf)
+        , m_serializer(make_unique<jsoncons::json_serializer>(m_os, false)) // no indent
     {}
 
 
     std::unique_ptr<Message> decode_msg(bool, const char*, size_t, const char*, size_t) override;
-    std::string encode_msg(const Message&) override;
-    void reset()
-    {
-        m_encoded_msg.clear();
-    }
+    void encode_msg(const Message&, std::string&) override;
 
 protected:
     void visit(const Unknown&) override;
@@ -284,16 +796,29 @@ protected:
     void visit(const FileData&) override;
     void visit(const NoSuchFile&) override;
     void visit(const Update&) override;
+    void visit(const Cancel&) override;
 
 private:
-    std::string m_encoded_msg;
+    /**
+     * the serializer keeps its nesting stack between messages, pointed to the current output by m_buf.
+     * It's replaced when an encode fails, the stack would be left in the middle of the message.
+     */
+    Ostringbuf m_buf;
+    std::ostream m_os;
+    std::unique_ptr<jsoncons::json_serializer> m_serializer;
 };
 
 
 std::unique_ptr<Message> JSONCoder::decode_msg(bool payload, const char* encoded, size_t encoded_sz, const char* signature, size_t signature_sz)
 try
 {
-    const auto json = jsoncons::json::parse_string(string(encoded, encoded_sz));
+    CS_TRACE_SPAN("decode_msg", "coder");
+    Imembuf encoded_buf(encoded, encoded_sz);
+    istream encoded_is(&encoded_buf);
+    MsgInputHandler handler(encoded_sz);
+    jsoncons::json_reader reader(encoded_is, handler);
+    reader.read();
+    const jsoncons::json& json = handler.root();
 
     MType type = MType::UNKNOWN;
     if (json.has_member("type"))
@@ -376,13 +901,24 @@ try
 
     case MType::UPDATE:
     {
+        if (! handler.m_files_error.empty())
+            throw CoderError(fs("JSONCoder::decode Update files error: " << handler.m_files_error));
         auto xmsg = make_unique<Update>();
         decode(json, *xmsg);
+        xmsg->m_files = move(handler.m_files);
         msg = move(xmsg);
         break;
     }
 
 
+    case MType::CANCEL:
+    {
+        auto xmsg = make_unique<Cancel>();
+        decode(json, *xmsg);
+        msg = move(xmsg);
+        break;
+    }
+
     // Add additional message types here
 
     default:
@@ -397,6 +933,10 @@ try
     msg->m_signature.assign(signature, signature_sz);
     return std::move(msg);
 }
+catch(const CoderError&)
+{
+    throw;
+}
 catch(const jsoncons::json_exception& e)
 {
     throw CoderError(fs("JSONCoder::decode JSON parse error: " << e.what()));
@@ -411,22 +951,9 @@ catch(const std::exception & e)
 }
 
 
-namespace
-{
-
-std::string json_2_str(const jsoncons::json& json)
-{
-    ostringstream json_os;
-    jsoncons::json_serializer serializer(json_os, false); // no indent
-    json.to_stream(serializer);
-    return json_os.str();
-}
-
-}
-
-
-std::string JSONCoder::encode_msg(const Message& msg)
+void JSONCoder::encode_msg(const Message& msg, std::string& out)
 {
+    CS_TRACE_SPAN("encode_msg", "coder");
     using namespace cs::io;
     char prefix = 0;
     if (! msg.m_payload && ! msg.signature())
@@ -438,38 +965,44 @@ std::string JSONCoder::encode_msg(const Message& msg)
     else if (msg.m_payload &&  msg.signature())
         prefix = '$';
 
-    msg.accept(*this); // fills m_encoded_msg with the selected encoder
-    ostringstream result;
-    result << prefix;
-    Obytestream ob;
-    assert(m_encoded_msg.size() <= Message::MAX_SIZE);
-    ob.write<u32>(m_encoded_msg.size());
-    result << ob.m_buff;
-    result << ':';
-    result << m_encoded_msg;
+    out.push_back(prefix);
+    // the size is patched once the body is serialized
+    const size_t size_pos = out.size();
+    out.append(sizeof(u32), '\0');
+    out.push_back(':');
+    const size_t body_pos = out.size();
+
+    m_buf.target(&out);
+    try
+    {
+        msg.accept(*this); // serializes the body into out with the selected encoder
+    }
+    catch (...)
+    {
+        // leave out as it was and start the next message from a clean state
+        m_buf.target(nullptr);
+        out.resize(size_pos - 1);
+        m_os.clear();
+        m_serializer = make_unique<jsoncons::json_serializer>(m_os, false);
+        throw;
+    }
+    m_buf.target(nullptr);
+
+    const size_t body_sz = out.size() - body_pos;
+    assert(body_sz <= Message::MAX_SIZE);
+    Obytestream::write_at<u32>(&out[size_pos], body_sz);
+
     if (msg.signature())
     {
         Obytestream obs;
         obs.write<u32>(msg.m_signature.size());
-        result << obs.m_buff;
-        result << ':';
-        result << msg.m_signature;
+        out.append(obs.m_buff);
+        out.push_back(':');
+        out.append(msg.m_signature);
     }
-
-    /******/
-    // reset m_encoded_msg
-    reset();
-    /******/
-
-    return result.str();
 }
 
-#define ENCXX\
-    do {\
-        jsoncons::json json;\
-        encode(x, json);\
-        m_encoded_msg = json_2_str(json);\
-    } while(0);
+#define ENCXX encode(x, *m_serializer)
 
 void JSONCoder::visit(const Unknown&)
 {
@@ -501,8 +1034,6 @@ void JSONCoder::visit(const Go& x)
     ENCXX;
 }
 
-
-
 void JSONCoder::visit(const GetUpdates& x)
 {
     ENCXX;
@@ -528,6 +1059,13 @@ void JSONCoder::visit(const Update& x)
     ENCXX;
 }
 
+void JSONCoder::visit(const Cancel& x)
+{
+    ENCXX;
+}
+
+#undef ENCXX
+
 
 
 } // end ns json
@@ -566,7 +1104,14 @@ std::unique_ptr<Message> Coder::decode_msg(bool payload, const char* encoded, si
 
 std::string Coder::encode_msg(const Message& m) const
 {
-    return m_p->encode_msg(m);
+    std::string result;
+    m_p->encode_msg(m, result);
+    return result;
+}
+
+void Coder::encode_msg(const Message& m, std::string& out) const
+{
+    m_p->encode_msg(m, out);
 }
 
 
@@ -70,6 +70,9 @@ public:
     /// @returns a string with the encoded message
     std::string encode_msg(const Message&) const;
 
+    /// appends the encoded message to @param out without intermediate copies
+    void encode_msg(const Message&, std::string& out) const;
+
 private:
     std::unique_ptr<CoderImpl> m_p;
 };
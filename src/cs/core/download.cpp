@@ -0,0 +1,237 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "download.hpp"
+#include <cassert>
+
+using namespace std;
+
+namespace cs
+{
+namespace core
+{
+namespace download
+{
+
+u64 Download::s_piece_sz = 4 << 20;
+size_t Download::s_max_requests = 4;
+double Download::s_slow_factor = 4;
+Download::clock::duration Download::s_request_timeout = std::chrono::seconds(60);
+
+Download::Download(const std::string& checksum, u64 size, request_t request, cancel_t cancel):
+    m_checksum(checksum)
+    , m_size(size)
+    , m_request(request)
+    , m_cancel(cancel)
+    , m_pieces((size + s_piece_sz - 1) / s_piece_sz)
+    , m_pieces_done()
+    , m_next_missing()
+    , m_peers()
+{
+}
+
+void Download::add_peer(const std::string& peer, clock::time_point now)
+{
+    m_peers.emplace(peer, Peer());
+    schedule(now);
+}
+
+void Download::remove_peer(const std::string& peer, clock::time_point now)
+{
+    auto peer_i = m_peers.find(peer);
+    if (peer_i == m_peers.end())
+        return;
+    for (const auto& req: peer_i->second.requests)
+        if (! req.second.expired)
+            forget(req.second.piece);
+    m_peers.erase(peer_i);
+    schedule(now);
+}
+
+void Download::request_done(const std::string& peer, u32 request, bool found, clock::time_point now)
+{
+    auto peer_i = m_peers.find(peer);
+    if (peer_i == m_peers.end())
+        return;
+    Peer& p = peer_i->second;
+    auto req_i = p.requests.find(request);
+    if (req_i == p.requests.end())
+        return;
+    const Request req = req_i->second;
+    // requests to the peer share its bandwidth, the ones in flight count to estimate it
+    const size_t in_flight = p.requests.size();
+    p.requests.erase(req_i);
+
+    if (! found)
+    {
+        if (! req.expired)
+            forget(req.piece);
+        remove_peer(peer, now);
+        return;
+    }
+
+    Piece& piece = m_pieces[req.piece];
+    if (! req.expired)
+        --piece.requests;
+    if (piece.state != DONE)
+    {
+        piece.state = DONE;
+        ++m_pieces_done;
+        // expired requests and the ones taken over from slow peers
+        cancel(req.piece);
+    }
+
+    const double elapsed = max(chrono::duration<double>(now - req.start).count(), 1e-6);
+    const double sample = piece_length(req.piece) * in_flight / elapsed;
+    p.rate = p.rate ? (p.rate + sample) / 2 : sample;
+    schedule(now);
+}
+
+void Download::tick(clock::time_point now)
+{
+    for (auto& peer: m_peers)
+    {
+        for (auto& req: peer.second.requests)
+        {
+            if (req.second.expired || now - req.second.start < s_request_timeout)
+                continue;
+            req.second.expired = true;
+            forget(req.second.piece);
+            // at best it would have sent the piece within the timeout
+            const double timeout_rate = piece_length(req.second.piece) / chrono::duration<double>(s_request_timeout).count();
+            peer.second.rate = peer.second.rate ? min(peer.second.rate / 2, timeout_rate) : timeout_rate;
+        }
+    }
+    schedule(now);
+}
+
+size_t Download::requests(const std::string& peer) const
+{
+    auto peer_i = m_peers.find(peer);
+    return peer_i == m_peers.end() ? 0 : peer_i->second.requests.size();
+}
+
+double Download::rate(const std::string& peer) const
+{
+    auto peer_i = m_peers.find(peer);
+    return peer_i == m_peers.end() ? 0 : peer_i->second.rate;
+}
+
+size_t Download::slots(const Peer& peer) const
+{
+    // peers are given the benefit of the doubt until measured
+    if (! peer.rate)
+        return s_max_requests;
+    double fastest = 0;
+    for (const auto& p: m_peers)
+        fastest = max(fastest, p.second.rate);
+    return peer.rate * s_slow_factor < fastest ? 1 : s_max_requests;
+}
+
+size_t Download::pick(const Peer& peer)
+{
+    while (m_next_missing < m_pieces.size() && m_pieces[m_next_missing].state != MISSING)
+        ++m_next_missing;
+    if (m_next_missing < m_pieces.size())
+        return m_next_missing;
+
+    // everything is requested, take over a piece from a peer much slower than this one
+    if (! peer.rate)
+        return m_pieces.size();
+    for (const auto& other: m_peers)
+    {
+        if (&other.second == &peer || ! other.second.rate || other.second.rate * s_slow_factor >= peer.rate)
+            continue;
+        for (const auto& req: other.second.requests)
+        {
+            const Piece& piece = m_pieces[req.second.piece];
+            if (piece.state == REQUESTED && piece.requests == 1)
+                return req.second.piece;
+        }
+    }
+    return m_pieces.size();
+}
+
+void Download::forget(size_t piece)
+{
+    Piece& p = m_pieces[piece];
+    if (p.requests)
+        --p.requests;
+    if (p.state == REQUESTED && ! p.requests)
+    {
+        p.state = MISSING;
+        m_next_missing = min(m_next_missing, piece);
+    }
+}
+
+void Download::cancel(size_t piece)
+{
+    for (auto& peer: m_peers)
+    {
+        auto& requests = peer.second.requests;
+        for (auto req = requests.begin(); req != requests.end();)
+        {
+            if (req->second.piece != piece)
+            {
+                ++req;
+                continue;
+            }
+            if (m_cancel)
+                m_cancel(peer.first, req->first);
+            req = requests.erase(req);
+        }
+    }
+    m_pieces[piece].requests = 0;
+}
+
+void Download::schedule(clock::time_point now)
+{
+    vector<pair<const string*, Peer*>> peers;
+    for (auto& peer: m_peers)
+        peers.emplace_back(&peer.first, &peer.second);
+    // unmeasured peers first, then the fastest
+    sort(peers.begin(), peers.end(), [](const pair<const string*, Peer*>& a, const pair<const string*, Peer*>& b) {
+        if (! a.second->rate || ! b.second->rate)
+            return ! a.second->rate && b.second->rate;
+        return a.second->rate > b.second->rate;
+    });
+
+    // a request to each peer per round, so pieces spread evenly
+    bool requested = true;
+    while (requested && ! done())
+    {
+        requested = false;
+        for (auto& peer: peers)
+        {
+            Peer& p = *peer.second;
+            if (p.requests.size() >= slots(p))
+                continue;
+            const size_t piece = pick(p);
+            if (piece == m_pieces.size())
+                continue;
+            const u32 id = m_request(*peer.first, piece_offset(piece), piece_length(piece));
+            Request req = {piece, now, false};
+            p.requests[id] = req;
+            m_pieces[piece].state = REQUESTED;
+            ++m_pieces[piece].requests;
+            requested = true;
+        }
+    }
+}
+
+} // end ns
+} // end ns
+} // end ns
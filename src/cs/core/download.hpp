@@ -0,0 +1,195 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "../config.hpp"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cs
+{
+namespace core
+{
+namespace download
+{
+
+/**
+ * Schedules a swarming download: the file is split in pieces which are requested with ranged Gets to
+ * all the peers that have it at once, a few outstanding per peer.
+ *
+ * The throughput of each peer is measured as its pieces arrive. Peers much slower than the fastest
+ * one get a single piece at a time, requests that take too long are given to other peers, and at
+ * the end the pieces still held by slow peers are requested again to faster idle ones, whichever
+ * arrives first completes the piece, the other requests for it are cancelled.
+ *
+ * The requests are issued and cancelled through callbacks so the Download doesn't know about
+ * connections, the owner reports back with request_done when each finishes.
+ */
+class Download
+{
+public:
+    typedef std::chrono::steady_clock clock;
+    /// request the range [offset, offset + length) of the file to peer, @returns the request id
+    typedef std::function<u32(const std::string& peer, u64 offset, u64 length)> request_t;
+    /// the outstanding @param request to @param peer is no longer wanted, it won't be reported done
+    typedef std::function<void(const std::string& peer, u32 request)> cancel_t;
+
+    /// size of the pieces
+    static u64 s_piece_sz;
+    /// outstanding requests to a peer
+    static size_t s_max_requests;
+    /// a peer this many times slower than the fastest one gets a single request
+    static double s_slow_factor;
+    /// a request outstanding longer than this is given to other peers too
+    static clock::duration s_request_timeout;
+
+    Download(const std::string& checksum, u64 size, request_t request, cancel_t cancel = cancel_t());
+
+    Download(const Download&) = delete;
+    Download& operator=(const Download&) = delete;
+
+    /// @param peer has the file, requests to it start right away
+    void add_peer(const std::string& peer, clock::time_point now = clock::now());
+
+    /// @param peer went away, its pieces are requested to the others
+    void remove_peer(const std::string& peer, clock::time_point now = clock::now());
+
+    /**
+     * @param request to @param peer finished, when not @param found the peer doesn't have the file
+     * and is removed. Replies for unknown requests, for example of removed peers, are ignored.
+     */
+    void request_done(const std::string& peer, u32 request, bool found, clock::time_point now = clock::now());
+
+    /// expire the requests that take too long and give their pieces to other peers, to be called periodically
+    void tick(clock::time_point now = clock::now());
+
+    bool done() const
+    {
+        return m_pieces_done == m_pieces.size();
+    }
+
+    const std::string& checksum() const
+    {
+        return m_checksum;
+    }
+
+    size_t pieces() const
+    {
+        return m_pieces.size();
+    }
+
+    size_t pieces_done() const
+    {
+        return m_pieces_done;
+    }
+
+    /// @returns the number of peers the file is downloaded from
+    size_t peers() const
+    {
+        return m_peers.size();
+    }
+
+    bool has_peer(const std::string& peer) const
+    {
+        return m_peers.find(peer) != m_peers.end();
+    }
+
+    /// @returns the outstanding requests to @param peer
+    size_t requests(const std::string& peer) const;
+
+    /// @returns the measured throughput of @param peer in bytes per second, 0 if unknown
+    double rate(const std::string& peer) const;
+
+private:
+    enum PieceState: u8
+    {
+        MISSING = 0,
+        REQUESTED,
+        DONE,
+    };
+
+    struct Piece
+    {
+        Piece():
+            state(MISSING)
+            , requests()
+        {}
+
+        PieceState state;
+        /// outstanding requests that didn't expire
+        u16 requests;
+    };
+
+    struct Request
+    {
+        size_t piece;
+        clock::time_point start;
+        /// took too long, the piece is requested to others but the reply is still welcome
+        bool expired;
+    };
+
+    struct Peer
+    {
+        Peer():
+            requests()
+            , rate()
+        {}
+
+        /// by request id
+        std::map<u32, Request> requests;
+        /// bytes per second, 0 until the first piece arrives
+        double rate;
+    };
+
+    u64 piece_offset(size_t piece) const
+    {
+        return piece * s_piece_sz;
+    }
+
+    u64 piece_length(size_t piece) const
+    {
+        return std::min(s_piece_sz, m_size - piece_offset(piece));
+    }
+
+    /// @returns how many requests @param peer can have outstanding given how fast it is
+    size_t slots(const Peer& peer) const;
+    /// @returns the next piece to request to @param peer, m_pieces.size() if there's none
+    size_t pick(const Peer& peer);
+    /// the request for @param piece doesn't count anymore, it's requested again if nobody else has it
+    void forget(size_t piece);
+    /// cancel the requests left for @param piece, which is done
+    void cancel(size_t piece);
+    /// issue requests to the peers with free slots, spread evenly, fastest first
+    void schedule(clock::time_point now);
+
+    std::string m_checksum;
+    u64 m_size;
+    request_t m_request;
+    cancel_t m_cancel;
+    std::vector<Piece> m_pieces;
+    size_t m_pieces_done;
+    /// pieces before this one are not MISSING
+    size_t m_next_missing;
+    std::map<std::string, Peer> m_peers;
+};
+
+} // end ns
+} // end ns
+} // end ns
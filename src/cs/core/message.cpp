@@ -49,6 +49,7 @@ mtype_str_table_t mtype_str_table_init()
     res[SC(MType::FILE_DATA)] = "file_data";
     res[SC(MType::NO_SUCH_FILE)] = "no_such_file";
     res[SC(MType::UPDATE)] = "update";
+    res[SC(MType::CANCEL)] = "cancel";
     return res;
 }
 } // end anon ns
@@ -95,6 +96,9 @@ MType mtype_from_string(const std::string& type)
     if (type == "update")
         return MType::UPDATE;
 
+    if (type == "cancel")
+        return MType::CANCEL;
+
     return MType::UNKNOWN;
 }
 
@@ -48,6 +48,8 @@ enum class MType: unsigned
     FILE_DATA,
     NO_SUCH_FILE,
     UPDATE,
+    /// the reply to a pipelined Get is no longer wanted
+    CANCEL,
 
     /// Not a message, Maximum value of the enum used to create arrays
     MAX,
@@ -122,6 +124,7 @@ class Get;
 class FileData;
 class NoSuchFile;
 class Update;
+class Cancel;
 
 
 class ConstMessageVisitor
@@ -139,6 +142,7 @@ public:
     virtual void visit(const FileData&) = 0;
     virtual void visit(const NoSuchFile&) = 0;
     virtual void visit(const Update&) = 0;
+    virtual void visit(const Cancel&) = 0;
 };
 
 
@@ -157,6 +161,7 @@ public:
     virtual void visit(FileData&) = 0;
     virtual void visit(NoSuchFile&) = 0;
     virtual void visit(Update&) = 0;
+    virtual void visit(Cancel&) = 0;
 };
 
 
@@ -387,51 +392,101 @@ public:
 };
 
 
+/**
+ * Request of a file by content. Gets with a non zero stream are pipelined, several can be outstanding
+ * and the replies name the stream of the request. A pipelined Get with a length asks for the range
+ * [offset, offset + length) of the file only.
+ */
 class Get: public MessageImpl<Get, MType::GET>
 {
 public:
-    Get(const std::string& checksum):
+    Get(const std::string& checksum, u32 stream = 0, u64 offset = 0, u64 length = 0):
         m_checksum(checksum)
+        , m_stream(stream)
+        , m_offset(offset)
+        , m_length(length)
     {}
 
     Get():
         m_checksum()
+        , m_stream()
+        , m_offset()
+        , m_length()
     {}
 
     std::string m_checksum;
+    /// 0 when not pipelined
+    u32 m_stream;
+    u64 m_offset;
+    /// 0 for the whole file
+    u64 m_length;
 };
 
 
 
+/**
+ * File contents in the payload. For a pipelined Get each FileData carries the next chunk of its
+ * stream, found at offset in the file, a FileData with an empty payload ends the stream.
+ */
 class FileData: public MessageImpl<FileData, MType::FILE_DATA>
 {
 public:
-    FileData(const std::string& checksum):
+    FileData(const std::string& checksum, u32 stream = 0, u64 offset = 0):
         m_checksum(checksum)
+        , m_stream(stream)
+        , m_offset(offset)
     {
         m_payload = true;
     }
 
     FileData():
         m_checksum()
+        , m_stream()
+        , m_offset()
     {
     }
 
     std::string m_checksum;
+    u32 m_stream;
+    u64 m_offset;
 };
 
 class NoSuchFile: public MessageImpl<NoSuchFile, MType::NO_SUCH_FILE>
 {
 public:
-    NoSuchFile(const std::string& checksum):
+    NoSuchFile(const std::string& checksum, u32 stream = 0):
         m_checksum(checksum)
+        , m_stream(stream)
     {
     }
     NoSuchFile():
         m_checksum()
+        , m_stream()
+    {}
+
+    std::string m_checksum;
+    u32 m_stream;
+};
+
+/**
+ * Stop sending the reply to the pipelined Get of a stream, the sender ends the stream early with a
+ * FileData without data unless it's over already
+ */
+class Cancel: public MessageImpl<Cancel, MType::CANCEL>
+{
+public:
+    Cancel(const std::string& checksum, u32 stream):
+        m_checksum(checksum)
+        , m_stream(stream)
+    {
+    }
+    Cancel():
+        m_checksum()
+        , m_stream()
     {}
 
     std::string m_checksum;
+    u32 m_stream;
 };
 
 
@@ -16,7 +16,15 @@
  *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "protocol.hpp"
+#include "../trace.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "boost/format.hpp"
 
 using namespace std;
@@ -28,6 +36,42 @@ namespace core
 namespace protocol
 {
 
+namespace
+{
+
+/// the metrics of all the peers, got once
+struct ProtocolMetrics
+{
+    ProtocolMetrics()
+    {
+        for (unsigned i = 0; i < static_cast<unsigned>(msg::MType::MAX); ++i)
+        {
+            const string type = msg::mtype_to_string(static_cast<msg::MType>(i));
+            messages_in[i] = &message_counter("in", type);
+            messages_out[i] = &message_counter("out", type);
+        }
+    }
+
+    static metrics::Counter& message_counter(const std::string& direction, const std::string& type)
+    {
+        return metrics::counter("cs_protocol_messages_total", "Messages received and sent by type", {{"direction", direction}, {"type", type}});
+    }
+
+    std::array<metrics::Counter*, static_cast<size_t>(msg::MType::MAX)> messages_in;
+    std::array<metrics::Counter*, static_cast<size_t>(msg::MType::MAX)> messages_out;
+};
+
+ProtocolMetrics& protocol_metrics()
+{
+    static ProtocolMetrics metrics;
+    return metrics;
+}
+
+/// the last TxFile::id given
+std::atomic<u64> s_txfile_ids(0);
+
+} // end anon ns
+
 /*
  * Handlers -------------------------------------
  */
@@ -47,15 +91,17 @@ public:
     try
     {
         share::Share& share = r_protocol.share(msg.m_share_id);
+        if (r_protocol.read_only() && msg.m_access != "read_only")
+            throw ProtocolError(fs("Start asks for " << msg.m_access << " access with the read only key"));
 
         r_protocol.m_peerinfo.m_peer = msg.m_peer;
         r_protocol.m_peerinfo.m_name = msg.m_name;
-        // TODO: access
         r_protocol.m_peerinfo.m_features = msg.m_features;
         r_protocol.m_peerinfo.m_software = msg.m_software;
 
         const ServerInfo& si = r_protocol.r_serverinfo;
-        r_protocol.send_msg(msg::Go(si.m_software, si.m_protocol, si.m_features, r_protocol.m_share, "", share.m_peer_id, si.m_name, utils::isotime(std::time(nullptr))));
+        r_protocol.send_msg(msg::Go(si.m_software, si.m_protocol, r_protocol.features(), r_protocol.m_share, "", share.m_peer_id, si.m_name, utils::isotime(std::time(nullptr))));
+        r_protocol.features_negotiated();
         /***********/
         m_next_state = CONNECTED;
         /***********/
@@ -71,7 +117,7 @@ public:
         share::Share& share = r_protocol.share(msg.m_share_id);
         // FIXME access, peer discovery
         const ServerInfo& si = r_protocol.r_serverinfo;
-        r_protocol.send_msg(msg::Start(si.m_software, si.m_protocol, si.m_features, msg.m_share_id, "", share.m_peer_id, si.m_name, utils::isotime(std::time(nullptr))));
+        r_protocol.send_msg(msg::Start(si.m_software, si.m_protocol, r_protocol.features(), msg.m_share_id, "", share.m_peer_id, si.m_name, utils::isotime(std::time(nullptr))));
         /***********/
         m_next_state = WAIT4_GO;
         /***********/
@@ -98,6 +144,7 @@ public:
 
         if (r_protocol.m_share != msg.m_share_id)
             throw std::runtime_error("Share id doesn't match in WAIT4_GO / msg::Go");
+        r_protocol.features_negotiated();
 
         /***********/
         m_next_state = CONNECTED;
@@ -117,13 +164,29 @@ public:
 
     void visit(const msg::Get& msg) override
     {
-        const bool ok = r_protocol.do_get(msg.m_checksum);
+        // pipelined Gets are served while staying CONNECTED
+        const bool ok = r_protocol.do_get(msg.m_checksum, msg.m_stream, msg.m_offset, msg.m_length);
         if (ok)
             /***********/
             m_next_state = GET;
             /***********/
     }
 
+    void visit(const msg::FileData& msg) override
+    {
+        r_protocol.do_file_data(msg.m_checksum, msg.m_stream, msg.m_offset);
+    }
+
+    void visit(const msg::NoSuchFile& msg) override
+    {
+        r_protocol.do_no_such_file(msg.m_checksum, msg.m_stream);
+    }
+
+    void visit(const msg::Cancel& msg) override
+    {
+        r_protocol.do_cancel(msg.m_checksum, msg.m_stream);
+    }
+
     void visit(const msg::GetUpdates& msg) override
     {
         r_protocol.do_get_updates(msg.m_since);
@@ -162,16 +225,29 @@ public:
 
 
 
-class MessageHandler_GET: public MessageHandler
+class MessageHandler_GET: public MessageHandler_CONNECTED
 {
 public:
     MessageHandler_GET(State state, Protocol& protocol):
-        MessageHandler{state, protocol}
+        MessageHandler_CONNECTED{state, protocol}
     {
     }
-    // No messages are allowed while sending data, TODO new mtype to abort?
+    // Our replies are control messages that go between the chunks of the file being sent, so
+    // requests are served as in CONNECTED, but another Get that is not pipelined has to wait.
     // After the transfer is finished we go back to CONNECTED in Protocol::handle_empty_output_buff
 
+    void visit(const msg::Get& msg) override
+    {
+        if (! msg.m_stream)
+            throw ProtocolError("Can't handle a Get that is not pipelined while sending a file");
+        MessageHandler_CONNECTED::visit(msg);
+    }
+
+    void visit(const msg::Update& msg) override
+    {
+        // stay in GET, partial updates are not tracked while sending a file
+        r_protocol.do_update(msg.m_files);
+    }
 };
 
 
@@ -195,15 +271,36 @@ Protocol::Protocol(const ServerInfo& server_info, std::map<std::string, share::S
     , r_shares(shares)
     , m_peerinfo()
     , m_share()
+    , m_authorized_share()
+    , m_authorized_access()
     , m_state(State::INITIAL)
     , m_state_trans_table()
-    , m_txfile_is()
+    , m_txfile()
+    , m_txstreams()
     //, m_frozen_manifest()
-    , m_rxfile_os()
+    , m_rxfile()
+    , m_rxstreams()
+    , m_rxstream()
+    , m_rxstream_data()
+    , m_next_stream(1)
+    , m_unpipelined_gets()
     , m_coder()
     , m_handle_send_msg()
+    , m_handle_send_payload_chunk()
+    , m_handle_send_payload_file_chunk()
+    , m_handle_sendfile_capable([]() { return false; })
+    , m_handle_payload_file_closed([](u64) {})
+    , m_handle_get_done([](u32, const std::string&, bool) {})
+    , m_handle_remote_update([](const share::RemoteUpdate&) {})
+    , m_handle_open_file_writer(open_file_writer)
+    , m_handle_hash_file(hash_file)
+    , m_handle_interleave_control([](bool) {})
+    , m_peding_updates()
+    , m_peer_metrics()
+    , m_peer_payload_in()
+    , m_peer_payload_out()
 {
-#define SET_HANDLER(state, type) m_state_trans_table[(state)] = make_unique<type>(m_state, *this);
+#define SET_HANDLER(state, type) m_state_trans_table[(state)] = make_unique<type>((state), *this);
 
     SET_HANDLER(INITIAL, MessageHandler_INITIAL);
     SET_HANDLER(WAIT4_GO, MessageHandler_WAIT4_GO);
@@ -216,28 +313,173 @@ Protocol::Protocol(const ServerInfo& server_info, std::map<std::string, share::S
 
 void Protocol::send_msg(const msg::Message& m)
 {
-    assert(! m_txfile_is); // we are not sending data
+    // while a file is sent only control messages, without payload, can go between its chunks
+    assert(! m_txfile || ! m.m_payload);
+    protocol_metrics().messages_out[static_cast<size_t>(m.type())]->inc();
     m_handle_send_msg(m_coder.encode_msg(m), m.m_payload);
 }
 
+TxFile::TxFile(const bfs::path& path):
+    fd(::open(path.c_str(), O_RDONLY))
+    , id(++s_txfile_ids)
+    , offset()
+    , size()
+{
+    struct stat st;
+    if (fd == -1 || ::fstat(fd, &st) != 0)
+    {
+        const int err = errno;
+        if (fd != -1)
+            ::close(fd);
+        throw std::runtime_error(boost::str(boost::format("Protocol::send \"%1%\" error, couldn't open file: %2%") % path.string() % strerror(err)));
+    }
+    size = st.st_size;
+}
+
+TxFile::~TxFile()
+{
+    ::close(fd);
+}
+
+TxStream::TxStream(u32 stream, const std::string& checksum, const bfs::path& path, u64 offset, u64 length):
+    stream(stream)
+    , checksum(checksum)
+    , file(path)
+{
+    // a range past the end is served as empty
+    file.offset = min(offset, file.size);
+    if (length && length < file.size - file.offset)
+        file.size = file.offset + length;
+}
+
+bool RxStream::verify()
+{
+    string digest(SHA256_DIGEST_STRING_LENGTH, 0);
+    sha2::SHA256_End(&sha256, &digest[0]);
+    digest.resize(digest.size() - 1);
+    return digest == checksum;
+}
+
 void Protocol::send_file(const bfs::path& path)
 {
-    m_txfile_is = make_unique<bfs::ifstream>(path, ios_base::in | ios_base::binary);
-    if (! *m_txfile_is)
+    m_txfile = make_unique<TxFile>(path);
+}
+
+u32 Protocol::recieve_file(const bfs::path& path, get_done_t done)
+{
+    unique_ptr<FileWriter> file = m_handle_open_file_writer(path, true);
+    const u32 stream = next_stream_id();
+    // the checksum is known when the FileData arrives
+    m_rxstreams.emplace(stream, RxStream(string(), move(file), 0, numeric_limits<u64>::max(), move(done)));
+    m_rxfile = stream;
+    return stream;
+}
+
+u32 Protocol::next_stream_id()
+{
+    // ids wrap around, the ones of requests still outstanding are skipped
+    u32 stream = m_next_stream;
+    while (! stream || m_rxstreams.count(stream))
+        ++stream;
+    m_next_stream = stream + 1;
+    return stream;
+}
+
+u32 Protocol::get_file(const std::string& checksum, const bfs::path& path, u64 offset, u64 length, get_done_t done)
+{
+    const bool pipelined = peer_has(feature::pipelined_get);
+    if (length && ! pipelined)
+        throw std::runtime_error("Protocol::get_file error, the peer can't send ranges");
+
+    // other ranges of the file might be written already
+    unique_ptr<FileWriter> file = m_handle_open_file_writer(path, ! length);
+    if (length)
+        file->preallocate(offset, length);
+    else
+        offset = 0;
+
+    const u32 stream = next_stream_id();
+    const u64 end = length ? offset + length : numeric_limits<u64>::max();
+    m_rxstreams.emplace(stream, RxStream(checksum, move(file), offset, end, move(done)));
+    if (pipelined)
+        send_msg(msg::Get(checksum, stream, offset, length));
+    else
     {
-        m_txfile_is.reset();
-        throw std::runtime_error(boost::str(boost::format("Protocol::send \"%1%\" error, couldn't open file") % path.string())); 
+        m_unpipelined_gets.push_back(stream);
+        if (m_unpipelined_gets.size() == 1)
+            send_msg(msg::Get(checksum));
     }
+    return stream;
 }
 
-void Protocol::recieve_file(const bfs::path& path)
+void Protocol::cancel_get(u32 stream)
 {
-    m_rxfile_os = make_unique<bfs::ofstream>(path, ios_base::out | ios_base::binary);
-    m_rxfile_os->exceptions(ifstream::eofbit | ifstream::failbit | ifstream::badbit);
-    if (! *m_rxfile_os)
+    auto rx = m_rxstreams.find(stream);
+    if (rx == m_rxstreams.end() || rx->second.cancelled)
+        return;
+    RxStream& rxstream = rx->second;
+    rxstream.cancelled = true;
+    if (rxstream.closing || stream == m_rxfile)
+        // all of it arrived already, it's forgotten once written, or the peer doesn't know the
+        // stream of recieve_file, what arrives is dropped
+        return;
+
+    auto unpipelined = find(m_unpipelined_gets.begin(), m_unpipelined_gets.end(), stream);
+    if (unpipelined != m_unpipelined_gets.end())
     {
-        m_rxfile_os.reset();
-        throw std::runtime_error(boost::str(boost::format("Protocol::send \"%1%\" error, couldn't open file") % path.string())); 
+        if (unpipelined == m_unpipelined_gets.begin())
+            // a Get without a stream can't be cancelled, its reply is dropped
+            return;
+        // not sent yet
+        m_unpipelined_gets.erase(unpipelined);
+        rxstream.closing = true;
+        rxstream.file->close([this, stream](bool) { rxstream_closed(stream, false); });
+        return;
+    }
+    if (peer_has(feature::cancel_get))
+        send_msg(msg::Cancel(rxstream.checksum, stream));
+}
+
+void Protocol::next_unpipelined_get()
+{
+    m_unpipelined_gets.pop_front();
+    if (! m_unpipelined_gets.empty())
+        send_msg(msg::Get(m_rxstreams.at(m_unpipelined_gets.front()).checksum));
+}
+
+size_t Protocol::txfile_block_sz()
+{
+    return m_handle_sendfile_capable() ? s_txfile_sendfile_block_sz : s_txfile_block_sz;
+}
+
+void Protocol::send_stream_chunks(size_t budget)
+{
+    const size_t block_sz = txfile_block_sz();
+    // each stream once, a stream ends in a later round, when the output of its last chunk, which
+    // may still read the file, is gone
+    for (size_t streams = m_txstreams.size(); streams && budget; --streams)
+    {
+        unique_ptr<TxStream> txstream = move(m_txstreams.front());
+        m_txstreams.pop_front();
+        TxFile& file = txstream->file;
+        send_msg(msg::FileData(txstream->checksum, txstream->stream, file.offset));
+        if (file.offset < file.size)
+        {
+            const size_t chunk_sz = min<u64>(min(block_sz, budget), file.size - file.offset);
+            file.offset += chunk_sz;
+            m_handle_send_payload_file_chunk(file.fd, file.id, file.offset - chunk_sz, chunk_sz, min<u64>(block_sz, file.size - file.offset));
+            m_handle_send_payload_chunk(string());
+            count_payload(true, chunk_sz);
+            budget -= chunk_sz;
+            // to the back of the queue, the next stream goes next
+            m_txstreams.push_back(move(txstream));
+        }
+        else
+        {
+            // a FileData without data ends the stream, its chunks were written so the file can be closed
+            m_handle_send_payload_chunk(string());
+            m_handle_payload_file_closed(file.id);
+        }
     }
 }
 
@@ -246,35 +488,44 @@ void Protocol::recieve_file(const bfs::path& path)
  */
 void Protocol::handle_empty_output_buff()
 {
-    if (m_txfile_is)
+    if (m_txfile)
     {
         // when the pointer is not null, a file transfer is in progress, send the next chunk
-        std::string rbuff(s_txfile_block_sz, 0);
-        m_txfile_is->read(&rbuff[0], rbuff.size());
-        rbuff.resize(m_txfile_is->gcount());
-        // send the buffer
-        m_handle_send_payload_chunk(move(rbuff));
-        if (! *m_txfile_is)
+        if (m_txfile->offset < m_txfile->size)
         {
-            // EOF
-            if (! rbuff.empty())
-                // make sure to send the terminating 0 size chunk, per cs payload protocol
-                m_handle_send_payload_chunk(string());
-            m_txfile_is.reset();
+            const size_t block_sz = txfile_block_sz();
+            const size_t chunk_sz = min<u64>(block_sz, m_txfile->size - m_txfile->offset);
+            m_txfile->offset += chunk_sz;
+            m_handle_send_payload_file_chunk(m_txfile->fd, m_txfile->id, m_txfile->offset - chunk_sz, chunk_sz, min<u64>(block_sz, m_txfile->size - m_txfile->offset));
+            count_payload(true, chunk_sz);
+        }
+        else
+        {
+            // EOF, the file chunks were written so the file can be closed
+            // send the terminating 0 size chunk, per cs payload protocol
+            m_handle_send_payload_chunk(string());
+            m_handle_payload_file_closed(m_txfile->id);
+            m_txfile.reset();
             assert(m_state == GET);
             /*****************/
             m_state = CONNECTED;
             /*****************/
         }
     }
+    else if (! m_txstreams.empty())
+        send_stream_chunks(txfile_block_sz());
 }
 
 
 void Protocol::handle_msg(char const* msg_encoded, size_t msg_sz, char const* signature, size_t signature_sz, bool payload)
 {
+    CS_TRACE_SPAN("handle_msg", "protocol");
     auto msg = m_coder.decode_msg(payload, msg_encoded, msg_sz, signature, signature_sz);
+    protocol_metrics().messages_in[static_cast<size_t>(msg->type())]->inc();
     unique_ptr<MessageHandler>& handler = m_state_trans_table[m_state];
     assert(handler);
+    // handlers stay in their state unless the message moves the protocol to another one
+    handler->m_next_state = handler->m_state;
     msg->accept(*handler);
     /********* m_next_state *****/
     m_state = handler->next_state();
@@ -283,15 +534,83 @@ void Protocol::handle_msg(char const* msg_encoded, size_t msg_sz, char const* si
 
 void Protocol::handle_payload(const char* data, size_t len)
 {
-    if (m_rxfile_os)
-        m_rxfile_os->write(data, len);
+    count_payload(false, len);
+    if (m_rxstream)
+    {
+        auto rx = m_rxstreams.find(m_rxstream);
+        assert(rx != m_rxstreams.end());
+        RxStream& rxstream = rx->second;
+        if (len > rxstream.end - rxstream.offset)
+            throw ProtocolError(fs("Protocol::handle_payload data past the requested range of stream " << m_rxstream));
+        if (! rxstream.cancelled)
+        {
+            rxstream.file->write(rxstream.offset, data, len);
+            if (! rxstream.ranged())
+                sha2::SHA256_Update(&rxstream.sha256, reinterpret_cast<const u8*>(data), len);
+        }
+        rxstream.offset += len;
+        m_rxstream_data = m_rxstream_data || len;
+    }
     else
         throw std::runtime_error("handle_payload unexpected payload, a file transfer is not in progress");
 }
 
 void Protocol::handle_payload_end()
 {
-    m_rxfile_os.reset();
+    if (m_rxstream)
+    {
+        // the reply to a Get without a stream is the whole file in a single payload, as is the file of recieve_file
+        const bool unpipelined = ! m_unpipelined_gets.empty() && m_unpipelined_gets.front() == m_rxstream;
+        const bool rxfile = m_rxstream == m_rxfile;
+        if (! m_rxstream_data || unpipelined || rxfile)
+        {
+            auto rx = m_rxstreams.find(m_rxstream);
+            assert(rx != m_rxstreams.end());
+            const u32 stream = m_rxstream;
+            // a mismatch is known now, it's reported once the file is closed
+            const bool verified = rx->second.ranged() || rx->second.verify();
+            rx->second.closing = true;
+            rx->second.file->close([this, stream, verified](bool ok) { rxstream_closed(stream, ok && verified); });
+        }
+        m_rxstream = 0;
+        if (rxfile)
+            m_rxfile = 0;
+        else if (unpipelined)
+            next_unpipelined_get();
+    }
+}
+
+void Protocol::count_payload(bool sent, u64 len)
+{
+    if (! m_peer_payload_in || m_peer_metrics != m_peerinfo.m_peer)
+    {
+        // names are chosen by the peers and not unique, ids are
+        m_peer_metrics = m_peerinfo.m_peer;
+        const std::string help = "Payload bytes received from and sent to each connected peer";
+        metrics::Registry& registry = metrics::Registry::global();
+        m_peer_payload_in = registry.shared_counter("cs_peer_payload_bytes_total", help, {{"direction", "in"}, {"peer", m_peer_metrics}});
+        m_peer_payload_out = registry.shared_counter("cs_peer_payload_bytes_total", help, {{"direction", "out"}, {"peer", m_peer_metrics}});
+    }
+    (sent ? m_peer_payload_out : m_peer_payload_in)->inc(len);
+}
+
+void Protocol::rxstream_closed(u32 stream, bool ok)
+{
+    auto rx = m_rxstreams.find(stream);
+    assert(rx != m_rxstreams.end());
+    rxstream_done(rx, ok);
+}
+
+void Protocol::rxstream_done(std::map<u32, RxStream>::iterator rx, bool found)
+{
+    const u32 stream = rx->first;
+    const string checksum = move(rx->second.checksum);
+    get_done_t done;
+    if (! rx->second.cancelled)
+        done = rx->second.done ? move(rx->second.done) : m_handle_get_done;
+    m_rxstreams.erase(rx);
+    if (done)
+        done(stream, checksum, found);
 }
 
 
@@ -300,8 +619,14 @@ void Protocol::handle_update(const std::vector<msg::MFile>& files)
     // FIXME
 }
 
-bool Protocol::do_get(const std::string& checksum)
+bool Protocol::do_get(const std::string& checksum, u32 stream, u64 offset, u64 length)
 {
+    if (length && ! stream)
+        throw ProtocolError("Protocol::do_get a range can only be requested by a pipelined Get");
+    for (const auto& txstream: m_txstreams)
+        if (stream && txstream->stream == stream)
+            throw ProtocolError(fs("Protocol::do_get stream " << stream << " is already in use"));
+
     // get list of files that match this checksum from the share
     const auto mfiles = share().get_mfiles_by_content(checksum);
     #if 0
@@ -311,19 +636,79 @@ bool Protocol::do_get(const std::string& checksum)
         return x.path;
     });
     #endif
-    if (! mfiles.empty())
+    if (mfiles.empty())
     {
-        msg::FileData filedata(checksum);
-        assert(filedata.m_payload);
-        send_msg(filedata);
-        send_file(share().fullpath(bfs::path(mfiles.front().path)));
-        return true;
+        send_msg(msg::NoSuchFile(checksum, stream));
+        return false;
     }
-    else
+
+    if (stream)
     {
-        send_msg(msg::NoSuchFile(checksum));
+        if (m_txstreams.size() >= s_max_txstreams)
+            throw ProtocolError(fs("Protocol::do_get too many pipelined Gets, over " << static_cast<size_t>(s_max_txstreams)));
+        const bool idle = m_txstreams.empty();
+        m_txstreams.emplace_back(make_unique<TxStream>(stream, checksum, share().fullpath(bfs::path(mfiles.front().path)), offset, length));
+        // the next chunks are queued as the output buffer empties
+        if (idle)
+            send_stream_chunks(txfile_block_sz());
         return false;
     }
+
+    msg::FileData filedata(checksum);
+    assert(filedata.m_payload);
+    send_msg(filedata);
+    send_file(share().fullpath(bfs::path(mfiles.front().path)));
+    return true;
+}
+
+void Protocol::do_file_data(const std::string& checksum, u32 stream, u64 offset)
+{
+    if (! stream && m_rxfile)
+    {
+        // the payload goes to the file given to recieve_file
+        m_rxstreams.at(m_rxfile).checksum = checksum;
+        stream = m_rxfile;
+    }
+    if (! stream && ! m_unpipelined_gets.empty())
+        stream = m_unpipelined_gets.front();
+    auto rx = m_rxstreams.find(stream);
+    if (! stream || rx == m_rxstreams.end() || rx->second.checksum != checksum || rx->second.closing)
+        throw ProtocolError(fs("Protocol::do_file_data unexpected FileData for stream " << stream));
+    RxStream& rxstream = rx->second;
+    if (rxstream.ranged() && offset != rxstream.offset)
+    {
+        // chunks of a range can only go forward inside it
+        if (offset < rxstream.offset || offset > rxstream.end)
+            throw ProtocolError(fs("Protocol::do_file_data FileData offset " << offset << " out of the range of stream " << stream));
+        rxstream.offset = offset;
+    }
+    m_rxstream = stream;
+    m_rxstream_data = false;
+}
+
+void Protocol::do_no_such_file(const std::string& checksum, u32 stream)
+{
+    const bool unpipelined = ! stream && ! m_unpipelined_gets.empty();
+    if (unpipelined)
+        stream = m_unpipelined_gets.front();
+    auto rx = m_rxstreams.find(stream);
+    if (! stream || rx == m_rxstreams.end() || rx->second.checksum != checksum || rx->second.closing)
+        throw ProtocolError(fs("Protocol::do_no_such_file unexpected NoSuchFile for stream " << stream));
+    if (unpipelined)
+        next_unpipelined_get();
+    rxstream_done(rx, false);
+}
+
+void Protocol::do_cancel(const std::string& checksum, u32 stream)
+{
+    for (auto& txstream: m_txstreams)
+        if (txstream->stream == stream && txstream->checksum == checksum)
+        {
+            // its next round sends the FileData without data that ends it
+            txstream->file.size = txstream->file.offset;
+            return;
+        }
+    // it ended already, the end is on its way
 }
 
 void Protocol::do_get_updates(const std::map<std::string, u64>& since)
@@ -341,14 +726,39 @@ void Protocol::do_get_updates(const std::map<std::string, u64>& since)
 
 void Protocol::do_update(const std::vector<msg::MFile>& files)
 {
-    auto& share = this->share();
-    for_each(files.begin(), files.end(), bind(&share::Share::remote_update, &share, placeholders::_1));
+    if (read_only())
+        throw ProtocolError("Protocol::do_update a read only peer can't send changes");
+    m_handle_remote_update(share().remote_update(m_peerinfo.m_peer, files));
+}
+
+std::vector<std::string> Protocol::features() const
+{
+    vector<string> result = r_serverinfo.m_features;
+    for (const char* feature: {feature::pipelined_get, feature::interleaved_control, feature::cancel_get})
+        if (find(result.begin(), result.end(), feature) == result.end())
+            result.emplace_back(feature);
+    return result;
+}
+
+bool Protocol::peer_has(const std::string& feature) const
+{
+    const vector<string>& features = m_peerinfo.m_features;
+    return find(features.begin(), features.end(), feature) != features.end();
+}
+
+void Protocol::features_negotiated()
+{
+    m_handle_interleave_control(peer_has(feature::interleaved_control));
 }
 
 share::Share& Protocol::share(const std::string& share)
 {
     if (! share.empty())
+    {
+        if (! m_authorized_share.empty() && share != m_authorized_share)
+            throw ShareNotFoundError(boost::str(boost::format("Share %1% wasn't authorized") % share));
         m_share = share;
+    }
     auto shr_i = r_shares.find(m_share);
     if (shr_i != r_shares.end())
         return shr_i->second;
@@ -360,6 +770,9 @@ void connect(ProtocolState& pstate, Protocol& protocol)
     // bind output handlers
     protocol.m_handle_send_msg = bind(&ProtocolState::send_msg, &pstate, placeholders::_1, placeholders::_2);
     protocol.m_handle_send_payload_chunk = bind(&ProtocolState::send_payload_chunk, &pstate, placeholders::_1);
+    protocol.m_handle_send_payload_file_chunk = bind(&ProtocolState::send_payload_file_chunk, &pstate, placeholders::_1, placeholders::_2, placeholders::_3, placeholders::_4, placeholders::_5);
+    protocol.m_handle_sendfile_capable = bind(&ProtocolState::sendfile_capable, &pstate);
+    protocol.m_handle_interleave_control = bind(&ProtocolState::set_interleave_control, &pstate, placeholders::_1);
 
     // bind input handlers
     pstate.m_handle_msg = bind(&Protocol::handle_msg, &protocol, placeholders::_1, placeholders::_2, placeholders::_3, placeholders::_4, placeholders::_5);
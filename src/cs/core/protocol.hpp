@@ -24,8 +24,11 @@
 #include "share.hpp"
 #include "coder.hpp"
 #include "../utils.hpp"
+#include "../file.hpp"
 #include "../protocolstate.hpp"
 #include <array>
+#include <deque>
+#include <limits>
 #include <map>
 
 
@@ -78,6 +81,23 @@
  *
  *        <--------
  *
+ *         Get({checksum, stream: 1}), Get({checksum, stream: 2}) ...
+ *
+ *        ---------->
+ *
+ *         FileData({checksum, stream: 2}) + chunk, FileData({checksum, stream: 1}) + chunk ...
+ *         FileData({checksum, stream: 2}) + no data, ends the stream
+ *
+ *        <--------
+ *
+ *         Get({checksum, stream: 3, offset, length}), a range of the file
+ *
+ *        ---------->
+ *
+ *         FileData({checksum, stream: 3, offset}) + chunk ...
+ *
+ *        <--------
+ *
  *
  *
  *        ....
@@ -109,6 +129,17 @@ enum State: unsigned
 DEFINE_RE_EXCEPTION(ProtocolError);
 DEFINE_RE_EXCEPTION(ShareNotFoundError);
 
+/// features of the protocol advertised in Start and Go, used with a peer only if it advertised them too
+namespace feature
+{
+/// Get, FileData and NoSuchFile with a stream, several Gets outstanding and ranges
+constexpr char pipelined_get[] = "pipelined_get";
+/// messages without payload between the chunks of a payload, @sa ProtocolState
+constexpr char interleaved_control[] = "interleaved_control";
+/// Cancel of a pipelined Get
+constexpr char cancel_get[] = "cancel_get";
+}
+
 class Protocol;
 
 /**
@@ -191,6 +222,10 @@ public:
     {
         throw ProtocolError(fs("Can't handle message type Update on state: " << static_cast<unsigned>(m_state)));
     }
+    void visit(const msg::Cancel&) override
+    {
+        throw ProtocolError(fs("Can't handle message type Cancel on state: " << static_cast<unsigned>(m_state)));
+    }
 
     State m_state;
     State m_next_state;
@@ -204,14 +239,100 @@ public:
  */
 typedef std::array<std::unique_ptr<MessageHandler>, State::MAX> state_trans_table_t;
 
+/**
+ * A file being sent as payload, read by offset so it can go out with sendfile
+ */
+struct TxFile
+{
+    /// @throws runtime_error when file can't be opened
+    explicit TxFile(const bfs::path& path);
+    ~TxFile();
+
+    TxFile(const TxFile&) = delete;
+    TxFile& operator=(const TxFile&) = delete;
+
+    int fd;
+    /// unique in the process, unlike fd which is reused once closed
+    const u64 id;
+    /// next byte to send
+    u64 offset;
+    u64 size;
+};
+
+/**
+ * A file being sent for a pipelined Get, or the range [offset, offset + length) of it when length
+ * is not 0
+ */
+struct TxStream
+{
+    /// @throws runtime_error when file can't be opened
+    TxStream(u32 stream, const std::string& checksum, const bfs::path& path, u64 offset = 0, u64 length = 0);
+
+    u32 stream;
+    std::string checksum;
+    TxFile file;
+};
+
+/// called when a pipelined Get finished, @param found is false as well when the data doesn't match the checksum
+typedef std::function<void(u32 stream, const std::string& checksum, bool found)> get_done_t;
+
+/**
+ * A file being recieved for a pipelined Get, a whole file is hashed as it arrives so it's verified
+ * without reading it back
+ */
+struct RxStream
+{
+    RxStream(const std::string& checksum, std::unique_ptr<FileWriter> file, u64 offset, u64 end, get_done_t done):
+        checksum(checksum)
+        , file(std::move(file))
+        , offset(offset)
+        , end(end)
+        , closing()
+        , cancelled()
+        , done(std::move(done))
+        , sha256()
+    {
+        sha2::SHA256_Init(&sha256);
+    }
+
+    std::string checksum;
+    std::unique_ptr<FileWriter> file;
+    /// where the next data is written, for a ranged Get each FileData says where its chunk goes
+    u64 offset;
+    /// data can't be written past this offset
+    u64 end;
+    /// the stream ended, it's done once the data written behind is on disk
+    bool closing;
+    /// not wanted anymore, what still arrives is dropped and done isn't called
+    bool cancelled;
+    /// what to do when it finishes, Protocol::m_handle_get_done if empty
+    get_done_t done;
+    /// hash of the data recieved so far, unused for a range which can't be checked on its own
+    sha2::SHA256_CTX sha256;
+
+    bool ranged() const
+    {
+        return end != std::numeric_limits<u64>::max();
+    }
+
+    /// @returns whether the data recieved has the expected checksum
+    bool verify();
+};
+
 /**
  * Implements the clearskies core protocol
  */
 class Protocol
 {
 public:
-    typedef std::function<void(const std::string&& msg_sig_encoded, bool payload)> handle_send_msg_t;
-    typedef std::function<void(const std::string& chunk)> handle_send_payload_chunk_t;
+    typedef std::function<void(std::string&& msg_sig_encoded, bool payload)> handle_send_msg_t;
+    typedef std::function<void(std::string&& chunk)> handle_send_payload_chunk_t;
+    typedef std::function<void(int fd, u64 file_id, u64 offset, size_t size, size_t read_ahead)> handle_send_payload_file_chunk_t;
+    typedef std::function<void(u64 file_id)> handle_payload_file_closed_t;
+    typedef std::function<bool()> handle_sendfile_capable_t;
+    typedef get_done_t handle_get_done_t;
+    typedef std::function<void(const share::RemoteUpdate&)> handle_remote_update_t;
+    typedef std::function<void(bool interleave)> handle_interleave_control_t;
 
     Protocol(const ServerInfo&, std::map<std::string, share::Share>& shares);
 
@@ -221,7 +342,7 @@ public:
     void set_state(State state) { m_state = state; }
 
     /**
-     * open the given file and set m_txfile_is so payload chunks are read and queued to be sent each time
+     * open the given file and set m_txfile so payload chunks are read and queued to be sent each time
      * handle_empty_output_buff is called when the output buffers are empty
      *
      * Warning: Caller is responsible for the security of this function and permissions to access the given
@@ -233,13 +354,42 @@ public:
     void send_file(const bfs::path& path);
 
     /**
-     * open the given file for writing so recieved chunks are written there on handle_payload
+     * open the given file for writing so the payload of the next FileData without a stream, which
+     * no Get of get_file is waiting for, is written there. It's hashed as it arrives and, once on
+     * disk, reported like a Get with the stream id returned, found is false if it doesn't match the
+     * checksum of the FileData.
      *
      * Warning: Caller is responsible for the security of this function and permissions to access the given
      *
      * @throws runtime_error when file can't be opened
      */
-    void recieve_file(const bfs::path& path);
+    u32 recieve_file(const bfs::path& path, get_done_t done = get_done_t());
+
+    /**
+     * Request the file with the given checksum with a pipelined Get, its contents are written to
+     * path as they arrive. Many requests can be outstanding, @param done is called when each
+     * finishes, or m_handle_get_done if it's empty. found is false as well when the data recieved
+     * doesn't match the checksum.
+     *
+     * When @param length is not 0 only the range [offset, offset + length) is requested and written
+     * at the same place of path, which is created if needed but not truncated, so the ranges of a file
+     * can be fetched by several requests, even from different peers. Ranges aren't verified, the
+     * caller has to checksum the whole file once it has all of them.
+     *
+     * A peer that didn't advertise feature::pipelined_get is sent the Gets without a stream one at a
+     * time, the next when the reply to the previous one ends, and can't be asked for ranges.
+     *
+     * @returns the stream id of the request, not used by any other request outstanding
+     * @throws runtime_error when file can't be opened or a range is requested to a peer that can't send it
+     */
+    u32 get_file(const std::string& checksum, const bfs::path& path, u64 offset = 0, u64 length = 0, get_done_t done = get_done_t());
+
+    /**
+     * The reply to the Get of @param stream is no longer wanted, its completion isn't reported. The
+     * peer is asked to stop if it advertised feature::cancel_get, the data that still arrives is
+     * dropped. Unknown or finished streams are ignored.
+     */
+    void cancel_get(u32 stream);
 
     // callbacks for connecting to @sa cs::ProtocolState
     void handle_empty_output_buff();
@@ -254,8 +404,14 @@ public:
     // message actions, note that the handlers / visitors logic control that these actions are triggered on the
     // appropiate states only
 
-    /// action for MType::GET, @return true on success
-    bool do_get(const std::string& checksum);
+    /// action for MType::GET, @return true when a not pipelined file transfer starts
+    bool do_get(const std::string& checksum, u32 stream = 0, u64 offset = 0, u64 length = 0);
+    /// action for MType::FILE_DATA of a pipelined Get, its payload goes to the stream file at offset
+    void do_file_data(const std::string& checksum, u32 stream, u64 offset = 0);
+    /// action for MType::NO_SUCH_FILE of a pipelined Get
+    void do_no_such_file(const std::string& checksum, u32 stream);
+    /// action for MType::CANCEL, the stream being sent ends early
+    void do_cancel(const std::string& checksum, u32 stream);
     void do_get_updates(const std::map<std::string, u64>& since);
     void do_update(const std::vector<msg::MFile>& files);
 
@@ -263,6 +419,21 @@ public:
     // callbacks for connecting to @sa cs::core::share::Share
     // FIXME
 
+    /// @returns the features to advertise in Start and Go, the ones of the ServerInfo and the protocol's
+    std::vector<std::string> features() const;
+
+    /// @returns whether the peer advertised @param feature
+    bool peer_has(const std::string& feature) const;
+
+    /// @returns whether the peer authenticated with the read only key, it can't change the share
+    bool read_only() const
+    {
+        return m_authorized_access == "ro";
+    }
+
+    /// Start and Go were exchanged, use the features both sides have
+    void features_negotiated();
+
     /**
      * @returns the current selected @param[in] share or @throws ShareNotFoundError, this can happen if the
      * share was detached and can't be found anymore, in this case users of this class should close
@@ -278,22 +449,42 @@ public:
     PeerInfo m_peerinfo;
     /// selected share name
     std::string m_share;
+    /// when set the peer authenticated for this share only and can't select another
+    std::string m_authorized_share;
+    /// access of the key the peer authenticated with, "rw" or "ro" @sa server::psk_identity, empty if it didn't
+    std::string m_authorized_access;
 
     /// current protocol state
     State m_state;
 
     /// table of message visitors given a state
     state_trans_table_t m_state_trans_table;
-    /// the file being transmitted to the peer when set
+    /// size of the payload chunks of a file transmitted to the peer
     static const size_t s_txfile_block_sz = 65536;
-    /// pointer to an open input stream for the file that is being sent if set
-    std::unique_ptr<bfs::ifstream> m_txfile_is;
+    /// chunk size when the file is sent without copying, there's no buffer to keep small
+    static const size_t s_txfile_sendfile_block_sz = 1 << 20;
+    /// the file being transmitted to the peer when set
+    std::unique_ptr<TxFile> m_txfile;
+    /// pipelined transfers to the peer, served round-robin from the front
+    std::deque<std::unique_ptr<TxStream>> m_txstreams;
+    /// pipelined transfers a peer can have in progress, each holds an open file
+    static const size_t s_max_txstreams = 256;
 
     /// pointer to a FrozenManifest being sent in chunks
     //std::unique_ptr<share::FrozenManifest> m_frozen_manifest;
 
-    /// pointer to an open output stream for the file that is being recieved if set
-    std::unique_ptr<bfs::ofstream> m_rxfile_os;
+    /// stream in m_rxstreams of the file given to recieve_file until its FileData ends, 0 if none
+    u32 m_rxfile;
+    /// files being recieved for our pipelined Gets by stream id
+    std::map<u32, RxStream> m_rxstreams;
+    /// stream of the FileData whose payload is being recieved, 0 if none
+    u32 m_rxstream;
+    /// whether the current FileData brought any data, an empty one ends its stream
+    bool m_rxstream_data;
+    /// id for the next pipelined Get
+    u32 m_next_stream;
+    /// streams requested with Gets without a stream to a peer that doesn't pipeline, the front one was sent
+    std::deque<u32> m_unpipelined_gets;
 
     /// encodes messages into bytes
     msg::Coder m_coder;
@@ -302,9 +493,47 @@ public:
     handle_send_msg_t m_handle_send_msg;
     /// what to do when a chunk is sent
     handle_send_payload_chunk_t m_handle_send_payload_chunk;
+    /// what to do when a chunk of a file is sent
+    handle_send_payload_file_chunk_t m_handle_send_payload_file_chunk;
+    /// whether file chunks are sent without copying them
+    handle_sendfile_capable_t m_handle_sendfile_capable;
+    /// a file being sent is closed, what was read ahead of it is stale
+    handle_payload_file_closed_t m_handle_payload_file_closed;
+    /// what to do when a pipelined Get finished
+    handle_get_done_t m_handle_get_done;
+    /// what to do with the files of an Update once compared with the share, @sa share::Share::remote_update
+    handle_remote_update_t m_handle_remote_update;
+    /// opens the files recieved, synchronous writes by default, @sa cs::open_file_writer
+    open_file_writer_t m_handle_open_file_writer;
+    /// hashes the files downloaded in ranges to verify them, synchronously by default @sa cs::hash_file
+    hash_file_t m_handle_hash_file;
+    /// whether control messages can be sent between payload chunks, @sa ProtocolState::set_interleave_control
+    handle_interleave_control_t m_handle_interleave_control;
 
     /// queued updates to be sent to the peer, as noticed by the Share fs scan
     std::deque<msg::MFile> m_peding_updates;
+
+private:
+    /// size of the file chunks, larger when they are sent without copying
+    size_t txfile_block_sz();
+    /// queue a chunk of each pipelined transfer, round-robin, up to @param budget bytes
+    void send_stream_chunks(size_t budget);
+    /// @returns a stream id not used by any request outstanding
+    u32 next_stream_id();
+    /// the data of @param stream is written, it's done
+    void rxstream_closed(u32 stream, bool ok);
+    /// forget the stream @param rx and report it finished unless it was cancelled
+    void rxstream_done(std::map<u32, RxStream>::iterator rx, bool found);
+    /// the reply to the front of m_unpipelined_gets ended, send the next Get
+    void next_unpipelined_get();
+    /// count @param len bytes of payload sent to the peer when @param sent, recieved otherwise
+    void count_payload(bool sent, u64 len);
+
+    /// payload counters of the peer with the id m_peer_metrics, got again when the id changes. The
+    /// series of a peer go away with the last connection to it
+    std::string m_peer_metrics;
+    std::shared_ptr<metrics::Counter> m_peer_payload_in;
+    std::shared_ptr<metrics::Counter> m_peer_payload_out;
 };
 
 void connect(ProtocolState&, Protocol&);
@@ -17,6 +17,7 @@
  */
 #include "share.hpp"
 #include "../utils.hpp"
+#include "../trace.hpp"
 #include <iostream>
 #include "boost/format.hpp"
 using namespace std;
@@ -24,7 +25,99 @@ using namespace std;
 namespace
 {
 
+cs::Vclock vclock_arg(sqlite3pp::ext::context& c, int idx)
+{
+    if (c.args_type(idx) == SQLITE_NULL)
+        return cs::Vclock();
+    const void* data = c.get<void const*>(idx);
+    return cs::Vclock::unpack(data, c.args_bytes(idx));
+}
+
+/// vclock_get(clock, id): the value of peer id, NULL if the clock has none
+void sql_vclock_get(sqlite3pp::ext::context& c)
+{
+    try
+    {
+        const cs::Vclock vclock = vclock_arg(c, 0);
+        const auto id = static_cast<cs::PeerId>(c.get<long long int>(1));
+        for (const auto& e: vclock.entries())
+        {
+            if (e.id == id)
+            {
+                c.result(static_cast<long long int>(e.value));
+                return;
+            }
+        }
+        c.result(nullptr);
+    }
+    catch (const std::exception& e)
+    {
+        c.result_error(e.what());
+    }
+}
+
+/// vclock_merge(clock, id, value): the clock with peer id raised to value
+void sql_vclock_merge(sqlite3pp::ext::context& c)
+{
+    try
+    {
+        cs::Vclock vclock = vclock_arg(c, 0);
+        vclock.merge(static_cast<cs::PeerId>(c.get<long long int>(1)), static_cast<cs::u64>(c.get<long long int>(2)));
+        const string packed = vclock.pack();
+        c.result(packed.data(), static_cast<int>(packed.size()), false);
+    }
+    catch (const std::exception& e)
+    {
+        c.result_error(e.what());
+    }
+}
 
+/// @returns true if @param table has @param column
+bool has_column(std::shared_ptr<sqlite3pp::database>& db, const std::string& table, const std::string& column)
+{
+    sqlite3pp::query q(db, fs("PRAGMA table_info(" << table << ")").c_str());
+    for (const auto& row: q)
+        if (row.get<string>(1) == column)
+            return true;
+    return false;
+}
+
+/// the metrics of all the shares, got once
+struct ShareMetrics
+{
+    ShareMetrics():
+          scan_files(cs::metrics::counter("cs_scan_files_total", "Files found by share scans"))
+        , scan_stat(cs::metrics::latency("cs_scan_stat_seconds", "Time a scan takes to find and stat a file"))
+        , checksum_bytes(cs::metrics::counter("cs_checksum_bytes_total", "Bytes read to checksum files"))
+        , checksum_files(cs::metrics::counter("cs_checksum_files_total", "Files checksummed"))
+        , checksum_queue(cs::metrics::gauge("cs_checksum_queue_files", "Files waiting to be checksummed"))
+        , get_file_info(statement("get_file_info"))
+        , insert_mfile(statement("insert_mfile"))
+        , update_mfile(statement("update_mfile"))
+        , cksum_select(statement("cksum_select"))
+    {}
+
+    static cs::metrics::Histogram& statement(const std::string& name)
+    {
+        return cs::metrics::latency("cs_sqlite_statement_seconds", "Time to run SQLite statements", {{"statement", name}});
+    }
+
+    cs::metrics::Counter& scan_files;
+    cs::metrics::Histogram& scan_stat;
+    cs::metrics::Counter& checksum_bytes;
+    cs::metrics::Counter& checksum_files;
+    cs::metrics::Gauge& checksum_queue;
+    cs::metrics::Histogram& get_file_info;
+    cs::metrics::Histogram& insert_mfile;
+    cs::metrics::Histogram& update_mfile;
+    cs::metrics::Histogram& cksum_select;
+};
+
+ShareMetrics& share_metrics()
+{
+    static ShareMetrics metrics;
+    return metrics;
+}
 
 } // end anon ns
 
@@ -126,6 +219,7 @@ FrozenManifest::FrozenManifest(const std::string& peer_id, Share& share, const s
     , m_table("frozen_files_" + peer_id)
     , m_since(since)
 {
+    CS_TRACE_SPAN("freeze_manifest", "sqlite");
     {
         // The temporary table should not exist for this peer already
         sqlite3pp::query q_cnt_tbl(r_share.m_db, R"#(SELECT COUNT(*) FROM sqlite_master WHERE type='table' and name=?)#");
@@ -171,6 +265,24 @@ FrozenManifest::~FrozenManifest()
     sqlite3pp::command(r_share.m_db, q.c_str()).execute();
 }
 
+namespace
+{
+
+/// @returns @param s as an SQL string literal, the peer ids come from the peer
+string sql_quote(const string& s)
+{
+    string result = "'";
+    for (const char c: s)
+    {
+        if (c == '\'')
+            result += '\'';
+        result += c;
+    }
+    return result + "'";
+}
+
+} // end anon ns
+
 std::string FrozenManifest::where_condition(const std::map<std::string, u64>& since)
 {
     ostringstream where;
@@ -182,7 +294,7 @@ std::string FrozenManifest::where_condition(const std::map<std::string, u64>& si
             {
                 if (&x != &*since.begin())
                     where << "OR ";
-                where << "last_changed_by = '" << x.first << "' AND last_changed_rev > " << x.second << "\n";
+                where << "last_changed_by = " << sql_quote(x.first) << " AND last_changed_rev > " << x.second << "\n";
             }
         }
 
@@ -191,9 +303,9 @@ std::string FrozenManifest::where_condition(const std::map<std::string, u64>& si
         {
             if (&x != &*since.begin())
                 where << ", ";
-            where << "'" << x.first << "'";
+            where << sql_quote(x.first);
         }
-        where << ")\n";
+        where << "))\n";
     }
     return where.str();
 }
@@ -245,14 +357,20 @@ MFile& Share::Share_iterator::dereference() const
 }
 
 
-Share::Share(const std::string& share_path, const std::string& dbpath):
+Share::Share(const std::string& share_path, const std::string& dbpath, std::shared_ptr<vfs::Filesystem> filesystem):
       m_path(share_path)
+    , m_fs(move(filesystem))
     , m_revision(0)
     , m_db(make_shared<sqlite3pp::database>(dbpath.c_str()))
+    , m_sql_functions()
     , m_db_path(dbpath)
     , m_insert_mfile_q(m_db)
     , m_update_mfile_q(m_db)
     , m_get_mfiles_by_content_q(m_db)
+    , m_insert_remote_update_q(m_db)
+    , m_get_vclock_q(m_db)
+    , m_set_vclock_q(m_db)
+    , m_peer_ids()
     , m_scan_in_progress()
     , m_scan_batch_sz(256)
     , m_scan_it()
@@ -265,6 +383,7 @@ Share::Share(const std::string& share_path, const std::string& dbpath):
     , m_cksum_ctx_sha256()
     , m_cksum_mfile()
     , m_cksum_is()
+    , m_cksum_queue(share_metrics().checksum_queue)
     , m_share_id()
     , m_peer_id()
     , m_psk_rw()
@@ -272,15 +391,19 @@ Share::Share(const std::string& share_path, const std::string& dbpath):
     , m_psk_untrusted()
     , m_pkc_rw()
     , m_pkc_ro()
+    , m_handle_update()
+    , m_mutex(make_unique<recursive_mutex>())
 {
     sha2::SHA256_Init(&m_cksum_ctx_sha256);
     bfs::path share_path_(share_path);
-    if (! bfs::exists(share_path_))
+    const vfs::Type type = m_fs->stat(share_path_).type;
+    if (type == vfs::Type::NONE)
         throw std::runtime_error(fs("Share::Share error: " << share_path_ << " doesn't exist"));
 
-    if (! bfs::is_directory(share_path_))
+    if (type != vfs::Type::DIRECTORY)
         throw std::runtime_error(fs("Share::Share error: " << share_path_ << " not a directory"));
 
+    register_sql_functions();
     initialize_tables();
     initialize_statements();
 }
@@ -336,15 +459,53 @@ void Share::initialize_tables()
         )
     )#").execute();
     sqlite3pp::command(m_db, R"#(CREATE INDEX IF NOT EXISTS i_files_checksum ON files(checksum))#").execute();
+    // the next file to checksum is picked after each one, without this it's a scan of all the files
+    sqlite3pp::command(m_db, R"#(CREATE INDEX IF NOT EXISTS i_files_to_checksum ON files(path) WHERE to_checksum != 0)#").execute();
 
+    //
+    // VECTOR CLOCKS, peers are interned to small ids and clocks packed in a blob, @sa cs::Vclock
+    //
+    sqlite3pp::command(m_db, R"#(CREATE TABLE IF NOT EXISTS peer_ids (
+        id INTEGER PRIMARY KEY,
+        peer TEXT UNIQUE NOT NULL
+        )
+    )#").execute();
+    load_peer_ids();
+
+    // the first version had a row per path and peer, converted all at once or not at all. A
+    // failure throws out of the constructor, so the ids interned meanwhile are forgotten too.
+    const bool vclock_rows = has_column(m_db, "files_vclock", "key");
+    sqlite3pp::transaction migration(m_db);
+    if (vclock_rows)
+    {
+        sqlite3pp::command(m_db, R"#(ALTER TABLE files_vclock RENAME TO files_vclock_rows)#").execute();
+        sqlite3pp::command(m_db, R"#(DROP TABLE IF EXISTS peer_files_vclock)#").execute();
+    }
     sqlite3pp::command(m_db, R"#(CREATE TABLE IF NOT EXISTS files_vclock (
-        path TEXT NOT NULL,
-        key TEXT NOT NULL,
-        value INTEGER DEFAULT 0,
+        path TEXT PRIMARY KEY,
+        vclock BLOB NOT NULL,
         FOREIGN KEY(path) REFERENCES files(path)
         )
     )#").execute();
-    sqlite3pp::command(m_db, R"#(CREATE UNIQUE INDEX IF NOT EXISTS i_files_vlock_path ON files_vclock(path))#").execute();
+    if (vclock_rows)
+    {
+        map<string, Vclock> vclocks;
+        {
+            sqlite3pp::query q(m_db, R"#(SELECT path, key, value FROM files_vclock_rows)#");
+            for (const auto& row: q)
+                vclocks[row.get<string>(0)].merge(intern_peer(row.get<string>(1)), row.get<u64>(2));
+        }
+        for (const auto& x: vclocks)
+        {
+            const string packed = x.second.pack();
+            sqlite3pp::command insert(m_db, R"#(INSERT INTO files_vclock (path, vclock) VALUES (?, ?))#");
+            insert.bind(1, x.first);
+            insert.bind(2, static_cast<const void*>(packed.data()), static_cast<int>(packed.size()));
+            insert.execute();
+        }
+        sqlite3pp::command(m_db, R"#(DROP TABLE files_vclock_rows)#").execute();
+    }
+    migration.commit();
 
 
     //
@@ -362,18 +523,34 @@ void Share::initialize_tables()
         )
     )#").execute();
     sqlite3pp::command(m_db, R"#(CREATE INDEX IF NOT EXISTS i_peer_files_path ON peer_files(path))#").execute();
+    sqlite3pp::command(m_db, R"#(CREATE UNIQUE INDEX IF NOT EXISTS i_peer_files_path_peer ON peer_files(path, peer))#").execute();
 
     sqlite3pp::command(m_db, R"#(CREATE TABLE IF NOT EXISTS peer_files_vclock (
         path TEXT NOT NULL,
         peer TEXT NOT NULL,
-        key TEXT NOT NULL,
-        value INTEGER DEFAULT 0,
+        vclock BLOB NOT NULL,
+        PRIMARY KEY(path, peer),
         FOREIGN KEY(path) REFERENCES peer_files(path)
         )
     )#").execute();
-    sqlite3pp::command(m_db, R"#(CREATE INDEX IF NOT EXISTS i_peer_files_vlock_path ON peer_files_vclock(path))#").execute();
 
 
+    //
+    // REMOTE UPDATES, the batch being applied, @sa Share::remote_update
+    //
+    sqlite3pp::command(m_db, R"#(CREATE TEMPORARY TABLE IF NOT EXISTS remote_update (
+        path TEXT PRIMARY KEY,
+        checksum TEXT,
+        last_changed_by TEXT,
+        last_changed_rev INTEGER,
+        mtime TEXT,
+        size INTEGER,
+        deleted INTEGER,
+        mode INTEGER,
+        action INTEGER DEFAULT 0
+        )
+    )#").execute();
+
 }
 
 
@@ -413,6 +590,9 @@ void Share::initialize_statements()
     m_cksum_select_q.prepare("SELECT * FROM files WHERE to_checksum != 0 ORDER BY path");
 
     m_get_mfiles_by_content_q.prepare("SELECT * FROM files WHERE checksum = ?");
+    m_insert_remote_update_q.prepare("INSERT OR REPLACE INTO remote_update (path, checksum, last_changed_by, last_changed_rev, mtime, size, deleted, mode) VALUES (?,?,?,?,?,?,?,?)");
+    m_get_vclock_q.prepare("SELECT vclock FROM files_vclock WHERE path = ?");
+    m_set_vclock_q.prepare("INSERT OR REPLACE INTO files_vclock (path, vclock) VALUES (?, ?)");
 }
 
 
@@ -470,10 +650,27 @@ void Share::init_or_read_share_identity()
     }
 }
 
+void Share::load_peer_ids()
+{
+    sqlite3pp::query q(m_db, R"#(SELECT id, peer FROM peer_ids WHERE id > ? ORDER BY id)#");
+    q.bind(1, m_peer_ids.last());
+    for (const auto& row: q)
+        m_peer_ids.add(row.get<u32>(0), row.get<string>(1));
+}
+
+void Share::register_sql_functions()
+{
+    m_sql_functions = make_unique<sqlite3pp::ext::function>(*m_db);
+    m_sql_functions->create("vclock_get", sql_vclock_get, 2);
+    m_sql_functions->create("vclock_merge", sql_vclock_merge, 3);
+}
+
 
 std::unique_ptr<MFile> Share::get_file_info(const std::string& path)
 {
     unique_ptr<MFile> result;
+    CS_TRACE_SPAN("get_file_info", "sqlite");
+    metrics::ScopedTimer timer(share_metrics().get_file_info);
     sqlite3pp::query file_q(m_db, "SELECT * FROM files WHERE path = :path");
     file_q.bind(":path", path);
 
@@ -492,6 +689,8 @@ std::unique_ptr<MFile> Share::get_file_info(const std::string& path)
 
 void Share::insert_mfile(const MFile& f)
 {
+    CS_TRACE_SPAN("insert_mfile", "sqlite");
+    metrics::ScopedTimer timer(share_metrics().insert_mfile);
     m_insert_mfile_q.reset();
     m_insert_mfile_q.bind(1, f.path);
     m_insert_mfile_q.bind(2, f.mtime);
@@ -509,6 +708,8 @@ void Share::insert_mfile(const MFile& f)
 
 void Share::update_mfile(const MFile& f)
 {
+    CS_TRACE_SPAN("update_mfile", "sqlite");
+    metrics::ScopedTimer timer(share_metrics().update_mfile);
     m_update_mfile_q.reset();
     assert(! f.path.empty());
     m_update_mfile_q.bind(1, f.mtime);
@@ -533,13 +734,17 @@ void Share::update_mfile(const MFile& f)
 void Share::scan()
 {
     m_scan_in_progress = true;
-    m_scan_it = make_unique<bfs::recursive_directory_iterator>(m_path);
+    m_scan_it = m_fs->walk(m_path);
     m_scan_found_count = 0;
     time(&m_scan_duration_s);
+
+    sqlite3pp::query q(m_db, "SELECT COUNT(*) FROM files WHERE to_checksum != 0");
+    m_cksum_queue.set(q.fetchone().get<i64>(0));
 }
 
 bool Share::scan_step()
 {
+    CS_TRACE_SPAN("scan_step", "share");
     if (m_scan_in_progress == false)
     {
         assert(false);
@@ -555,6 +760,7 @@ bool Share::scan_step()
 
 bool Share::cksum_step()
 {
+    CS_TRACE_SPAN("cksum_step", "share");
     for(size_t nblock = 0; nblock < m_cksum_batch_sz;)
     {
         if (m_cksum_is)
@@ -576,15 +782,16 @@ void Share::cksum_do_block()
 {
     assert(m_cksum_is);
     std::array<char, Share::s_cksum_block_sz> rbuff;
-    m_cksum_is->read(rbuff.data(), rbuff.size());
-    sha2::SHA256_Update(&m_cksum_ctx_sha256, (const cs::u8*) rbuff.data(), m_cksum_is->gcount());
-    if (! *m_cksum_is)
+    const size_t len = m_cksum_is->read(rbuff.data(), rbuff.size());
+    share_metrics().checksum_bytes.inc(len);
+    sha2::SHA256_Update(&m_cksum_ctx_sha256, (const cs::u8*) rbuff.data(), len);
+    if (len < rbuff.size())
     {
         // EOF
         string checksum(SHA256_DIGEST_STRING_LENGTH, 0);
         sha2::SHA256_End(&m_cksum_ctx_sha256, &checksum[0]);
         checksum.resize(checksum.size() - 1);
-        if (! bfs::exists(fullpath(m_cksum_mfile.path)))
+        if (m_fs->stat(fullpath(m_cksum_mfile.path)).type == vfs::Type::NONE)
         {
             // check if file vanished one last time
             m_cksum_mfile.was_deleted(m_peer_id, m_revision);
@@ -595,8 +802,10 @@ void Share::cksum_do_block()
             m_cksum_mfile.checksum = move(checksum);
             m_cksum_mfile.to_checksum = false;
             m_cksum_mfile.updated = true;
+            share_metrics().checksum_files.inc();
         }
         update_mfile(m_cksum_mfile);
+        m_cksum_queue.add(-1);
         m_cksum_is.reset();
     }
 }
@@ -606,25 +815,32 @@ bool Share::cksum_next_file()
     // the query needs to be rerun, since checksumming runs interwinded with file scanning, so there
     // could be new files to checksum added on every step. Another solution is to first scan then
     // checksum, but this way we should be utilizing the CPU more.
-    m_cksum_select_q.reset();
-    const auto to_cksum_it = m_cksum_select_q.begin();
+    {
+        CS_TRACE_SPAN("cksum_select", "sqlite");
+        metrics::ScopedTimer timer(share_metrics().cksum_select);
+        m_cksum_select_q.reset();
+        const auto to_cksum_it = m_cksum_select_q.begin();
 
-    // There are no more files to checksum
-    if (to_cksum_it == m_cksum_select_q.end())
-        return false;
+        // There are no more files to checksum
+        if (to_cksum_it == m_cksum_select_q.end())
+        {
+            m_cksum_queue.set(0);
+            return false;
+        }
 
-    m_cksum_mfile.from_row(*to_cksum_it);
-    m_cksum_is = make_unique<bfs::ifstream>(fullpath(bfs::path(m_cksum_mfile.path)), ios_base::in | ios_base::binary);
+        m_cksum_mfile.from_row(*to_cksum_it);
+    }
+    m_cksum_is = m_fs->open(fullpath(bfs::path(m_cksum_mfile.path)));
 
-    if (! *m_cksum_is) // note that we are not checking the pointer, but the stream
+    if (! m_cksum_is)
     {
         // file can't be opened, it has been deleted
         m_cksum_mfile.was_deleted(m_peer_id, m_revision);
         ++m_revision;
         update_mfile(m_cksum_mfile);
-        m_cksum_is.reset();
+        m_cksum_queue.add(-1);
+        return true;
     }
-    m_cksum_is->exceptions(ios::badbit);
     sha2::SHA256_Init(&m_cksum_ctx_sha256);
     return true;
 }
@@ -634,47 +850,38 @@ bool Share::cksum_next_file()
  */
 bool Share::fs_scan_step()
 {
+    CS_TRACE_SPAN("fs_scan_step", "share");
     if (! m_scan_it)
         return false;
 
-    bfs::recursive_directory_iterator& it = *m_scan_it;
-    bfs::recursive_directory_iterator end;
-    for (size_t batch_i = 0; it != end && batch_i < m_scan_batch_sz; ++it, ++batch_i)  // batch_i is the number of files in this batch so far
+    ShareMetrics& stats = share_metrics();
+    vfs::Entry entry;
+    for (size_t batch_i = 0; batch_i < m_scan_batch_sz; ++batch_i)  // batch_i is the number of files in this batch so far
     {
-        const auto& dentry = *it;
-        if (dentry.status().type() == bfs::regular_file)
+        bool more = false;
         {
-            MFile f;
-            // we get the path relative to the share
-            bfs::path fpath = get_tail(dentry.path(), it.level() + 1);
-            assert(fpath.is_relative());
-            f.path = fpath.string();
-            f.mtime = utils::isotime(bfs::last_write_time(dentry.path()));
-            f.size = bfs::file_size(dentry.path());
-            f.mode = dentry.status().permissions();
-            f.scan_found = true;
-            f.deleted = false;
-            f.to_checksum = false;
-            scan_found(f);
-
-#if 0
-            cout << f.path << endl;
-            cout << f.mtime << endl;
-            cout << oct << f.mode << dec << endl;
-            cout << f.size << endl;
-            cout << endl;
-#endif
+            metrics::ScopedTimer timer(stats.scan_stat);
+            more = m_scan_it->next(entry);
         }
-
-    }
-    // scan finished
-    if (it == end)
-    {
-        m_scan_it.reset();
-        return false;
+        if (! more)
+        {
+            // scan finished
+            m_scan_it.reset();
+            return false;
+        }
+        MFile f;
+        // the path relative to the share
+        f.path = move(entry.path);
+        f.mtime = utils::isotime(entry.stat.mtime);
+        f.size = entry.stat.size;
+        f.mode = entry.stat.mode;
+        f.scan_found = true;
+        f.deleted = false;
+        f.to_checksum = false;
+        scan_found(f);
+        stats.scan_files.inc();
     }
-    else
-        return true;
+    return true;
 }
 
 void Share::on_scan_finished()
@@ -703,25 +910,22 @@ void Share::on_scan_finished()
 
 void Share::scan_found(MFile& scan_file)
 {
-    // TODO: add bytes to checksum for stats
     assert(scan_file.scan_found);
     unique_ptr<MFile> mfile = get_file_info(scan_file.path);
     ++m_scan_found_count;
     if (mfile) // found
     {
-        bool changed = false;
-        if (scan_file.mtime != mfile->mtime
+        const bool content_changed = scan_file.mtime != mfile->mtime
             || scan_file.size != mfile->size
-            || mfile->deleted)
-        {
-            mfile->to_checksum = true;
-            changed = true;
-        }
-        if (scan_file.mode != mfile->mode)
-            changed = true;
+            || mfile->deleted;
+        const bool changed = content_changed || scan_file.mode != mfile->mode;
 
         if (changed)
         {
+            // keep the checksum, a change of mode only doesn't need a new one
+            scan_file.checksum = move(mfile->checksum);
+            m_cksum_queue.add(static_cast<int>(content_changed) - static_cast<int>(mfile->to_checksum));
+            scan_file.to_checksum = content_changed;
             *mfile = scan_file;
             // This is a local change to the file attributes or content
             // last_changed_rev and last_changed_by by this peer now
@@ -746,6 +950,7 @@ void Share::scan_found(MFile& scan_file)
         scan_file.last_changed_by = m_peer_id;
         scan_file.to_checksum = true; // after checksum updated is set to true
         insert_mfile(scan_file);
+        m_cksum_queue.add(1);
     }
 }
 
@@ -779,14 +984,189 @@ std::vector<MFile> Share::get_mfiles_by_content(const std::string& checksum)
 
 bool Share::was_updated(const MFile& file)
 {
-    bfs::path abspath = fullpath(file.path);
-    const string mtime = utils::isotime(bfs::last_write_time(abspath));
-    return file.mtime != mtime;
+    const vfs::Stat stat = m_fs->stat(fullpath(file.path));
+    // a file that is gone is not up to date either
+    return stat.type == vfs::Type::NONE || file.mtime != utils::isotime(stat.mtime);
+}
+
+PeerId Share::intern_peer(const std::string& peer)
+{
+    PeerId id = 0;
+    if (m_peer_ids.find(peer, id))
+        return id;
+    sqlite3pp::command insert(m_db, R"#(INSERT INTO peer_ids (peer) VALUES (?))#");
+    insert.bind(1, peer);
+    insert.execute();
+    id = static_cast<PeerId>(m_db->last_insert_rowid());
+    m_peer_ids.add(id, peer);
+    return id;
+}
+
+Vclock Share::get_vclock(const std::string& path)
+{
+    m_get_vclock_q.reset();
+    // a statement left running keeps the temporary tables of FrozenManifest from being dropped,
+    // whichever way this returns
+    auto reset = utils::make_scope_guard([this]() { m_get_vclock_q.reset(); });
+    m_get_vclock_q.bind(1, path);
+    for (const auto& row: m_get_vclock_q)
+        return Vclock::unpack(row.get<void const*>(0), row.column_bytes(0));
+    return Vclock();
+}
+
+void Share::set_vclock(const std::string& path, const Vclock& vclock)
+{
+    const string packed = vclock.pack();
+    m_set_vclock_q.reset();
+    m_set_vclock_q.bind(1, path);
+    m_set_vclock_q.bind(2, static_cast<const void*>(packed.data()), static_cast<int>(packed.size()));
+    m_set_vclock_q.execute();
+}
+
+namespace
+{
+
+/// values of remote_update.action
+enum RemoteAction
+{
+    REMOTE_NOOP = 0,
+    REMOTE_FAST_FORWARD = 1,
+    REMOTE_CONFLICT = 2,
+    REMOTE_DOWNLOAD = 3,
+};
+
+} // end anon ns
+
+RemoteUpdate Share::remote_update(const std::string& peer_id, const std::vector<msg::MFile>& files)
+{
+    CS_TRACE_SPAN("remote_update", "sqlite");
+    RemoteUpdate result;
+    // outside the transaction, a rollback would undo ids already in m_peer_ids
+    for (const auto& file: files)
+        intern_peer(file.last_changed_by);
+    sqlite3pp::transaction transaction(m_db);
+    load_remote_update(files);
+
+    /*
+     * In order:
+     * - already seen that revision of the peer that made the change, or a newer one: noop
+     * - same content and mode, or deleted on both sides: noop
+     * - changed here and the peer didn't announce our version before: conflict
+     * - deletions and mode changes: fast forward
+     * - otherwise the content has to be downloaded
+     */
+    {
+        sqlite3pp::command classify(m_db, boost::str(boost::format(R"#(UPDATE remote_update SET action = (
+            SELECT CASE
+                WHEN IFNULL(vclock_get(v.vclock, i.id), -1) >= r.last_changed_rev
+                    OR (l.last_changed_by = r.last_changed_by AND l.last_changed_rev >= r.last_changed_rev)
+                    THEN %1%
+                WHEN (r.deleted AND (l.path IS NULL OR l.deleted))
+                    OR (NOT r.deleted AND l.path IS NOT NULL AND NOT l.deleted AND l.checksum = r.checksum AND l.mode = r.mode)
+                    THEN %1%
+                WHEN l.path IS NOT NULL AND l.last_changed_by = ?1
+                    AND (p.path IS NULL OR p.deleted != l.deleted OR p.checksum != l.checksum)
+                    THEN %3%
+                WHEN r.deleted OR (l.path IS NOT NULL AND NOT l.deleted AND l.checksum = r.checksum)
+                    THEN %2%
+                ELSE %4%
+            END
+            FROM remote_update r
+            LEFT JOIN files l ON l.path = r.path
+            LEFT JOIN peer_ids i ON i.peer = r.last_changed_by
+            LEFT JOIN files_vclock v ON v.path = r.path
+            LEFT JOIN peer_files p ON p.path = r.path AND p.peer = ?2
+            WHERE r.path = remote_update.path
+        ))#") % REMOTE_NOOP % REMOTE_FAST_FORWARD % REMOTE_CONFLICT % REMOTE_DOWNLOAD).c_str());
+        classify.bind(1, m_peer_id);
+        classify.bind(2, peer_id);
+        classify.execute();
+    }
+
+    // the rest is recorded once it's applied, @sa remote_update_applied
+    record_remote_update(peer_id, boost::str(boost::format("r.action = %1%") % REMOTE_NOOP));
+
+    sqlite3pp::query q(m_db, R"#(SELECT checksum, path, last_changed_by, last_changed_rev, mtime, size, deleted, mode, action
+        FROM remote_update WHERE action != 0 ORDER BY path)#");
+    for (const auto& row: q)
+    {
+        msg::MFile file(row.get<string>(0), row.get<string>(1), row.get<string>(2), row.get<u64>(3),
+            row.get<string>(4), row.get<u64>(5), row.get<bool>(6), row.get<int>(7));
+        switch (row.get<int>(8))
+        {
+        case REMOTE_FAST_FORWARD:
+            result.fast_forward.emplace_back(move(file));
+            break;
+        case REMOTE_CONFLICT:
+            result.conflict.emplace_back(move(file));
+            break;
+        case REMOTE_DOWNLOAD:
+            result.download.emplace_back(move(file));
+            break;
+        }
+    }
+    result.noop = sqlite3pp::query(m_db, "SELECT COUNT(*) FROM remote_update WHERE action = 0").fetchone().get<u64>(0);
+
+    sqlite3pp::command(m_db, "DELETE FROM remote_update").execute();
+    transaction.commit();
+    return result;
+}
+
+void Share::remote_update_applied(const std::string& peer_id, const std::vector<msg::MFile>& files)
+{
+    CS_TRACE_SPAN("remote_update_applied", "sqlite");
+    for (const auto& file: files)
+        intern_peer(file.last_changed_by);
+    sqlite3pp::transaction transaction(m_db);
+    load_remote_update(files);
+    record_remote_update(peer_id, "1");
+    sqlite3pp::command(m_db, "DELETE FROM remote_update").execute();
+    transaction.commit();
 }
 
-void Share::remote_update(const msg::MFile& file)
+void Share::load_remote_update(const std::vector<msg::MFile>& files)
 {
-    // FIXME
+    sqlite3pp::command(m_db, "DELETE FROM remote_update").execute();
+    for (const auto& file: files)
+    {
+        m_insert_remote_update_q.reset();
+        m_insert_remote_update_q.bind(1, file.path);
+        m_insert_remote_update_q.bind(2, file.checksum);
+        m_insert_remote_update_q.bind(3, file.last_changed_by);
+        m_insert_remote_update_q.bind(4, file.last_changed_rev);
+        m_insert_remote_update_q.bind(5, file.mtime);
+        m_insert_remote_update_q.bind(6, file.size);
+        m_insert_remote_update_q.bind(7, file.deleted);
+        m_insert_remote_update_q.bind(8, file.mode);
+        m_insert_remote_update_q.execute();
+    }
+}
+
+void Share::record_remote_update(const std::string& peer_id, const std::string& condition)
+{
+    // the peer's view of these files, a file changed here is in conflict only if it differs
+    {
+        const string query = boost::str(boost::format(R"#(INSERT OR REPLACE INTO peer_files (path, peer, tmp_path, mtime, size, mode, checksum, deleted)
+            SELECT r.path, ?1, IFNULL(p.tmp_path, ''), r.mtime, r.size, r.mode, r.checksum, r.deleted
+            FROM remote_update r
+            LEFT JOIN peer_files p ON p.path = r.path AND p.peer = ?1
+            WHERE %1%
+        )#") % condition);
+        sqlite3pp::command peer_files(m_db, query.c_str());
+        peer_files.bind(1, peer_id);
+        peer_files.execute();
+    }
+    // the revisions seen of the peers that made the changes
+    {
+        const string query = boost::str(boost::format(R"#(INSERT OR REPLACE INTO files_vclock (path, vclock)
+            SELECT r.path, vclock_merge(v.vclock, i.id, r.last_changed_rev)
+            FROM remote_update r
+            JOIN peer_ids i ON i.peer = r.last_changed_by
+            LEFT JOIN files_vclock v ON v.path = r.path
+            WHERE %1%
+        )#") % condition);
+        sqlite3pp::command(m_db, query.c_str()).execute();
+    }
 }
 
 bfs::path get_tail(const bfs::path& path, size_t tail)
@@ -20,11 +20,16 @@
 #include "../config.hpp"
 #include "../boost_fs_fwd.hpp"
 #include "sqlite3pp/sqlite3pp.hpp"
+#include "sqlite3pp/sqlite3ppext.hpp"
 #include "message.hpp"
+#include "../vclock.hpp"
+#include "../vfs.hpp"
+#include "../metrics.hpp"
 
 #include <boost/iterator/iterator_facade.hpp>
 #include <array>
 #include <map>
+#include <mutex>
 #include <vector>
 #include <string>
 #include <thread>
@@ -82,7 +87,7 @@ struct MFile
 
     msg::MFile to_msg_mfile() const
     {
-        return msg::MFile(checksum, path, last_changed_by, last_changed_rev, mtime, size, mode, deleted);
+        return msg::MFile(checksum, path, last_changed_by, last_changed_rev, mtime, size, deleted, mode);
     }
 
     std::string path;
@@ -109,6 +114,28 @@ struct MFile_updated
     bool up_to_date;
 };
 
+/**
+ * How the files of an Update from a peer compare to ours, @sa Share::remote_update
+ */
+struct RemoteUpdate
+{
+    RemoteUpdate():
+        download()
+        , fast_forward()
+        , conflict()
+        , noop()
+    {}
+
+    /// newer content we don't have, to be fetched
+    std::vector<msg::MFile> download;
+    /// newer versions that need no data: deletions and mode changes
+    std::vector<msg::MFile> fast_forward;
+    /// changed here and by the peer since we last agreed on them
+    std::vector<msg::MFile> conflict;
+    /// files we already have, in this version or a newer one
+    size_t noop;
+};
+
 class FrozenManifest;
 
 /**
@@ -195,8 +222,10 @@ public:
  * Procedure to commit a file to a share:
  *  - An updated file from another client is downloaded into a temporary directory outside the share
  *  together with its vector clock.
- *  - Once the file is fully downloaded, it's checksum is calculated, if it matches the file is
- *  commited to the share (so a scan is not in place at the same time).
+ *  - Once the file is fully downloaded, it's checksum is checked, if it matches the file is
+ *  commited to the share (so a scan is not in place at the same time). A file recieved with a
+ *  single Get is hashed as it arrives (@sa cs::core::protocol::RxStream), one downloaded in ranges
+ *  has to be read back.
  *  - On commit if the vclock of the new file is descendant of the file we already have, it's
  *  replaced, otherwise this file is marked as conflicted and respective copies are saved in the
  *  share.
@@ -247,7 +276,8 @@ public:
     };
 
 
-    Share(const std::string& share_path, const std::string& dbpath = ":memory:");
+    /// @param filesystem is where the share is scanned and checksummed from
+    Share(const std::string& share_path, const std::string& dbpath = ":memory:", std::shared_ptr<vfs::Filesystem> filesystem = vfs::disk());
     Share(const Share&) = delete;
     Share& operator=(const Share&) = delete;
     Share(Share&&) = default;
@@ -258,9 +288,23 @@ public:
 
 private:
     void init_or_read_share_identity();
+    /// read the peer ids not in m_peer_ids yet
+    void load_peer_ids();
+    /// vclock_get(clock, id) and vclock_merge(clock, id, value) for queries over packed clocks
+    void register_sql_functions();
 
 public:
 
+    /**
+     * held while a connection works on the share, so connections of different threads take turns
+     * on it. The identity and the keys don't change once the share is constructed, reading them
+     * doesn't need it.
+     */
+    std::recursive_mutex& mutex()
+    {
+        return *m_mutex;
+    }
+
     /// @sa Share_iterator
     Share_iterator begin()
     {
@@ -314,13 +358,10 @@ private:
     void on_scan_finished();
 
 public:
-#if 0
-    size_t scan_total() const { assert(0); }
-    size_t scan_done() const { assert(0); }
-    bool checksum_in_progress() const { assert(0); }
-    size_t checksum_total() const { assert(0); }
-    size_t checksum_done() const { assert(0); }
-#endif
+    /// @returns the files found by the scan in progress or the last one
+    size_t scan_done() const { return m_scan_found_count; }
+    /// @returns the files waiting to be checksummed
+    size_t checksum_queued() const { return static_cast<size_t>(m_cksum_queue.value()); }
 
     /// actions to perform for each scanned file
     void scan_found(MFile& file);
@@ -378,22 +419,58 @@ public:
         while(scan_step()) {};
     }
 
-    /// process a remote update for a given file
-    void remote_update(const msg::MFile&);
+    /// @returns the id of @param peer in this share, @sa cs::PeerIds
+    PeerId intern_peer(const std::string& peer);
+
+    /// @returns the vector clock of the file at @param path, empty if it has none
+    Vclock get_vclock(const std::string& path);
+
+    void set_vclock(const std::string& path, const Vclock& vclock);
+
+    /**
+     * Compare the files of an Update from @param peer_id with the share in one transaction,
+     * classifying each one. The peer's view of the files is kept in peer_files, so a file we
+     * changed is a conflict only if the peer hadn't seen our version. Only the files we already
+     * have are recorded, their revisions go to files_vclock so they aren't compared again.
+     *
+     * Nothing is changed on disk, applying the result is up to the caller, who records the fast
+     * forwards, downloads and resolved conflicts with remote_update_applied once they're done.
+     */
+    RemoteUpdate remote_update(const std::string& peer_id, const std::vector<msg::MFile>& files);
+
+    /// record fast forwards, downloads or resolved conflicts of remote_update once they are in the share
+    void remote_update_applied(const std::string& peer_id, const std::vector<msg::MFile>& files);
+
+private:
+    /// fill the remote_update table with @param files
+    void load_remote_update(const std::vector<msg::MFile>& files);
+    /// keep the peer's view and the revisions seen of the rows of remote_update r matching @param condition
+    void record_remote_update(const std::string& peer_id, const std::string& condition);
+
+public:
 
 
     /// path to the share
     std::string m_path;
+    /// file system the share is on
+    std::shared_ptr<vfs::Filesystem> m_fs;
     /// revision number for this share / peer, incorporated in the version clock when this share
     /// modifies a file
     u64 m_revision;
 
     std::shared_ptr<sqlite3pp::database> m_db;
+    /// functions for the queries, registered in m_db
+    std::unique_ptr<sqlite3pp::ext::function> m_sql_functions;
     /// path to the sqlite database of the share
     std::string m_db_path;
     sqlite3pp::command m_insert_mfile_q;
     sqlite3pp::command m_update_mfile_q;
     sqlite3pp::query m_get_mfiles_by_content_q;
+    sqlite3pp::command m_insert_remote_update_q;
+    sqlite3pp::query m_get_vclock_q;
+    sqlite3pp::command m_set_vclock_q;
+    /// peers interned to the ids used in the vector clocks of this share
+    PeerIds m_peer_ids;
 
 
     /********* FS SCAN ************/
@@ -401,7 +478,7 @@ public:
     bool m_scan_in_progress;
     /// number of files to scan (stat) at once. We should target <= 0.5s
     size_t m_scan_batch_sz;
-    std::unique_ptr<bfs::recursive_directory_iterator> m_scan_it;
+    std::unique_ptr<vfs::Walker> m_scan_it;
     size_t m_scan_found_count;
     std::time_t m_scan_duration_s;
     sqlite3pp::query m_select_not_scan_found_q;
@@ -426,7 +503,9 @@ public:
     sha2::SHA256_CTX  m_cksum_ctx_sha256;
     MFile m_cksum_mfile;
     /// when it's set means we are in the middle of checksumming a file
-    std::unique_ptr<bfs::ifstream> m_cksum_is;
+    std::unique_ptr<vfs::Reader> m_cksum_is;
+    /// files to checksum, counted in the checksum queue metric of all the shares
+    metrics::Contribution m_cksum_queue;
 
     /********** SHARE IDENTITY, KEYS ***********/
 
@@ -449,6 +528,10 @@ public:
     typedef std::function<void(const std::vector<MFile>&)> handle_update_t;
     /// when there are files updated, all the callbacks here are called
     std::deque<handle_update_t> m_handle_update;
+
+private:
+    /// @sa mutex, a pointer so the share can be moved
+    std::unique_ptr<std::recursive_mutex> m_mutex;
 };
 
 /// returns a path with the last tail number of components
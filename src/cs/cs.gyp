@@ -11,11 +11,23 @@
                 "../../vendor/sqlite3pp/sqlite3pp.gyp:sqlite3pp",
                 "../../vendor/sha2/sha2.gyp:sha2",
                 "../../vendor/libuv/uv.gyp:libuv",
+                "../../vendor/libutp/libutp.gyp:libutp",
+                "../../vendor/polarssl-1.3.3/polarssl.gyp:polarssl",
+            ],
+            # tls.hpp includes the PolarSSL headers
+            "export_dependent_settings": [
+                "../../vendor/polarssl-1.3.3/polarssl.gyp:polarssl",
             ],
             "sources": [
                 "int_types.h",
                 "daemon/daemon.hpp",
                 "daemon/daemon.cpp",
+                "daemon/asyncfile.hpp",
+                "daemon/asyncfile.cpp",
+                "daemon/utp.hpp",
+                "daemon/utp.cpp",
+                "daemon/rategate.hpp",
+                "daemon/rategate.cpp",
                 "core/message.cpp",
                 "core/message.hpp",
                 "core/coder.cpp",
@@ -25,6 +37,8 @@
                 "core/serverinfo.hpp",
                 "core/share.hpp",
                 "core/share.cpp",
+                "core/download.hpp",
+                "core/download.cpp",
                 "protocolstate.cpp",
                 "protocolstate.hpp",
                 "utils.hpp",
@@ -38,6 +52,16 @@
                 "config.hpp",
                 "server.hpp",
                 "server.cpp",
+                "tls.hpp",
+                "tls.cpp",
+                "ratelimit.hpp",
+                "ratelimit.cpp",
+                "vfs.hpp",
+                "vfs.cpp",
+                "metrics.hpp",
+                "metrics.cpp",
+                "trace.hpp",
+                "trace.cpp",
             ],
             "include_dirs": [
                 "../",
@@ -0,0 +1,266 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "asyncfile.hpp"
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
+using namespace std;
+
+namespace cs
+{
+namespace daemon
+{
+
+size_t WriteBacklog::s_max_pending = 16 << 20;
+
+size_t AsyncFileWriter::s_block_sz = 256 << 10;
+
+AsyncFileWriter::AsyncFileWriter(uvpp::loop& loop, const bfs::path& path, bool truncate, std::shared_ptr<WriteBacklog> backlog, std::recursive_mutex* mutex):
+    m_state(make_shared<State>(loop, backlog, mutex))
+    , m_buff(make_shared<string>())
+    , m_buff_offset()
+{
+    // opening is quick compared to the data, the caller wants to know right away if it can
+    uvpp::error err = m_state->file.open(path.string(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0));
+    if (err)
+        throw std::runtime_error(fs("AsyncFileWriter: couldn't open " << path << ": " << err.str()));
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+    if (! m_state->closing)
+        // finish in the background
+        close(nullptr);
+    else
+        m_state->done = nullptr;
+}
+
+void AsyncFileWriter::write(u64 offset, const char* data, size_t len)
+{
+    assert(! m_state->closing);
+    if (! m_buff->empty() && offset != m_buff_offset + m_buff->size())
+        flush();
+    if (m_buff->empty())
+        m_buff_offset = offset;
+    m_buff->append(data, len);
+    m_state->backlog->add(len);
+    if (m_buff->size() >= s_block_sz)
+        flush();
+}
+
+void AsyncFileWriter::preallocate(u64 offset, u64 length)
+{
+    shared_ptr<State> state = m_state;
+    ++state->ops;
+    // only a hint, file systems without it are fine
+    if (! state->file.allocate(offset, length, [state](uvpp::error) { op_done(state, true); }))
+        --state->ops;
+}
+
+void AsyncFileWriter::close(std::function<void(bool ok)> done)
+{
+    assert(! m_state->closing);
+    flush();
+    m_state->closing = true;
+    m_state->done = done;
+    shared_ptr<State> state = m_state;
+    ++state->ops;
+    op_done(state, true);
+}
+
+void AsyncFileWriter::flush()
+{
+    if (m_buff->empty())
+        return;
+    shared_ptr<State> state = m_state;
+    shared_ptr<string> buff = move(m_buff);
+    m_buff = make_shared<string>();
+    m_buff->reserve(s_block_sz);
+    ++state->ops;
+    const bool issued = state->file.write(buff->data(), buff->size(), m_buff_offset, [state, buff](uvpp::error err) {
+        state->backlog->done(buff->size());
+        op_done(state, ! err);
+    });
+    if (! issued)
+    {
+        state->backlog->done(buff->size());
+        op_done(state, false);
+    }
+}
+
+void AsyncFileWriter::op_done(const std::shared_ptr<State>& state, bool ok)
+{
+    assert(state->ops);
+    --state->ops;
+    state->failed = state->failed || ! ok;
+    if (! state->closing || state->ops)
+        return;
+
+    // everything is written, the close is the last operation
+    ++state->ops;
+    shared_ptr<State> s = state;
+    auto closed = [s](uvpp::error err) {
+        --s->ops;
+        s->failed = s->failed || err;
+        auto done = move(s->done);
+        s->done = nullptr;
+        if (! done)
+            return;
+        if (s->mutex)
+        {
+            lock_guard<recursive_mutex> lock(*s->mutex);
+            done(! s->failed);
+        }
+        else
+            done(! s->failed);
+    };
+    if (! state->file.close(closed))
+        closed(uvpp::error(UV_EIO));
+}
+
+size_t FileReader::s_max_read_ahead = 4;
+
+FileReader::FileReader(uvpp::loop& loop):
+    m_loop(loop.get())
+    , m_ahead()
+    , m_in_flight()
+{
+}
+
+FileReader::~FileReader()
+{
+    for (auto& weak: m_in_flight)
+    {
+        auto read = weak.lock();
+        if (read)
+            read->done = nullptr;
+    }
+}
+
+void FileReader::read(int fd, u64 file_id, u64 offset, size_t size, size_t read_ahead, ProtocolState::read_done_t done)
+{
+    auto match = [file_id](u64 offset, size_t size) {
+        return [file_id, offset, size](const shared_ptr<Read>& read) {
+            return read->file_id == file_id && read->offset == offset && read->data.size() == size;
+        };
+    };
+
+    // served by a read ahead when there's one
+    shared_ptr<Read> read;
+    auto ahead = find_if(m_ahead.begin(), m_ahead.end(), match(offset, size));
+    if (ahead != m_ahead.end())
+    {
+        read = *ahead;
+        m_ahead.erase(ahead);
+    }
+    else
+        read = start(fd, file_id, offset, size);
+
+    if (read_ahead && find_if(m_ahead.begin(), m_ahead.end(), match(offset + size, read_ahead)) == m_ahead.end())
+    {
+        m_ahead.push_back(start(fd, file_id, offset + size, read_ahead));
+        if (m_ahead.size() > s_max_read_ahead)
+            m_ahead.pop_front();
+    }
+
+    if (read->finished)
+        done(read->ok, move(read->data));
+    else
+        read->done = move(done);
+}
+
+void FileReader::forget(u64 file_id)
+{
+    // a read still in flight goes on, its data is dropped when it finishes
+    m_ahead.erase(remove_if(m_ahead.begin(), m_ahead.end(), [file_id](const shared_ptr<Read>& read) {
+        return read->file_id == file_id;
+    }), m_ahead.end());
+}
+
+std::shared_ptr<FileReader::Read> FileReader::start(int fd, u64 file_id, u64 offset, size_t size)
+{
+    m_in_flight.erase(remove_if(m_in_flight.begin(), m_in_flight.end(), [](const weak_ptr<Read>& r) { return r.expired(); }), m_in_flight.end());
+
+    auto read = make_shared<Read>(m_loop, fd, file_id, offset, size);
+    m_in_flight.push_back(read);
+    auto finished = [read](uvpp::error err, size_t nread) {
+        read->finished = true;
+        // the size of the range was taken from the file, it was truncated since
+        read->ok = ! err && nread == read->data.size();
+        read->data.resize(read->ok ? nread : 0);
+        if (read->done)
+        {
+            auto done = move(read->done);
+            read->done = nullptr;
+            done(read->ok, move(read->data));
+        }
+    };
+    if (! read->file.read(&read->data[0], size, offset, finished))
+        finished(uvpp::error(UV_EIO), 0);
+    return read;
+}
+
+void hash_file(uvpp::loop& loop, const bfs::path& path, hash_done_t done, std::recursive_mutex* mutex)
+{
+    auto digest = make_shared<string>();
+    auto work = [path, digest]() {
+        try
+        {
+            *digest = sha256_file(path);
+        }
+        catch (const std::runtime_error&)
+        {
+        }
+    };
+    auto after = [digest, done, mutex](uvpp::error) {
+        // a cancelled hash leaves the digest empty
+        if (mutex)
+        {
+            lock_guard<recursive_mutex> lock(*mutex);
+            done(*digest);
+        }
+        else
+            done(*digest);
+    };
+    if (! uvpp::queue_work(loop, work, after))
+        cs::hash_file(path, done);
+}
+
+void clone_file(uvpp::loop& loop, const bfs::path& from, const bfs::path& to, clone_done_t done)
+{
+    auto ok = make_shared<bool>(false);
+    auto work = [from, to, ok]() {
+        try
+        {
+            cs::clone_file(from, to);
+            *ok = true;
+        }
+        catch (const std::runtime_error&)
+        {
+        }
+    };
+    auto after = [ok, done](uvpp::error) {
+        // a cancelled copy isn't ok
+        done(*ok);
+    };
+    if (! uvpp::queue_work(loop, work, after))
+        cs::clone_file(from, to, done);
+}
+
+} // end ns
+} // end ns
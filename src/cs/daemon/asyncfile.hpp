@@ -0,0 +1,208 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "../config.hpp"
+#include "../file.hpp"
+#include "../protocolstate.hpp"
+#include "uvpp/uvpp.hpp"
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace cs
+{
+namespace daemon
+{
+
+/**
+ * Bytes recieved on a connection and not on disk yet. Reading from the peer is paused while there
+ * are too many, so a slow disk doesn't make them pile up in memory.
+ */
+struct WriteBacklog
+{
+    WriteBacklog():
+        pending()
+        , paused()
+        , pause()
+        , resume()
+    {}
+
+    void add(size_t n)
+    {
+        pending += n;
+        if (! paused && pending > s_max_pending && pause)
+        {
+            paused = true;
+            pause();
+        }
+    }
+
+    void done(size_t n)
+    {
+        pending -= n;
+        if (paused && pending <= s_max_pending / 2)
+        {
+            paused = false;
+            if (resume)
+                resume();
+        }
+    }
+
+    size_t pending;
+    bool paused;
+    /// stop and restart reading, cleared when the connection goes away
+    std::function<void()> pause;
+    std::function<void()> resume;
+
+    static size_t s_max_pending;
+};
+
+
+/**
+ * Writes recieved files behind, on the libuv threadpool. Contiguous data is gathered in blocks and
+ * each block is written while the next arrives, ranges announced with preallocate are reserved with
+ * fallocate so the file isn't fragmented by writes coming in any order.
+ */
+class AsyncFileWriter: public FileWriter
+{
+public:
+    /**
+     * The done callback of close runs with @param mutex held when given
+     * @throws runtime_error when @param path can't be opened
+     */
+    AsyncFileWriter(uvpp::loop& loop, const bfs::path& path, bool truncate, std::shared_ptr<WriteBacklog> backlog, std::recursive_mutex* mutex = nullptr);
+    ~AsyncFileWriter();
+
+    AsyncFileWriter(const AsyncFileWriter&) = delete;
+    AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+
+    void write(u64 offset, const char* data, size_t len) override;
+    void preallocate(u64 offset, u64 length) override;
+    void close(std::function<void(bool ok)> done) override;
+
+    /// data is written in blocks of this size
+    static size_t s_block_sz;
+
+private:
+    /// shared with the operations in flight, which can outlive the writer
+    struct State
+    {
+        State(uvpp::loop& loop, std::shared_ptr<WriteBacklog> backlog, std::recursive_mutex* mutex):
+            file(loop)
+            , ops()
+            , failed()
+            , closing()
+            , done()
+            , backlog(backlog)
+            , mutex(mutex)
+        {}
+
+        uvpp::file file;
+        /// operations in flight
+        size_t ops;
+        bool failed;
+        bool closing;
+        std::function<void(bool ok)> done;
+        std::shared_ptr<WriteBacklog> backlog;
+        std::recursive_mutex* mutex;
+    };
+
+    /// an operation of @param state finished
+    static void op_done(const std::shared_ptr<State>& state, bool ok);
+    /// write the gathered block
+    void flush();
+
+    std::shared_ptr<State> m_state;
+    /// data gathered for the next write, starting at m_buff_offset
+    std::shared_ptr<std::string> m_buff;
+    u64 m_buff_offset;
+};
+
+
+/**
+ * Reads file chunks for ProtocolState on the libuv threadpool, @sa ProtocolState::set_read_fun. The
+ * next chunks are read ahead while the current one is sent, so the socket doesn't wait for the
+ * disk. Reads in flight when the reader is destroyed complete without calling back.
+ *
+ * Read aheads are kept by file id, not by fd which is reused by the next file opened once the
+ * transfer ends, and dropped with forget when the file is closed. A read shorter than asked fails,
+ * the file changed since its size was taken.
+ */
+class FileReader
+{
+public:
+    explicit FileReader(uvpp::loop& loop);
+    ~FileReader();
+
+    FileReader(const FileReader&) = delete;
+    FileReader& operator=(const FileReader&) = delete;
+
+    void read(int fd, u64 file_id, u64 offset, size_t size, size_t read_ahead, ProtocolState::read_done_t done);
+
+    /// the file @param file_id is closed, drop what was read ahead of it
+    void forget(u64 file_id);
+
+    /// chunks read ahead that are kept, several transfers can be interleaved
+    static size_t s_max_read_ahead;
+
+private:
+    struct Read
+    {
+        Read(uv_loop_t* loop, int fd, u64 file_id, u64 offset, size_t size):
+            file(loop, fd)
+            , file_id(file_id)
+            , offset(offset)
+            , data(size, 0)
+            , finished()
+            , ok()
+            , done()
+        {}
+
+        uvpp::file file;
+        u64 file_id;
+        u64 offset;
+        std::string data;
+        bool finished;
+        bool ok;
+        ProtocolState::read_done_t done;
+    };
+
+    /// @returns a read of [offset, offset + size) of @param fd in flight
+    std::shared_ptr<Read> start(int fd, u64 file_id, u64 offset, size_t size);
+
+    uv_loop_t* m_loop;
+    /// chunks being read or read ahead, oldest first
+    std::deque<std::shared_ptr<Read>> m_ahead;
+    /// reads in flight, to cancel their callbacks
+    std::vector<std::weak_ptr<Read>> m_in_flight;
+};
+
+
+/**
+ * hash_file_t reading and hashing @param path on the libuv threadpool of @param loop, @param done
+ * runs on the loop thread with @param mutex held when given
+ */
+void hash_file(uvpp::loop& loop, const bfs::path& path, hash_done_t done, std::recursive_mutex* mutex = nullptr);
+
+/// clone_file_t copying @param from on the libuv threadpool of @param loop, @param done runs on the loop thread
+void clone_file(uvpp::loop& loop, const bfs::path& from, const bfs::path& to, clone_done_t done);
+
+} // end ns
+} // end ns
@@ -17,13 +17,23 @@
  */
 
 #include "daemon.hpp"
+#include "../fs.hpp"
 #include "../protocolstate.hpp"
+#include "../trace.hpp"
 #include "../utils.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <functional>
+#include <future>
 #include <iostream>
 
 #ifdef CS_PLATFORM_UNIX
 #include <unistd.h>
+#include <fcntl.h>
+#include <csignal>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #endif
 
 using namespace std;
@@ -31,6 +41,81 @@ using namespace std;
 namespace
 {
 
+/// ms between the checks for slow peers of the downloads
+const uint64_t download_tick = 1000;
+
+/**
+ * @returns a non-blocking IPv6 socket bound to @param port on all the interfaces with SO_REUSEPORT
+ * set, so each loop can listen on the same port
+ */
+int reuseport_socket(int port)
+{
+#ifdef SO_REUSEPORT
+    const int fd = ::socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd == -1)
+        throw runtime_error(string("Daemon: socket failed: ") + strerror(errno));
+
+    const int on = 1;
+    sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK) == -1
+        || ::fcntl(fd, F_SETFD, FD_CLOEXEC) == -1
+        || ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+        || ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0
+        || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+    {
+        const int err = errno;
+        ::close(fd);
+        throw runtime_error("Daemon: can't bind port " + to_string(port) + ": " + strerror(err));
+    }
+    return fd;
+#else
+    throw runtime_error("Daemon: several loops need SO_REUSEPORT, not available on this platform");
+#endif
+}
+
+/**
+ * wraps a protocol handler so it runs with the mutex of the share @param protocol selected held.
+ * Before the share is selected the handlers only read its identity, which doesn't change.
+ */
+template<typename ...A>
+std::function<void(A...)> guarded(cs::core::protocol::Protocol& protocol, std::function<void(A...)> handler)
+{
+    return [&protocol, handler](A... args) {
+        std::unique_lock<std::recursive_mutex> lock;
+        if (! protocol.m_share.empty())
+            lock = std::unique_lock<std::recursive_mutex>(protocol.share().mutex());
+        handler(args...);
+    };
+}
+
+/**
+ * put @param stream between @param pstate and a transport that sends the ciphertext with @param
+ * do_write, its write callback has to call Stream::on_write_finished. Once authenticated the peer
+ * can only select the share of its identity, and can't change it with the read only key.
+ */
+void secure(cs::tls::Stream& stream, cs::core::protocol::Protocol& protocol, cs::ProtocolState& pstate, cs::tls::Stream::do_write_t do_write)
+{
+    stream.set_write_fun(move(do_write));
+    stream.m_handle_established = [&stream, &protocol]() {
+        cs::server::parse_psk_identity(stream.identity(), protocol.m_authorized_share, protocol.m_authorized_access);
+    };
+    stream.m_handle_input = [&pstate](const char* data, size_t len) {
+        pstate.input(data, len);
+    };
+    stream.m_handle_write_finished = [&pstate]() {
+        pstate.on_write_finished();
+    };
+    stream.m_handle_error = [&pstate]() {
+        pstate.m_handle_error();
+    };
+    pstate.set_write_fun([&stream](const cs::OutputSlice* slices, size_t count) {
+        stream.write(slices, count);
+    });
+}
 
 } // end ns
 
@@ -41,16 +126,28 @@ namespace daemon
 
 Daemon::Daemon():
       m_port(0)
-    , m_running()
+    , m_state_mutex()
+    , m_state_cond()
+    , m_running(false)
+    , m_stop_requested(false)
     , m_daemon()
-    , m_loop()
-    , m_tcp_listen_conn(m_loop)
+    , m_num_loops(1)
+    , m_listen_port(0)
+    , m_workers()
+    , m_tls()
+    , m_governor()
 {
+    // the downloads run on the first loop @sa download, local copies are made on its threadpool
+    m_handle_clone_file = [this](const bfs::path& from, const bfs::path& to, clone_done_t done) {
+        clone_file(m_workers.front()->m_loop, from, to, move(done));
+    };
 }
 
 Daemon::~Daemon()
 {
     stop();
+    unique_lock<mutex> lock(m_state_mutex);
+    m_state_cond.wait(lock, [this]() { return ! m_running; });
 }
 
 
@@ -78,34 +175,347 @@ void Daemon::daemonize()
 
 void Daemon::start()
 {
-    m_tcp_listen_conn.bind6("::", m_port);
-    m_tcp_listen_conn.listen(std::bind(&Daemon::on_tcp_connect, this, placeholders::_1));
+    unique_lock<mutex> lock(m_state_mutex);
+    if (m_running)
+        throw std::runtime_error("Daemon::start already running");
     m_running = true;
-    m_loop.run();
+    m_stop_requested = false;
+    auto stopped = utils::make_scope_guard([this, &lock]() {
+        if (! lock.owns_lock())
+            lock.lock();
+        m_running = false;
+        m_stop_requested = false;
+        m_state_cond.notify_all();
+    });
+
+#ifdef CS_PLATFORM_UNIX
+    // a peer that goes away during a write or a sendfile fails it with EPIPE instead of killing us.
+    // SIGPIPE is blocked on the loops only, this thread and the ones it starts, what the rest of the
+    // process does with it is up to main
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    sigset_t old_mask;
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+    auto restore_mask = utils::make_scope_guard([&sigpipe, &old_mask]() {
+        if (! sigismember(&old_mask, SIGPIPE))
+        {
+            // the writes of this thread left it pending, it would be delivered once unblocked
+            const timespec no_wait = {0, 0};
+            while (sigtimedwait(&sigpipe, nullptr, &no_wait) == SIGPIPE)
+                ;
+        }
+        pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+    });
+#endif
+
+    const size_t num_loops = m_num_loops ? m_num_loops : max(thread::hardware_concurrency(), 1u);
+    m_workers.clear();
+    for (size_t i = 0; i < num_loops; ++i)
+    {
+        m_workers.emplace_back(make_unique<Worker>(*this));
+        Worker& worker = *m_workers.back();
+        worker.m_stop_async.data = &worker;
+        uv_async_init(worker.m_loop.get(), &worker.m_stop_async, [](uv_async_t* async, int) {
+            // close everything on the loop so it runs out of handles and returns
+            Worker& worker = *reinterpret_cast<Worker*>(async->data);
+            {
+                // the tasks not run yet are dropped
+                lock_guard<mutex> lock(worker.m_tasks_mutex);
+                worker.m_tasks_closed = true;
+                worker.m_tasks.clear();
+                uv_close(reinterpret_cast<uv_handle_t*>(&worker.m_tasks_async), nullptr);
+            }
+            if (worker.m_download_timer)
+                worker.m_download_timer->close();
+            // the downloads end before their connections go
+            for (const auto& conn: worker.m_connections)
+                worker.r_daemon.connection_closed(conn.first);
+            for (const auto& conn: worker.m_utp_connections)
+                worker.r_daemon.connection_closed(conn.first);
+            worker.m_tcp_listen_conn.close();
+            if (worker.m_utp)
+            {
+                // uTP peers aren't waited for, the context frees the connections left
+                worker.m_utp_connections.clear();
+                worker.m_utp->close();
+            }
+            for (auto& conn: worker.m_connections)
+            {
+                if (! conn.second->m_tcp_conn.is_closing())
+                {
+                    const string& peer = conn.first;
+                    conn.second->m_tcp_conn.close([&worker, peer]() {
+                        worker.m_connections.erase(peer);
+                    });
+                }
+            }
+#ifdef CS_TRACE
+            uv_close(reinterpret_cast<uv_handle_t*>(&worker.m_trace_prepare), nullptr);
+            uv_close(reinterpret_cast<uv_handle_t*>(&worker.m_trace_check), nullptr);
+#endif
+            uv_close(reinterpret_cast<uv_handle_t*>(async), nullptr);
+        });
+        worker.m_tasks_async.data = &worker;
+        uv_async_init(worker.m_loop.get(), &worker.m_tasks_async, [](uv_async_t* async, int) {
+            Worker& worker = *reinterpret_cast<Worker*>(async->data);
+            vector<function<void()>> tasks;
+            {
+                lock_guard<mutex> lock(worker.m_tasks_mutex);
+                tasks.swap(worker.m_tasks);
+            }
+            for (auto& task: tasks)
+            {
+                try
+                {
+                    task();
+                }
+                catch (const std::exception& e)
+                {
+                    cerr << "Daemon: task failed: " << e.what() << endl;
+                }
+            }
+        });
+#ifdef CS_TRACE
+        worker.m_trace_prepare.data = &worker;
+        worker.m_trace_check.data = &worker;
+        uv_prepare_init(worker.m_loop.get(), &worker.m_trace_prepare);
+        uv_check_init(worker.m_loop.get(), &worker.m_trace_check);
+        uv_prepare_start(&worker.m_trace_prepare, [](uv_prepare_t* prepare, int) {
+            Worker& worker = *reinterpret_cast<Worker*>(prepare->data);
+            worker.m_poll_started = trace::enabled() ? trace::now() : 0;
+        });
+        uv_check_start(&worker.m_trace_check, [](uv_check_t* check, int) {
+            Worker& worker = *reinterpret_cast<Worker*>(check->data);
+            if (worker.m_poll_started && trace::enabled())
+                trace::complete("poll", "socket", worker.m_poll_started, trace::now());
+        });
+        // they don't keep the loop running
+        uv_unref(reinterpret_cast<uv_handle_t*>(&worker.m_trace_prepare));
+        uv_unref(reinterpret_cast<uv_handle_t*>(&worker.m_trace_check));
+#endif
+    }
+
+    // the first listener picks the port when it's 0, the rest share it
+    const int port = listen(*m_workers.front(), m_port);
+    for (size_t i = 1; i < m_workers.size(); ++i)
+        listen(*m_workers[i], port);
+
+    // uTP listens on the same port number over UDP
+    Worker& first = *m_workers.front();
+    first.m_utp = make_unique<UTPContext>(first.m_loop);
+    if (first.m_utp->bind6("::", port) == 0)
+        throw runtime_error("Daemon: can't bind UDP port " + to_string(port));
+    first.m_utp->listen(std::bind(&Daemon::on_utp_accept, this, ref(first), placeholders::_1));
+
+    // the downloads run on the first loop as well, @sa download
+    first.m_download_timer = make_unique<uvpp::Timer>(first.m_loop);
+    first.m_download_timer->start(std::bind(&Daemon::tick_downloads, this), download_tick, download_tick);
+
+    m_listen_port = port;
+    // a stop that came during the set up is handled as soon as the loops run
+    if (m_stop_requested)
+        for (auto& worker: m_workers)
+            uv_async_send(&worker->m_stop_async);
+    lock.unlock();
+
+    for (size_t i = 1; i < m_workers.size(); ++i)
+    {
+        Worker& worker = *m_workers[i];
+        worker.m_thread = thread([&worker, i]() {
+            trace::set_thread_name(fs("loop " << i));
+            worker.m_loop.run();
+        });
+    }
+    trace::set_thread_name("loop 0");
+    m_workers.front()->m_loop.run();
+    for (size_t i = 1; i < m_workers.size(); ++i)
+        m_workers[i]->m_thread.join();
+
+    lock.lock();
+    m_workers.clear();
+    m_listen_port = 0;
 }
 
 
 void Daemon::stop()
 {
+    lock_guard<mutex> lock(m_state_mutex);
+    if (! m_running || m_stop_requested)
+        return;
+
+    m_stop_requested = true;
+    // the workers are there once start is done setting them up, otherwise start sees the request
+    if (m_listen_port != 0)
+        for (auto& worker: m_workers)
+            uv_async_send(&worker->m_stop_async);
+}
+
+
+void Daemon::download(const std::string& checksum, u64 size, const bfs::path& path, const std::vector<std::string>& connections)
+{
+    if (downloading(checksum))
+        throw std::runtime_error(fs("Daemon::download error, " << checksum << " is already being downloaded"));
+    auto task = [this, checksum, size, path, connections]() {
+        try
+        {
+            Server::download(checksum, size, path, connections);
+        }
+        catch (const std::runtime_error& e)
+        {
+            cerr << e.what() << endl;
+            // posted twice, the first one goes on
+            if (! downloading(checksum))
+                m_handle_download_done(checksum, false);
+        }
+    };
+    if (! post(0, move(task)))
+        throw std::runtime_error("Daemon::download error, not running");
+}
+
+
+std::vector<std::string> Daemon::connections()
+{
+    vector<string> result;
+    for (size_t i = 0;; ++i)
+    {
+        auto reply = make_shared<promise<vector<string>>>();
+        future<vector<string>> ids = reply->get_future();
+        auto task = [this, i, reply]() {
+            const Worker& worker = *m_workers[i];
+            vector<string> ids;
+            for (const auto& conn: worker.m_connections)
+                ids.emplace_back(conn.first);
+            for (const auto& conn: worker.m_utp_connections)
+                ids.emplace_back(conn.first);
+            reply->set_value(move(ids));
+        };
+        if (! post(i, move(task)))
+            break;
+        try
+        {
+            for (auto& id: ids.get())
+                result.emplace_back(move(id));
+        }
+        catch (const std::future_error&)
+        {
+            // the loop stopped before it ran the task
+        }
+    }
+    return result;
+}
+
 
-    m_running = false;
+server::Connection* Daemon::find_connection(const std::string& id)
+{
+    // the workers stay while the loops run
+    Worker& worker = *m_workers.front();
+    auto tcp_i = worker.m_connections.find(id);
+    if (tcp_i != worker.m_connections.end())
+        return tcp_i->second.get();
+    auto utp_i = worker.m_utp_connections.find(id);
+    if (utp_i != worker.m_utp_connections.end())
+        return utp_i->second.get();
+    return nullptr;
 }
 
 
-void Daemon::set_port(i16 port)
+bool Daemon::post(size_t index, std::function<void()> task)
 {
+    lock_guard<mutex> lock(m_state_mutex);
+    // the workers are there once start is done setting them up
+    if (m_listen_port == 0 || index >= m_workers.size())
+        return false;
+    Worker& worker = *m_workers[index];
+    lock_guard<mutex> tasks_lock(worker.m_tasks_mutex);
+    if (worker.m_tasks_closed)
+        return false;
+    worker.m_tasks.emplace_back(move(task));
+    uv_async_send(&worker.m_tasks_async);
+    return true;
+}
+
+
+void Daemon::check_not_running(const char* what)
+{
+    lock_guard<mutex> lock(m_state_mutex);
     if (m_running)
-        throw std::runtime_error("Daemon::set_port can't change while running");
+        throw std::runtime_error(fs("Daemon::" << what << " can't change while running"));
+}
 
+
+void Daemon::set_port(i16 port)
+{
+    check_not_running("set_port");
     m_port = port;
 }
 
 
-void Daemon::on_tcp_connect(uvpp::error error)
+void Daemon::set_loops(size_t loops)
+{
+    check_not_running("set_loops");
+    m_num_loops = loops;
+}
+
+
+void Daemon::set_tls(bool tls)
+{
+    check_not_running("set_tls");
+    if (! tls)
+        m_tls.reset();
+    else if (! m_tls)
+    {
+        m_tls = make_unique<tls::Context>();
+        // looked up from the loops during the handshakes, the keys of the shares don't change
+        m_tls->m_psk_lookup = [this](const string& identity) {
+            return psk(identity);
+        };
+    }
+}
+
+
+int Daemon::listen(Worker& worker, int port)
+{
+    if (m_num_loops == 1)
+    {
+        if (! worker.m_tcp_listen_conn.bind6("::", port))
+            throw runtime_error("Daemon: can't bind port " + to_string(port));
+    }
+    else
+    {
+        const int fd = reuseport_socket(port);
+        if (! worker.m_tcp_listen_conn.open(fd))
+        {
+            ::close(fd);
+            throw runtime_error("Daemon: uv_tcp_open failed");
+        }
+    }
+
+    if (! worker.m_tcp_listen_conn.listen(std::bind(&Daemon::on_tcp_connect, this, ref(worker), placeholders::_1)))
+        throw runtime_error("Daemon: can't listen on port " + to_string(port));
+
+    bool ip4;
+    string ip;
+    int bound_port = 0;
+    worker.m_tcp_listen_conn.getsockname(ip4, ip, bound_port);
+    return bound_port;
+}
+
+
+void Daemon::on_tcp_connect(Worker& worker, uvpp::error error)
 {
-    auto tcp_conn_ptr = make_unique<TCPConnection>(m_server_info, m_shares, m_loop);
+    if (error)
+        return;
+
+    auto tcp_conn_ptr = make_unique<TCPConnection>(m_server_info, m_shares, worker.m_loop);
     TCPConnection& tcp_conn = *tcp_conn_ptr;
-    m_tcp_listen_conn.accept(tcp_conn.m_tcp_conn);
+    if (! worker.m_tcp_listen_conn.accept(tcp_conn.m_tcp_conn))
+    {
+        // the peer went away, the connection lives until its handle is closed
+        TCPConnection* conn = tcp_conn_ptr.release();
+        conn->m_tcp_conn.close([conn]() { delete conn; });
+        return;
+    }
     //core::protocol::Protocol& protocol = tcp_conn.m_protocol;
     ProtocolState& pstate = tcp_conn.m_protocolstate;
 
@@ -120,50 +530,270 @@ void Daemon::on_tcp_connect(uvpp::error error)
     string peer_ = os.str();
     //string peer_ = fs("tcp://" << peer_ip << ":" << port); // will go out of scope
 
-    auto res = m_connections.emplace(piecewise_construct,
+    auto res = worker.m_connections.emplace(piecewise_construct,
         forward_as_tuple(move(peer_)),
         forward_as_tuple(move(tcp_conn_ptr)));
     assert(res.second);
     const string& peer = res.first->first; // reference that will stay valid
 
     // we need to be very careful about capturing objects that might go out of scope. The Connection
-    // is owned by Server::m_connections, so remains valid.
-    // tcp_conn and p_state are owned by the Server. (m_connections)
+    // is owned by Worker::m_connections, so remains valid.
+    // tcp_conn and p_state are owned by the Worker of this loop. (m_connections)
 
-    auto close_cb = [this, peer]() {
-        m_connections.erase(peer);
+    auto close_cb = [this, &worker, peer]() {
+        connection_closed(peer);
+        worker.m_connections.erase(peer);
     };
 
-    // write finished callback
-    auto write_cb = [&](uvpp::error) {
+    // write finished callback, installed once so issuing a write doesn't copy it
+    auto write_cb = [&pstate, &tcp_conn, peer, close_cb](uvpp::error error) {
         if (! error)
-            pstate.on_write_finished();
-        else
+        {
+            if (tcp_conn.m_tls)
+                tcp_conn.m_tls->on_write_finished();
+            else
+                pstate.on_write_finished();
+        }
+        else if (! tcp_conn.m_tcp_conn.is_closing())
         {
             cerr << "TCP client write error: " << peer << endl;
             tcp_conn.m_tcp_conn.close(close_cb);
         }
     };
 
-    // function to be called when the the protocol needs to write
-    auto do_write = [&](const char* buff, size_t sz) {
-        tcp_conn.m_tcp_conn.write(buff, sz, write_cb);
+    // function to be called when the the protocol needs to write, all the slices go in a single write
+    auto do_write = [&tcp_conn](const OutputSlice* slices, size_t count) {
+        tcp_conn.m_write_bufs.resize(count);
+        for (size_t i = 0; i < count; ++i)
+            tcp_conn.m_write_bufs[i] = uv_buf_init(const_cast<char*>(slices[i].data), slices[i].size);
+        tcp_conn.m_tcp_conn.write(tcp_conn.m_write_bufs.data(), count);
     };
 
-    auto read_cb = [&](const char* buff, ssize_t len) {
+    // file payloads go from the page cache to the socket, plain TCP sends the bytes unmodified
+    auto do_sendfile = [&tcp_conn](int fd, u64 offset, size_t size) {
+        tcp_conn.m_tcp_conn.sendfile(fd, offset, size);
+    };
+
+    // data is received in place at the end of the protocol input buffer, ciphertext is decrypted into it
+    auto alloc_cb = [&pstate, &tcp_conn](size_t suggested_size) {
+        if (tcp_conn.m_tls)
+            return uv_buf_init(tcp_conn.m_tls_input.data(), tcp_conn.m_tls_input.size());
+        const auto space = pstate.input_reserve(suggested_size);
+        return uv_buf_init(space.first, space.second);
+    };
+
+    auto read_cb = [&pstate, &tcp_conn, peer, close_cb](const char* data, ssize_t len) {
         if (len < 0)
         {
-            cerr << "TCP client read error: " << peer << endl;
-            tcp_conn.m_tcp_conn.close(close_cb);
+            if (len != UV_EOF)
+                cerr << "TCP client read error: " << peer << endl;
+            if (! tcp_conn.m_tcp_conn.is_closing())
+                tcp_conn.m_tcp_conn.close(close_cb);
         }
+        else if (tcp_conn.m_tls)
+            tcp_conn.m_tls->input(data, static_cast<size_t>(len));
         else
-            pstate.input(buff, static_cast<size_t>(len));
+            pstate.input_commit(static_cast<size_t>(len));
+    };
+
+    // file chunks that have to be copied are read without blocking the loop
+    auto do_read = [&tcp_conn](int fd, u64 file_id, u64 offset, size_t size, size_t read_ahead, ProtocolState::read_done_t done) {
+        tcp_conn.m_file_reader.read(fd, file_id, offset, size, read_ahead, move(done));
+    };
+    tcp_conn.m_protocol.m_handle_payload_file_closed = [&tcp_conn](u64 file_id) {
+        tcp_conn.m_file_reader.forget(file_id);
+    };
+
+    // recieved files are written behind, the peer waits while too much is pending
+    auto hold_read = [&tcp_conn]() {
+        if (tcp_conn.m_read_holds++ == 0)
+            tcp_conn.m_tcp_conn.read_stop();
+    };
+    auto release_read = [&tcp_conn]() {
+        if (--tcp_conn.m_read_holds == 0 && ! tcp_conn.m_tcp_conn.is_closing())
+            tcp_conn.m_tcp_conn.read_resume();
+    };
+    tcp_conn.m_write_backlog->pause = hold_read;
+    tcp_conn.m_write_backlog->resume = release_read;
+    uvpp::loop& loop = worker.m_loop;
+    tcp_conn.m_protocol.m_handle_open_file_writer = [this, &loop, &tcp_conn](const bfs::path& path, bool truncate) {
+        return unique_ptr<FileWriter>(new AsyncFileWriter(loop, path, truncate, tcp_conn.m_write_backlog, writer_mutex(tcp_conn.m_protocol)));
+    };
+    tcp_conn.m_protocol.m_handle_hash_file = [this, &loop, &tcp_conn](const bfs::path& path, hash_done_t done) {
+        hash_file(loop, path, move(done), writer_mutex(tcp_conn.m_protocol));
+    };
+
+    auto error_cb = [&tcp_conn, peer, close_cb]() {
+        cerr << "TCP client protocol error: " << peer << endl;
+        if (! tcp_conn.m_tcp_conn.is_closing())
+            tcp_conn.m_tcp_conn.close(close_cb);
     };
 
+    tcp_conn.m_tcp_conn.set_write_callback(write_cb);
+
     // set function to call when the protocol has data to write
     pstate.set_write_fun(do_write);
+    pstate.set_read_fun(do_read);
+    pstate.m_handle_error = error_cb;
+
+    guard_handlers(tcp_conn.m_protocol, pstate);
+    tcp_conn.m_rate_gate = make_unique<RateGate>(loop, m_governor, tcp_conn.m_protocol, pstate, hold_read, release_read);
+
+    if (m_tls)
+    {
+        // the payloads have to be encrypted, no sendfile
+        tcp_conn.m_tls = make_unique<tls::Stream>(*m_tls);
+        tcp_conn.m_tls_input.resize(TCPConnection::s_tls_input_size);
+        secure(*tcp_conn.m_tls, tcp_conn.m_protocol, pstate, [&tcp_conn](const char* data, size_t len) {
+            tcp_conn.m_write_bufs.resize(1);
+            tcp_conn.m_write_bufs[0] = uv_buf_init(const_cast<char*>(data), len);
+            tcp_conn.m_tcp_conn.write(tcp_conn.m_write_bufs.data(), 1);
+        });
+    }
+    else
+        pstate.set_sendfile_fun(do_sendfile);
+
+    tcp_conn.m_tcp_conn.read_start(alloc_cb, read_cb);
+}
+
+
+void Daemon::on_utp_accept(Worker& worker, utp_socket* socket)
+{
+    auto utp_conn_ptr = make_unique<UTPConnection>(m_server_info, m_shares, worker.m_loop);
+    UTPConnection& utp_conn = *utp_conn_ptr;
+    utp_conn.m_utp_conn.attach(socket);
+    ProtocolState& pstate = utp_conn.m_protocolstate;
+
+    string peer_ip;
+    int port = 0;
+    bool ip4;
+    utp_conn.m_utp_conn.getpeername(ip4, peer_ip, port);
+    auto res = worker.m_utp_connections.emplace(piecewise_construct,
+        forward_as_tuple(fs("utp://" << peer_ip << ":" << port)),
+        forward_as_tuple(move(utp_conn_ptr)));
+    if (! res.second)
+    {
+        // a peer has one connection per address, the socket is closed with the connection
+        cerr << "uTP client already connected: " << res.first->first << endl;
+        return;
+    }
+    const string& peer = res.first->first;
+
+    auto close_cb = [this, &worker, peer]() {
+        connection_closed(peer);
+        worker.m_utp_connections.erase(peer);
+    };
+
+    auto write_cb = [&pstate, &utp_conn, peer, close_cb](uvpp::error error) {
+        if (! error)
+        {
+            if (utp_conn.m_tls)
+                utp_conn.m_tls->on_write_finished();
+            else
+                pstate.on_write_finished();
+        }
+        else if (! utp_conn.m_utp_conn.is_closing())
+        {
+            cerr << "uTP client write error: " << peer << endl;
+            utp_conn.m_utp_conn.close(close_cb);
+        }
+    };
+
+    // libutp copies the slices into its packets as the congestion window opens
+    auto do_write = [&utp_conn](const OutputSlice* slices, size_t count) {
+        utp_conn.m_write_bufs.resize(count);
+        for (size_t i = 0; i < count; ++i)
+            utp_conn.m_write_bufs[i] = uv_buf_init(const_cast<char*>(slices[i].data), slices[i].size);
+        utp_conn.m_utp_conn.write(utp_conn.m_write_bufs.data(), count);
+    };
+
+    // libutp hands over each packet on its own, so the data is copied into the input buffer
+    auto read_cb = [&pstate, &utp_conn, peer, close_cb](const char* data, ssize_t len) {
+        if (len < 0)
+        {
+            if (len != UV_EOF)
+                cerr << "uTP client read error: " << peer << endl;
+            if (! utp_conn.m_utp_conn.is_closing())
+                utp_conn.m_utp_conn.close(close_cb);
+            return;
+        }
+        if (utp_conn.m_tls)
+            return utp_conn.m_tls->input(data, static_cast<size_t>(len));
+        const auto space = pstate.input_reserve(static_cast<size_t>(len));
+        memcpy(space.first, data, static_cast<size_t>(len));
+        pstate.input_commit(static_cast<size_t>(len));
+    };
+
+    auto do_read = [&utp_conn](int fd, u64 file_id, u64 offset, size_t size, size_t read_ahead, ProtocolState::read_done_t done) {
+        utp_conn.m_file_reader.read(fd, file_id, offset, size, read_ahead, move(done));
+    };
+    utp_conn.m_protocol.m_handle_payload_file_closed = [&utp_conn](u64 file_id) {
+        utp_conn.m_file_reader.forget(file_id);
+    };
+
+    auto hold_read = [&utp_conn]() {
+        if (utp_conn.m_read_holds++ == 0)
+            utp_conn.m_utp_conn.read_stop();
+    };
+    auto release_read = [&utp_conn]() {
+        if (--utp_conn.m_read_holds == 0 && ! utp_conn.m_utp_conn.is_closing())
+            utp_conn.m_utp_conn.read_resume();
+    };
+    utp_conn.m_write_backlog->pause = hold_read;
+    utp_conn.m_write_backlog->resume = release_read;
+    uvpp::loop& loop = worker.m_loop;
+    utp_conn.m_protocol.m_handle_open_file_writer = [this, &loop, &utp_conn](const bfs::path& path, bool truncate) {
+        return unique_ptr<FileWriter>(new AsyncFileWriter(loop, path, truncate, utp_conn.m_write_backlog, writer_mutex(utp_conn.m_protocol)));
+    };
+    utp_conn.m_protocol.m_handle_hash_file = [this, &loop, &utp_conn](const bfs::path& path, hash_done_t done) {
+        hash_file(loop, path, move(done), writer_mutex(utp_conn.m_protocol));
+    };
+
+    auto error_cb = [&utp_conn, peer, close_cb]() {
+        cerr << "uTP client protocol error: " << peer << endl;
+        if (! utp_conn.m_utp_conn.is_closing())
+            utp_conn.m_utp_conn.close(close_cb);
+    };
+
+    utp_conn.m_utp_conn.set_write_callback(write_cb);
+    utp_conn.m_utp_conn.set_read_callback(read_cb);
+
+    // no sendfile, the payloads go through libutp
+    pstate.set_write_fun(do_write);
+    pstate.set_read_fun(do_read);
+    pstate.m_handle_error = error_cb;
+
+    guard_handlers(utp_conn.m_protocol, pstate);
+    utp_conn.m_rate_gate = make_unique<RateGate>(loop, m_governor, utp_conn.m_protocol, pstate, hold_read, release_read);
 
-    tcp_conn.m_tcp_conn.read_start(read_cb);
+    if (m_tls)
+    {
+        utp_conn.m_tls = make_unique<tls::Stream>(*m_tls);
+        secure(*utp_conn.m_tls, utp_conn.m_protocol, pstate, [&utp_conn](const char* data, size_t len) {
+            utp_conn.m_write_bufs.resize(1);
+            utp_conn.m_write_bufs[0] = uv_buf_init(const_cast<char*>(data), len);
+            utp_conn.m_utp_conn.write(utp_conn.m_write_bufs.data(), 1);
+        });
+    }
+}
+
+
+void Daemon::guard_handlers(core::protocol::Protocol& protocol, ProtocolState& pstate)
+{
+    if (m_workers.size() > 1)
+    {
+        pstate.m_handle_msg = guarded(protocol, pstate.m_handle_msg);
+        pstate.m_handle_empty_output_buff = guarded(protocol, pstate.m_handle_empty_output_buff);
+        pstate.m_handle_payload = guarded(protocol, pstate.m_handle_payload);
+        pstate.m_handle_payload_end = guarded(protocol, pstate.m_handle_payload_end);
+    }
+}
+
+
+std::recursive_mutex* Daemon::writer_mutex(core::protocol::Protocol& protocol)
+{
+    // files are only recieved for the selected share
+    return m_workers.size() > 1 ? &protocol.share().mutex() : nullptr;
 }
 
 } // end ns
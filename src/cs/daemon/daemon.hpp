@@ -19,9 +19,21 @@
 #pragma once
 #include "../config.hpp"
 #include "../server.hpp"
+#include "../ratelimit.hpp"
+#include "../tls.hpp"
+#include "asyncfile.hpp"
+#include "rategate.hpp"
+#include "utp.hpp"
 #include "uvpp/uvpp.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 namespace cs
 {
@@ -39,11 +51,80 @@ public:
         server::Connection(server_info, shares)
         , r_loop(loop)
         , m_tcp_conn(loop)
+        , m_write_bufs()
+        , m_file_reader(loop)
+        , m_write_backlog(std::make_shared<WriteBacklog>())
+        , m_tls()
+        , m_tls_input()
+        , m_read_holds()
+        , m_rate_gate()
     {
 
     }
+
+    ~TCPConnection()
+    {
+        // files still being written outlive the connection
+        m_write_backlog->pause = nullptr;
+        m_write_backlog->resume = nullptr;
+    }
+
     uvpp::loop& r_loop;
     uvpp::Tcp m_tcp_conn;
+    /// buffers of the write in progress, reused between writes
+    std::vector<uv_buf_t> m_write_bufs;
+    /// reads the file chunks that are not sent with sendfile
+    FileReader m_file_reader;
+    /// recieved data not on disk yet
+    std::shared_ptr<WriteBacklog> m_write_backlog;
+    /// encrypts the traffic when set, the protocol data goes through it
+    std::unique_ptr<tls::Stream> m_tls;
+    /// ciphertext is read here, the plaintext goes to the protocol input buffer
+    std::vector<char> m_tls_input;
+    static const size_t s_tls_input_size = 64 * 1024;
+    /// reading is stopped while the write backlog or the rate gate hold it
+    unsigned m_read_holds;
+    std::unique_ptr<RateGate> m_rate_gate;
+};
+
+
+/// a connection over uTP, @sa UTPContext
+class UTPConnection: public server::Connection
+{
+public:
+    UTPConnection(
+        const core::ServerInfo& server_info,
+        std::map<std::string, core::share::Share>& shares,
+        uvpp::loop& loop
+    ):
+        server::Connection(server_info, shares)
+        , r_loop(loop)
+        , m_utp_conn()
+        , m_write_bufs()
+        , m_file_reader(loop)
+        , m_write_backlog(std::make_shared<WriteBacklog>())
+        , m_tls()
+        , m_read_holds()
+        , m_rate_gate()
+    {
+
+    }
+
+    ~UTPConnection()
+    {
+        m_write_backlog->pause = nullptr;
+        m_write_backlog->resume = nullptr;
+    }
+
+    uvpp::loop& r_loop;
+    UTPStream m_utp_conn;
+    std::vector<uv_buf_t> m_write_bufs;
+    /// file payloads are always copied, the data goes through libutp
+    FileReader m_file_reader;
+    std::shared_ptr<WriteBacklog> m_write_backlog;
+    std::unique_ptr<tls::Stream> m_tls;
+    unsigned m_read_holds;
+    std::unique_ptr<RateGate> m_rate_gate;
 };
 
 
@@ -59,18 +140,127 @@ public:
     Daemon& operator=(const Daemon&) = delete;
 
     void daemonize();
+    /// runs the event loops, blocks until stop is called. SIGPIPE is blocked on the loops while they run
     void start();
+    /**
+     * thread safe, makes start return once the connections are closed. A start in progress on
+     * another thread returns as well, even if its loops aren't running yet.
+     */
     void stop();
     void set_port(i16 port);
+    /**
+     * Number of event loops to run, each on its own thread with its own SO_REUSEPORT listener so
+     * the kernel spreads the incoming connections. 0 means one per core.
+     */
+    void set_loops(size_t loops);
+    /**
+     * Encrypt the connections with TLS, peers authenticate with the keys of a share and can use
+     * that share only @sa tls::Stream, server::psk_identity. Payloads aren't sent with sendfile.
+     * @throws tls::TLSError when TLS can't be set up
+     */
+    void set_tls(bool tls);
+    /// @returns the port the listeners are bound to once started, 0 before
+    int listen_port() const { return m_listen_port; }
+    /// bandwidth limits of the payloads, thread safe so they can be changed while running
+    ratelimit::Governor& governor() { return m_governor; }
+
+    /**
+     * thread safe @sa Server::download, the download runs on the first loop so only the
+     * @param connections of that loop take part. m_handle_download_done is called on that loop,
+     * also when the download couldn't start.
+     * @throws runtime_error when not running or the file is already being downloaded
+     */
+    void download(const std::string& checksum, u64 size, const bfs::path& path, const std::vector<std::string>& connections);
+
+    /// @returns the identifiers of the connections of all the loops, not to be called from a loop
+    std::vector<std::string> connections();
+
+protected:
+    /// only the connections of the first loop are found, to be called from that loop
+    server::Connection* find_connection(const std::string& id) override;
 
 private:
-    void on_tcp_connect(uvpp::error error);
+    /// an event loop with its listener and the connections it accepted
+    struct Worker
+    {
+        Worker(Daemon& daemon):
+              r_daemon(daemon)
+            , m_loop()
+            , m_tcp_listen_conn(m_loop)
+            , m_connections()
+            , m_utp()
+            , m_utp_connections()
+            , m_stop_async()
+            , m_tasks_async()
+            , m_tasks_mutex()
+            , m_tasks()
+            , m_tasks_closed()
+            , m_download_timer()
+#ifdef CS_TRACE
+            , m_trace_prepare()
+            , m_trace_check()
+            , m_poll_started()
+#endif
+            , m_thread()
+        {}
+
+        Daemon& r_daemon;
+        uvpp::loop m_loop;
+        uvpp::Tcp m_tcp_listen_conn;
+        std::map<std::string, std::unique_ptr<TCPConnection>> m_connections;
+        /// uTP on the listening port, only on the first loop since libutp isn't thread safe
+        std::unique_ptr<UTPContext> m_utp;
+        std::map<std::string, std::unique_ptr<UTPConnection>> m_utp_connections;
+        uv_async_t m_stop_async;
+        /// runs the m_tasks posted from other threads @sa post
+        uv_async_t m_tasks_async;
+        std::mutex m_tasks_mutex;
+        std::vector<std::function<void()>> m_tasks;
+        /// the loop is stopping and m_tasks_async is closed
+        bool m_tasks_closed;
+        /// ticks the downloads, on the first loop only where they run
+        std::unique_ptr<uvpp::Timer> m_download_timer;
+#ifdef CS_TRACE
+        /// the loop polls between prepare and check, the time it waits on the sockets is traced
+        uv_prepare_t m_trace_prepare;
+        uv_check_t m_trace_check;
+        u64 m_poll_started;
+#endif
+        std::thread m_thread;
+    };
+
+    /// @returns the port it's bound to
+    int listen(Worker& worker, int port);
+    void on_tcp_connect(Worker& worker, uvpp::error error);
+    void on_utp_accept(Worker& worker, utp_socket* socket);
+    /// with several loops the connections of different loops may use the same share
+    void guard_handlers(core::protocol::Protocol& protocol, ProtocolState& pstate);
+    /// @returns the mutex the data written for @param protocol is handed over with, @sa AsyncFileWriter
+    std::recursive_mutex* writer_mutex(core::protocol::Protocol& protocol);
+    /// @throws runtime_error when running, @param what is the method
+    void check_not_running(const char* what);
+    /**
+     * run @param task on the loop of the worker @param index, thread safe
+     * @returns false when it isn't running, the task is dropped then
+     */
+    bool post(size_t index, std::function<void()> task);
 
     i16 m_port;
+    /// guards m_running, m_stop_requested and m_workers while start sets them up or tears them down
+    std::mutex m_state_mutex;
+    /// signaled when start returns
+    std::condition_variable m_state_cond;
+    /// from the call to start until it returns
     bool m_running;
+    /// stop was called during this run
+    bool m_stop_requested;
     bool m_daemon;
-    uvpp::loop m_loop;
-    uvpp::Tcp m_tcp_listen_conn;
+    size_t m_num_loops;
+    std::atomic<int> m_listen_port;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    /// set when the connections are encrypted, shared by the loops
+    std::unique_ptr<tls::Context> m_tls;
+    ratelimit::Governor m_governor;
 };
 
 } // end ns
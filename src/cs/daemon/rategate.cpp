@@ -0,0 +1,143 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "rategate.hpp"
+
+using namespace std;
+
+namespace cs
+{
+namespace daemon
+{
+
+using ratelimit::Direction;
+
+RateGate::RateGate(
+    uvpp::loop& loop,
+    ratelimit::Governor& governor,
+    core::protocol::Protocol& protocol,
+    ProtocolState& pstate,
+    function<void()> hold_read,
+    function<void()> release_read
+):
+      r_loop(loop)
+    , r_governor(governor)
+    , r_protocol(protocol)
+    , r_pstate(pstate)
+    , m_hold_read(move(hold_read))
+    , m_release_read(move(release_read))
+    , m_refill(move(pstate.m_handle_empty_output_buff))
+    , m_handle_payload(move(pstate.m_handle_payload))
+    , m_timer()
+    , m_timer_armed()
+    , m_refill_waiting()
+    , m_read_held()
+{
+    auto send_chunk = move(protocol.m_handle_send_payload_chunk);
+    protocol.m_handle_send_payload_chunk = [this, send_chunk](string&& data) {
+        consume(Direction::UPLOAD, data.size());
+        send_chunk(move(data));
+    };
+    auto send_file_chunk = move(protocol.m_handle_send_payload_file_chunk);
+    protocol.m_handle_send_payload_file_chunk = [this, send_file_chunk](int fd, u64 file_id, u64 offset, size_t size, size_t read_ahead) {
+        consume(Direction::UPLOAD, size);
+        send_file_chunk(fd, file_id, offset, size, read_ahead);
+    };
+    pstate.m_handle_empty_output_buff = bind(&RateGate::refill, this);
+    pstate.m_handle_payload = bind(&RateGate::on_payload, this, placeholders::_1, placeholders::_2);
+}
+
+RateGate::~RateGate()
+{
+    if (m_timer)
+        m_timer->close();
+}
+
+u64 RateGate::wait(Direction dir)
+{
+    return r_governor.wait(dir, r_protocol.m_share, r_protocol.m_peerinfo.m_peer);
+}
+
+void RateGate::consume(Direction dir, size_t bytes)
+{
+    if (bytes)
+        r_governor.consume(dir, r_protocol.m_share, r_protocol.m_peerinfo.m_peer, bytes);
+}
+
+void RateGate::refill()
+{
+    const u64 ms = wait(Direction::UPLOAD);
+    if (ms)
+    {
+        m_refill_waiting = true;
+        arm(ms);
+        return;
+    }
+    m_refill_waiting = false;
+    m_refill();
+}
+
+void RateGate::on_payload(const char* data, size_t len)
+{
+    consume(Direction::DOWNLOAD, len);
+    m_handle_payload(data, len);
+    if (m_read_held)
+        return;
+    const u64 ms = wait(Direction::DOWNLOAD);
+    if (ms)
+    {
+        // the rest of what was read is handled, nothing more is read until the debt is paid
+        m_read_held = true;
+        m_hold_read();
+        arm(ms);
+    }
+}
+
+void RateGate::on_timer()
+{
+    m_timer_armed = false;
+    if (m_read_held)
+    {
+        const u64 ms = wait(Direction::DOWNLOAD);
+        if (ms)
+            arm(ms);
+        else
+        {
+            m_read_held = false;
+            m_release_read();
+        }
+    }
+    // a write in progress refills the output when it finishes
+    if (m_refill_waiting && ! r_pstate.m_write_in_progress)
+        refill();
+}
+
+void RateGate::arm(u64 ms)
+{
+    if (m_timer_armed)
+        return;
+    if (! m_timer)
+    {
+        m_timer = make_unique<uvpp::Timer>(r_loop);
+        m_timer->set_callback(bind(&RateGate::on_timer, this));
+    }
+    m_timer_armed = true;
+    m_timer->start(ms);
+}
+
+} // end ns
+} // end ns
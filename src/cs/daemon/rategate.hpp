@@ -0,0 +1,83 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "../config.hpp"
+#include "../core/protocol.hpp"
+#include "../protocolstate.hpp"
+#include "../ratelimit.hpp"
+#include "uvpp/uvpp.hpp"
+#include <functional>
+#include <memory>
+
+namespace cs
+{
+namespace daemon
+{
+
+/**
+ * Holds the payload of a connection to the limits of a ratelimit::Governor. The chunks sent and
+ * recieved are charged, while a limit is exceeded the output is not refilled with payload and
+ * reading stops until the timer says the debt is paid. Control messages are never held back, but
+ * the ones recieved wait with the payload while reading is stopped.
+ *
+ * Installs itself in the handlers of @param protocol and @param pstate, which have to be set
+ * already, and uses the share selected and the peer id at the time of each transfer.
+ */
+class RateGate
+{
+public:
+    /// @param hold_read and @param release_read stop and resume reading the connection
+    RateGate(
+        uvpp::loop& loop,
+        ratelimit::Governor& governor,
+        core::protocol::Protocol& protocol,
+        ProtocolState& pstate,
+        std::function<void()> hold_read,
+        std::function<void()> release_read
+    );
+    ~RateGate();
+
+    RateGate(const RateGate&) = delete;
+    RateGate& operator=(const RateGate&) = delete;
+
+private:
+    u64 wait(ratelimit::Direction dir);
+    void consume(ratelimit::Direction dir, size_t bytes);
+    void refill();
+    void on_payload(const char* data, size_t len);
+    void on_timer();
+    void arm(u64 ms);
+
+    uvpp::loop& r_loop;
+    ratelimit::Governor& r_governor;
+    core::protocol::Protocol& r_protocol;
+    ProtocolState& r_pstate;
+    std::function<void()> m_hold_read;
+    std::function<void()> m_release_read;
+    /// the handlers that were installed
+    ProtocolState::handle_empty_output_buff_t m_refill;
+    ProtocolState::handle_payload_t m_handle_payload;
+    /// created the first time a limit is hit
+    std::unique_ptr<uvpp::Timer> m_timer;
+    bool m_timer_armed;
+    bool m_refill_waiting;
+    bool m_read_held;
+};
+
+} // end ns
+} // end ns
@@ -0,0 +1,461 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "asyncfile.hpp"
+#include "utp.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+
+socklen_t sockaddr_len(const sockaddr* addr)
+{
+    return addr->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+}
+
+int uv_error(int utp_error_code)
+{
+    switch (utp_error_code)
+    {
+        case UTP_ECONNREFUSED:
+            return UV_ECONNREFUSED;
+        case UTP_ETIMEDOUT:
+            return UV_ETIMEDOUT;
+        default:
+            return UV_ECONNRESET;
+    }
+}
+
+} // end ns
+
+namespace cs
+{
+namespace daemon
+{
+
+u32 UTPContext::s_target_delay = 100 * 1000;
+
+u32 UTPContext::s_check_interval = 500;
+
+int UTPContext::s_socket_buffer_size = 4 << 20;
+
+UTPStream::UTPStream():
+      r_context()
+    , m_socket()
+    , m_connected()
+    , m_closing()
+    , m_read_stopped()
+    , m_write_done()
+    , m_closed()
+    , m_write_iov()
+    , m_write_pos()
+    , m_connect_cb()
+    , m_read_cb()
+    , m_write_cb()
+    , m_close_cb()
+{
+}
+
+UTPStream::~UTPStream()
+{
+    if (m_socket)
+    {
+        utp_set_userdata(m_socket, nullptr);
+        if (! m_closing)
+            utp_close(m_socket);
+    }
+    if (r_context)
+        r_context->forget(this);
+}
+
+void UTPStream::attach(utp_socket* socket)
+{
+    assert(! m_socket);
+    m_socket = socket;
+    r_context = reinterpret_cast<UTPContext*>(utp_context_get_userdata(utp_get_context(socket)));
+    utp_set_userdata(socket, this);
+    // accepted sockets are connected already, the rest wait for UTP_STATE_CONNECT
+    m_connected = ! m_connect_cb;
+}
+
+void UTPStream::write(const uv_buf_t* bufs, size_t nbufs)
+{
+    assert(m_write_pos == m_write_iov.size());
+    m_write_iov.resize(nbufs);
+    for (size_t i = 0; i < nbufs; ++i)
+        m_write_iov[i] = utp_iovec{bufs[i].base, bufs[i].len};
+    m_write_pos = 0;
+    continue_write();
+}
+
+void UTPStream::continue_write()
+{
+    if (! m_socket || m_closing || ! m_connected)
+        return;
+
+    while (m_write_pos < m_write_iov.size())
+    {
+        const ssize_t sent = utp_writev(m_socket, &m_write_iov[m_write_pos], m_write_iov.size() - m_write_pos);
+        if (sent <= 0)
+            // the window is full, UTP_STATE_WRITABLE continues
+            return;
+
+        size_t left = static_cast<size_t>(sent);
+        while (left)
+        {
+            utp_iovec& iov = m_write_iov[m_write_pos];
+            const size_t n = min(left, iov.iov_len);
+            iov.iov_base = static_cast<char*>(iov.iov_base) + n;
+            iov.iov_len -= n;
+            left -= n;
+            if (iov.iov_len == 0)
+                ++m_write_pos;
+        }
+        while (m_write_pos < m_write_iov.size() && m_write_iov[m_write_pos].iov_len == 0)
+            ++m_write_pos;
+    }
+
+    // libutp copied the data into its packets, the write completes as a stream write would
+    m_write_iov.clear();
+    m_write_pos = 0;
+    m_write_done = true;
+    r_context->defer(this);
+}
+
+void UTPStream::read_stop()
+{
+    m_read_stopped = true;
+}
+
+void UTPStream::read_resume()
+{
+    m_read_stopped = false;
+    if (m_socket && ! m_closing)
+        // announces the window opened again
+        utp_read_drained(m_socket);
+}
+
+void UTPStream::close(std::function<void()> callback)
+{
+    assert(! m_closing);
+    m_closing = true;
+    m_close_cb = move(callback);
+    m_write_iov.clear();
+    m_write_pos = 0;
+    if (m_socket)
+        utp_close(m_socket);
+    else
+    {
+        m_closed = true;
+        if (r_context)
+            r_context->defer(this);
+    }
+}
+
+bool UTPStream::getpeername(bool& ip4, std::string& ip, int& port)
+{
+    if (! m_socket)
+        return false;
+
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (utp_getpeername(m_socket, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+        return false;
+
+    ip4 = addr.ss_family == AF_INET;
+    if (ip4)
+        return uvpp::from_ip4_addr(reinterpret_cast<uvpp::ip4_addr*>(&addr), ip, port);
+    return uvpp::from_ip6_addr(reinterpret_cast<uvpp::ip6_addr*>(&addr), ip, port);
+}
+
+void UTPStream::on_state_change(int state)
+{
+    switch (state)
+    {
+        case UTP_STATE_CONNECT:
+            m_connected = true;
+            if (m_connect_cb)
+                m_connect_cb(uvpp::error(0));
+            continue_write();
+            break;
+
+        case UTP_STATE_WRITABLE:
+            continue_write();
+            break;
+
+        case UTP_STATE_EOF:
+            if (! m_closing && m_read_cb)
+                m_read_cb(nullptr, UV_EOF);
+            break;
+
+        case UTP_STATE_DESTROYING:
+            m_socket = nullptr;
+            if (m_closing)
+            {
+                m_closed = true;
+                r_context->defer(this);
+            }
+            break;
+    }
+}
+
+void UTPStream::on_read(const char* data, size_t len)
+{
+    if (! m_closing && m_read_cb)
+        m_read_cb(data, static_cast<ssize_t>(len));
+}
+
+void UTPStream::on_error(int error_code)
+{
+    if (m_closing)
+        return;
+
+    if (! m_connected && m_connect_cb)
+        m_connect_cb(uvpp::error(uv_error(error_code)));
+    else if (m_read_cb)
+        m_read_cb(nullptr, uv_error(error_code));
+}
+
+size_t UTPStream::read_buffer_size() const
+{
+    // the data is consumed as it arrives, while reading is stopped the whole window is taken
+    return m_read_stopped && m_socket ? utp_getsockopt(m_socket, UTP_RCVBUF) : 0;
+}
+
+void UTPStream::on_deferred()
+{
+    if (m_closed)
+    {
+        // the callback may destroy this socket
+        m_closed = false;
+        m_write_done = false;
+        auto callback = move(m_close_cb);
+        callback();
+        return;
+    }
+    if (m_write_done && ! m_closing)
+    {
+        m_write_done = false;
+        if (m_write_cb)
+            m_write_cb(uvpp::error(0));
+    }
+}
+
+
+UTPContext::UTPContext(uvpp::loop& loop):
+      m_ctx(utp_init(2))
+    , m_udp(loop)
+    , m_check_timer(loop)
+    , m_flush_timer(loop)
+    , m_flush_pending()
+    , m_on_accept()
+    , m_deferred()
+    , m_flushing()
+{
+    if (! m_ctx)
+        throw runtime_error("UTPContext: utp_init failed");
+
+    utp_context_set_userdata(m_ctx, this);
+    for (int callback: {UTP_ON_FIREWALL, UTP_ON_ACCEPT, UTP_ON_ERROR, UTP_ON_READ, UTP_ON_STATE_CHANGE,
+        UTP_GET_READ_BUFFER_SIZE, UTP_SENDTO})
+        utp_set_callback(m_ctx, callback, &UTPContext::utp_callback);
+    utp_context_set_option(m_ctx, UTP_TARGET_DELAY, s_target_delay);
+
+    m_flush_timer.set_callback([this]() { flush(); });
+    m_check_timer.start([this]() {
+        if (m_ctx)
+            utp_check_timeouts(m_ctx);
+    }, s_check_interval, s_check_interval);
+}
+
+UTPContext::~UTPContext()
+{
+    destroy();
+}
+
+int UTPContext::bind(const std::string& ip, int port)
+{
+    if (! m_udp.bind(ip, port))
+        return 0;
+    return start_recv();
+}
+
+int UTPContext::bind6(const std::string& ip, int port)
+{
+    if (! m_udp.bind6(ip, port))
+        return 0;
+    return start_recv();
+}
+
+int UTPContext::start_recv()
+{
+    m_udp.buffer_sizes(s_socket_buffer_size, s_socket_buffer_size);
+    if (! m_udp.recv_start([this](const char* buf, ssize_t len, const sockaddr* addr) { on_recv(buf, len, addr); }))
+        return 0;
+
+    bool ip4;
+    string ip;
+    int port = 0;
+    m_udp.getsockname(ip4, ip, port);
+    return port;
+}
+
+void UTPContext::listen(accept_t on_accept)
+{
+    m_on_accept = move(on_accept);
+}
+
+void UTPContext::connect(UTPStream& socket, const std::string& ip, int port)
+{
+    uvpp::ip4_addr addr4;
+    uvpp::ip6_addr addr6;
+    const sockaddr* addr = nullptr;
+    if (ip.find(':') == string::npos)
+    {
+        addr4 = uvpp::to_ip4_addr(ip, port);
+        addr = reinterpret_cast<const sockaddr*>(&addr4);
+    }
+    else
+    {
+        addr6 = uvpp::to_ip6_addr(ip, port);
+        addr = reinterpret_cast<const sockaddr*>(&addr6);
+    }
+
+    utp_socket* s = utp_create_socket(m_ctx);
+    if (! socket.m_connect_cb)
+        socket.set_connect_callback([](uvpp::error) {});
+    socket.attach(s);
+    utp_connect(s, addr, sockaddr_len(addr));
+}
+
+void UTPContext::close(std::function<void()> callback)
+{
+    destroy();
+    m_udp.close();
+    m_check_timer.close();
+    m_flush_timer.close(move(callback));
+}
+
+void UTPContext::destroy()
+{
+    if (! m_ctx)
+        return;
+
+    utp_context* ctx = m_ctx;
+    m_ctx = nullptr;
+    utp_destroy(ctx);
+}
+
+::uint64 UTPContext::utp_callback(utp_callback_arguments* args)
+{
+    UTPContext* self = reinterpret_cast<UTPContext*>(utp_context_get_userdata(args->context));
+    UTPStream* socket = args->socket ? reinterpret_cast<UTPStream*>(utp_get_userdata(args->socket)) : nullptr;
+    if (! self->m_ctx)
+    {
+        // being destroyed, the streams left let go of their sockets without notifying anyone
+        if (socket && args->callback_type == UTP_ON_STATE_CHANGE && args->state == UTP_STATE_DESTROYING)
+            socket->m_socket = nullptr;
+        return 0;
+    }
+
+    switch (args->callback_type)
+    {
+        case UTP_SENDTO:
+            self->m_udp.send(reinterpret_cast<const char*>(args->buf), args->len, args->address);
+            break;
+
+        case UTP_ON_FIREWALL:
+            // refuse connections when not listening
+            return self->m_on_accept ? 0 : 1;
+
+        case UTP_ON_ACCEPT:
+            self->m_on_accept(args->socket);
+            break;
+
+        case UTP_ON_STATE_CHANGE:
+            if (socket)
+                socket->on_state_change(args->state);
+            break;
+
+        case UTP_ON_READ:
+            if (socket)
+                socket->on_read(reinterpret_cast<const char*>(args->buf), args->len);
+            break;
+
+        case UTP_ON_ERROR:
+            if (socket)
+                socket->on_error(args->error_code);
+            break;
+
+        case UTP_GET_READ_BUFFER_SIZE:
+            return socket ? socket->read_buffer_size() : 0;
+    }
+    return 0;
+}
+
+void UTPContext::on_recv(const char* buf, ssize_t len, const sockaddr* addr)
+{
+    if (len <= 0 || ! m_ctx)
+        return;
+
+    utp_process_udp(m_ctx, reinterpret_cast<const byte*>(buf), static_cast<size_t>(len), addr, sockaddr_len(addr));
+    // the acks of the datagrams that arrived together go out once they were all processed
+    if (! m_flush_pending)
+    {
+        m_flush_pending = true;
+        m_flush_timer.start(0);
+    }
+}
+
+void UTPContext::defer(UTPStream* socket)
+{
+    if (find(m_deferred.begin(), m_deferred.end(), socket) == m_deferred.end())
+        m_deferred.push_back(socket);
+    if (! m_flush_pending)
+    {
+        m_flush_pending = true;
+        m_flush_timer.start(0);
+    }
+}
+
+void UTPContext::flush()
+{
+    m_flush_pending = false;
+    if (m_ctx)
+        utp_issue_deferred_acks(m_ctx);
+
+    // the callbacks may defer more events or destroy sockets
+    m_flushing.swap(m_deferred);
+    for (size_t i = 0; i < m_flushing.size(); ++i)
+    {
+        if (m_flushing[i])
+            m_flushing[i]->on_deferred();
+    }
+    m_flushing.clear();
+}
+
+void UTPContext::forget(UTPStream* socket)
+{
+    replace(m_deferred.begin(), m_deferred.end(), socket, static_cast<UTPStream*>(nullptr));
+    replace(m_flushing.begin(), m_flushing.end(), socket, static_cast<UTPStream*>(nullptr));
+}
+
+} // end ns
+} // end ns
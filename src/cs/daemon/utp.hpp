@@ -0,0 +1,186 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "../config.hpp"
+#include "libutp/utp.h"
+#include "uvpp/uvpp.hpp"
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace cs
+{
+namespace daemon
+{
+
+class UTPContext;
+
+/**
+ * A uTP connection, used like a uvpp::Tcp. The callbacks run on the loop of its context, writes
+ * complete asynchronously as on a stream.
+ */
+class UTPStream
+{
+public:
+    UTPStream();
+    /// the connection is closed without waiting for it
+    ~UTPStream();
+
+    UTPStream(const UTPStream&) = delete;
+    UTPStream& operator=(const UTPStream&) = delete;
+
+    /// take over @param socket, accepted or being connected
+    void attach(utp_socket* socket);
+
+    bool is_closing() const
+    {
+        return m_closing;
+    }
+
+    /// called once connected, or with the error when the connection couldn't be made
+    void set_connect_callback(std::function<void(uvpp::error)> callback)
+    {
+        m_connect_cb = std::move(callback);
+    }
+
+    /// @param callback gets the data in order, at the end a null buffer with UV_EOF or an error code
+    void set_read_callback(std::function<void(const char* buf, ssize_t len)> callback)
+    {
+        m_read_cb = std::move(callback);
+    }
+
+    void set_write_callback(std::function<void(uvpp::error)> callback)
+    {
+        m_write_cb = std::move(callback);
+    }
+
+    /// gather write, the buffers are sent in order and must stay valid until the write callback
+    void write(const uv_buf_t* bufs, size_t nbufs);
+
+    /**
+     * Close the receive window so the peer stops sending, the data already on the way still comes.
+     * uTP has no other way of pausing since the data isn't kept by the kernel.
+     */
+    void read_stop();
+    void read_resume();
+
+    /// @param callback is called once the peer acknowledged the end of the connection or it timed out
+    void close(std::function<void()> callback = []{});
+
+    bool getpeername(bool& ip4, std::string& ip, int& port);
+
+private:
+    friend class UTPContext;
+
+    void on_state_change(int state);
+    void on_read(const char* data, size_t len);
+    void on_error(int error_code);
+    /// @returns the bytes the application holds, subtracted from the receive window
+    size_t read_buffer_size() const;
+    /// hand the pending buffers to libutp as the congestion window allows
+    void continue_write();
+    /// the events that are notified from the loop instead of from inside libutp
+    void on_deferred();
+
+    UTPContext* r_context;
+    utp_socket* m_socket;
+    bool m_connected;
+    bool m_closing;
+    bool m_read_stopped;
+    bool m_write_done;
+    bool m_closed;
+    /// buffers of the write in progress, m_write_iov[m_write_pos] is the first with data left
+    std::vector<utp_iovec> m_write_iov;
+    size_t m_write_pos;
+    std::function<void(uvpp::error)> m_connect_cb;
+    std::function<void(const char*, ssize_t)> m_read_cb;
+    std::function<void(uvpp::error)> m_write_cb;
+    std::function<void()> m_close_cb;
+};
+
+
+/**
+ * libutp over a UDP socket of a loop. libutp's congestion control is LEDBAT, which sizes the window
+ * to keep the one way queuing delay it measures under s_target_delay. Whether that leaves room for
+ * TCP traffic sharing a bottleneck isn't tested here: on loopback there's no queue to measure.
+ *
+ * libutp keeps state in globals, a process should drive its contexts from a single thread.
+ */
+class UTPContext
+{
+public:
+    typedef std::function<void(utp_socket* socket)> accept_t;
+
+    explicit UTPContext(uvpp::loop& loop);
+    /// the handles must have been closed with close
+    ~UTPContext();
+
+    UTPContext(const UTPContext&) = delete;
+    UTPContext& operator=(const UTPContext&) = delete;
+
+    /// start receiving on @param ip:port, needed before connecting too. @returns the port bound, 0 on failure
+    int bind(const std::string& ip, int port);
+    int bind6(const std::string& ip, int port);
+
+    /// accept incoming connections, @param on_accept should attach them to a UTPStream right away
+    void listen(accept_t on_accept);
+
+    /// connect @param socket to @param ip:port, its connect callback tells when it's done
+    void connect(UTPStream& socket, const std::string& ip, int port);
+
+    /// free the connections left, their streams are detached, and close the handles
+    void close(std::function<void()> callback = []{});
+
+    /// LEDBAT target of the one way queuing delay in microseconds
+    static u32 s_target_delay;
+    /// how often the timeouts and retransmissions are checked, in ms
+    static u32 s_check_interval;
+    /**
+     * kernel buffers of the UDP socket. A datagram that doesn't fit is lost and uTP waits a second
+     * before sending it again, the default buffers are too small for a full window.
+     */
+    static int s_socket_buffer_size;
+
+private:
+    friend class UTPStream;
+
+    static ::uint64 utp_callback(utp_callback_arguments* args);
+    void on_recv(const char* buf, ssize_t len, const sockaddr* addr);
+    /// call UTPStream::on_deferred on @param socket at the next loop iteration
+    void defer(UTPStream* socket);
+    void flush();
+    /// the socket is going away, forget its deferred events
+    void forget(UTPStream* socket);
+    /// @returns the port the socket is bound to, 0 if receiving failed
+    int start_recv();
+    /// free libutp and the sockets left
+    void destroy();
+
+    utp_context* m_ctx;
+    uvpp::Udp m_udp;
+    uvpp::Timer m_check_timer;
+    /// zero timeout timer running flush after the datagrams of a loop iteration were processed
+    uvpp::Timer m_flush_timer;
+    bool m_flush_pending;
+    accept_t m_on_accept;
+    /// sockets with deferred events, entries of those destroyed meanwhile are null
+    std::vector<UTPStream*> m_deferred;
+    std::vector<UTPStream*> m_flushing;
+};
+
+} // end ns
+} // end ns
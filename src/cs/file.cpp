@@ -17,13 +17,250 @@
  */
 
 #include "file.hpp"
+#include "fs.hpp"
+#include <array>
 #include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
 #include "boost_fs_fwd.hpp"
+namespace sha2
+{
+#include "sha2/sha2.h"
+}
 
 using namespace std;
 
 namespace cs
 {
 
+namespace
+{
+
+class SyncFileWriter: public FileWriter
+{
+public:
+    SyncFileWriter(const bfs::path& path, bool truncate):
+        m_path(path)
+        , m_fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644))
+    {
+        if (m_fd == -1)
+            throw std::runtime_error(fs("SyncFileWriter: couldn't open " << path << ": " << strerror(errno)));
+    }
+
+    ~SyncFileWriter()
+    {
+        if (m_fd != -1)
+            ::close(m_fd);
+    }
+
+    void write(u64 offset, const char* data, size_t len) override
+    {
+        while (len)
+        {
+            const ssize_t n = ::pwrite(m_fd, data, len, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw std::runtime_error(fs("SyncFileWriter: write error on " << m_path << ": " << strerror(errno)));
+            data += n;
+            len -= n;
+            offset += n;
+        }
+    }
+
+    void preallocate(u64 offset, u64 length) override
+    {
+#if defined(__linux__)
+        // only a hint, file systems without it are fine
+        (void)::fallocate(m_fd, 0, offset, length);
+#else
+        (void)offset;
+        (void)length;
+#endif
+    }
+
+    void close(std::function<void(bool ok)> done) override
+    {
+        const bool ok = ::close(m_fd) == 0;
+        m_fd = -1;
+        done(ok);
+    }
+
+private:
+    bfs::path m_path;
+    int m_fd;
+};
+
+/// closes the fd when going out of scope
+struct Fd
+{
+    explicit Fd(int fd):
+        fd(fd)
+    {}
+
+    ~Fd()
+    {
+        if (fd != -1)
+            ::close(fd);
+    }
+
+    Fd(const Fd&) = delete;
+    Fd& operator=(const Fd&) = delete;
+
+    int fd;
+};
+
+/// @returns false if the kernel or the file systems can't do it, @throws runtime_error if it failed midway
+bool copy_file_range_all(int in, int out, u64 size, const bfs::path& to)
+{
+#if defined(SYS_copy_file_range)
+    loff_t in_off = 0;
+    loff_t out_off = 0;
+    while (static_cast<u64>(in_off) < size)
+    {
+        const ssize_t n = ::syscall(SYS_copy_file_range, in, &in_off, out, &out_off, size - in_off, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && ! in_off && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+            return false;
+        if (n < 0)
+            throw std::runtime_error(fs("clone_file: copy_file_range error on " << to << ": " << strerror(errno)));
+        // the source shrank
+        if (n == 0)
+            break;
+    }
+    return true;
+#else
+    (void)in;
+    (void)out;
+    (void)size;
+    (void)to;
+    return false;
+#endif
+}
+
+void copy_all(int in, int out, const bfs::path& to)
+{
+    char buf[64 * 1024];
+    while (true)
+    {
+        ssize_t n = ::read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::runtime_error(fs("clone_file: read error copying to " << to << ": " << strerror(errno)));
+        if (n == 0)
+            break;
+        const char* data = buf;
+        while (n)
+        {
+            const ssize_t w = ::write(out, data, n);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                throw std::runtime_error(fs("clone_file: write error on " << to << ": " << strerror(errno)));
+            data += w;
+            n -= w;
+        }
+    }
+}
+
+} // end anon ns
+
+std::unique_ptr<FileWriter> open_file_writer(const bfs::path& path, bool truncate)
+{
+    return std::unique_ptr<FileWriter>(new SyncFileWriter(path, truncate));
+}
+
+CloneMethod clone_file(const bfs::path& from, const bfs::path& to)
+{
+    Fd in(::open(from.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.fd == -1)
+        throw std::runtime_error(fs("clone_file: couldn't open " << from << ": " << strerror(errno)));
+    struct stat st;
+    if (::fstat(in.fd, &st) != 0)
+        throw std::runtime_error(fs("clone_file: couldn't stat " << from << ": " << strerror(errno)));
+    Fd out(::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (out.fd == -1)
+        throw std::runtime_error(fs("clone_file: couldn't open " << to << ": " << strerror(errno)));
+
+    CloneMethod method = CloneMethod::COPY;
+#if defined(FICLONE)
+    if (::ioctl(out.fd, FICLONE, in.fd) == 0)
+        method = CloneMethod::REFLINK;
+    else
+#endif
+    if (copy_file_range_all(in.fd, out.fd, st.st_size, to))
+        method = CloneMethod::COPY_FILE_RANGE;
+    else
+        copy_all(in.fd, out.fd, to);
+
+    const int fd = out.fd;
+    out.fd = -1;
+    if (::close(fd) != 0)
+        throw std::runtime_error(fs("clone_file: write error on " << to << ": " << strerror(errno)));
+    return method;
+}
+
+std::string sha256_file(const bfs::path& path)
+{
+    Fd in(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.fd == -1)
+        throw std::runtime_error(fs("sha256_file: couldn't open " << path << ": " << strerror(errno)));
+    sha2::SHA256_CTX ctx;
+    sha2::SHA256_Init(&ctx);
+    std::array<char, 65536> buff;
+    while (true)
+    {
+        const ssize_t n = ::read(in.fd, buff.data(), buff.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::runtime_error(fs("sha256_file: read error on " << path << ": " << strerror(errno)));
+        if (! n)
+            break;
+        sha2::SHA256_Update(&ctx, reinterpret_cast<const u8*>(buff.data()), n);
+    }
+    string digest(SHA256_DIGEST_STRING_LENGTH, 0);
+    sha2::SHA256_End(&ctx, &digest[0]);
+    digest.resize(digest.size() - 1);
+    return digest;
+}
+
+void clone_file(const bfs::path& from, const bfs::path& to, clone_done_t done)
+{
+    bool ok = false;
+    try
+    {
+        clone_file(from, to);
+        ok = true;
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+    done(ok);
+}
+
+void hash_file(const bfs::path& path, hash_done_t done)
+{
+    string digest;
+    try
+    {
+        digest = sha256_file(path);
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+    done(digest);
+}
 
 } // end ns
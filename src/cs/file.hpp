@@ -18,6 +18,9 @@
 
 #pragma once
 #include "int_types.h"
+#include "boost_fs_fwd.hpp"
+#include <functional>
+#include <memory>
 #include <string>
 
 namespace cs
@@ -43,4 +46,81 @@ struct File
     bool deleted;
 };
 
+/**
+ * Destination of file data recieved from a peer. Implementations may write behind, copying the data
+ * and writing it later, close tells when everything is on disk. Destroying a writer finishes its
+ * writes in the background without notifying.
+ */
+class FileWriter
+{
+public:
+    virtual ~FileWriter() = default;
+
+    /**
+     * write @param len bytes of @param data at @param offset, data can be reused when it returns
+     * @throws runtime_error on errors found right away
+     */
+    virtual void write(u64 offset, const char* data, size_t len) = 0;
+
+    /// hint that [offset, offset + length) will be written, so disk space can be reserved at once
+    virtual void preallocate(u64 offset, u64 length) = 0;
+
+    /**
+     * no more writes, @param done is called with false if any failed once all are finished. It can
+     * be called before close returns and destroy the writer.
+     */
+    virtual void close(std::function<void(bool ok)> done) = 0;
+};
+
+/// opens @param path for writing, creating it if needed, truncating it if @param truncate
+typedef std::function<std::unique_ptr<FileWriter>(const bfs::path& path, bool truncate)> open_file_writer_t;
+
+/**
+ * @returns a writer that writes synchronously, for when there's no loop to do it in the background
+ * @throws runtime_error when the file can't be opened
+ */
+std::unique_ptr<FileWriter> open_file_writer(const bfs::path& path, bool truncate);
+
+/// how clone_file made the copy
+enum class CloneMethod
+{
+    /// shares the data blocks of the source, copy on write
+    REFLINK,
+    /// copied inside the kernel, or shared by file systems that can
+    COPY_FILE_RANGE,
+    /// read and written
+    COPY,
+};
+
+/**
+ * Make @param to a copy of @param from, as cheaply as the file system allows: a reflink, else
+ * copy_file_range, else reading and writing it. @param to is created or truncated.
+ * @throws runtime_error when either file can't be opened or the copy fails
+ */
+CloneMethod clone_file(const bfs::path& from, const bfs::path& to);
+
+/// called once a file is copied, @param ok is false when the copy failed
+typedef std::function<void(bool ok)> clone_done_t;
+
+/// copies @param from to @param to, @param done may be called later, when it's copied in the background
+typedef std::function<void(const bfs::path& from, const bfs::path& to, clone_done_t done)> clone_file_t;
+
+/// clone_file_t copying synchronously, for when there's no loop to do it in the background
+void clone_file(const bfs::path& from, const bfs::path& to, clone_done_t done);
+
+/// called with the SHA-256 hex digest of a file, empty if it couldn't be read
+typedef std::function<void(const std::string& sha256)> hash_done_t;
+
+/// hashes the file @param path, @param done may be called later, when it's read in the background
+typedef std::function<void(const bfs::path& path, hash_done_t done)> hash_file_t;
+
+/**
+ * @returns the SHA-256 hex digest of the contents of @param path
+ * @throws runtime_error when it can't be read
+ */
+std::string sha256_file(const bfs::path& path);
+
+/// hash_file_t reading the file synchronously, for when there's no loop to do it in the background
+void hash_file(const bfs::path& path, hash_done_t done);
+
 } // end ns
@@ -0,0 +1,375 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "metrics.hpp"
+#include "jsoncons/json.hpp"
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+using namespace std;
+
+namespace cs
+{
+namespace metrics
+{
+
+namespace
+{
+
+const double s_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+bool valid_name(const string& name, bool colon)
+{
+    if (name.empty())
+        return false;
+    for (size_t i = 0; i < name.size(); ++i)
+    {
+        const char c = name[i];
+        const bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'
+            || (colon && c == ':') || (i > 0 && c >= '0' && c <= '9');
+        if (! ok)
+            return false;
+    }
+    return true;
+}
+
+const char* type_name(unsigned type)
+{
+    static const char* const names[] = {"counter", "gauge", "summary"};
+    return names[type];
+}
+
+/// @returns @param s escaped as a Prometheus label value, or as help text without @param quote
+string prom_escape(const string& s, bool quote)
+{
+    string result;
+    result.reserve(s.size());
+    for (const char c: s)
+    {
+        if (c == '\\')
+            result += "\\\\";
+        else if (c == '\n')
+            result += "\\n";
+        else if (c == '"' && quote)
+            result += "\\\"";
+        else
+            result += c;
+    }
+    return result;
+}
+
+/// write {a="b",...} with @param extra as the last label if it's not empty
+void prom_labels(ostream& os, const labels_t& labels, const string& extra = string())
+{
+    if (labels.empty() && extra.empty())
+        return;
+    os << '{';
+    bool first = true;
+    for (const auto& label: labels)
+    {
+        if (! first)
+            os << ',';
+        first = false;
+        os << label.first << "=\"" << prom_escape(label.second, true) << '"';
+    }
+    if (! extra.empty())
+        os << (first ? "" : ",") << extra;
+    os << '}';
+}
+
+void json_labels(jsoncons::json_output_handler& out, const labels_t& labels)
+{
+    out.name("labels");
+    out.begin_object();
+    for (const auto& label: labels)
+    {
+        out.name(label.first);
+        out.value(label.second);
+    }
+    out.end_object();
+}
+
+string quantile_str(double q)
+{
+    ostringstream os;
+    os << q;
+    return os.str();
+}
+
+} // end anon ns
+
+
+Histogram::Histogram(double scale):
+      m_scale(scale)
+    , m_buckets()
+    , m_count()
+    , m_sum()
+    , m_max()
+{
+    for (auto& bucket: m_buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+size_t Histogram::bucket(u64 value)
+{
+    if (value < s_sub_buckets)
+        return value;
+    // the power of two, at least 4, and the next 4 bits below it
+    const unsigned exp = 63 - __builtin_clzll(value);
+    return (exp - 3) * s_sub_buckets + ((value >> (exp - 4)) & (s_sub_buckets - 1));
+}
+
+u64 Histogram::bucket_max(size_t bucket)
+{
+    if (bucket < s_sub_buckets)
+        return bucket;
+    const unsigned exp = bucket / s_sub_buckets + 3;
+    const u64 sub = bucket % s_sub_buckets;
+    const u64 width = u64(1) << (exp - 4);
+    return ((s_sub_buckets + sub) << (exp - 4)) + (width - 1);
+}
+
+void Histogram::record(u64 value)
+{
+    m_buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+    u64 max = m_max.load(std::memory_order_relaxed);
+    while (value > max && ! m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        ;
+}
+
+u64 Histogram::quantile(double q) const
+{
+    // count the buckets instead of using m_count, they might be updated while we read them
+    array<u64, s_buckets> counts;
+    u64 total = 0;
+    for (size_t i = 0; i < s_buckets; ++i)
+    {
+        counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0)
+        return 0;
+
+    const u64 rank = std::min(total, std::max(u64(1), static_cast<u64>(std::ceil(q * total))));
+    u64 seen = 0;
+    for (size_t i = 0; i < s_buckets; ++i)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+            return std::min(bucket_max(i), max());
+    }
+    return max();
+}
+
+
+Registry& Registry::global()
+{
+    static Registry registry;
+    return registry;
+}
+
+Registry::Family& Registry::family(const std::string& name, Type type, const std::string& help, const labels_t& labels)
+{
+    auto it = m_families.find(name);
+    if (it == m_families.end())
+    {
+        if (! valid_name(name, true))
+            throw std::runtime_error(fs("metrics: invalid name \"" << name << "\""));
+        Family family;
+        family.type = type;
+        family.help = help;
+        it = m_families.emplace(name, std::move(family)).first;
+    }
+    else if (it->second.type != type)
+        throw std::runtime_error(fs("metrics: " << name << " is a " << type_name(static_cast<unsigned>(it->second.type))));
+
+    for (const auto& label: labels)
+        if (! valid_name(label.first, false) || label.first == "quantile")
+            throw std::runtime_error(fs("metrics: invalid label \"" << label.first << "\" of " << name));
+    return it->second;
+}
+
+Counter& Registry::counter(const std::string& name, const std::string& help, const labels_t& labels)
+{
+    lock_guard<mutex> lock(m_mutex);
+    auto& series = family(name, Type::COUNTER, help, labels).counters[labels];
+    if (! series)
+        series = make_unique<Counter>();
+    return *series;
+}
+
+std::shared_ptr<Counter> Registry::shared_counter(const std::string& name, const std::string& help, const labels_t& labels)
+{
+    lock_guard<mutex> lock(m_mutex);
+    Family& f = family(name, Type::COUNTER, help, labels);
+    auto& series = f.counters[labels];
+    auto shared = f.shared_counters.find(labels);
+    if (shared != f.shared_counters.end())
+    {
+        if (auto result = shared->second.lock())
+            return result;
+        // the last holder let it go and is about to remove it
+        series.reset();
+    }
+    else if (series)
+        // one of counter() isn't owned by its holders
+        return std::shared_ptr<Counter>(std::shared_ptr<Counter>(), series.get());
+
+    series = make_unique<Counter>();
+    std::shared_ptr<Counter> result(series.get(), [this, name, labels](Counter*) {
+        lock_guard<mutex> lock(m_mutex);
+        Family& f = m_families.at(name);
+        auto shared = f.shared_counters.find(labels);
+        // unless it was replaced meanwhile by one that is held
+        if (shared == f.shared_counters.end() || ! shared->second.expired())
+            return;
+        f.counters.erase(labels);
+        f.shared_counters.erase(shared);
+    });
+    f.shared_counters[labels] = result;
+    return result;
+}
+
+Gauge& Registry::gauge(const std::string& name, const std::string& help, const labels_t& labels)
+{
+    lock_guard<mutex> lock(m_mutex);
+    auto& series = family(name, Type::GAUGE, help, labels).gauges[labels];
+    if (! series)
+        series = make_unique<Gauge>();
+    return *series;
+}
+
+Histogram& Registry::histogram(const std::string& name, const std::string& help, const labels_t& labels, double scale)
+{
+    lock_guard<mutex> lock(m_mutex);
+    auto& series = family(name, Type::HISTOGRAM, help, labels).histograms[labels];
+    if (! series)
+        series = make_unique<Histogram>(scale);
+    return *series;
+}
+
+std::string Registry::json() const
+{
+    ostringstream os;
+    jsoncons::json_serializer out(os, true);
+    lock_guard<mutex> lock(m_mutex);
+    out.begin_json();
+    out.begin_object();
+    for (const auto& name_family: m_families)
+    {
+        const Family& family = name_family.second;
+        out.name(name_family.first);
+        out.begin_object();
+        out.name("type");
+        out.value(string(type_name(static_cast<unsigned>(family.type))));
+        out.name("help");
+        out.value(family.help);
+        out.name("series");
+        out.begin_array();
+        for (const auto& series: family.counters)
+        {
+            out.begin_object();
+            json_labels(out, series.first);
+            out.name("value");
+            out.value(static_cast<unsigned long long>(series.second->value()));
+            out.end_object();
+        }
+        for (const auto& series: family.gauges)
+        {
+            out.begin_object();
+            json_labels(out, series.first);
+            out.name("value");
+            out.value(static_cast<long long>(series.second->value()));
+            out.end_object();
+        }
+        for (const auto& series: family.histograms)
+        {
+            const Histogram& h = *series.second;
+            out.begin_object();
+            json_labels(out, series.first);
+            out.name("count");
+            out.value(static_cast<unsigned long long>(h.count()));
+            out.name("sum");
+            out.value(h.sum() * h.scale());
+            out.name("max");
+            out.value(h.max() * h.scale());
+            out.name("quantiles");
+            out.begin_object();
+            for (const double q: s_quantiles)
+            {
+                out.name(quantile_str(q));
+                out.value(h.quantile(q) * h.scale());
+            }
+            out.end_object();
+            out.end_object();
+        }
+        out.end_array();
+        out.end_object();
+    }
+    out.end_object();
+    out.end_json();
+    return os.str();
+}
+
+std::string Registry::prometheus() const
+{
+    ostringstream os;
+    os << setprecision(10);
+    lock_guard<mutex> lock(m_mutex);
+    for (const auto& name_family: m_families)
+    {
+        const string& name = name_family.first;
+        const Family& family = name_family.second;
+        os << "# HELP " << name << ' ' << prom_escape(family.help, false) << '\n';
+        os << "# TYPE " << name << ' ' << type_name(static_cast<unsigned>(family.type)) << '\n';
+        for (const auto& series: family.counters)
+        {
+            os << name;
+            prom_labels(os, series.first);
+            os << ' ' << series.second->value() << '\n';
+        }
+        for (const auto& series: family.gauges)
+        {
+            os << name;
+            prom_labels(os, series.first);
+            os << ' ' << series.second->value() << '\n';
+        }
+        for (const auto& series: family.histograms)
+        {
+            const Histogram& h = *series.second;
+            for (const double q: s_quantiles)
+            {
+                os << name;
+                prom_labels(os, series.first, fs("quantile=\"" << q << '"'));
+                os << ' ' << h.quantile(q) * h.scale() << '\n';
+            }
+            os << name << "_sum";
+            prom_labels(os, series.first);
+            os << ' ' << h.sum() * h.scale() << '\n';
+            os << name << "_count";
+            prom_labels(os, series.first);
+            os << ' ' << h.count() << '\n';
+        }
+    }
+    return os.str();
+}
+
+} // end ns
+} // end ns
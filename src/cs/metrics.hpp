@@ -0,0 +1,313 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "config.hpp"
+#include "int_types.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace cs
+{
+namespace metrics
+{
+
+/// label name -> value of a series
+typedef std::map<std::string, std::string> labels_t;
+
+/// a value that only goes up
+class Counter
+{
+public:
+    Counter():
+        m_value()
+    {}
+
+    void inc(u64 n = 1)
+    {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    u64 value() const
+    {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<u64> m_value;
+};
+
+
+/// a value that goes up and down, like the length of a queue
+class Gauge
+{
+public:
+    Gauge():
+        m_value()
+    {}
+
+    void set(i64 value)
+    {
+        m_value.store(value, std::memory_order_relaxed);
+    }
+
+    void add(i64 n)
+    {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    i64 value() const
+    {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<i64> m_value;
+};
+
+
+/**
+ * The part of a Gauge that one object accounts for, like its queue when the gauge is the sum of
+ * the queues. It's taken out of the gauge when the object is destroyed, and moves with it.
+ */
+class Contribution
+{
+public:
+    explicit Contribution(Gauge& gauge):
+          m_gauge(&gauge)
+        , m_value()
+    {}
+
+    Contribution(Contribution&& other):
+          m_gauge(other.m_gauge)
+        , m_value(other.m_value)
+    {
+        other.m_value = 0;
+    }
+
+    Contribution& operator=(Contribution&& other)
+    {
+        set(0);
+        m_gauge = other.m_gauge;
+        m_value = other.m_value;
+        other.m_value = 0;
+        return *this;
+    }
+
+    ~Contribution()
+    {
+        set(0);
+    }
+
+    void set(i64 value)
+    {
+        if (value == m_value)
+            return;
+        m_gauge->add(value - m_value);
+        m_value = value;
+    }
+
+    void add(i64 n)
+    {
+        m_gauge->add(n);
+        m_value += n;
+    }
+
+    i64 value() const
+    {
+        return m_value;
+    }
+
+private:
+    Gauge* m_gauge;
+    i64 m_value;
+};
+
+
+/**
+ * Distribution of values with a bounded relative error, like HdrHistogram: values under 16 have a
+ * bucket each and every power of two above is split in 16 buckets, so a quantile is off by less
+ * than 1/16 of its value over the whole u64 range. Recording is a few relaxed atomic adds.
+ *
+ * Values are recorded as integers, nanoseconds for latencies, and exported multiplied by the scale.
+ */
+class Histogram
+{
+public:
+    static const size_t s_sub_buckets = 16;
+    /// 16 small values and 16 buckets for each power of two from 2^4 to 2^63
+    static const size_t s_buckets = s_sub_buckets + (64 - 4) * s_sub_buckets;
+
+    explicit Histogram(double scale = 1.0);
+
+    void record(u64 value);
+
+    u64 count() const
+    {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+    u64 sum() const
+    {
+        return m_sum.load(std::memory_order_relaxed);
+    }
+
+    u64 max() const
+    {
+        return m_max.load(std::memory_order_relaxed);
+    }
+
+    double scale() const
+    {
+        return m_scale;
+    }
+
+    /// @returns the value @param q of the values recorded are under or equal to, 0 if there are none
+    u64 quantile(double q) const;
+
+    /// @returns the bucket of @param value
+    static size_t bucket(u64 value);
+    /// @returns the largest value that goes in @param bucket
+    static u64 bucket_max(size_t bucket);
+
+private:
+    const double m_scale;
+    std::array<std::atomic<u64>, s_buckets> m_buckets;
+    std::atomic<u64> m_count;
+    std::atomic<u64> m_sum;
+    std::atomic<u64> m_max;
+};
+
+
+/// records the nanoseconds from its construction to its destruction in a Histogram
+class ScopedTimer
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    explicit ScopedTimer(Histogram& histogram):
+          r_histogram(histogram)
+        , m_start(clock::now())
+    {}
+
+    ~ScopedTimer()
+    {
+        r_histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - m_start).count());
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Histogram& r_histogram;
+    const clock::time_point m_start;
+};
+
+
+/**
+ * The metrics of a process by name and labels. Getting a metric takes a lock, so hot paths get
+ * theirs once and keep the reference: metrics are never moved nor removed, except the shared ones
+ * of things that go away like peers, which are removed once nobody holds them. Updating them is
+ * lock free.
+ *
+ * Names and labels follow Prometheus: names are [a-zA-Z_:][a-zA-Z0-9_:]*, counters end in _total and
+ * label names are [a-zA-Z_][a-zA-Z0-9_]*.
+ */
+class Registry
+{
+public:
+    Registry() = default;
+    Registry(const Registry&) = delete;
+    Registry& operator=(const Registry&) = delete;
+
+    /// the registry the code of clearskies reports to
+    static Registry& global();
+
+    /**
+     * @returns the counter @param name with @param labels, created the first time with @param help
+     * @throws runtime_error when the name or the labels aren't valid or the name is of another type
+     */
+    Counter& counter(const std::string& name, const std::string& help, const labels_t& labels = labels_t());
+    /**
+     * @returns the counter like counter(), shared with whoever holds it with the same labels and
+     * removed once none of them does. A counter got with counter() is never removed.
+     */
+    std::shared_ptr<Counter> shared_counter(const std::string& name, const std::string& help, const labels_t& labels);
+    /// @sa counter
+    Gauge& gauge(const std::string& name, const std::string& help, const labels_t& labels = labels_t());
+    /// @sa counter, @param scale for export, given when the histogram is created
+    Histogram& histogram(const std::string& name, const std::string& help, const labels_t& labels = labels_t(), double scale = 1.0);
+
+    /**
+     * @returns the metrics as a JSON object by name, each one with its type, help and series.
+     * Histograms have the count, sum, max and quantiles 0.5, 0.9, 0.99 and 0.999, scaled.
+     */
+    std::string json() const;
+
+    /// @returns the metrics in the Prometheus text format, histograms as summaries
+    std::string prometheus() const;
+
+private:
+    enum class Type: unsigned
+    {
+        COUNTER,
+        GAUGE,
+        HISTOGRAM,
+    };
+
+    struct Family
+    {
+        Type type;
+        std::string help;
+        std::map<labels_t, std::unique_ptr<Counter>> counters;
+        std::map<labels_t, std::unique_ptr<Gauge>> gauges;
+        std::map<labels_t, std::unique_ptr<Histogram>> histograms;
+        /// the counters of shared_counter, also in counters
+        std::map<labels_t, std::weak_ptr<Counter>> shared_counters;
+    };
+
+    /// @returns the family @param name, created if it doesn't exist @throws runtime_error
+    Family& family(const std::string& name, Type type, const std::string& help, const labels_t& labels);
+
+    mutable std::mutex m_mutex;
+    std::map<std::string, Family> m_families;
+};
+
+/// Registry::global().counter(...)
+inline Counter& counter(const std::string& name, const std::string& help, const labels_t& labels = labels_t())
+{
+    return Registry::global().counter(name, help, labels);
+}
+
+inline Gauge& gauge(const std::string& name, const std::string& help, const labels_t& labels = labels_t())
+{
+    return Registry::global().gauge(name, help, labels);
+}
+
+/// a histogram of nanoseconds exported as seconds
+inline Histogram& latency(const std::string& name, const std::string& help, const labels_t& labels = labels_t())
+{
+    return Registry::global().histogram(name, help, labels, 1e-9);
+}
+
+} // end ns
+} // end ns
@@ -39,6 +39,17 @@ public:
             m_buff.push_back(static_cast<char>(w >> (8*i)));
     }
 
+    /// write big endian into a preallocated buffer of at least sizeof(W) bytes
+    template<typename W, typename T>
+    static void write_at(char* dst, T x)
+    {
+        static_assert(std::is_integral<W>::value && std::is_integral<T>::value, "argument must be integral");
+        static_assert(sizeof(W) <= sizeof(T), "Write size has to be <= of original type");
+        W w = x;
+        for (i8 i = sizeof(W) - 1; i >= 0; --i)
+            *dst++ = static_cast<char>(w >> (8*i));
+    }
+
     u8 const* begin()
     {
         return reinterpret_cast<u8 const*>(&*m_buff.begin());
@@ -16,8 +16,14 @@
  *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "protocolstate.hpp"
+#include "trace.hpp"
 #include <cstdlib>
 #include <cassert>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
 #include "ibytestream.hpp"
 #include "obytestream.hpp"
 
@@ -51,15 +57,24 @@ pair<bool, size_t> to_base10(const char* b, const char * const e)
     return res;
 }
 
-/// shift the unprocessed data in the input buffer left
-void trim_buff(std::string& buf, std::string::const_iterator from)
+/// the metrics of all the protocol states, got once
+struct ProtocolStateMetrics
 {
-    assert(from >= cbegin(buf));
-    assert(from <= cend(buf));
-    if (from == cbegin(buf))
-        return;
-    copy(from, cend(buf), begin(buf));
-    buf.resize(distance(from, cend(buf)));
+    ProtocolStateMetrics():
+          bytes_in(metrics::counter("cs_protocol_bytes_total", "Bytes received and sent by the protocol", {{"direction", "in"}}))
+        , bytes_out(metrics::counter("cs_protocol_bytes_total", "Bytes received and sent by the protocol", {{"direction", "out"}}))
+        , output_queue(metrics::gauge("cs_protocol_output_queue_buffers", "Buffers queued for output by the protocol"))
+    {}
+
+    metrics::Counter& bytes_in;
+    metrics::Counter& bytes_out;
+    metrics::Gauge& output_queue;
+};
+
+ProtocolStateMetrics& protocol_state_metrics()
+{
+    static ProtocolStateMetrics metrics;
+    return metrics;
 }
 
 } // end anon ns
@@ -77,18 +92,23 @@ void trim_buff(std::string& buf, std::string::const_iterator from)
  *  ![4 bytes size]:<50bytes>[4 bytes chunk size]:<chunk size payload bytes>
  *
  */
-MsgRstate find_message(const std::string& buff)
+MsgRstate find_message(const char* const b, const char* const e)
 {
     static const size_t prefix_sz = 6; // s[sz]:
     static const size_t sign_prefix_sz = 5;
+    assert(b <= e);
+    const size_t have = e - b;
     MsgRstate result;
-    if (buff.size() < prefix_sz)
+    if (have < prefix_sz)
+    {
+        result.need = prefix_sz;
         return result;
-    result.prefix = buff[0];
-    if (result.prefix != 'm' && result.prefix != '$' && result.prefix != 's' && result.prefix != '!')
+    }
+    result.prefix = b[0];
+    if (! is_msg_prefix(result.prefix))
         return result.set_garbage();
 
-    io::Ibytestream ibytestream(reinterpret_cast<u8 const*>(buff.data()), reinterpret_cast<u8 const*>(buff.data() + buff.size()));
+    io::Ibytestream ibytestream(reinterpret_cast<u8 const*>(b), reinterpret_cast<u8 const*>(e));
     ibytestream.skip(1);
     result.encoded_sz = ibytestream.read<u32>();
 
@@ -96,54 +116,62 @@ MsgRstate find_message(const std::string& buff)
         return result.set_garbage();
 
     result.encoded = reinterpret_cast<const char*>(ibytestream.skip(1));
-    ibytestream.skip(result.encoded_sz);
-
-    const size_t msg_have = buff.size() - prefix_sz;
-    if (msg_have >= result.encoded_sz)
+    const size_t msg_end = prefix_sz + result.encoded_sz;
+    if (! has_signature(result.prefix))
     {
-        // process message
-        if (has_signature(result.prefix))
+        if (have < msg_end)
         {
-            if (buff.size() >= prefix_sz + result.encoded_sz + sign_prefix_sz)
-            {
-                result.signature_sz = ibytestream.read<u32>();
-                if (*ibytestream.m_next != ':')
-                    return result.set_garbage();
-
-                if (result.encoded_sz + result.signature_sz > ProtocolState::s_msg_size_max)
-                    // we don't like this
-                    return result.set_garbage();
-
-                result.signature = reinterpret_cast<const char*>(ibytestream.skip(1));
-                ibytestream.skip(result.signature_sz);
-                result.found = true;
-                result.enc_sig_sz = reinterpret_cast<const char*>(ibytestream.m_next) - buff.data();
-                return result;
-            }
-            else
-                // keep reading
-                return result;
-        }
-        else
-        {
-            result.found = true;
-            result.enc_sig_sz = reinterpret_cast<const char*>(ibytestream.m_next) - buff.data();
+            // keep reading
+            result.need = msg_end;
             return result;
         }
+        ibytestream.skip(result.encoded_sz);
+        result.found = true;
+        result.enc_sig_sz = msg_end;
+        return result;
     }
-    // keep reading
+
+    if (have < msg_end + sign_prefix_sz)
+    {
+        // keep reading, at least until the signature size
+        result.need = msg_end + sign_prefix_sz;
+        return result;
+    }
+    ibytestream.skip(result.encoded_sz);
+    result.signature_sz = ibytestream.read<u32>();
+    if (*ibytestream.m_next != ':')
+        return result.set_garbage();
+
+    if (result.encoded_sz + result.signature_sz > ProtocolState::s_msg_size_max)
+        // we don't like this
+        return result.set_garbage();
+
+    const size_t sig_end = msg_end + sign_prefix_sz + result.signature_sz;
+    if (have < sig_end)
+    {
+        // keep reading
+        result.need = sig_end;
+        return result;
+    }
+    result.signature = reinterpret_cast<const char*>(ibytestream.skip(1));
+    result.found = true;
+    result.enc_sig_sz = sig_end;
     return result;
 }
 
 
-PayLoadFound find_payload(const std::string& buff)
+PayLoadFound find_payload(const char* const b, const char* const e)
 {
     PayLoadFound result;
-    static const size_t payload_prefix_sz = 5;
-    if (buff.size() < payload_prefix_sz)
+    assert(b <= e);
+    const size_t have = e - b;
+    if (have < PayLoadFound::prefix_sz)
+    {
+        result.need = PayLoadFound::prefix_sz;
         return result;
+    }
 
-    io::Ibytestream ibytestream(reinterpret_cast<u8 const*>(buff.data()), reinterpret_cast<u8 const*>(buff.data() + buff.size()));
+    io::Ibytestream ibytestream(reinterpret_cast<u8 const*>(b), reinterpret_cast<u8 const*>(e));
 
     result.data_sz = ibytestream.read<u32>();
     if (*ibytestream.m_next != ':')
@@ -152,33 +180,117 @@ PayLoadFound find_payload(const std::string& buff)
     if (result.data_sz > ProtocolState::s_payload_chunk_size_max)
         return result.set_garbage();
 
-    if (buff.size() >= result.data_sz + payload_prefix_sz)
+    if (have >= result.total_size_unchecked())
         result.found = true;
+    else
+        result.need = result.total_size_unchecked();
     return result;
 }
 
+metrics::Gauge& ProtocolState::output_queue_gauge()
+{
+    return protocol_state_metrics().output_queue;
+}
+
 size_t ProtocolState::s_msg_signature_max = 512;
 size_t ProtocolState::s_msg_size_max = 16777216;
 size_t ProtocolState::s_payload_chunk_size_max = 16777216;
 size_t ProtocolState::s_input_buff_size = 4096;
+size_t ProtocolState::s_output_coalesce_size = 16384;
+size_t ProtocolState::s_output_max_slices = 64;
+size_t ProtocolState::s_input_reserve_max = 65536;
+
+void ProtocolState::reclaim_input_buff(size_t len)
+{
+    assert(m_input_pos <= m_input_sz);
+    const size_t unprocessed = m_input_sz - m_input_pos;
+    if (unprocessed == 0)
+    {
+        m_input_sz = 0;
+        m_input_pos = 0;
+        const size_t idle_cap = max(s_input_buff_size, len);
+        if (m_input_cap > 4 * idle_cap)
+        {
+            // don't keep the room of a big message around
+            m_input_buff.reset(new char[idle_cap]);
+            m_input_cap = idle_cap;
+        }
+    }
+    // only shift when the consumed part is at least as big as what is moved, or when the data
+    // would be moved to a bigger buffer anyway, so every byte is moved a bounded number of times
+    else if (m_input_pos != 0 && (m_input_pos >= unprocessed || m_input_sz + len > m_input_cap))
+    {
+        memmove(m_input_buff.get(), m_input_buff.get() + m_input_pos, unprocessed);
+        m_input_sz = unprocessed;
+        m_input_pos = 0;
+    }
+
+    if (m_input_sz + len > m_input_cap)
+    {
+        const size_t cap = max(m_input_sz + len, 2 * m_input_cap);
+        unique_ptr<char[]> buff(new char[cap]);
+        memcpy(buff.get(), m_input_buff.get(), m_input_sz);
+        m_input_buff = move(buff);
+        m_input_cap = cap;
+    }
+}
+
+std::pair<char*, size_t> ProtocolState::input_reserve(size_t min_sz)
+{
+    reclaim_input_buff(min_sz);
+    return make_pair(m_input_buff.get() + m_input_sz, m_input_cap - m_input_sz);
+}
+
+void ProtocolState::input(const char* data, size_t len)
+{
+    char* dst = input_reserve(len).first;
+    copy(data, data + len, dst);
+    input_commit(len);
+}
 
 /**
  * Check if we have a full message then decode it and handle, otherwise wait for more data, same for
  * payload.
+ *
+ * Processed data is not removed from the input buffer but skipped with m_input_pos, the handlers get
+ * pointers directly into the buffer, where the data may have been received in place. Once the size
+ * of an incomplete message or chunk is known it's kept in m_input_need and parsing is not attempted
+ * again until enough data has arrived.
  */
-void ProtocolState::input(const char* data, size_t len)
+void ProtocolState::input_commit(size_t len)
 {
-    m_input_buff.append(data, len);
+    assert(m_input_sz + len <= m_input_cap);
+    protocol_state_metrics().bytes_in.inc(len);
+    m_input_sz += len;
     while (true)
     {
-        if (! m_read_payload)
+        const char* const begin = m_input_buff.get() + m_input_pos;
+        const char* const end = m_input_buff.get() + m_input_sz;
+        if (static_cast<size_t>(end - begin) < m_input_need)
+            // the current message or chunk is still incomplete
+            break;
+        if (begin == end)
+            // all consumed, what's left past the end is stale data that could pass for a prefix
+            break;
+
+        // between payload chunks a frame starting with a message prefix is a control message,
+        // chunk sizes are too small for their first byte to be one
+        if (! m_read_payload || is_msg_prefix(*begin))
         {
-            MsgRstate mrs = find_message(m_input_buff);
+            MsgRstate mrs = find_message(begin, end);
             if (mrs.found)
             {
+                m_input_pos += mrs.enc_sig_sz;
+                m_input_need = 0;
+                if (m_read_payload && mrs.payload())
+                {
+                    // a payload can't start inside another
+                    m_handle_error();
+                    continue;
+                }
                 try
                 {
-                    m_read_payload = mrs.payload();
+                    m_read_payload = m_read_payload || mrs.payload();
                     m_handle_msg(mrs.encoded, mrs.encoded_sz, mrs.signature, mrs.signature_sz, mrs.payload());
                 }
                 catch(...)
@@ -186,97 +298,284 @@ void ProtocolState::input(const char* data, size_t len)
                     m_handle_error();
                 }
             }
-            if (mrs.garbage)
-                m_handle_error();
-
-            trim_buff(m_input_buff, cbegin(m_input_buff) + mrs.enc_sig_sz);
-            if (mrs.enc_sig_sz == 0)
+            else
+            {
+                if (mrs.garbage)
+                    m_handle_error();
+                else
+                    m_input_need = mrs.need;
                 // no data was consumed, stop processing
                 break;
+            }
         }
         else
         {
-            if (! m_pl_found)
-                // we are not waiting for finishing a chunk
-                // read the size\n field
-                m_pl_found = find_payload(m_input_buff);
-
-            // we either found payload or not enough bytes to get the size
-            if (m_pl_found && (m_input_buff.size() >= m_pl_found.total_size()))
+            PayLoadFound plf = find_payload(begin, end);
+            if (plf)
             {
-                if (m_pl_found.data_sz != 0)
-                    m_handle_payload(&m_input_buff[PayLoadFound::prefix_sz], m_pl_found.data_sz);
+                m_input_pos += plf.total_size();
+                m_input_need = 0;
+                if (plf.data_sz != 0)
+                    m_handle_payload(begin + PayLoadFound::prefix_sz, plf.data_sz);
                 else
                 {
                     // last chunk has 0 size
                     m_handle_payload_end();
                     m_read_payload = false;
                 }
-                trim_buff(m_input_buff, cbegin(m_input_buff) + m_pl_found.total_size());
-                m_pl_found.reset();
             }
-            else if (m_pl_found.garbage)
+            else if (plf.garbage)
             {
                 m_handle_error();
                 // FIXME: review this
-                trim_buff(m_input_buff, cbegin(m_input_buff) + m_pl_found.total_size());
+                m_input_pos += min(plf.total_size_unchecked(), static_cast<size_t>(end - begin));
+                m_input_need = 0;
                 m_read_payload = false;
-                m_pl_found.reset();
             }
             else
+            {
                 // we need more payload data or even for the size
+                m_input_need = plf.need;
                 break;
+            }
         }
     }
+    if (m_input_pos + m_input_need > m_input_cap)
+        // make room for the frame, up to s_input_reserve_max at once, the buffer doubles as the rest arrives
+        reclaim_input_buff(min(m_input_need - (m_input_sz - m_input_pos), s_input_reserve_max));
 }
 
-void ProtocolState::send_msg(const std::string&& msg_encoded, bool const payload)
+void ProtocolState::send_msg(std::string&& msg_encoded, bool const payload)
 {
-    assert(m_payload_ended);
-    m_last_has_payload = payload;
-    const bool do_write = m_output_buff.empty() == true;
-    m_output_buff.emplace_back(move(msg_encoded));
-    if (do_write)
+    if (payload)
+    {
+        assert(m_payload_ended);
+        m_last_has_payload = true;
+        m_payload_ended = false;
+        enqueue_output(m_output_buff, m_output_in_flight, nullptr, 0, move(msg_encoded));
+    }
+    else if (control_ahead() || ! m_control_buff.empty() || (! m_interleave_control && ! m_payload_ended))
+        // ahead of the bulk data, behind the control messages held, or held until the end of the payload being sent
+        enqueue_output(m_control_buff, m_control_in_flight, nullptr, 0, move(msg_encoded));
+    else
+        enqueue_control_in_bulk(move(msg_encoded));
+    update_output_queue();
+    if (! m_write_in_progress)
         write_next_buff();
 }
 
-void ProtocolState::send_payload_chunk(const std::string& chunk)
+void ProtocolState::send_payload_chunk(std::string&& chunk)
 {
     using namespace cs::io;
     assert(m_last_has_payload);
-    const bool do_write = m_output_buff.empty() == true;
     m_payload_ended = chunk.empty();
 
-    Obytestream ob;
-    ob.write<u32>(chunk.size());
-    ostringstream os;
-    os << ob.m_buff << ':';
-    m_output_buff.emplace_back(os.str()); // size prefix
-    m_output_buff.emplace_back(chunk); // payload chunk
-    // writes are like a chain, only if it's empty we start a write, otherwise on_write_finished
-    // triggers writting of the next buffer.
-    if (do_write)
+    char prefix[PayLoadFound::prefix_sz];
+    Obytestream::write_at<u32>(prefix, chunk.size());
+    prefix[sizeof(u32)] = ':';
+    enqueue_output(m_output_buff, m_output_in_flight, prefix, sizeof(prefix), move(chunk));
+    if (m_payload_ended && ! m_interleave_control)
+    {
+        // the control messages held during the payload go after it
+        for (size_t i = m_control_in_flight; i < m_control_buff.size(); ++i)
+            enqueue_control_in_bulk(move(m_control_buff[i].data));
+        m_control_buff.erase(m_control_buff.begin() + m_control_in_flight, m_control_buff.end());
+    }
+    update_output_queue();
+    if (! m_write_in_progress)
         write_next_buff();
 }
 
+void ProtocolState::enqueue_control_in_bulk(std::string&& msg_encoded)
+{
+    enqueue_output(m_output_buff, m_output_in_flight, nullptr, 0, move(msg_encoded));
+    ++m_output_buff.back().control_msgs;
+    ++m_output_control;
+}
+
+void ProtocolState::send_payload_file_chunk(int fd, u64 file_id, u64 offset, size_t size, size_t read_ahead)
+{
+    using namespace cs::io;
+    assert(m_last_has_payload);
+    assert(fd != -1);
+    assert(size != 0);
+    if (! m_do_sendfile && m_do_read)
+    {
+        // the entry keeps its place in the output, references to deque elements survive insertions
+        m_payload_ended = false;
+        m_output_buff.emplace_back();
+        OutputBuffer& buf = m_output_buff.back();
+        buf.reading = true;
+        update_output_queue();
+        m_do_read(fd, file_id, offset, size, read_ahead, [this, &buf](bool ok, std::string&& data) {
+            on_read_finished(buf, ok, move(data));
+        });
+        return;
+    }
+    if (! m_do_sendfile)
+    {
+        // the transport needs the bytes, copy them
+        string chunk(size, 0);
+        size_t have = 0;
+        while (have < size)
+        {
+            const ssize_t nread = ::pread(fd, &chunk[have], size - have, offset + have);
+            if (nread < 0 && errno == EINTR)
+                continue;
+            if (nread < 0)
+                throw std::runtime_error(fs("ProtocolState::send_payload_file_chunk read error: " << strerror(errno)));
+            if (nread == 0)
+                // the file was truncated, the range announced can't be sent
+                throw std::runtime_error("ProtocolState::send_payload_file_chunk read error: the file is shorter than the range");
+            have += nread;
+        }
+        send_payload_chunk(move(chunk));
+        return;
+    }
+
+    m_payload_ended = false;
+    char prefix[PayLoadFound::prefix_sz];
+    Obytestream::write_at<u32>(prefix, size);
+    prefix[sizeof(u32)] = ':';
+    enqueue_output(m_output_buff, m_output_in_flight, prefix, sizeof(prefix), string());
+    m_output_buff.emplace_back();
+    OutputBuffer& back = m_output_buff.back();
+    back.file_fd = fd;
+    back.file_offset = offset;
+    back.file_sz = size;
+    back.continues = true;
+    update_output_queue();
+    if (! m_write_in_progress)
+        write_next_buff();
+}
+
+void ProtocolState::enqueue_output(std::deque<OutputBuffer>& queue, size_t in_flight, const char* header, size_t header_sz, std::string&& data)
+{
+    assert(header_sz <= PayLoadFound::prefix_sz);
+    // buffers not yet handed to m_do_write can still grow, small output is appended to the last one
+    if (queue.size() > in_flight
+        && ! queue.back().is_file()
+        && ! queue.back().reading
+        && queue.back().data.size() + header_sz + data.size() <= s_output_coalesce_size)
+    {
+        std::string& back = queue.back().data;
+        back.append(header, header_sz);
+        back.append(data);
+    }
+    else
+    {
+        queue.emplace_back();
+        OutputBuffer& back = queue.back();
+        copy(header, header + header_sz, back.header);
+        back.header_sz = header_sz;
+        back.data = move(data);
+    }
+    // writes are like a chain, only if none is in progress the caller starts one, otherwise
+    // on_write_finished triggers writting of everything queued meanwhile.
+}
+
 void ProtocolState::on_write_finished()
 {
+    if (trace::enabled() && m_write_started)
+        // the time the socket took to take the data
+        trace::complete("write", "socket", m_write_started, trace::now());
+    m_write_started = 0;
     m_write_in_progress = false;
-    assert(! m_output_buff.empty());
-    m_output_buff.pop_front();
-    if (! m_output_buff.empty())
+    assert(m_output_in_flight + m_control_in_flight != 0);
+    assert(m_output_in_flight <= m_output_buff.size());
+    assert(m_control_in_flight <= m_control_buff.size());
+    m_control_buff.erase(m_control_buff.begin(), m_control_buff.begin() + m_control_in_flight);
+    m_control_in_flight = 0;
+    for (size_t i = 0; i < m_output_in_flight; ++i)
+        m_output_control -= m_output_buff[i].control_msgs;
+    m_output_buff.erase(m_output_buff.begin(), m_output_buff.begin() + m_output_in_flight);
+    m_output_in_flight = 0;
+    update_output_queue();
+    // control held until the end of a payload waits for more of it
+    if (! m_output_buff.empty() || (! m_control_buff.empty() && control_ahead()))
         write_next_buff();
     else
         m_handle_empty_output_buff();
 }
 
+size_t ProtocolState::gather_output(const std::deque<OutputBuffer>& queue)
+{
+    size_t count = 0;
+    for (const OutputBuffer& buf: queue)
+    {
+        if (buf.is_file() || buf.reading)
+            // goes in its own write, or can't go yet
+            break;
+        if (m_output_slices.size() + 2 > s_output_max_slices && ! m_output_slices.empty())
+            break;
+        if (buf.header_sz)
+            m_output_slices.push_back(OutputSlice{buf.header, buf.header_sz});
+        if (! buf.data.empty())
+            m_output_slices.push_back(OutputSlice{buf.data.data(), buf.data.size()});
+        ++count;
+    }
+    return count;
+}
+
 void ProtocolState::write_next_buff()
 {
     assert(! m_write_in_progress);
-    assert(! m_output_buff.empty());
-    const string& buf = m_output_buff.front();
-    m_do_write(buf.c_str(), buf.size());
+    assert(! m_output_buff.empty() || ! m_control_buff.empty());
+    assert(m_output_in_flight == 0);
+    assert(m_control_in_flight == 0);
+    m_output_slices.clear();
+    // control goes first unless the bulk data is in the middle of a frame
+    if (control_ahead() && (m_output_buff.empty() || ! m_output_buff.front().continues))
+        m_control_in_flight = gather_output(m_control_buff);
+
+    if (m_control_in_flight == 0 && ! m_output_buff.empty() && m_output_buff.front().is_file())
+    {
+        const OutputBuffer& front = m_output_buff.front();
+        assert(m_do_sendfile);
+        m_output_in_flight = 1;
+        m_write_in_progress = true;
+        m_write_started = trace::enabled() ? trace::now() : 0;
+        protocol_state_metrics().bytes_out.inc(front.file_sz);
+        m_do_sendfile(front.file_fd, front.file_offset, front.file_sz);
+        return;
+    }
+
+    m_output_in_flight = gather_output(m_output_buff);
+    if (m_output_slices.empty())
+    {
+        // waiting for a read, or only the empty buffers of reads at the end of a file are left
+        if (m_output_in_flight == 0)
+            return;
+        m_write_in_progress = true;
+        on_write_finished();
+        return;
+    }
     m_write_in_progress = true;
+    size_t len = 0;
+    for (const OutputSlice& slice: m_output_slices)
+        len += slice.size;
+    protocol_state_metrics().bytes_out.inc(len);
+    m_write_started = trace::enabled() ? trace::now() : 0;
+    m_do_write(m_output_slices.data(), m_output_slices.size());
+}
+
+void ProtocolState::on_read_finished(OutputBuffer& buf, bool ok, std::string&& data)
+{
+    using namespace cs::io;
+    assert(buf.reading);
+    buf.reading = false;
+    if (! ok)
+        // the chunk is left out, what we send is still well framed
+        m_handle_error();
+    else if (! data.empty())
+    {
+        Obytestream::write_at<u32>(buf.header, data.size());
+        buf.header[sizeof(u32)] = ':';
+        buf.header_sz = PayLoadFound::prefix_sz;
+        buf.data = move(data);
+    }
+    if (! m_write_in_progress)
+        write_next_buff();
 }
 
 } // end ns
@@ -18,9 +18,13 @@
 #pragma once
 
 #include "config.hpp"
+#include "metrics.hpp"
 #include <string>
 #include <deque>
+#include <vector>
 #include <functional>
+#include <memory>
+#include <utility>
 #include <cassert>
 #include <stddef.h>
 
@@ -40,6 +44,12 @@ inline bool has_payload(const char c)
 }
 
 
+inline bool is_msg_prefix(const char c)
+{
+    return c == 'm' || c == '$' || c == 's' || c == '!';
+}
+
+
 struct MsgRstate
 {
     MsgRstate():
@@ -51,6 +61,7 @@ struct MsgRstate
         , signature()
         , signature_sz()
         , enc_sig_sz()
+        , need()
     {}
 
     MsgRstate& set_garbage()
@@ -79,11 +90,19 @@ struct MsgRstate
     size_t signature_sz;
     /// pos where msg ends, data is processed and destroyed until this pos
     size_t enc_sig_sz;
+    /// when not found, how many bytes the buffer needs before the message can be complete
+    size_t need;
 };
 
 
+/// @return where the message starts and its components in the input range [b, e)
+MsgRstate find_message(const char* b, const char* e);
+
 /// @return where the message starts and its components in the input buffer
-MsgRstate find_message(const std::string& buff);
+inline MsgRstate find_message(const std::string& buff)
+{
+    return find_message(buff.data(), buff.data() + buff.size());
+}
 
 
 struct PayLoadFound
@@ -92,6 +111,7 @@ struct PayLoadFound
         found()
         , garbage()
         , data_sz()
+        , need()
     {}
 
     void reset()
@@ -99,6 +119,7 @@ struct PayLoadFound
         found = false;
         garbage = false;
         data_sz = 0;
+        need = 0;
     }
 
     PayLoadFound& set_garbage()
@@ -120,17 +141,72 @@ struct PayLoadFound
     size_t total_size() const
     {
         assert(found);
+        return total_size_unchecked();
+    }
+
+    size_t total_size_unchecked() const
+    {
         return prefix_sz + data_sz;
     }
 
     bool found;
     bool garbage;
     size_t data_sz;
+    /// when not found, how many bytes the buffer needs before the chunk can be complete
+    size_t need;
     static const size_t prefix_sz = 5;
 };
 
+/// @return info about a payload chunk on the input range [b, e)
+PayLoadFound find_payload(const char* b, const char* e);
+
 /// @return info about a payload chunk on the input buffer
-PayLoadFound find_payload(const std::string& buff);
+inline PayLoadFound find_payload(const std::string& buff)
+{
+    return find_payload(buff.data(), buff.data() + buff.size());
+}
+
+/// a contiguous piece of output, the protocol state writes a sequence of them at once
+struct OutputSlice
+{
+    const char* data;
+    size_t size;
+};
+
+/// entry of the output queue: an optional frame prefix kept inline followed by data
+struct OutputBuffer
+{
+    OutputBuffer():
+        header()
+        , header_sz()
+        , data()
+        , file_fd(-1)
+        , file_offset()
+        , file_sz()
+        , continues()
+        , reading()
+        , control_msgs()
+    {}
+
+    bool is_file() const
+    {
+        return file_fd != -1;
+    }
+
+    char header[PayLoadFound::prefix_sz];
+    u8 header_sz;
+    std::string data;
+    /// when set, the buffer is a range of an open file to be sent with sendfile instead of data
+    int file_fd;
+    u64 file_offset;
+    size_t file_sz;
+    /// the buffer is the rest of a frame started by the previous one, nothing can go in between
+    bool continues;
+    /// a file chunk being read asynchronously, nothing after it can be written until it's done
+    bool reading;
+    /// messages without payload in the buffer, when they go with the bulk data
+    u32 control_msgs;
+};
 
 /**
  * @brief Base protocol state class for all protocols
@@ -140,12 +216,29 @@ PayLoadFound find_payload(const std::string& buff);
  *
  * Input data is fed and when messages are complete, handle_message is called which implementes the
  * message dispatching logic in derived classes
+ *
+ * Output goes in two channels. Messages with payload and their chunks are bulk data, written in
+ * order. Messages without payload are control. When the peer can parse them between the chunks of
+ * a payload, @sa set_interleave_control, they are written before the pending bulk data at the next
+ * frame boundary, so they don't wait behind a big transfer, but never before control messages that
+ * went with the bulk data earlier. Otherwise they go with the bulk data, after the end of the
+ * payload being sent. On input, control messages found between payload chunks are handled without
+ * ending the payload.
  */
 class ProtocolState
 {
 public:
-    /// type of callback for writing data
-    typedef std::function<void(char const*, size_t)> do_write_t;
+    /// type of callback for writing data, the slices should be written in order in a single write
+    typedef std::function<void(OutputSlice const*, size_t count)> do_write_t;
+
+    /// type of callback for writing a range of a file without copying it, @sa set_sendfile_fun
+    typedef std::function<void(int fd, u64 offset, size_t size)> do_sendfile_t;
+
+    /// called with the data of an asynchronous read, all of the range asked unless it failed
+    typedef std::function<void(bool ok, std::string&& data)> read_done_t;
+
+    /// type of callback for reading a range of a file asynchronously, @sa set_read_fun
+    typedef std::function<void(int fd, u64 file_id, u64 offset, size_t size, size_t read_ahead, read_done_t done)> do_read_t;
 
     /// called when a message is completely read on the input buffer
     typedef std::function<void(char const* msg_encoded, size_t msg_sz, char const* signature, size_t signature_sz, bool payload)> handle_msg_t;
@@ -166,17 +259,40 @@ public:
 
     static size_t s_msg_signature_max;
     static size_t s_msg_size_max;
+    /// must stay under 0x21000000, so the size of a chunk can't start with a message prefix
     static size_t s_payload_chunk_size_max;
     /// initial size of the input buffer
     static size_t s_input_buff_size;
+    /**
+     * most room made ahead for the rest of an incomplete frame, bigger frames grow the buffer as
+     * they arrive so a peer can't make us allocate a whole frame with its header only
+     */
+    static size_t s_input_reserve_max;
+    /// queued output smaller than this is appended to the last pending buffer instead of queued apart
+    static size_t s_output_coalesce_size;
+    /// maximum number of slices passed in a single write
+    static size_t s_output_max_slices;
     ProtocolState():
-          m_input_buff()
+          m_input_buff(new char[s_input_buff_size])
+        , m_input_sz()
+        , m_input_cap(s_input_buff_size)
+        , m_input_pos()
+        , m_input_need()
         , m_output_buff()
+        , m_output_in_flight()
+        , m_control_buff()
+        , m_control_in_flight()
+        , m_interleave_control(false)
+        , m_output_control()
+        , m_output_slices()
         , m_last_has_payload()
         , m_payload_ended(true)
         , m_read_payload(false)
-        , m_pl_found()
-        , m_do_write([](char const*, size_t) { assert(false); })
+        , m_output_queue(output_queue_gauge())
+        , m_write_started()
+        , m_do_write([](OutputSlice const*, size_t) { assert(false); })
+        , m_do_sendfile()
+        , m_do_read()
         , m_write_in_progress(false)
         , m_handle_empty_output_buff()
         , m_handle_msg()
@@ -184,7 +300,6 @@ public:
         , m_handle_payload_end()
         , m_handle_error([]() { assert(false);} )
     {
-        m_input_buff.reserve(s_input_buff_size);
     }
 
 #if 0
@@ -206,42 +321,159 @@ public:
      */
     void input(const char* data, size_t len);
 
-    void send_msg(const std::string&& msg_sig_encoded, bool payload);
-    void send_payload_chunk(const std::string& chunk);
+    /**
+     * @returns free space of at least @param min_sz bytes at the end of the input buffer, so the event
+     * library can receive into it without copying. Valid until the next input call.
+     */
+    std::pair<char*, size_t> input_reserve(size_t min_sz);
+
+    /// process @param len bytes received into the space given by input_reserve
+    void input_commit(size_t len);
+
+    /// @returns the allocated size of the input buffer
+    size_t input_capacity() const
+    {
+        return m_input_cap;
+    }
+
+    /// queue a message, control when it has no @param payload, @sa ProtocolState
+    void send_msg(std::string&& msg_sig_encoded, bool payload);
+    void send_payload_chunk(std::string&& chunk);
+
+    /**
+     * queue a payload chunk of @param size bytes, size > 0, read from @param fd at @param offset
+     * The file goes out with the sendfile function when the connection has one, otherwise it's read
+     * into a regular chunk, asynchronously with the read function when there's one. The next
+     * @param read_ahead bytes of the file are going to be sent too, they can be read in advance.
+     * @param file_id tells the file apart from the ones opened before with the same fd, @sa
+     * core::protocol::TxFile::id. The file must stay open until the output buffer is empty.
+     */
+    void send_payload_file_chunk(int fd, u64 file_id, u64 offset, size_t size, size_t read_ahead = 0);
 
     void set_write_fun(do_write_t do_write)
     {
         m_do_write = do_write;
     }
 
+    /**
+     * Enable zero-copy file payloads for transports that send the bytes unmodified, when finished
+     * on_write_finished should be called as for regular writes. An empty function disables it.
+     */
+    void set_sendfile_fun(do_sendfile_t do_sendfile)
+    {
+        m_do_sendfile = do_sendfile;
+    }
+
+    /// @returns true if file payloads are sent without copying them through memory
+    bool sendfile_capable() const
+    {
+        return static_cast<bool>(m_do_sendfile);
+    }
+
+    /// let control messages go between payload chunks, once the peer said it parses them there
+    void set_interleave_control(bool interleave)
+    {
+        m_interleave_control = interleave;
+        if (! m_write_in_progress && ! m_control_buff.empty() && control_ahead())
+            write_next_buff();
+    }
+
+    /**
+     * Read the file payloads that are copied with @param do_read instead of blocking on the disk,
+     * the output after a chunk waits for its read. The reads in flight must not complete once this
+     * object is gone. An empty function reads synchronously.
+     */
+    void set_read_fun(do_read_t do_read)
+    {
+        m_do_read = do_read;
+    }
+
 
     /// to be called by the event library on write when the last write finished
     void on_write_finished();
 
     /**
-     * will write the next output buffer by calling the write function @sa m_do_write
+     * will write the queued output buffers by calling the write function @sa m_do_write
      * @post m_write_in_progress will be true
      */
     void write_next_buff();
 
 
 private:
-    /// internal input buffer accumulating data until it can be processed
-    std::string m_input_buff;
-    /// queue of buffers to write, we write from front to back, new appended to back, when wrote,
+    /// queue @param data preceded by @param header_sz bytes of @param header in @param queue
+    static void enqueue_output(std::deque<OutputBuffer>& queue, size_t in_flight, const char* header, size_t header_sz, std::string&& data);
+
+    /// add the slices of the queued buffers that can go in the current write, @returns how many
+    size_t gather_output(const std::deque<OutputBuffer>& queue);
+
+    /// queue the control message @param msg_encoded with the bulk data
+    void enqueue_control_in_bulk(std::string&& msg_encoded);
+
+    /// @returns whether m_control_buff can be written ahead of the bulk data
+    bool control_ahead() const
+    {
+        return m_interleave_control && m_output_control == 0;
+    }
+
+    /// the asynchronous read of @param buf finished
+    void on_read_finished(OutputBuffer& buf, bool ok, std::string&& data);
+
+    /// make room for @param len more bytes, discarding the consumed data when it's cheap to do so
+    void reclaim_input_buff(size_t len);
+
+    /// gauge of the buffers queued for output by all the instances
+    static metrics::Gauge& output_queue_gauge();
+    /// count the buffers queued now in the gauge
+    void update_output_queue()
+    {
+        m_output_queue.set(static_cast<i64>(m_output_buff.size() + m_control_buff.size()));
+    }
+
+    /// internal input buffer accumulating data until it can be processed, not value initialized
+    /// since it's received into directly
+    std::unique_ptr<char[]> m_input_buff;
+    /// bytes of m_input_buff holding data
+    size_t m_input_sz;
+    /// allocated size of m_input_buff
+    size_t m_input_cap;
+    /// data before this position in m_input_buff was already processed
+    size_t m_input_pos;
+    /// bytes needed after m_input_pos before the current message or chunk is complete, so partial
+    /// frames are not parsed again on every read
+    size_t m_input_need;
+    /// queue of bulk buffers to write, we write from front to back, new appended to back, when wrote,
     /// removed from front.
-    std::deque<std::string> m_output_buff;
+    std::deque<OutputBuffer> m_output_buff;
+    /// number of buffers at the front of m_output_buff being written
+    size_t m_output_in_flight;
+    /// queue of control messages, written before m_output_buff at its next frame boundary
+    std::deque<OutputBuffer> m_control_buff;
+    /// number of buffers at the front of m_control_buff being written
+    size_t m_control_in_flight;
+    /// control messages can be written between payload chunks
+    bool m_interleave_control;
+    /// control messages queued in m_output_buff
+    size_t m_output_control;
+    /// slices of the current write, kept to reuse its storage
+    std::vector<OutputSlice> m_output_slices;
 
     bool m_last_has_payload;
     bool m_payload_ended;
 
     /// true if we are reading a payload section, false if we are reading or expecting a message
     bool m_read_payload;
-    PayLoadFound m_pl_found;
+    /// our buffers in output_queue_gauge
+    metrics::Contribution m_output_queue;
+    /// trace timestamp of the write in progress, 0 when it's not traced
+    u64 m_write_started;
 
 public:
     /// callback used to write data
     do_write_t m_do_write;
+    /// callback used to send file ranges, empty when the transport can't
+    do_sendfile_t m_do_sendfile;
+    /// callback used to read file chunks in the background, empty to read them right away
+    do_read_t m_do_read;
     bool m_write_in_progress;
 
     handle_empty_output_buff_t m_handle_empty_output_buff;
@@ -0,0 +1,142 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ratelimit.hpp"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace cs
+{
+namespace ratelimit
+{
+
+void TokenBucket::set_rate(u64 rate, u64 burst, clock::time_point now)
+{
+    refill(now);
+    const bool was_unlimited = m_rate == 0;
+    m_rate = rate;
+    m_burst = burst ? burst : rate;
+    // a new limit starts with a full bucket, a changed one keeps its debt
+    if (m_rate == 0)
+        m_tokens = 0;
+    else if (was_unlimited)
+        m_tokens = m_burst;
+    else
+        m_tokens = min(m_tokens, static_cast<double>(m_burst));
+}
+
+void TokenBucket::refill(clock::time_point now)
+{
+    if (m_rate && now > m_last)
+    {
+        const double secs = chrono::duration<double>(now - m_last).count();
+        m_tokens = min(m_tokens + secs * m_rate, static_cast<double>(m_burst));
+    }
+    m_last = now;
+}
+
+u64 TokenBucket::wait(clock::time_point now)
+{
+    if (m_rate == 0)
+        return 0;
+    refill(now);
+    if (m_tokens > 0)
+        return 0;
+    // rounded up, and a ms more so the timer doesn't fire just before the debt is paid
+    return static_cast<u64>(ceil(-m_tokens * 1000 / m_rate)) + 1;
+}
+
+void TokenBucket::consume(u64 bytes, clock::time_point now)
+{
+    if (m_rate == 0)
+        return;
+    refill(now);
+    m_tokens -= bytes;
+}
+
+
+Governor::Governor():
+      m_mutex()
+    , m_global()
+    , m_shares()
+    , m_peers()
+{
+}
+
+void Governor::set_global_limit(Direction dir, u64 rate, u64 burst)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_global[static_cast<size_t>(dir)].set_rate(rate, burst, clock::now());
+}
+
+void Governor::set_share_limit(const string& share_id, Direction dir, u64 rate, u64 burst)
+{
+    lock_guard<mutex> lock(m_mutex);
+    set_limit(m_shares, share_id, dir, rate, burst);
+}
+
+void Governor::set_peer_limit(const string& peer_id, Direction dir, u64 rate, u64 burst)
+{
+    lock_guard<mutex> lock(m_mutex);
+    set_limit(m_peers, peer_id, dir, rate, burst);
+}
+
+void Governor::set_limit(map<string, buckets_t>& buckets, const string& key, Direction dir, u64 rate, u64 burst)
+{
+    auto i = buckets.find(key);
+    if (i == buckets.end())
+    {
+        if (rate == 0)
+            return;
+        i = buckets.emplace(key, buckets_t()).first;
+    }
+    i->second[static_cast<size_t>(dir)].set_rate(rate, burst, clock::now());
+    if (all_of(i->second.begin(), i->second.end(), [](const TokenBucket& bucket) { return bucket.unlimited(); }))
+        buckets.erase(i);
+}
+
+u64 Governor::wait(Direction dir, const string& share_id, const string& peer_id, clock::time_point now)
+{
+    const size_t d = static_cast<size_t>(dir);
+    lock_guard<mutex> lock(m_mutex);
+    u64 result = m_global[d].wait(now);
+    auto share_i = m_shares.find(share_id);
+    if (share_i != m_shares.end())
+        result = max(result, share_i->second[d].wait(now));
+    auto peer_i = m_peers.find(peer_id);
+    if (peer_i != m_peers.end())
+        result = max(result, peer_i->second[d].wait(now));
+    return result;
+}
+
+void Governor::consume(Direction dir, const string& share_id, const string& peer_id, u64 bytes, clock::time_point now)
+{
+    const size_t d = static_cast<size_t>(dir);
+    lock_guard<mutex> lock(m_mutex);
+    m_global[d].consume(bytes, now);
+    auto share_i = m_shares.find(share_id);
+    if (share_i != m_shares.end())
+        share_i->second[d].consume(bytes, now);
+    auto peer_i = m_peers.find(peer_id);
+    if (peer_i != m_peers.end())
+        peer_i->second[d].consume(bytes, now);
+}
+
+} // end ns
+} // end ns
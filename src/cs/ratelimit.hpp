@@ -0,0 +1,122 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "config.hpp"
+#include "int_types.h"
+#include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace cs
+{
+namespace ratelimit
+{
+
+enum class Direction: unsigned
+{
+    UPLOAD = 0,
+    DOWNLOAD,
+    MAX
+};
+
+/**
+ * Token bucket with a rate in bytes per second, 0 means unlimited. Transfers go when there are
+ * tokens and are charged afterwards, so a transfer bigger than the tokens left puts the bucket in
+ * debt and the next one waits until it's paid.
+ */
+class TokenBucket
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    TokenBucket():
+          m_rate()
+        , m_burst()
+        , m_tokens()
+        , m_last()
+    {}
+
+    /// @param burst bytes that can accumulate, 0 is a second worth of @param rate
+    void set_rate(u64 rate, u64 burst, clock::time_point now);
+
+    u64 rate() const
+    {
+        return m_rate;
+    }
+
+    bool unlimited() const
+    {
+        return m_rate == 0;
+    }
+
+    /// @returns ms until a transfer can go, 0 if it can now
+    u64 wait(clock::time_point now);
+
+    /// charge @param bytes transferred
+    void consume(u64 bytes, clock::time_point now);
+
+private:
+    void refill(clock::time_point now);
+
+    u64 m_rate;
+    u64 m_burst;
+    /// negative when in debt
+    double m_tokens;
+    clock::time_point m_last;
+};
+
+
+/**
+ * Limits the payload transfers of a daemon with token buckets for all of them, for each share and
+ * for each peer, in each direction. A transfer has to fit in all its buckets. Thread safe, the
+ * limits can be changed at any time.
+ */
+class Governor
+{
+public:
+    typedef TokenBucket::clock clock;
+
+    Governor();
+
+    /// @param rate in bytes per second, 0 removes the limit @sa TokenBucket::set_rate
+    void set_global_limit(Direction dir, u64 rate, u64 burst = 0);
+    void set_share_limit(const std::string& share_id, Direction dir, u64 rate, u64 burst = 0);
+    void set_peer_limit(const std::string& peer_id, Direction dir, u64 rate, u64 burst = 0);
+
+    /// @returns ms until payload of @param share_id and @param peer_id can go in @param dir, 0 if it can now
+    u64 wait(Direction dir, const std::string& share_id, const std::string& peer_id, clock::time_point now = clock::now());
+
+    /// charge @param bytes of payload transferred
+    void consume(Direction dir, const std::string& share_id, const std::string& peer_id, u64 bytes, clock::time_point now = clock::now());
+
+private:
+    typedef std::array<TokenBucket, static_cast<size_t>(Direction::MAX)> buckets_t;
+
+    static void set_limit(std::map<std::string, buckets_t>& buckets, const std::string& key, Direction dir, u64 rate, u64 burst);
+
+    std::mutex m_mutex;
+    buckets_t m_global;
+    /// only the shares and peers with a limit have buckets
+    std::map<std::string, buckets_t> m_shares;
+    std::map<std::string, buckets_t> m_peers;
+};
+
+} // end ns
+} // end ns
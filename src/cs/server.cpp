@@ -16,6 +16,8 @@
  *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "server.hpp"
+#include "file.hpp"
+#include "utils.hpp"
 
 using namespace std;
 
@@ -25,6 +27,23 @@ namespace cs
 namespace server
 {
 
+std::string psk_identity(const std::string& share_id, const std::string& access)
+{
+    return share_id + ":" + access;
+}
+
+bool parse_psk_identity(const std::string& identity, std::string& share_id, std::string& access)
+{
+    const auto sep = identity.rfind(':');
+    if (sep == string::npos)
+        return false;
+    access = identity.substr(sep + 1);
+    if (access != "rw" && access != "ro")
+        return false;
+    share_id = identity.substr(0, sep);
+    return true;
+}
+
 std::string Server::attach_share(const std::string& share_path, const std::string& dbpath)
 {
     string share_id;
@@ -59,6 +78,219 @@ std::vector<std::string> Server::shares() const
     return result;
 }
 
+void Server::download(const std::string& checksum, u64 size, const bfs::path& path, const std::vector<std::string>& connections)
+{
+    lock_guard<recursive_mutex> lock(m_downloads_mutex);
+    if (downloading(checksum))
+        throw std::runtime_error(fs("Server::download error, " << checksum << " is already being downloaded"));
+
+    vector<local_file_t> copies = local_copies(checksum, size, path);
+    if (! copies.empty())
+    {
+        m_reusing.insert(checksum);
+        reuse_local(checksum, size, path, connections, move(copies));
+        return;
+    }
+    fetch(checksum, size, path, connections);
+}
+
+void Server::fetch(const std::string& checksum, u64 size, const bfs::path& path, const std::vector<std::string>& connections)
+{
+    // the pieces are written in place as they arrive
+    {
+        bfs::ofstream os(path, ios_base::out | ios_base::binary);
+        if (! os)
+            throw std::runtime_error(fs("Server::download error, couldn't create " << path));
+    }
+    bfs::resize_file(path, size);
+
+    auto request = [this, checksum, path](const string& connection, u64 offset, u64 length)
+    {
+        // the reply goes to this download whatever else the connection is fetching
+        auto done = [this, connection](u32 stream, const string& checksum, bool found)
+        {
+            handle_get_done(connection, stream, checksum, found);
+        };
+        // the peers are removed before their connection goes, @sa connection_closed
+        Connection* conn = find_connection(connection);
+        if (! conn)
+            throw std::runtime_error(fs("Server::download error, no connection " << connection));
+        return conn->m_protocol.get_file(checksum, path, offset, length, done);
+    };
+    auto cancel = [this](const string& connection, u32 stream)
+    {
+        Connection* conn = find_connection(connection);
+        if (conn)
+            conn->m_protocol.cancel_get(stream);
+    };
+    auto res = m_downloads.emplace(checksum, make_unique<core::download::Download>(checksum, size, request, cancel));
+    m_download_paths[checksum] = path;
+    for (const auto& connection: connections)
+    {
+        // the pieces are requested as ranges
+        Connection* conn = find_connection(connection);
+        if (! conn || ! conn->m_protocol.peer_has(core::protocol::feature::pipelined_get))
+            continue;
+        res.first->second->add_peer(connection);
+    }
+    check_download(res.first);
+}
+
+std::vector<Server::local_file_t> Server::local_copies(const std::string& checksum, u64 size, const bfs::path& path)
+{
+    vector<local_file_t> result;
+    for (auto& x: m_shares)
+    {
+        core::share::Share& share = x.second;
+        try
+        {
+            for (const auto& mfile: share.get_mfiles_by_content(checksum))
+            {
+                const bfs::path from = share.fullpath(mfile.path);
+                if (mfile.size != size || (bfs::exists(path) && bfs::equivalent(from, path)))
+                    continue;
+                result.emplace_back(x.first, mfile);
+            }
+        }
+        catch (const std::runtime_error&)
+        {
+            // a candidate vanished or couldn't be read, try the next share or download it
+        }
+    }
+    return result;
+}
+
+void Server::reuse_local(const std::string& checksum, u64 size, const bfs::path& path, const std::vector<std::string>& connections, std::vector<local_file_t> copies)
+{
+    if (copies.empty())
+    {
+        m_reusing.erase(checksum);
+        try
+        {
+            fetch(checksum, size, path, connections);
+        }
+        catch (const std::runtime_error&)
+        {
+            m_handle_download_done(checksum, false);
+        }
+        return;
+    }
+
+    const local_file_t copy = copies.front();
+    copies.erase(copies.begin());
+    auto cloned = [this, checksum, size, path, connections, copies, copy](bool ok)
+    {
+        lock_guard<recursive_mutex> lock(m_downloads_mutex);
+        bool reused = false;
+        try
+        {
+            // changed while it was copied
+            reused = ok && ! m_shares.at(copy.first).was_updated(copy.second) && bfs::file_size(path) == size;
+        }
+        catch (const std::runtime_error&)
+        {
+        }
+        if (! reused)
+        {
+            reuse_local(checksum, size, path, connections, copies);
+            return;
+        }
+        m_reusing.erase(checksum);
+        m_handle_download_done(checksum, true);
+    };
+    m_handle_clone_file(m_shares.at(copy.first).fullpath(copy.second.path), path, cloned);
+}
+
+std::string Server::psk(const std::string& identity) const
+{
+    string share_id;
+    string access;
+    if (! parse_psk_identity(identity, share_id, access))
+        return string();
+    const auto share_i = m_shares.find(share_id);
+    if (share_i == m_shares.end())
+        return string();
+    const core::share::Share& share = share_i->second;
+    return utils::hex_to_bin<string>(access == "rw" ? share.m_psk_rw : share.m_psk_ro);
+}
+
+void Server::tick_downloads()
+{
+    lock_guard<recursive_mutex> lock(m_downloads_mutex);
+    for (auto i = m_downloads.begin(); i != m_downloads.end();)
+    {
+        auto next = i;
+        ++next;
+        i->second->tick();
+        check_download(i);
+        i = next;
+    }
+}
+
+void Server::connection_closed(const std::string& connection)
+{
+    lock_guard<recursive_mutex> lock(m_downloads_mutex);
+    for (auto i = m_downloads.begin(); i != m_downloads.end();)
+    {
+        auto next = i;
+        ++next;
+        if (i->second->has_peer(connection))
+        {
+            i->second->remove_peer(connection);
+            check_download(i);
+        }
+        i = next;
+    }
+}
+
+Connection* Server::find_connection(const std::string& id)
+{
+    auto i = m_connections.find(id);
+    if (i == m_connections.end())
+        return nullptr;
+    return i->second.get();
+}
+
+void Server::handle_get_done(const std::string& connection, u32 stream, const std::string& checksum, bool found)
+{
+    lock_guard<recursive_mutex> lock(m_downloads_mutex);
+    auto i = m_downloads.find(checksum);
+    if (i == m_downloads.end())
+        return;
+    i->second->request_done(connection, stream, found);
+    check_download(i, connection);
+}
+
+void Server::check_download(std::map<std::string, std::unique_ptr<core::download::Download>>::iterator i, const std::string& connection)
+{
+    if (! i->second->done() && i->second->peers())
+        return;
+    const string checksum = i->first;
+    const bool complete = i->second->done();
+    const bfs::path path = m_download_paths.at(checksum);
+    m_downloads.erase(i);
+    m_download_paths.erase(checksum);
+    if (! complete)
+    {
+        m_handle_download_done(checksum, false);
+        return;
+    }
+
+    // the pieces are ranges, which aren't verified as they arrive
+    m_verifying.insert(checksum);
+    auto verified = [this, checksum](const string& sha256)
+    {
+        lock_guard<recursive_mutex> lock(m_downloads_mutex);
+        m_verifying.erase(checksum);
+        m_handle_download_done(checksum, sha256 == checksum);
+    };
+    Connection* conn = connection.empty() ? nullptr : find_connection(connection);
+    if (conn)
+        conn->m_protocol.m_handle_hash_file(path, verified);
+    else
+        hash_file(path, verified);
+}
+
 
 
 } // end ns
@@ -18,12 +18,16 @@
 
 #pragma once
 #include "config.hpp"
+#include "file.hpp"
 #include "core/share.hpp"
 #include "core/serverinfo.hpp"
 #include "protocolstate.hpp"
 #include "core/protocol.hpp"
+#include "core/download.hpp"
 #include <string>
 #include <map>
+#include <mutex>
+#include <set>
 
 namespace cs
 {
@@ -31,6 +35,15 @@ namespace cs
 namespace server
 {
 
+/**
+ * @returns the PSK identity a peer authenticates with for @param share_id, @param access is "rw"
+ * for the read write key of the share or "ro" for the read only one @sa tls::Stream
+ */
+std::string psk_identity(const std::string& share_id, const std::string& access);
+
+/// split a psk_identity, @returns false when @param identity isn't one
+bool parse_psk_identity(const std::string& identity, std::string& share_id, std::string& access);
+
 
 /**
  * Base class for connections to peers
@@ -67,16 +80,26 @@ public:
 class Server 
 {
 public:
+    /// called when a download finished, @param complete is false when no peer could provide it
+    typedef std::function<void(const std::string& checksum, bool complete)> handle_download_done_t;
+
     Server(): 
         m_shares()
         , m_connections()
+        , m_downloads()
+        , m_download_paths()
+        , m_verifying()
+        , m_reusing()
+        , m_downloads_mutex()
         , m_server_info()
+        , m_handle_download_done([](const std::string&, bool) {})
+        , m_handle_clone_file([](const bfs::path& from, const bfs::path& to, clone_done_t done) { clone_file(from, to, done); })
     {}
 
+    virtual ~Server() = default;
+
     Server(const Server&) = delete;
     Server& operator=(const Server&) = delete;
-    Server(Server&&) = default;
-    Server& operator=(Server&&) = default;
 
     /**
      * We attach a path and a database holding the configuration for this share. If @param dbpath is
@@ -91,14 +114,87 @@ public:
     /// @returns the list of known share_ids
     std::vector<std::string> shares() const;
 
+    /**
+     * Fetch the file with @param checksum of @param size into @param path, in pieces requested to
+     * all the given @param connections at once, @sa core::download::Download. The replies to these
+     * requests go to the download, the connections to peers that don't pipeline Gets are left out.
+     * Once it has all the pieces the file is hashed, with the m_handle_hash_file of the connection
+     * that sent the last one, and m_handle_download_done is called with whether it matches.
+     * Connections @sa find_connection doesn't know are left out as well.
+     *
+     * When a file with the same content is in any of the shares it's copied from there instead,
+     * @sa reuse_local, and m_handle_download_done is called once it's copied.
+     *
+     * @throws runtime_error when the file is already being downloaded or path can't be created
+     */
+    void download(const std::string& checksum, u64 size, const bfs::path& path, const std::vector<std::string>& connections);
+
+    /// @returns true while the file with @param checksum is being downloaded or verified
+    bool downloading(const std::string& checksum) const
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_downloads_mutex);
+        return m_downloads.find(checksum) != m_downloads.end() || m_verifying.count(checksum) || m_reusing.count(checksum);
+    }
+
+    /// give the requests of slow peers to others, to be called periodically
+    void tick_downloads();
+
+    /// @param connection is going away, its pieces are requested to the other peers of the downloads
+    void connection_closed(const std::string& connection);
+
+    /// @returns the pre-shared key of a psk_identity, empty if the share is unknown
+    std::string psk(const std::string& identity) const;
+
 protected:
+    /// @returns the connection with identifier @param id, nullptr if unknown
+    virtual Connection* find_connection(const std::string& id);
+    /// @param connection finished the pipelined Get @param stream
+    void handle_get_done(const std::string& connection, u32 stream, const std::string& checksum, bool found);
+    /**
+     * end the download @param i if it's complete or has no peers left, a complete one is verified
+     * first with the hash function of @param connection if given, synchronously otherwise
+     */
+    void check_download(std::map<std::string, std::unique_ptr<core::download::Download>>::iterator i, const std::string& connection = std::string());
+
+    /// a file of a share, by share id
+    typedef std::pair<std::string, core::share::MFile> local_file_t;
+    /**
+     * @returns the files of the shares with @param checksum and @param size, that aren't @param path.
+     * Files modified since they were checksummed are left out @sa core::share::Share::get_mfiles_by_content.
+     */
+    std::vector<local_file_t> local_copies(const std::string& checksum, u64 size, const bfs::path& path);
+    /**
+     * Materialize @param path from the first of @param copies with m_handle_clone_file, reflinked
+     * or copied @sa cs::clone_file. When it changed while it was copied the next one is tried, and
+     * once none is left the file is fetched from @param connections.
+     */
+    void reuse_local(const std::string& checksum, u64 size, const bfs::path& path, const std::vector<std::string>& connections, std::vector<local_file_t> copies);
+    /**
+     * request the pieces of the file to @param connections
+     * @throws runtime_error when @param path can't be created
+     */
+    void fetch(const std::string& checksum, u64 size, const bfs::path& path, const std::vector<std::string>& connections);
+
     /// share id to @sa core::share::Share, the share knows the path
     std::map<std::string, core::share::Share> m_shares;
     /// connection identifier to Connection
     std::map<std::string, std::unique_ptr<Connection>> m_connections;
+    /// downloads in progress by checksum
+    std::map<std::string, std::unique_ptr<core::download::Download>> m_downloads;
+    /// the file each download in m_downloads is written to
+    std::map<std::string, bfs::path> m_download_paths;
+    /// downloads with all their pieces whose file is being hashed
+    std::set<std::string> m_verifying;
+    /// downloads being copied from a file of the shares
+    std::set<std::string> m_reusing;
+    /// guards m_downloads, m_download_paths, m_verifying and m_reusing, the requests are sent with it held
+    mutable std::recursive_mutex m_downloads_mutex;
 
 public:
     core::ServerInfo m_server_info;
+    handle_download_done_t m_handle_download_done;
+    /// copies the files of the shares that downloads reuse, synchronously by default
+    clone_file_t m_handle_clone_file;
 
 };
 
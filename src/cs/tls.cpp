@@ -0,0 +1,439 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "tls.hpp"
+#include "polarssl/dhm.h"
+#include "polarssl/net.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+
+/**
+ * TLS 1.2 AES-GCM suites with pre-shared keys, the DHE one first for forward secrecy. PolarSSL
+ * has ECDHE-PSK with CBC only.
+ */
+const int s_ciphersuites[] = {
+    TLS_DHE_PSK_WITH_AES_128_GCM_SHA256,
+    TLS_PSK_WITH_AES_128_GCM_SHA256,
+    0
+};
+
+} // end ns
+
+namespace cs
+{
+namespace tls
+{
+
+void Context::SessionDeleter::operator()(ssl_session* session) const
+{
+    ssl_session_free(session);
+    delete session;
+}
+
+Context::Context():
+      m_psk_lookup()
+    , m_mutex()
+    , m_entropy()
+    , m_ctr_drbg()
+    , m_ticket_keys()
+    , m_sessions()
+{
+    static const char personalization[] = "clearskies_core";
+    entropy_init(&m_entropy);
+    if (ctr_drbg_init(&m_ctr_drbg, entropy_func, &m_entropy,
+        reinterpret_cast<const unsigned char*>(personalization), sizeof(personalization) - 1) != 0)
+    {
+        entropy_free(&m_entropy);
+        throw TLSError("Context: can't seed the random generator");
+    }
+}
+
+Context::~Context()
+{
+    entropy_free(&m_entropy);
+}
+
+int Context::random(void* ctx, unsigned char* output, size_t len)
+{
+    Context& context = *static_cast<Context*>(ctx);
+    lock_guard<mutex> lock(context.m_mutex);
+    return ctr_drbg_random(&context.m_ctr_drbg, output, len);
+}
+
+ssl_ticket_keys* Context::ticket_keys(const string& identity)
+{
+    lock_guard<mutex> lock(m_mutex);
+    auto& keys = m_ticket_keys[identity];
+    if (! keys)
+    {
+        unique_ptr<ssl_ticket_keys> new_keys(new ssl_ticket_keys());
+        unsigned char key[16];
+        if (ctr_drbg_random(&m_ctr_drbg, new_keys->key_name, sizeof(new_keys->key_name)) != 0
+            || ctr_drbg_random(&m_ctr_drbg, key, sizeof(key)) != 0
+            || aes_setkey_enc(&new_keys->enc, key, 128) != 0
+            || aes_setkey_dec(&new_keys->dec, key, 128) != 0
+            || ctr_drbg_random(&m_ctr_drbg, new_keys->mac_key, sizeof(new_keys->mac_key)) != 0)
+        {
+            m_ticket_keys.erase(identity);
+            throw TLSError("Context: can't create the ticket keys");
+        }
+        keys = move(new_keys);
+    }
+    return keys.get();
+}
+
+void Context::save_session(const string& key, const ssl_context& ssl)
+{
+    unique_ptr<ssl_session, SessionDeleter> session(new ssl_session());
+    if (ssl_get_session(&ssl, session.get()) != 0)
+        return;
+    lock_guard<mutex> lock(m_mutex);
+    m_sessions[key] = move(session);
+}
+
+bool Context::load_session(const string& key, ssl_context& ssl)
+{
+    lock_guard<mutex> lock(m_mutex);
+    auto session_i = m_sessions.find(key);
+    return session_i != m_sessions.end() && ssl_set_session(&ssl, session_i->second.get()) == 0;
+}
+
+
+Stream::Stream(Context& ctx, const string& identity, const string& psk, const string& peer):
+      m_handle_input()
+    , m_handle_write_finished()
+    , m_handle_established([]() {})
+    , m_handle_error()
+    , r_ctx(ctx)
+    , m_ssl()
+    , m_do_write()
+    , m_identity(identity)
+    , m_session_key(identity + "@" + peer)
+    , m_input()
+    , m_input_len()
+    , m_output()
+    , m_output_writing()
+    , m_writing()
+    , m_record()
+    , m_pending()
+    , m_write_pending()
+    , m_write_queued()
+    , m_write_sent()
+    , m_plaintext(s_record_size)
+    , m_established()
+    , m_resumed()
+    , m_failed()
+{
+    init(SSL_IS_CLIENT);
+    const auto psk_data = reinterpret_cast<const unsigned char*>(psk.data());
+    const auto identity_data = reinterpret_cast<const unsigned char*>(identity.data());
+    if (ssl_set_psk(&m_ssl, psk_data, psk.size(), identity_data, identity.size()) != 0
+        || ssl_set_hostname(&m_ssl, identity.c_str()) != 0
+        || ssl_set_session_tickets(&m_ssl, SSL_SESSION_TICKETS_ENABLED) != 0)
+    {
+        ssl_free(&m_ssl);
+        throw TLSError("Stream: can't set up the client");
+    }
+    r_ctx.load_session(m_session_key, m_ssl);
+}
+
+Stream::Stream(Context& ctx):
+      m_handle_input()
+    , m_handle_write_finished()
+    , m_handle_established([]() {})
+    , m_handle_error()
+    , r_ctx(ctx)
+    , m_ssl()
+    , m_do_write()
+    , m_identity()
+    , m_session_key()
+    , m_input()
+    , m_input_len()
+    , m_output()
+    , m_output_writing()
+    , m_writing()
+    , m_record()
+    , m_pending()
+    , m_write_pending()
+    , m_write_queued()
+    , m_write_sent()
+    , m_plaintext(s_record_size)
+    , m_established()
+    , m_resumed()
+    , m_failed()
+{
+    init(SSL_IS_SERVER);
+    ssl_set_psk_cb(&m_ssl, &Stream::psk, this);
+    ssl_set_sni(&m_ssl, &Stream::sni, this);
+    try
+    {
+        // until the client names its identity the tickets can't be decrypted
+        m_ssl.ticket_keys = r_ctx.ticket_keys(string());
+    }
+    catch (...)
+    {
+        ssl_free(&m_ssl);
+        throw;
+    }
+    if (ssl_set_dh_param(&m_ssl, POLARSSL_DHM_RFC3526_MODP_2048_P, POLARSSL_DHM_RFC3526_MODP_2048_G) != 0
+        || ssl_set_session_tickets(&m_ssl, SSL_SESSION_TICKETS_ENABLED) != 0)
+    {
+        m_ssl.ticket_keys = nullptr;
+        ssl_free(&m_ssl);
+        throw TLSError("Stream: can't set up the server");
+    }
+}
+
+Stream::~Stream()
+{
+    // the ticket keys belong to the context
+    m_ssl.ticket_keys = nullptr;
+    ssl_free(&m_ssl);
+}
+
+void Stream::init(int endpoint)
+{
+    if (ssl_init(&m_ssl) != 0)
+        throw TLSError("Stream: ssl_init failed");
+    ssl_set_endpoint(&m_ssl, endpoint);
+    // the pre-shared key authenticates both ends
+    ssl_set_authmode(&m_ssl, SSL_VERIFY_NONE);
+    ssl_set_rng(&m_ssl, &Context::random, &r_ctx);
+    ssl_set_bio(&m_ssl, &Stream::recv, this, &Stream::send, this);
+    // GCM needs TLS 1.2
+    ssl_set_min_version(&m_ssl, SSL_MAJOR_VERSION_3, SSL_MINOR_VERSION_3);
+    ssl_set_ciphersuites(&m_ssl, s_ciphersuites);
+}
+
+void Stream::start()
+{
+    process();
+    flush();
+}
+
+void Stream::input(const char* data, size_t len)
+{
+    if (m_failed)
+        return;
+    m_input = data;
+    m_input_len = len;
+    process();
+    // anything left is dropped, PolarSSL buffers partial records and stops reading only on errors
+    m_input = nullptr;
+    m_input_len = 0;
+    flush();
+}
+
+void Stream::write(const OutputSlice* slices, size_t count)
+{
+    if (m_failed)
+        return;
+    if (! m_established)
+    {
+        for (size_t i = 0; i < count; ++i)
+            m_pending.append(slices[i].data, slices[i].size);
+        m_write_pending = true;
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (! encrypt(slices[i].data, slices[i].size))
+            return fail();
+    }
+    if (! m_record.empty() && ! encrypt_record())
+        return fail();
+    m_write_queued = true;
+    flush();
+}
+
+void Stream::on_write_finished()
+{
+    m_writing = false;
+    const bool sent = m_write_sent;
+    m_write_sent = false;
+    flush();
+    if (sent)
+        m_handle_write_finished();
+}
+
+int Stream::recv(void* ctx, unsigned char* buf, size_t len)
+{
+    Stream& stream = *static_cast<Stream*>(ctx);
+    if (stream.m_input_len == 0)
+        return POLARSSL_ERR_NET_WANT_READ;
+    const size_t n = min(len, stream.m_input_len);
+    memcpy(buf, stream.m_input, n);
+    stream.m_input += n;
+    stream.m_input_len -= n;
+    return static_cast<int>(n);
+}
+
+int Stream::send(void* ctx, const unsigned char* buf, size_t len)
+{
+    Stream& stream = *static_cast<Stream*>(ctx);
+    stream.m_output.append(reinterpret_cast<const char*>(buf), len);
+    return static_cast<int>(len);
+}
+
+int Stream::sni(void* ctx, ssl_context* ssl, const unsigned char* name, size_t len)
+{
+    Stream& stream = *static_cast<Stream*>(ctx);
+    const string identity(reinterpret_cast<const char*>(name), len);
+    try
+    {
+        if (! stream.r_ctx.m_psk_lookup || stream.r_ctx.m_psk_lookup(identity).empty())
+            return -1;
+        ssl->ticket_keys = stream.r_ctx.ticket_keys(identity);
+    }
+    catch (...)
+    {
+        // PolarSSL is C, nothing can be thrown through it
+        return -1;
+    }
+    stream.m_identity = identity;
+    return 0;
+}
+
+int Stream::psk(void* ctx, ssl_context* ssl, const unsigned char* identity, size_t len)
+{
+    Stream& stream = *static_cast<Stream*>(ctx);
+    // the name sent selected the ticket keys, the key has to be of the same identity
+    if (stream.m_identity.empty() || stream.m_identity.compare(0, string::npos, reinterpret_cast<const char*>(identity), len) != 0)
+        return -1;
+    string key;
+    try
+    {
+        key = stream.r_ctx.m_psk_lookup(stream.m_identity);
+    }
+    catch (...)
+    {
+        return -1;
+    }
+    if (key.empty())
+        return -1;
+    return ssl_set_psk(ssl, reinterpret_cast<const unsigned char*>(key.data()), key.size(), identity, len);
+}
+
+void Stream::process()
+{
+    if (! m_established)
+    {
+        while (m_ssl.state != SSL_HANDSHAKE_OVER)
+        {
+            const int ret = ssl_handshake_step(&m_ssl);
+            // the handshake parameters are gone once it's over
+            if (m_ssl.handshake && m_ssl.handshake->resume)
+                m_resumed = true;
+            if (ret == POLARSSL_ERR_NET_WANT_READ)
+                return;
+            if (ret != 0)
+                return fail();
+        }
+        m_established = true;
+        if (m_ssl.endpoint == SSL_IS_CLIENT)
+            r_ctx.save_session(m_session_key, m_ssl);
+        m_handle_established();
+        if (m_write_pending)
+        {
+            m_write_pending = false;
+            const OutputSlice pending = { m_pending.data(), m_pending.size() };
+            write(&pending, 1);
+            string().swap(m_pending);
+        }
+    }
+
+    while (! m_failed)
+    {
+        const int ret = ssl_read(&m_ssl, reinterpret_cast<unsigned char*>(m_plaintext.data()), m_plaintext.size());
+        if (ret == POLARSSL_ERR_NET_WANT_READ || ret == 0)
+            return;
+        if (ret < 0)
+            return fail();
+        m_handle_input(m_plaintext.data(), static_cast<size_t>(ret));
+    }
+}
+
+bool Stream::encrypt(const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n;
+        if (m_record.empty() && len >= s_record_size)
+        {
+            // a full record straight from the data
+            const int ret = ssl_write(&m_ssl, reinterpret_cast<const unsigned char*>(data), s_record_size);
+            if (ret <= 0)
+                return false;
+            n = static_cast<size_t>(ret);
+        }
+        else
+        {
+            // small writes and the ends of large ones are packed with the following data
+            n = min(len, s_record_size - m_record.size());
+            m_record.append(data, n);
+            if (m_record.size() == s_record_size && ! encrypt_record())
+                return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool Stream::encrypt_record()
+{
+    const auto data = reinterpret_cast<const unsigned char*>(m_record.data());
+    size_t written = 0;
+    while (written < m_record.size())
+    {
+        const int ret = ssl_write(&m_ssl, data + written, m_record.size() - written);
+        if (ret <= 0)
+            return false;
+        written += static_cast<size_t>(ret);
+    }
+    m_record.clear();
+    return true;
+}
+
+void Stream::flush()
+{
+    if (m_writing || m_output.empty() || m_failed)
+        return;
+    m_output_writing.swap(m_output);
+    m_output.clear();
+    m_write_sent = m_write_queued;
+    m_write_queued = false;
+    m_writing = true;
+    m_do_write(m_output_writing.data(), m_output_writing.size());
+}
+
+void Stream::fail()
+{
+    if (m_failed)
+        return;
+    m_failed = true;
+    m_handle_error();
+}
+
+} // end ns
+} // end ns
@@ -0,0 +1,204 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "config.hpp"
+#include "protocolstate.hpp"
+#include "utils.hpp"
+#include "polarssl/ctr_drbg.h"
+#include "polarssl/entropy.h"
+#include "polarssl/ssl.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace cs
+{
+namespace tls
+{
+
+DEFINE_RE_EXCEPTION(TLSError);
+
+/**
+ * State shared by the TLS streams of a peer: the random generator, the keys of the session tickets
+ * we issue and the sessions we can resume as a client. It's thread safe, so the loops of a daemon
+ * share it and a ticket issued on one is accepted on the others.
+ */
+class Context
+{
+public:
+    /// @returns the key of a PSK identity, empty when it's unknown
+    typedef std::function<std::string(const std::string& identity)> psk_lookup_t;
+
+    /// @throws TLSError when the random generator can't be seeded
+    Context();
+    ~Context();
+
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    /// keys of the clients of server streams, called from the loops of the streams
+    psk_lookup_t m_psk_lookup;
+
+private:
+    friend class Stream;
+
+    struct SessionDeleter
+    {
+        void operator()(ssl_session* session) const;
+    };
+
+    /// f_rng for PolarSSL
+    static int random(void* ctx, unsigned char* output, size_t len);
+    /// @returns the keys of the tickets for @param identity, created the first time
+    ssl_ticket_keys* ticket_keys(const std::string& identity);
+    /// keep the session of the client @param ssl to resume it with @param key
+    void save_session(const std::string& key, const ssl_context& ssl);
+    /// set the session saved with @param key in @param ssl, @returns whether there was one
+    bool load_session(const std::string& key, ssl_context& ssl);
+
+    std::mutex m_mutex;
+    entropy_context m_entropy;
+    ctr_drbg_context m_ctr_drbg;
+    /// tickets are encrypted with the keys of the identity they are issued for
+    std::map<std::string, std::unique_ptr<ssl_ticket_keys>> m_ticket_keys;
+    std::map<std::string, std::unique_ptr<ssl_session, SessionDeleter>> m_sessions;
+};
+
+
+/**
+ * TLS over a byte stream, between a transport and a ProtocolState. Peers authenticate each other
+ * with a pre-shared key, the identity is sent as server name too so the server encrypts the ticket
+ * with keys of that identity, and resuming the session authenticates for it only. Records are
+ * encrypted with AES-GCM.
+ *
+ * The transport passes what it reads to input and calls on_write_finished when the write started
+ * with the write function is done. Writes of plaintext before the handshake ends are held back.
+ */
+class Stream
+{
+public:
+    /// send @param len bytes of ciphertext, the data stays valid until on_write_finished
+    typedef std::function<void(const char* data, size_t len)> do_write_t;
+    /// plaintext recieved, valid during the call only
+    typedef std::function<void(const char* data, size_t len)> handle_input_t;
+
+    /**
+     * client stream authenticating as @param identity with the key @param psk. The session is
+     * resumed when there's one saved for @param identity and @param peer.
+     * @throws TLSError
+     */
+    Stream(Context& ctx, const std::string& identity, const std::string& psk, const std::string& peer = std::string());
+    /// server stream, the keys are looked up with Context::m_psk_lookup @throws TLSError
+    explicit Stream(Context& ctx);
+    ~Stream();
+
+    Stream(const Stream&) = delete;
+    Stream& operator=(const Stream&) = delete;
+
+    void set_write_fun(do_write_t do_write)
+    {
+        m_do_write = std::move(do_write);
+    }
+
+    /// start the handshake, the client sends its hello. The server waits for it.
+    void start();
+    /// process @param len bytes of ciphertext recieved
+    void input(const char* data, size_t len);
+    /// encrypt and send the @param slices, m_handle_write_finished is called once they are sent
+    void write(const OutputSlice* slices, size_t count);
+    /// the transport finished the last write
+    void on_write_finished();
+
+    bool established() const
+    {
+        return m_established;
+    }
+
+    /// @returns true when the handshake resumed a session instead of exchanging keys
+    bool resumed() const
+    {
+        return m_resumed;
+    }
+
+    /// @returns the PSK identity the peer is authenticated for once established
+    const std::string& identity() const
+    {
+        return m_identity;
+    }
+
+    handle_input_t m_handle_input;
+    /// the plaintext of write was sent
+    std::function<void()> m_handle_write_finished;
+    /// the handshake finished, called before any plaintext is handled
+    std::function<void()> m_handle_established;
+    /// the handshake failed or a record couldn't be decrypted, or the peer closed the session
+    std::function<void()> m_handle_error;
+
+    /// largest record plaintext, writes are packed in records of this size
+    static const size_t s_record_size = SSL_MAX_CONTENT_LEN;
+
+private:
+    void init(int endpoint);
+    static int recv(void* ctx, unsigned char* buf, size_t len);
+    static int send(void* ctx, const unsigned char* buf, size_t len);
+    static int sni(void* ctx, ssl_context* ssl, const unsigned char* name, size_t len);
+    static int psk(void* ctx, ssl_context* ssl, const unsigned char* identity, size_t len);
+    /// advance the handshake, then decrypt the records recieved
+    void process();
+    /// encrypt @param len bytes, @returns false on error
+    bool encrypt(const char* data, size_t len);
+    /// encrypt what's in m_record
+    bool encrypt_record();
+    /// send the ciphertext produced unless a write is in progress
+    void flush();
+    void fail();
+
+    Context& r_ctx;
+    ssl_context m_ssl;
+    do_write_t m_do_write;
+    /// client: identity we authenticate as. server: the name the client sent, then the identity.
+    std::string m_identity;
+    /// client: key for the saved session
+    std::string m_session_key;
+    /// ciphertext being processed, PolarSSL keeps what it reads of a partial record
+    const char* m_input;
+    size_t m_input_len;
+    /// ciphertext to send, and the one being sent
+    std::string m_output;
+    std::string m_output_writing;
+    bool m_writing;
+    /// plaintext packed into a full record
+    std::string m_record;
+    /// plaintext written before the handshake finished
+    std::string m_pending;
+    bool m_write_pending;
+    /// the ciphertext of the last write is in m_output / m_output_writing
+    bool m_write_queued;
+    bool m_write_sent;
+    /// buffer for the decrypted records
+    std::vector<char> m_plaintext;
+    bool m_established;
+    bool m_resumed;
+    bool m_failed;
+};
+
+} // end ns
+} // end ns
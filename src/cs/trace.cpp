@@ -0,0 +1,278 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "trace.hpp"
+#include "jsoncons/json.hpp"
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+using namespace std;
+
+namespace cs
+{
+namespace trace
+{
+
+#ifdef CS_TRACE
+std::atomic<bool> s_enabled(false);
+#endif
+
+namespace
+{
+
+/// an event of a ring, its fields are atomic because the export reads them while they are written
+struct Event
+{
+    std::atomic<const char*> name;
+    std::atomic<const char*> category;
+    std::atomic<u64> begin;
+    std::atomic<u64> end;
+};
+
+/// the events of a thread, written by that thread only
+class Ring
+{
+public:
+    /// keeps the last @param events, plus a slot for the one a push may be writing during an export
+    Ring(u32 tid, size_t events):
+          m_tid(tid)
+        , m_name()
+        , m_capacity(events + 1)
+        , m_events(new Event[m_capacity])
+        , m_written(0)
+        , m_cleared(0)
+    {
+        for (size_t i = 0; i < m_capacity; ++i)
+        {
+            m_events[i].name.store(nullptr, std::memory_order_relaxed);
+            m_events[i].category.store(nullptr, std::memory_order_relaxed);
+            m_events[i].begin.store(0, std::memory_order_relaxed);
+            m_events[i].end.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void push(const char* name, const char* category, u64 begin, u64 end)
+    {
+        const u64 i = m_written.load(std::memory_order_relaxed);
+        // the count of the last push is visible before the slot is overwritten, see write_chrome_json
+        std::atomic_thread_fence(std::memory_order_release);
+        Event& e = m_events[i % m_capacity];
+        e.name.store(name, std::memory_order_relaxed);
+        e.category.store(category, std::memory_order_relaxed);
+        e.begin.store(begin, std::memory_order_relaxed);
+        e.end.store(end, std::memory_order_relaxed);
+        m_written.store(i + 1, std::memory_order_release);
+    }
+
+    const u32 m_tid;
+    /// guarded by the mutex of the registry
+    std::string m_name;
+    const size_t m_capacity;
+    std::unique_ptr<Event[]> m_events;
+    /// events ever pushed, the event i is at i % m_capacity
+    std::atomic<u64> m_written;
+    /// events before this one were cleared
+    std::atomic<u64> m_cleared;
+};
+
+/// the rings of all the threads that recorded, kept after the threads end so their events can be exported
+struct Registry
+{
+    Registry():
+          mutex()
+        , rings()
+        , buffer_events(1 << 16)
+    {}
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Ring>> rings;
+    size_t buffer_events;
+};
+
+Registry& registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+thread_local Ring* t_ring = nullptr;
+/// the name of the thread until it has a ring
+thread_local std::string t_name;
+
+Ring& thread_ring()
+{
+    if (unlikely(! t_ring))
+    {
+        Registry& r = registry();
+        lock_guard<mutex> lock(r.mutex);
+        r.rings.emplace_back(make_shared<Ring>(static_cast<u32>(r.rings.size() + 1), r.buffer_events));
+        t_ring = r.rings.back().get();
+        t_ring->m_name = move(t_name);
+    }
+    return *t_ring;
+}
+
+/// an event copied out of a ring
+struct Copy
+{
+    const char* name;
+    const char* category;
+    u64 begin;
+    u64 end;
+};
+
+} // end anon ns
+
+
+void set_enabled(bool enabled)
+{
+#ifdef CS_TRACE
+    s_enabled.store(enabled, std::memory_order_relaxed);
+#else
+    UNUSED(enabled);
+#endif
+}
+
+u64 now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void complete(const char* name, const char* category, u64 begin, u64 end)
+{
+    thread_ring().push(name, category, begin, end);
+}
+
+void set_thread_name(const std::string& name)
+{
+    if (! t_ring)
+    {
+        // the ring is allocated when the thread records
+        t_name = name;
+        return;
+    }
+    Registry& r = registry();
+    lock_guard<mutex> lock(r.mutex);
+    t_ring->m_name = name;
+}
+
+void set_buffer_events(size_t events)
+{
+    Registry& r = registry();
+    lock_guard<mutex> lock(r.mutex);
+    r.buffer_events = std::max(size_t(1), events);
+}
+
+void clear()
+{
+    Registry& r = registry();
+    lock_guard<mutex> lock(r.mutex);
+    for (auto& ring: r.rings)
+        ring->m_cleared.store(ring->m_written.load(std::memory_order_acquire), std::memory_order_relaxed);
+}
+
+void write_chrome_json(std::ostream& os)
+{
+    const unsigned long long pid = ::getpid();
+    jsoncons::json_serializer out(os);
+    out.begin_json();
+    out.begin_object();
+    out.name("displayTimeUnit");
+    out.value(string("ns"));
+    out.name("traceEvents");
+    out.begin_array();
+
+    Registry& r = registry();
+    lock_guard<mutex> lock(r.mutex);
+    vector<Copy> events;
+    for (const auto& ring: r.rings)
+    {
+        const unsigned long long tid = ring->m_tid;
+        if (! ring->m_name.empty())
+        {
+            out.begin_object();
+            out.name("name");
+            out.value(string("thread_name"));
+            out.name("ph");
+            out.value(string("M"));
+            out.name("pid");
+            out.value(pid);
+            out.name("tid");
+            out.value(tid);
+            out.name("args");
+            out.begin_object();
+            out.name("name");
+            out.value(ring->m_name);
+            out.end_object();
+            out.end_object();
+        }
+
+        const u64 written = ring->m_written.load(std::memory_order_acquire);
+        const u64 events_kept = ring->m_capacity - 1;
+        const u64 first = std::max(ring->m_cleared.load(std::memory_order_relaxed), written > events_kept ? written - events_kept : 0);
+        events.clear();
+        for (u64 i = first; i < written; ++i)
+        {
+            const Event& e = ring->m_events[i % ring->m_capacity];
+            events.push_back(Copy{e.name.load(std::memory_order_relaxed), e.category.load(std::memory_order_relaxed),
+                e.begin.load(std::memory_order_relaxed), e.end.load(std::memory_order_relaxed)});
+        }
+        // the copies are read before the count, so an event overwritten while it was copied is
+        // counted in it
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // the event being pushed now overwrites the slot of written_after - capacity
+        const u64 written_after = ring->m_written.load(std::memory_order_acquire);
+        const u64 valid = written_after + 1 > ring->m_capacity ? written_after + 1 - ring->m_capacity : 0;
+        for (u64 i = std::max(first, valid); i < written; ++i)
+        {
+            const Copy& e = events[i - first];
+            out.begin_object();
+            out.name("name");
+            out.value(string(e.name));
+            out.name("cat");
+            out.value(string(e.category));
+            out.name("ph");
+            out.value(string("X"));
+            out.name("ts");
+            out.value(e.begin / 1000.0);
+            out.name("dur");
+            out.value((e.end - e.begin) / 1000.0);
+            out.name("pid");
+            out.value(pid);
+            out.name("tid");
+            out.value(tid);
+            out.end_object();
+        }
+    }
+    out.end_array();
+    out.end_object();
+    out.end_json();
+}
+
+std::string chrome_json()
+{
+    ostringstream os;
+    write_chrome_json(os);
+    return os.str();
+}
+
+} // end ns
+} // end ns
@@ -0,0 +1,128 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "config.hpp"
+#include "int_types.h"
+#include <atomic>
+#include <ostream>
+#include <string>
+
+/**
+ * @file trace.hpp
+ * Spans of time spent in the hot paths, recorded per thread and exported in the Chrome trace format,
+ * which chrome://tracing and Perfetto open.
+ *
+ * Spans are compiled in when CS_TRACE is defined, which the build does unless it's configured with
+ * -D cs_trace=0, and are recorded only while tracing is enabled at runtime. When it's disabled a
+ * span costs a load and a branch. Each thread records into a ring buffer of its own, so the oldest
+ * events of a thread are dropped once it's full and recording never takes a lock.
+ */
+
+#define CS_TRACE_CONCAT_(a, b) a ## b
+#define CS_TRACE_CONCAT(a, b) CS_TRACE_CONCAT_(a, b)
+
+#ifdef CS_TRACE
+/// trace the rest of the scope as @param name in @param category, both string literals
+#define CS_TRACE_SPAN(name, category) ::cs::trace::Span CS_TRACE_CONCAT(cs_trace_span_, __LINE__)((name), (category))
+#else
+#define CS_TRACE_SPAN(name, category) do {} while (false)
+#endif
+
+namespace cs
+{
+namespace trace
+{
+
+#ifdef CS_TRACE
+
+extern std::atomic<bool> s_enabled;
+
+/// @returns whether spans are recorded
+inline bool enabled()
+{
+    return unlikely(s_enabled.load(std::memory_order_relaxed));
+}
+
+#else
+
+inline constexpr bool enabled()
+{
+    return false;
+}
+
+#endif
+
+/// start or stop recording, events recorded before are kept, it does nothing without CS_TRACE
+void set_enabled(bool enabled);
+
+/// @returns a timestamp in ns of a monotonic clock
+u64 now();
+
+/**
+ * record an event of the calling thread from @param begin to @param end, timestamps of now().
+ * @param name and @param category have to outlive the trace, like string literals.
+ */
+void complete(const char* name, const char* category, u64 begin, u64 end);
+
+/// name the calling thread in the trace
+void set_thread_name(const std::string& name);
+
+/// events each thread keeps, for the buffers of the threads that start recording after the call
+void set_buffer_events(size_t events);
+
+/// forget the events recorded so far
+void clear();
+
+/**
+ * write the events recorded as a Chrome trace JSON object. Threads may go on recording meanwhile,
+ * the events they overwrite while it's written are left out.
+ */
+void write_chrome_json(std::ostream& os);
+
+/// @sa write_chrome_json
+std::string chrome_json();
+
+
+/// records the time from its construction to its destruction if tracing is enabled when it's constructed
+class Span
+{
+public:
+    Span(const char* name, const char* category):
+          m_name(enabled() ? name : nullptr)
+        , m_category(category)
+        , m_begin(m_name ? now() : 0)
+    {}
+
+    ~Span()
+    {
+        if (m_name)
+            complete(m_name, m_category, m_begin, now());
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+private:
+    /// null when not recording
+    const char* const m_name;
+    const char* const m_category;
+    const u64 m_begin;
+};
+
+} // end ns
+} // end ns
@@ -17,8 +17,9 @@
  */
 #include "vclock.hpp"
 #include "config.hpp"
+#include <algorithm>
 #include <limits>
-#include <unordered_set>
+#include <stdexcept>
 
 
 using namespace std;
@@ -26,47 +27,185 @@ using namespace std;
 namespace cs
 {
 
+namespace
+{
 
-/**
- * A vclock desc is descendant from parent when All values(desc)  >= values(parent)
- */
-bool Vclock::is_descendant(const Vclock& parent) const
+void put_varint(string& out, u64 x)
+{
+    while (x >= 0x80)
+    {
+        out.push_back(static_cast<char>((x & 0x7f) | 0x80));
+        x >>= 7;
+    }
+    out.push_back(static_cast<char>(x));
+}
+
+u64 get_varint(const u8*& p, const u8* end)
+{
+    u64 x = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        if (p == end)
+            throw std::runtime_error("Vclock::unpack error, truncated");
+        const u8 b = *p++;
+        x |= static_cast<u64>(b & 0x7f) << shift;
+        if (! (b & 0x80))
+            return x;
+    }
+    throw std::runtime_error("Vclock::unpack error, varint too long");
+}
+
+} // end anon ns
+
+
+PeerId PeerIds::intern(const std::string& peer)
 {
-    unordered_set<string> keys;
-    for (const auto& x: m_clk)
-        keys.insert(x.first);
-    for (const auto& x: parent.m_clk)
-        keys.insert(x.first);
+    auto i = m_ids.find(peer);
+    if (i != m_ids.end())
+        return i->second;
+    const PeerId id = static_cast<PeerId>(m_names.size());
+    m_names.push_back(peer);
+    m_ids.emplace(peer, id);
+    return id;
+}
 
-    for (const auto& key: keys)
+void PeerIds::add(PeerId id, const std::string& peer)
+{
+    auto i = m_ids.find(peer);
+    if (i != m_ids.end())
     {
-        u64 desc_val = 0;
-        u64 paren_val = 0;
-        const auto di = m_clk.find(key);
-        if (di != m_clk.end())
-            desc_val = di->second;
+        if (i->second != id)
+            throw std::runtime_error(fs("PeerIds::add error, " << peer << " already has id " << i->second));
+        return;
+    }
+    if (! id || (id < m_names.size() && ! m_names[id].empty()))
+        throw std::runtime_error(fs("PeerIds::add error, id " << id << " is taken"));
+    if (id >= m_names.size())
+        m_names.resize(id + 1);
+    m_names[id] = peer;
+    m_ids.emplace(peer, id);
+}
 
-        const auto pi = parent.m_clk.find(key);
-        if (pi != parent.m_clk.end())
-            paren_val = pi->second;
+bool PeerIds::find(const std::string& peer, PeerId& id) const
+{
+    auto i = m_ids.find(peer);
+    if (i == m_ids.end())
+        return false;
+    id = i->second;
+    return true;
+}
+
+const std::string& PeerIds::name(PeerId id) const
+{
+    if (! id || id >= m_names.size() || m_names[id].empty())
+        throw std::out_of_range(fs("PeerIds::name error, unknown id " << id));
+    return m_names[id];
+}
 
-        if (desc_val < paren_val)
+
+Vclock::Vclock(const std::map<std::string, u64>& clk, PeerIds& ids):
+    m_clk()
+{
+    for (const auto& x: clk)
+        merge(ids.intern(x.first), x.second);
+}
+
+/**
+ * A vclock desc is descendant from parent when All values(desc)  >= values(parent), both are walked
+ * in id order at once
+ */
+bool Vclock::is_descendant(const Vclock& parent) const
+{
+    auto d = m_clk.begin();
+    const auto de = m_clk.end();
+    for (const Entry& p: parent.m_clk)
+    {
+        while (d != de && d->id < p.id)
+            ++d;
+        const u64 desc_val = (d != de && d->id == p.id) ? d->value : 0;
+        if (desc_val < p.value)
             return false;
     }
     return true;
 }
 
-u64 Vclock::operator[](const std::string& key) const
+u64 Vclock::operator[](PeerId id) const
 {
-    const auto i = m_clk.find(key);
-    if (i != m_clk.end())
-        return i->second;
+    const auto i = std::lower_bound(m_clk.begin(), m_clk.end(), id, [](const Entry& e, PeerId id) { return e.id < id; });
+    if (i != m_clk.end() && i->id == id)
+        return i->value;
     return 0u;
 }
 
-void Vclock::increment(const std::string& key, u64 val)
+std::map<std::string, u64> Vclock::get_values(const PeerIds& ids) const
+{
+    map<string, u64> result;
+    for (const Entry& e: m_clk)
+        result.emplace(ids.name(e.id), e.value);
+    return result;
+}
+
+void Vclock::increment(PeerId id, u64 val)
+{
+    auto i = lower_bound(id);
+    if (i != m_clk.end() && i->id == id)
+        i->value += val;
+    else
+        m_clk.insert(i, Entry{id, val});
+}
+
+void Vclock::merge(PeerId id, u64 val)
+{
+    auto i = lower_bound(id);
+    if (i != m_clk.end() && i->id == id)
+        i->value = max(i->value, val);
+    else
+        m_clk.insert(i, Entry{id, val});
+}
+
+std::string Vclock::pack() const
+{
+    string result;
+    result.reserve(m_clk.size() * 4);
+    PeerId prev = 0;
+    for (const Entry& e: m_clk)
+    {
+        put_varint(result, e.id - prev);
+        put_varint(result, e.value);
+        prev = e.id;
+    }
+    return result;
+}
+
+Vclock Vclock::unpack(const void* data, size_t size)
+{
+    Vclock result;
+    const u8* p = static_cast<const u8*>(data);
+    const u8* end = p + size;
+    u64 id = 0;
+    while (p != end)
+    {
+        const u64 delta = get_varint(p, end);
+        // ids start at 1 and are strictly increasing
+        if (! delta)
+            throw std::runtime_error("Vclock::unpack error, ids out of order");
+        id += delta;
+        if (id > numeric_limits<PeerId>::max())
+            throw std::runtime_error("Vclock::unpack error, id out of range");
+        result.m_clk.push_back(Entry{static_cast<PeerId>(id), get_varint(p, end)});
+    }
+    return result;
+}
+
+bool Vclock::operator==(const Vclock& o) const
+{
+    return m_clk.size() == o.m_clk.size() && std::equal(m_clk.begin(), m_clk.end(), o.m_clk.begin(),
+        [](const Entry& a, const Entry& b) { return a.id == b.id && a.value == b.value; });
+}
+
+Vclock::entries_t::iterator Vclock::lower_bound(PeerId id)
 {
-    m_clk[key] += val;
+    return std::lower_bound(m_clk.begin(), m_clk.end(), id, [](const Entry& e, PeerId id) { return e.id < id; });
 }
 
 
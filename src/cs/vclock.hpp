@@ -18,60 +18,119 @@
 
 #pragma once
 #include "int_types.h"
+#include <boost/container/small_vector.hpp>
 #include <map>
-#include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 
 namespace cs
 {
 
-class VclockImpl;
+/// a peer id interned to a small integer, @sa PeerIds
+typedef u32 PeerId;
+
+/**
+ * Interns peer ids to small integers so clocks are compact and compared without touching strings.
+ * The ids are local, a share keeps its own table so the clocks it stores stay valid across runs.
+ */
+class PeerIds
+{
+public:
+    PeerIds():
+        m_ids()
+        , m_names(1)
+    {}
+
+    /// @returns the id of @param peer, assigning the next one if it's new
+    PeerId intern(const std::string& peer);
+
+    /**
+     * add @param peer with an id assigned elsewhere, as when loading them from storage
+     * @throws runtime_error if the peer or the id are already taken by others
+     */
+    void add(PeerId id, const std::string& peer);
+
+    /// @returns false if @param peer has no id yet
+    bool find(const std::string& peer, PeerId& id) const;
+
+    /// @returns the peer of @param id @throws out_of_range if it's not known
+    const std::string& name(PeerId id) const;
+
+    /// @returns the largest id in use, 0 if none
+    PeerId last() const
+    {
+        return static_cast<PeerId>(m_names.size() - 1);
+    }
+
+private:
+    std::unordered_map<std::string, PeerId> m_ids;
+    /// peer by id, 0 is not used
+    std::vector<std::string> m_names;
+};
 
 /**
  * A Vclock is descendant of another when changes are a consequence of another, thus the changes are
  * newer and not in conflict. Otherwise the changes are "outdated" and are in conflict.
  *
- * Limitations:
- *
- * To handle integer overflows we assume that vector clock with a value of 0 is a descendant of
- * std::numeric_limits<u32>::max so we can wrap around. This means that there's a very small chance
- * that a very old change will appear as new if it's compared against the max value.
+ * The clock is an array of (peer id, value) sorted by id, most have a few entries which are kept
+ * inline. Missing entries have a value of 0.
  */
 class Vclock
 {
 public:
+    struct Entry
+    {
+        PeerId id;
+        u64 value;
+    };
+    typedef boost::container::small_vector<Entry, 4> entries_t;
+
     Vclock():
         m_clk()
     {}
 
-    Vclock(const std::map<std::string, u64>& clk):
-        m_clk(clk)
-    {}
+    /// interns the peers of @param clk in @param ids
+    Vclock(const std::map<std::string, u64>& clk, PeerIds& ids);
 
     /// @returns true if this clock is a descendant from @param other
     bool is_descendant(const Vclock& other) const;
 
     /**
-     * access the version field at clock given by @param key, if key doesn't exists is assumed to
+     * access the version field at clock given by @param id, if it doesn't exists is assumed to
      * have value of 0
-     * @returns an arbitrary precission int in base10
      */
-    u64 operator[](const std::string& key) const;
+    u64 operator[](PeerId id) const;
+
+    /// @returns the values by peer
+    std::map<std::string, u64> get_values(const PeerIds& ids) const;
 
-    std::map<std::string, u64> get_values() const
+    const entries_t& entries() const
     {
         return m_clk;
     }
 
+    /// increment clock @param id by @param val
+    void increment(PeerId id, u64 val = 1);
+
+    /// raise clock @param id to @param val if it's lower
+    void merge(PeerId id, u64 val);
+
+    /// @returns the clock packed as varints, ids delta encoded, for storage
+    std::string pack() const;
 
-    /// increment clock @param key by @param val
-    void increment(const std::string& key, u64 val = 1);
+    /// @returns the clock @param data of @param size was packed from @throws runtime_error if it's malformed
+    static Vclock unpack(const void* data, size_t size);
+
+    bool operator==(const Vclock& o) const;
 
 private:
-    std::map<std::string, u64> m_clk;
+    /// @returns where the entry @param id is or would be inserted
+    entries_t::iterator lower_bound(PeerId id);
+
+    entries_t m_clk;
 };
 
 } // end ns
 
-
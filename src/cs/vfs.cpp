@@ -0,0 +1,394 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vfs.hpp"
+#include "fs.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace cs
+{
+namespace vfs
+{
+
+namespace
+{
+
+Stat from_stat(const struct stat& st)
+{
+    Stat result;
+    if (S_ISREG(st.st_mode))
+        result.type = Type::REGULAR;
+    else if (S_ISDIR(st.st_mode))
+        result.type = Type::DIRECTORY;
+    else
+        result.type = Type::OTHER;
+    result.size = static_cast<u64>(st.st_size);
+    result.mtime = st.st_mtime;
+    result.mode = static_cast<u16>(st.st_mode & 07777);
+    return result;
+}
+
+class DiskWalker: public Walker
+{
+public:
+    DiskWalker(const bfs::path& root):
+          m_it(root)
+        , m_prefix_sz(root.string().size())
+    {
+        // the paths of the entries are root / name, with a separator unless root ends in one
+        const string& r = root.string();
+        if (! r.empty() && r.back() != '/')
+            ++m_prefix_sz;
+    }
+
+    bool next(Entry& entry) override
+    {
+        const bfs::recursive_directory_iterator end;
+        for (; m_it != end; ++m_it)
+        {
+            const string& path = m_it->path().string();
+            // a single stat for the type, size and mtime, following symlinks as the iterator does
+            struct stat st;
+            if (::stat(path.c_str(), &st) != 0 || ! S_ISREG(st.st_mode))
+                continue;
+            entry.path.assign(path, m_prefix_sz, string::npos);
+            entry.stat = from_stat(st);
+            ++m_it;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    bfs::recursive_directory_iterator m_it;
+    size_t m_prefix_sz;
+};
+
+class DiskReader: public Reader
+{
+public:
+    DiskReader(const bfs::path& path):
+        m_is(path, ios_base::in | ios_base::binary)
+    {
+    }
+
+    bool is_open() const
+    {
+        return static_cast<bool>(m_is);
+    }
+
+    size_t read(char* buf, size_t len) override
+    {
+        m_is.read(buf, len);
+        if (m_is.bad())
+            throw runtime_error("vfs::DiskReader read error");
+        return static_cast<size_t>(m_is.gcount());
+    }
+
+private:
+    bfs::ifstream m_is;
+};
+
+/// seconds from 1970 to 2014, the initial mtimes are in 2014 and the changes after
+const time_t s_epoch = 1388534400;
+const time_t s_day = 24 * 3600;
+
+/// @returns a double in [0, 1) from @param x
+double unit(u64 x)
+{
+    return (x >> 11) * (1.0 / (1ull << 53));
+}
+
+/// mtime of the changes of round @param round_index, later than any initial one
+time_t round_mtime(size_t round_index)
+{
+    return s_epoch + 400 * s_day + static_cast<time_t>(round_index) * s_day;
+}
+
+class SyntheticReader: public Reader
+{
+public:
+    SyntheticReader(u64 key, u64 size):
+          m_key(key)
+        , m_size(size)
+        , m_pos()
+    {}
+
+    size_t read(char* buf, size_t len) override
+    {
+        const size_t result = static_cast<size_t>(min<u64>(len, m_size - m_pos));
+        // the content is a stream of 8 byte words, each a hash of the key and its position
+        for (size_t done = 0; done < result;)
+        {
+            const u64 word = mix64(m_key + m_pos / sizeof(u64));
+            const size_t offset = m_pos % sizeof(u64);
+            const size_t n = min(sizeof(u64) - offset, result - done);
+            memcpy(buf + done, reinterpret_cast<const char*>(&word) + offset, n);
+            done += n;
+            m_pos += n;
+        }
+        return result;
+    }
+
+private:
+    u64 m_key;
+    u64 m_size;
+    u64 m_pos;
+};
+
+class SyntheticWalker: public Walker
+{
+public:
+    SyntheticWalker(const SyntheticTree& tree):
+          r_tree(tree)
+        , m_next()
+    {}
+
+    bool next(Entry& entry) override
+    {
+        for (; m_next < r_tree.capacity(); ++m_next)
+        {
+            entry.stat = r_tree.file_stat(m_next);
+            if (entry.stat.type == Type::NONE)
+                continue;
+            entry.path = r_tree.path(m_next++);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    const SyntheticTree& r_tree;
+    u64 m_next;
+};
+
+} // end anon ns
+
+
+Stat Disk::stat(const bfs::path& path)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+        return Stat();
+    return from_stat(st);
+}
+
+std::unique_ptr<Walker> Disk::walk(const bfs::path& root)
+{
+    return make_unique<DiskWalker>(root);
+}
+
+std::unique_ptr<Reader> Disk::open(const bfs::path& path)
+{
+    auto reader = make_unique<DiskReader>(path);
+    if (! reader->is_open())
+        return nullptr;
+    return move(reader);
+}
+
+std::shared_ptr<Filesystem> disk()
+{
+    static const shared_ptr<Filesystem> result = make_shared<Disk>();
+    return result;
+}
+
+
+SyntheticTree::SyntheticTree(const bfs::path& root, const Shape& shape):
+      m_root(root.generic_string().substr(0, root.generic_string().find_last_not_of('/') + 1))
+    , m_shape(shape)
+    , m_capacity(shape.files)
+    , m_rounds()
+{
+    if (shape.files_per_dir == 0 || shape.fanout < 2 || shape.min_size > shape.max_size)
+        throw runtime_error("SyntheticTree: invalid shape");
+}
+
+void SyntheticTree::mutate(Change change, double fraction, Spread spread)
+{
+    Round round;
+    round.change = change;
+    round.spread = spread;
+    round.first = m_capacity;
+    if (change == Change::CREATE)
+    {
+        round.fraction = max(0.0, fraction);
+        round.begin = m_capacity;
+    }
+    else
+    {
+        round.fraction = max(0.0, min(1.0, fraction));
+        round.begin = m_capacity ? mix64(m_shape.seed ^ mix64(m_rounds.size())) % m_capacity : 0;
+    }
+    round.count = static_cast<u64>(llround(round.fraction * m_capacity));
+    if (change == Change::CREATE)
+        m_capacity += round.count;
+    m_rounds.push_back(round);
+}
+
+std::string SyntheticTree::path(u64 index) const
+{
+    u64 dir = index / m_shape.files_per_dir;
+    vector<u32> digits;
+    while (digits.size() < m_shape.depth || dir)
+    {
+        digits.push_back(static_cast<u32>(dir % m_shape.fanout));
+        dir /= m_shape.fanout;
+    }
+    string result;
+    for (auto it = digits.rbegin(); it != digits.rend(); ++it)
+    {
+        result += 'd';
+        result += to_string(*it);
+        result += '/';
+    }
+    result += 'f';
+    result += to_string(index);
+    return result;
+}
+
+Stat SyntheticTree::file_stat(u64 index) const
+{
+    Stat result;
+    const State st = state(index);
+    if (! st.exists)
+        return result;
+    result.type = Type::REGULAR;
+    result.size = size(index, st.version);
+    result.mtime = st.mtime;
+    result.mode = st.mode;
+    return result;
+}
+
+Stat SyntheticTree::stat(const bfs::path& path)
+{
+    if (path.generic_string() == m_root)
+    {
+        Stat result;
+        result.type = Type::DIRECTORY;
+        result.mode = 0755;
+        return result;
+    }
+    const u64 i = index(path);
+    return i < m_capacity ? file_stat(i) : Stat();
+}
+
+std::unique_ptr<Walker> SyntheticTree::walk(const bfs::path& root)
+{
+    if (root.generic_string() != m_root)
+        throw runtime_error(fs("SyntheticTree: " << root << " is not the root of the tree"));
+    return make_unique<SyntheticWalker>(*this);
+}
+
+std::unique_ptr<Reader> SyntheticTree::open(const bfs::path& path)
+{
+    const u64 i = index(path);
+    if (i == m_capacity)
+        return nullptr;
+    const State st = state(i);
+    if (! st.exists)
+        return nullptr;
+    return make_unique<SyntheticReader>(mix64(m_shape.seed ^ mix64(i) ^ mix64(~static_cast<u64>(st.version))), size(i, st.version));
+}
+
+SyntheticTree::State SyntheticTree::state(u64 index) const
+{
+    State st;
+    st.exists = index < m_shape.files;
+    st.version = 0;
+    st.mtime = s_epoch + static_cast<time_t>(mix64(m_shape.seed ^ mix64(index)) % (365 * s_day));
+    st.mode = 0644;
+    for (size_t r = 0; r < m_rounds.size(); ++r)
+    {
+        const Round& round = m_rounds[r];
+        if (round.change == Change::CREATE)
+        {
+            if (index >= round.begin && index < round.begin + round.count)
+            {
+                st.exists = true;
+                st.version = static_cast<u32>(r + 1);
+                st.mtime = round_mtime(r + 1);
+            }
+            continue;
+        }
+        if (! st.exists || ! picked(round, r, index))
+            continue;
+        switch (round.change)
+        {
+        case Change::MODIFY:
+            st.version = static_cast<u32>(r + 1);
+            st.mtime = round_mtime(r + 1);
+            break;
+        case Change::TOUCH:
+            st.mtime = round_mtime(r + 1);
+            break;
+        case Change::CHMOD:
+            st.mode ^= 0200;
+            break;
+        case Change::DELETE:
+            st.exists = false;
+            break;
+        case Change::CREATE:
+            break;
+        }
+    }
+    return st;
+}
+
+bool SyntheticTree::picked(const Round& round, size_t round_index, u64 index) const
+{
+    // files created later aren't changed by a round
+    if (index >= round.first)
+        return false;
+    if (round.spread == Spread::CLUSTERED)
+        return (index + round.first - round.begin) % round.first < round.count;
+    return unit(mix64(m_shape.seed ^ mix64((static_cast<u64>(round_index) << 48) ^ index))) < round.fraction;
+}
+
+u64 SyntheticTree::size(u64 index, u32 version) const
+{
+    const double lo = log(static_cast<double>(m_shape.min_size + 1));
+    const double hi = log(static_cast<double>(m_shape.max_size + 1));
+    const double u = unit(mix64(m_shape.seed ^ mix64(index) ^ mix64(version)));
+    const u64 result = static_cast<u64>(exp(lo + u * (hi - lo))) - 1;
+    return max(m_shape.min_size, min(m_shape.max_size, result));
+}
+
+u64 SyntheticTree::index(const bfs::path& file_path) const
+{
+    const string p = file_path.generic_string();
+    if (p.size() <= m_root.size() + 1 || p.compare(0, m_root.size(), m_root) != 0 || p[m_root.size()] != '/')
+        return m_capacity;
+    const string relative = p.substr(m_root.size() + 1);
+    const size_t name = relative.rfind('/') + 1;
+    if (relative.size() <= name + 1 || relative[name] != 'f' || ! isdigit(relative[name + 1]))
+        return m_capacity;
+    const u64 result = strtoull(relative.c_str() + name + 1, nullptr, 10);
+    if (result >= m_capacity || path(result) != relative)
+        return m_capacity;
+    return result;
+}
+
+} // end ns
+} // end ns
@@ -0,0 +1,257 @@
+/*
+ *  This file is part of clearskies_core file synchronization program
+ *  Copyright (C) 2014 Pedro Larroy
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "config.hpp"
+#include "int_types.h"
+#include "boost_fs_fwd.hpp"
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cs
+{
+namespace vfs
+{
+
+enum class Type: unsigned
+{
+    NONE = 0,
+    REGULAR,
+    DIRECTORY,
+    OTHER,
+};
+
+struct Stat
+{
+    Stat():
+          type(Type::NONE)
+        , size()
+        , mtime()
+        , mode()
+    {}
+
+    Type type;
+    u64 size;
+    std::time_t mtime;
+    /// permission bits
+    u16 mode;
+};
+
+inline bool operator==(const Stat& a, const Stat& b)
+{
+    return a.type == b.type && a.size == b.size && a.mtime == b.mtime && a.mode == b.mode;
+}
+
+inline bool operator!=(const Stat& a, const Stat& b)
+{
+    return ! (a == b);
+}
+
+/// a regular file found by a Walker
+struct Entry
+{
+    /// relative to the root of the walk, with / as separator
+    std::string path;
+    Stat stat;
+};
+
+/// regular files under a directory and its subdirectories, in no particular order
+class Walker
+{
+public:
+    virtual ~Walker() = default;
+
+    /// fill @param entry with the next file @returns false when there are no more
+    virtual bool next(Entry& entry) = 0;
+};
+
+/// a file open for reading from the start
+class Reader
+{
+public:
+    virtual ~Reader() = default;
+
+    /**
+     * read up to @param len bytes into @param buf, less only at the end of the file
+     * @returns the bytes read, 0 at the end @throws runtime_error on errors
+     */
+    virtual size_t read(char* buf, size_t len) = 0;
+};
+
+/**
+ * The file system as seen by a Share when scanning and checksumming, so the scan can run over trees
+ * that are not on disk @sa Disk, SyntheticTree
+ */
+class Filesystem
+{
+public:
+    virtual ~Filesystem() = default;
+
+    /// @returns the metadata of @param path, with type NONE if it doesn't exist
+    virtual Stat stat(const bfs::path& path) = 0;
+
+    /// walk the regular files under the directory @param root @throws runtime_error
+    virtual std::unique_ptr<Walker> walk(const bfs::path& root) = 0;
+
+    /// @returns a reader of the file @param path, null if it can't be opened
+    virtual std::unique_ptr<Reader> open(const bfs::path& path) = 0;
+};
+
+
+/// the real file system
+class Disk: public Filesystem
+{
+public:
+    Stat stat(const bfs::path& path) override;
+    std::unique_ptr<Walker> walk(const bfs::path& root) override;
+    std::unique_ptr<Reader> open(const bfs::path& path) override;
+};
+
+/// @returns the Disk shared by the shares that don't use another file system
+std::shared_ptr<Filesystem> disk();
+
+
+/**
+ * A tree of files generated on the fly from a seed, mounted at a root path. Nothing is stored per
+ * file: the metadata and the content of each one are computed from its index and the mutations
+ * applied, so trees of tens of millions of files take no memory and the same seed always gives the
+ * same tree.
+ *
+ * File i is at dN/.../fi: leaf directories hold files_per_dir consecutive files and are named by the
+ * digits of their number in base fanout, with at least depth levels. Sizes are log-uniform between
+ * min_size and max_size. Only the root and the files can be stat, the directories in between can't.
+ */
+class SyntheticTree: public Filesystem
+{
+public:
+    struct Shape
+    {
+        Shape():
+              files(1000)
+            , files_per_dir(32)
+            , fanout(16)
+            , depth(2)
+            , min_size(0)
+            , max_size(64 << 10)
+            , seed(1)
+        {}
+
+        u64 files;
+        u32 files_per_dir;
+        u32 fanout;
+        u32 depth;
+        u64 min_size;
+        u64 max_size;
+        u64 seed;
+    };
+
+    enum class Change: unsigned
+    {
+        /// new content, size and mtime
+        MODIFY,
+        /// new mtime only, the content stays
+        TOUCH,
+        /// toggles the owner write permission
+        CHMOD,
+        DELETE,
+        /// adds files after the last one, the fraction is of capacity()
+        CREATE,
+    };
+
+    /// which files a change picks
+    enum class Spread: unsigned
+    {
+        /// each file with the probability of the fraction
+        UNIFORM,
+        /// a run of consecutive files from a random one, which are whole directories
+        CLUSTERED,
+    };
+
+    /// @throws runtime_error if the shape has no files per directory or a fanout under 2
+    SyntheticTree(const bfs::path& root, const Shape& shape);
+
+    /**
+     * apply @param change to @param fraction of the files picked as @param spread. The changes
+     * pile up, each one with its own random picks.
+     */
+    void mutate(Change change, double fraction, Spread spread = Spread::UNIFORM);
+
+    /// number of files ever created, existing or deleted
+    u64 capacity() const
+    {
+        return m_capacity;
+    }
+
+    /// @returns the path of file @param index relative to the root
+    std::string path(u64 index) const;
+
+    /// @returns the metadata of file @param index, with type NONE if it was deleted
+    Stat file_stat(u64 index) const;
+
+    Stat stat(const bfs::path& path) override;
+    std::unique_ptr<Walker> walk(const bfs::path& root) override;
+    std::unique_ptr<Reader> open(const bfs::path& path) override;
+
+private:
+    struct Round
+    {
+        Change change;
+        double fraction;
+        Spread spread;
+        /// files before the round, CREATE adds from here
+        u64 first;
+        /// CLUSTERED: the run starts here and wraps around, CREATE: files added
+        u64 begin;
+        u64 count;
+    };
+
+    /// what the rounds left of a file
+    struct State
+    {
+        bool exists;
+        /// round that last changed the content, 0 for the initial one
+        u32 version;
+        std::time_t mtime;
+        u16 mode;
+    };
+
+    State state(u64 index) const;
+    /// @returns whether @param round picks @param index, which exists
+    bool picked(const Round& round, size_t round_index, u64 index) const;
+    u64 size(u64 index, u32 version) const;
+    /// @returns the file index of @param path, m_capacity when it's not a file of the tree
+    u64 index(const bfs::path& path) const;
+
+    const std::string m_root;
+    const Shape m_shape;
+    u64 m_capacity;
+    std::vector<Round> m_rounds;
+};
+
+/// @returns a well mixed hash of @param x, the next state of a splitmix64 generator
+inline u64 mix64(u64 x)
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+} // end ns
+} // end ns
@@ -0,0 +1,260 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.hpp"
+#include "jsoncons/json.hpp"
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <new>
+
+using namespace std;
+
+namespace
+{
+std::atomic<size_t> g_allocations(0);
+}
+
+/// count allocations so benchmarks can report them per operation
+void* operator new(size_t sz)
+{
+    ++g_allocations;
+    if (void* p = malloc(sz ? sz : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+namespace bench
+{
+
+size_t allocations()
+{
+    return g_allocations;
+}
+
+std::vector<Benchmark>& registry()
+{
+    static std::vector<Benchmark> benchmarks;
+    return benchmarks;
+}
+
+} // end ns
+
+
+namespace
+{
+
+struct Result
+{
+    std::string name;
+    size_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    /// 0 when the benchmark doesn't process bytes
+    double mib_per_s;
+};
+
+/// run @p b doubling the iterations until a run takes at least @p min_time
+Result run(const bench::Benchmark& b, chrono::duration<double> min_time)
+{
+    typedef chrono::steady_clock clock;
+    // untimed warm up, builds static fixtures
+    b.fun(1);
+    size_t iterations = 1;
+    size_t bytes = 0;
+    size_t allocs = 0;
+    chrono::duration<double> elapsed;
+    while (true)
+    {
+        const size_t allocs_start = bench::allocations();
+        const auto start = clock::now();
+        bytes = b.fun(iterations);
+        elapsed = clock::now() - start;
+        allocs = bench::allocations() - allocs_start;
+        if (elapsed >= min_time)
+            break;
+        iterations *= 2;
+    }
+    return Result{b.name, iterations, elapsed.count() * 1e9 / iterations, static_cast<double>(allocs) / iterations,
+        bytes ? bytes / elapsed.count() / (1 << 20) : 0};
+}
+
+void print(const Result& r)
+{
+    cout << left << setw(48) << r.name << right
+        << setw(12) << r.iterations << " iter "
+        << setw(14) << fixed << setprecision(1) << r.ns_per_op << " ns/op";
+    cout << setw(10) << setprecision(2) << r.allocs_per_op << " allocs/op";
+    if (r.mib_per_s)
+        cout << setw(12) << setprecision(1) << r.mib_per_s << " MiB/s";
+    cout << endl;
+}
+
+/// {"benchmarks": [{"name": ..., "iterations": ..., "ns_per_op": ..., "allocs_per_op": ..., "mib_per_s": ...}]}
+void write_json(ostream& os, const vector<Result>& results)
+{
+    os << "{\n    \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const Result& r = results[i];
+        os << (i ? ",\n" : "\n") << fixed
+            << "        {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+            << ", \"ns_per_op\": " << setprecision(3) << r.ns_per_op
+            << ", \"allocs_per_op\": " << setprecision(3) << r.allocs_per_op
+            << ", \"mib_per_s\": " << setprecision(3) << r.mib_per_s << "}";
+    }
+    os << "\n    ]\n}\n";
+}
+
+/// @returns ns/op by benchmark name of a file written with --json
+map<string, double> read_baseline(const string& path)
+{
+    map<string, double> result;
+    const jsoncons::json json = jsoncons::json::parse_file(path);
+    const jsoncons::json& benchmarks = json["benchmarks"];
+    for (size_t i = 0; i < benchmarks.size(); ++i)
+        result[benchmarks[i]["name"].as_string()] = benchmarks[i]["ns_per_op"].as_double();
+    return result;
+}
+
+/// print the change of each result against @p baseline, @returns false if any is slower than @p threshold
+bool compare(const vector<Result>& results, const map<string, double>& baseline, double threshold)
+{
+    bool ok = true;
+    cout << endl << left << setw(48) << "benchmark" << right << setw(16) << "baseline ns/op" << setw(16) << "ns/op" << setw(10) << "change" << endl;
+    for (const auto& r: results)
+    {
+        cout << left << setw(48) << r.name << right;
+        const auto i = baseline.find(r.name);
+        if (i == baseline.end())
+        {
+            cout << setw(16) << "-" << setw(16) << fixed << setprecision(1) << r.ns_per_op << setw(10) << "new" << endl;
+            continue;
+        }
+        const double change = (r.ns_per_op / i->second - 1) * 100;
+        cout << setw(16) << fixed << setprecision(1) << i->second << setw(16) << r.ns_per_op
+            << setw(9) << showpos << change << noshowpos << "%";
+        if (change > threshold)
+        {
+            cout << "  REGRESSION";
+            ok = false;
+        }
+        cout << endl;
+    }
+    return ok;
+}
+
+void usage(const char* argv0)
+{
+    cerr << "usage: " << argv0 << " [--json FILE] [--compare BASELINE] [--threshold PERCENT] [--min-time SECONDS] [FILTER]" << endl
+        << "  runs the benchmarks whose name contains FILTER" << endl
+        << "  --json       writes the results to FILE, - for stdout" << endl
+        << "  --compare    compares ns/op with a file written with --json, exits with 1 on regressions" << endl
+        << "  --threshold  slowdown in percent that is a regression, 10 by default" << endl
+        << "  --min-time   minimum time each benchmark runs, 0.2 by default" << endl;
+}
+
+} // end anon ns
+
+
+/**
+ * Runs every registered benchmark whose name contains the filter, doubling the iterations until a
+ * run takes at least min_time. The inputs are generated with fixed seeds, so runs are comparable.
+ */
+int main(int argc, char* argv[])
+{
+    using namespace bench;
+    chrono::duration<double> min_time(0.2);
+    const char* filter = "";
+    string json_path;
+    string baseline_path;
+    double threshold = 10;
+    for (int i = 1; i < argc; ++i)
+    {
+        const string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--json" && has_value)
+            json_path = argv[++i];
+        else if (arg == "--compare" && has_value)
+            baseline_path = argv[++i];
+        else if (arg == "--threshold" && has_value)
+            threshold = atof(argv[++i]);
+        else if (arg == "--min-time" && has_value)
+            min_time = chrono::duration<double>(atof(argv[++i]));
+        else if (arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        else
+            filter = argv[i];
+    }
+
+    map<string, double> baseline;
+    if (! baseline_path.empty())
+    {
+        try
+        {
+            baseline = read_baseline(baseline_path);
+        }
+        catch (const exception& e)
+        {
+            cerr << "can't read the baseline " << baseline_path << ": " << e.what() << endl;
+            return 2;
+        }
+    }
+
+    // with the JSON on stdout the table goes to stderr
+    ostream& table = json_path == "-" ? cerr : cout;
+    streambuf* const cout_buf = cout.rdbuf(table.rdbuf());
+    vector<Result> results;
+    for (const auto& b: registry())
+    {
+        if (! strstr(b.name.c_str(), filter))
+            continue;
+        results.push_back(run(b, min_time));
+        print(results.back());
+    }
+
+    bool ok = true;
+    if (! baseline_path.empty())
+        ok = compare(results, baseline, threshold);
+    cout.rdbuf(cout_buf);
+
+    if (json_path == "-")
+        write_json(cout, results);
+    else if (! json_path.empty())
+    {
+        ofstream os(json_path);
+        write_json(os, results);
+        if (! os)
+        {
+            cerr << "can't write " << json_path << endl;
+            return 2;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/**
+ * @file bench.hpp
+ * Minimal micro-benchmark registry for the bench executable
+ */
+namespace bench
+{
+
+/// runs the measured operation @p iterations times, @returns the number of bytes processed
+typedef std::function<size_t(size_t iterations)> bench_fun_t;
+
+struct Benchmark
+{
+    std::string name;
+    bench_fun_t fun;
+};
+
+std::vector<Benchmark>& registry();
+
+/// number of heap allocations since the start of the program
+size_t allocations();
+
+struct Registrar
+{
+    Registrar(const char* name, bench_fun_t fun)
+    {
+        registry().push_back(Benchmark{name, fun});
+    }
+};
+
+/// keep the compiler from optimizing away a computed value
+template<typename T>
+inline void do_not_optimize(const T& x)
+{
+    asm volatile("" : : "g"(&x) : "memory");
+}
+
+} // end ns
+
+#define BENCHMARK(NAME)\
+    static size_t NAME(size_t);\
+    static bench::Registrar NAME##_registrar__(#NAME, NAME);\
+    static size_t NAME(size_t iterations)
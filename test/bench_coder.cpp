@@ -0,0 +1,176 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.hpp"
+#include "cs/protocolstate.hpp"
+#include "cs/core/coder.hpp"
+#include <cassert>
+
+using namespace std;
+using namespace cs;
+using namespace cs::core::msg;
+
+namespace
+{
+
+/// an Update with @p files distinct files
+Update update_with_files(size_t files)
+{
+    Update update(1);
+    for (size_t i = 0; i < files; ++i)
+        update.m_files.emplace_back("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef",
+            "some/directory/file_" + to_string(i), "peer", i + 1, "2014-03-01T10:00:00Z", 1024 + i, false, 0644);
+    return update;
+}
+
+GetUpdates get_updates_with_peers(size_t peers)
+{
+    map<string, u64> since;
+    for (size_t i = 0; i < peers; ++i)
+        since["0123456789abcdef0123456789abcde" + to_string(i % 10) + to_string(i)] = 1000 + i;
+    return GetUpdates(since);
+}
+
+size_t encode(const Message& msg, size_t iterations)
+{
+    Coder coder;
+    string out;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        out.clear();
+        coder.encode_msg(msg, out);
+        bench::do_not_optimize(out);
+    }
+    return out.size() * iterations;
+}
+
+/// decodes the framed message @p encoded as a peer would after finding it in its input
+size_t decode(const string& encoded, size_t iterations)
+{
+    const MsgRstate msg = find_message(encoded);
+    assert(msg.found);
+    Coder coder;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        auto decoded = coder.decode_msg(msg.payload(), msg.encoded, msg.encoded_sz, msg.signature, msg.signature_sz);
+        bench::do_not_optimize(decoded);
+    }
+    return msg.encoded_sz * iterations;
+}
+
+const Start& start_msg()
+{
+    static const Start start{"CS_CORE v0.1", 1, vector<string>(), "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef",
+        "read_write", "0123456789abcdef0123456789abcdef", "name", "2014-03-01T10:00:00Z"};
+    return start;
+}
+
+} // end anon ns
+
+
+BENCHMARK(coder_encode_ping)
+{
+    return encode(Ping(), iterations);
+}
+
+BENCHMARK(coder_decode_ping)
+{
+    static const string encoded = Coder().encode_msg(Ping());
+    return decode(encoded, iterations);
+}
+
+BENCHMARK(coder_encode_start)
+{
+    return encode(start_msg(), iterations);
+}
+
+BENCHMARK(coder_decode_start)
+{
+    static const string encoded = Coder().encode_msg(start_msg());
+    return decode(encoded, iterations);
+}
+
+BENCHMARK(coder_encode_get)
+{
+    static const Get get("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef", 7, 1 << 20, 1 << 16);
+    return encode(get, iterations);
+}
+
+BENCHMARK(coder_decode_get)
+{
+    static const string encoded = Coder().encode_msg(Get("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef", 7, 1 << 20, 1 << 16));
+    return decode(encoded, iterations);
+}
+
+BENCHMARK(coder_encode_file_data)
+{
+    static const FileData file_data("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef", 7, 1 << 20);
+    return encode(file_data, iterations);
+}
+
+BENCHMARK(coder_decode_file_data)
+{
+    static const string encoded = Coder().encode_msg(FileData("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef", 7, 1 << 20));
+    return decode(encoded, iterations);
+}
+
+BENCHMARK(coder_encode_get_updates_16_peers)
+{
+    static const GetUpdates get_updates = get_updates_with_peers(16);
+    return encode(get_updates, iterations);
+}
+
+BENCHMARK(coder_decode_get_updates_16_peers)
+{
+    static const string encoded = Coder().encode_msg(get_updates_with_peers(16));
+    return decode(encoded, iterations);
+}
+
+BENCHMARK(coder_encode_update_1_file)
+{
+    static const Update update = update_with_files(1);
+    return encode(update, iterations);
+}
+
+BENCHMARK(coder_decode_update_1_file)
+{
+    static const string encoded = Coder().encode_msg(update_with_files(1));
+    return decode(encoded, iterations);
+}
+
+BENCHMARK(coder_encode_update_100_files)
+{
+    static const Update update = update_with_files(100);
+    return encode(update, iterations);
+}
+
+BENCHMARK(coder_decode_update_100_files)
+{
+    static const string encoded = Coder().encode_msg(update_with_files(100));
+    return decode(encoded, iterations);
+}
+
+BENCHMARK(coder_encode_update_10000_files)
+{
+    static const Update update = update_with_files(10000);
+    return encode(update, iterations);
+}
+
+BENCHMARK(coder_decode_update_10000_files)
+{
+    static const string encoded = Coder().encode_msg(update_with_files(10000));
+    return decode(encoded, iterations);
+}
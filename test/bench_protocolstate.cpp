@@ -0,0 +1,196 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.hpp"
+#include "cs/protocolstate.hpp"
+#include "cs/core/coder.hpp"
+#include <cassert>
+
+using namespace std;
+using namespace cs;
+using namespace cs::core::msg;
+
+namespace
+{
+
+/// an encoded Update of at most @p sz bytes
+string big_update(size_t sz)
+{
+    Update update(1);
+    const MFile mfile("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef",
+        "some/directory/file_0000000", "peer", 1, "2014-03-01T10:00:00Z", 1024, false, 0644);
+    update.m_files.push_back(mfile);
+    const size_t file_sz = Coder().encode_msg(update).size();
+    update.m_files.resize(sz / file_sz, mfile);
+    return Coder().encode_msg(update);
+}
+
+/// feeds @p input to a ProtocolState in @p fragment sized reads
+size_t feed_fragmented(const string& input, size_t fragment, size_t iterations)
+{
+    size_t msgs = 0;
+    ProtocolState pstate;
+    pstate.m_handle_msg = [&](const char*, size_t, const char*, size_t, bool) { ++msgs; };
+    for (size_t i = 0; i < iterations; ++i)
+        for (size_t pos = 0; pos < input.size(); pos += fragment)
+            pstate.input(input.data() + pos, min(fragment, input.size() - pos));
+    assert(msgs == iterations);
+    bench::do_not_optimize(msgs);
+    return input.size() * iterations;
+}
+
+/// many small messages delivered in reads that cut them at arbitrary points
+string small_messages(size_t count)
+{
+    string result;
+    Coder coder;
+    for (size_t i = 0; i < count; ++i)
+        coder.encode_msg(Get("0123456789abcdef0123456789abcdef" + to_string(i)), result);
+    return result;
+}
+
+} // end anon ns
+
+
+BENCHMARK(protocolstate_input_max_size_update_64KiB_reads)
+{
+    static const string input = big_update(Message::MAX_SIZE);
+    return feed_fragmented(input, 64 << 10, iterations);
+}
+
+BENCHMARK(protocolstate_input_1MiB_update_1400B_reads)
+{
+    static const string input = big_update(1 << 20);
+    return feed_fragmented(input, 1400, iterations);
+}
+
+BENCHMARK(protocolstate_input_small_messages_1400B_reads)
+{
+    static const string input = small_messages(1000);
+    size_t msgs = 0;
+    ProtocolState pstate;
+    pstate.m_handle_msg = [&](const char*, size_t, const char*, size_t, bool) { ++msgs; };
+    for (size_t i = 0; i < iterations; ++i)
+        for (size_t pos = 0; pos < input.size(); pos += 1400)
+            pstate.input(input.data() + pos, min<size_t>(1400, input.size() - pos));
+    assert(msgs == 1000 * iterations);
+    bench::do_not_optimize(msgs);
+    return input.size() * iterations;
+}
+
+BENCHMARK(protocolstate_output_small_messages_while_writing)
+{
+    // messages queued while a write is in progress are flushed together
+    static const string msg = Coder().encode_msg(Get("0123456789abcdef0123456789abcdef"));
+    size_t bytes = 0;
+    ProtocolState pstate;
+    pstate.set_write_fun([&](const OutputSlice* slices, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+            bytes += slices[i].size;
+    });
+    pstate.m_handle_empty_output_buff = []() {};
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        for (size_t j = 0; j < 100; ++j)
+            pstate.send_msg(string(msg), false);
+        while (bytes < (i + 1) * 100 * msg.size())
+            pstate.on_write_finished();
+    }
+    pstate.on_write_finished();
+    return bytes;
+}
+
+namespace
+{
+
+/// the bytes ProtocolState sends for a payload chunk of @p sz bytes
+string encoded_payload_chunk(size_t sz)
+{
+    string result;
+    ProtocolState pstate;
+    pstate.set_write_fun([&](const OutputSlice* slices, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+            result.append(slices[i].data, slices[i].size);
+    });
+    pstate.m_handle_empty_output_buff = []() {};
+    pstate.send_msg(Coder().encode_msg(FileData("0123456789abcdef0123456789abcdef")), true);
+    pstate.send_payload_chunk(string(sz, 'x'));
+    while (pstate.m_write_in_progress)
+        pstate.on_write_finished();
+    // without the message the chunk follows
+    return result.substr(find_message(result).enc_sig_sz);
+}
+
+size_t find_message_bench(const string& input, size_t iterations)
+{
+    size_t found = 0;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        const MsgRstate msg = find_message(input.data(), input.data() + input.size());
+        found += msg.found;
+        bench::do_not_optimize(msg);
+    }
+    assert(found == iterations);
+    bench::do_not_optimize(found);
+    return 0;
+}
+
+} // end anon ns
+
+
+BENCHMARK(find_message_get)
+{
+    static const string input = Coder().encode_msg(Get("0123456789abcdef0123456789abcdef"));
+    return find_message_bench(input, iterations);
+}
+
+BENCHMARK(find_message_64KiB_update)
+{
+    static const string input = big_update(64 << 10);
+    return find_message_bench(input, iterations);
+}
+
+BENCHMARK(find_message_partial_64KiB_update)
+{
+    // the length prefix tells how much is needed without looking at the rest
+    static const string input = big_update(64 << 10).substr(0, 1400);
+    size_t need = 0;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        const MsgRstate msg = find_message(input.data(), input.data() + input.size());
+        need += msg.need;
+        bench::do_not_optimize(msg);
+    }
+    bench::do_not_optimize(need);
+    return 0;
+}
+
+BENCHMARK(find_payload_64KiB_chunk)
+{
+    static const string input = encoded_payload_chunk(64 << 10);
+    size_t found = 0;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        const PayLoadFound chunk = find_payload(input.data(), input.data() + input.size());
+        found += chunk.found;
+        bench::do_not_optimize(chunk);
+    }
+    assert(found == iterations);
+    bench::do_not_optimize(found);
+    return 0;
+}
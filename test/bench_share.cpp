@@ -0,0 +1,318 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.hpp"
+#include "cs/core/share.hpp"
+#include "cs/utils.hpp"
+#include "cs/boost_fs_fwd.hpp"
+#include <boost/filesystem/fstream.hpp>
+#include <cassert>
+#include <random>
+
+using namespace std;
+using namespace cs;
+using namespace cs::core::share;
+
+namespace
+{
+
+/// files of the generated trees, in directories of s_dir_files
+const size_t s_tree_files = 1000;
+const size_t s_dir_files = 50;
+
+/// a tree of s_tree_files small files with sizes from a fixed seed @returns their total size
+size_t generate_tree(const bfs::path& path)
+{
+    mt19937 rng(42);
+    size_t bytes = 0;
+    for (size_t i = 0; i < s_tree_files; ++i)
+    {
+        const bfs::path dir = path / ("dir_" + to_string(i / s_dir_files));
+        if (i % s_dir_files == 0)
+            bfs::create_directories(dir);
+        const string content(rng() % 8192, static_cast<char>('a' + i % 26));
+        bfs::ofstream os(dir / ("file_" + to_string(i)));
+        os << content;
+        bytes += content.size();
+    }
+    return bytes;
+}
+
+/// a scanned share over a generated tree, with its database on disk
+struct Fixture
+{
+    Fixture():
+          tree()
+        , db()
+        , bytes(generate_tree(tree.path))
+        , share(tree.path.string(), (db.path / "share.db").string())
+        , files()
+    {
+        share.fullscan();
+        for (const auto& file: share)
+            files.push_back(file);
+        assert(files.size() == s_tree_files);
+    }
+
+    utils::Tmpdir tree;
+    utils::Tmpdir db;
+    size_t bytes;
+    Share share;
+    vector<MFile> files;
+};
+
+Fixture& fixture()
+{
+    static Fixture fixture;
+    return fixture;
+}
+
+} // end anon ns
+
+
+BENCHMARK(share_scan_new_1000_files)
+{
+    // scanning a tree for the first time inserts and checksums every file
+    Fixture& f = fixture();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Share share(f.tree.path.string());
+        share.fullscan();
+    }
+    return f.bytes * iterations;
+}
+
+BENCHMARK(share_rescan_unchanged_1000_files)
+{
+    Fixture& f = fixture();
+    for (size_t i = 0; i < iterations; ++i)
+        f.share.fullscan();
+    return 0;
+}
+
+BENCHMARK(share_scan_new_synthetic_10k_files)
+{
+    // the scanner and the database without the disk
+    vfs::SyntheticTree::Shape shape;
+    shape.files = 10000;
+    shape.max_size = 4096;
+    auto tree = make_shared<vfs::SyntheticTree>("/synthetic", shape);
+    size_t bytes = 0;
+    for (u64 i = 0; i < tree->capacity(); ++i)
+        bytes += tree->file_stat(i).size;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        Share share("/synthetic", ":memory:", tree);
+        share.fullscan();
+    }
+    return bytes * iterations;
+}
+
+BENCHMARK(share_rescan_synthetic_1pct_modified_10k_files)
+{
+    static vfs::SyntheticTree::Shape shape = []() {
+        vfs::SyntheticTree::Shape shape;
+        shape.files = 10000;
+        shape.max_size = 4096;
+        return shape;
+    }();
+    static auto tree = make_shared<vfs::SyntheticTree>("/synthetic", shape);
+    static Share share = []() {
+        Share share("/synthetic", ":memory:", tree);
+        share.fullscan();
+        return share;
+    }();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        tree->mutate(vfs::SyntheticTree::Change::MODIFY, 0.01);
+        share.fullscan();
+    }
+    return 0;
+}
+
+BENCHMARK(vfs_synthetic_walk_10M_files)
+{
+    // per file, the walk alone
+    static vfs::SyntheticTree tree = []() {
+        vfs::SyntheticTree::Shape shape;
+        shape.files = 10000000;
+        vfs::SyntheticTree tree("/synthetic", shape);
+        tree.mutate(vfs::SyntheticTree::Change::MODIFY, 0.01);
+        tree.mutate(vfs::SyntheticTree::Change::DELETE, 0.01, vfs::SyntheticTree::Spread::CLUSTERED);
+        return tree;
+    }();
+    static auto walker = tree.walk("/synthetic");
+    vfs::Entry entry;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        if (! walker->next(entry))
+            walker = tree.walk("/synthetic");
+        bench::do_not_optimize(entry);
+    }
+    return 0;
+}
+
+BENCHMARK(share_cksum_do_block_64KiB)
+{
+    static utils::Tmpdir tree;
+    static const size_t file_sz = 16 << 20;
+    static Share share = []() {
+        bfs::ofstream os(tree.path / "big");
+        mt19937 rng(42);
+        for (size_t i = 0; i < file_sz / sizeof(u32); ++i)
+        {
+            const u32 x = rng();
+            os.write(reinterpret_cast<const char*>(&x), sizeof(x));
+        }
+        os.close();
+        Share share(tree.path.string());
+        share.fullscan();
+        return share;
+    }();
+    size_t bytes = 0;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        if (! share.m_cksum_is)
+        {
+            // checksum the file again, the last block of each pass updates its row
+            share.m_cksum_mfile = *share.get_file_info("big");
+            share.m_cksum_is = share.m_fs->open(tree.path / "big");
+            sha2::SHA256_Init(&share.m_cksum_ctx_sha256);
+        }
+        share.cksum_do_block();
+        bytes += Share::s_cksum_block_sz;
+    }
+    return bytes;
+}
+
+BENCHMARK(share_sql_get_file_info)
+{
+    Fixture& f = fixture();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        auto file = f.share.get_file_info(f.files[i % f.files.size()].path);
+        assert(file);
+        bench::do_not_optimize(file);
+    }
+    return 0;
+}
+
+BENCHMARK(share_sql_insert_mfile)
+{
+    // into a share of its own, so the others see the same table
+    static utils::Tmpdir db;
+    static size_t inserted = 0;
+    static Share share(fixture().tree.path.string(), (db.path / "share.db").string());
+    MFile file = fixture().files[0];
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        file.path = "inserted/file_" + to_string(inserted++);
+        share.insert_mfile(file);
+    }
+    return 0;
+}
+
+BENCHMARK(share_sql_update_mfile)
+{
+    Fixture& f = fixture();
+    for (size_t i = 0; i < iterations; ++i)
+        f.share.update_mfile(f.files[i % f.files.size()]);
+    return 0;
+}
+
+BENCHMARK(share_sql_get_mfiles_by_content)
+{
+    Fixture& f = fixture();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        auto files = f.share.get_mfiles_by_content(f.files[i % f.files.size()].checksum);
+        assert(! files.empty());
+        bench::do_not_optimize(files);
+    }
+    return 0;
+}
+
+BENCHMARK(share_sql_set_vclock)
+{
+    Fixture& f = fixture();
+    const PeerId peer = f.share.intern_peer("0123456789abcdef0123456789abcdef");
+    Vclock vclock;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        vclock.increment(peer);
+        f.share.set_vclock(f.files[i % f.files.size()].path, vclock);
+    }
+    return 0;
+}
+
+BENCHMARK(share_sql_get_vclock)
+{
+    Fixture& f = fixture();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        const Vclock vclock = f.share.get_vclock(f.files[i % f.files.size()].path);
+        bench::do_not_optimize(vclock);
+    }
+    return 0;
+}
+
+BENCHMARK(share_sql_iterate_1000_files)
+{
+    Fixture& f = fixture();
+    size_t files = 0;
+    for (size_t i = 0; i < iterations; ++i)
+        for (const auto& file: f.share)
+        {
+            bench::do_not_optimize(file);
+            ++files;
+        }
+    assert(files == iterations * s_tree_files);
+    return 0;
+}
+
+BENCHMARK(share_sql_get_updates_1000_files)
+{
+    Fixture& f = fixture();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        auto manifest = f.share.get_updates("0123456789abcdef0123456789abcdef");
+        size_t files = 0;
+        for (const auto& file: *manifest)
+        {
+            bench::do_not_optimize(file);
+            ++files;
+        }
+        assert(files == s_tree_files);
+    }
+    return 0;
+}
+
+BENCHMARK(share_sql_remote_update_100_files)
+{
+    Fixture& f = fixture();
+    static const vector<cs::core::msg::MFile> files = []() {
+        vector<cs::core::msg::MFile> result;
+        for (size_t i = 0; i < 100; ++i)
+            result.push_back(fixture().files[i * 10].to_msg_mfile());
+        return result;
+    }();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        auto result = f.share.remote_update("0123456789abcdef0123456789abcdef", files);
+        bench::do_not_optimize(result);
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.hpp"
+#include "cs/trace.hpp"
+
+using namespace std;
+using namespace cs;
+
+namespace
+{
+
+size_t spans(bool enabled, size_t iterations)
+{
+    trace::set_enabled(enabled);
+    size_t sum = 0;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        CS_TRACE_SPAN("bench", "bench");
+        sum += i;
+        bench::do_not_optimize(sum);
+    }
+    trace::set_enabled(false);
+    trace::clear();
+    return 0;
+}
+
+} // end anon ns
+
+
+/// the cost of a span compiled in while tracing is off
+BENCHMARK(trace_span_disabled)
+{
+    return spans(false, iterations);
+}
+
+/// two clock reads and a push to the ring of the thread
+BENCHMARK(trace_span_enabled)
+{
+    return spans(true, iterations);
+}
@@ -0,0 +1,102 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.hpp"
+#include "cs/config.hpp"
+#include <cassert>
+#include "uvpp/uvpp.hpp"
+
+using namespace std;
+using namespace uvpp;
+
+namespace
+{
+
+/**
+ * Writes @p iterations times @p msg over a loopback TCP connection, one write in flight at a time
+ * as ProtocolState does. The writer callback captures as much as the daemon one, it's passed on
+ * every write or installed once with set_write_callback when @p installed_callback.
+ */
+size_t loopback_writes(size_t iterations, const string& msg, bool installed_callback)
+{
+    uvpp::loop l;
+    Tcp server(l);
+    Tcp conn(l);
+    Tcp client(l);
+    bool ip4;
+    string ip;
+    int port;
+    server.bind("127.0.0.1", 0);
+    server.getsockname(ip4, ip, port);
+
+    static char rbuf[65536];
+    size_t received = 0;
+    const size_t total = iterations * msg.size();
+    server.listen([&](error) {
+        server.accept(conn);
+        conn.read_start(
+            [&](size_t) { return uv_buf_init(rbuf, sizeof(rbuf)); },
+            [&](const char*, ssize_t len) {
+                if (len > 0)
+                    received += len;
+                if (len < 0 || received == total)
+                {
+                    conn.close();
+                    server.close();
+                }
+            });
+    });
+
+    size_t written = 0;
+    const string peer = "tcp://127.0.0.1:12345, long enough to not be inline";
+    uv_buf_t buf = uv_buf_init(const_cast<char*>(msg.data()), msg.size());
+    function<void(error)> write_cb = [&, peer](error e) {
+        assert(! e);
+        if (++written == iterations)
+            client.close();
+        else if (installed_callback)
+            client.write(&buf, 1);
+        else
+            client.write(msg.data(), msg.size(), write_cb);
+    };
+    client.connect("127.0.0.1", port, [&](error) {
+        if (installed_callback)
+        {
+            client.set_write_callback(write_cb);
+            client.write(&buf, 1);
+        }
+        else
+            client.write(msg.data(), msg.size(), write_cb);
+    });
+    l.run();
+    assert(received == total);
+    return received;
+}
+
+} // end anon ns
+
+
+BENCHMARK(uvpp_write_loopback_64B)
+{
+    static const string msg(64, 'x');
+    return loopback_writes(iterations, msg, false);
+}
+
+BENCHMARK(uvpp_write_loopback_64B_installed_callback)
+{
+    static const string msg(64, 'x');
+    return loopback_writes(iterations, msg, true);
+}
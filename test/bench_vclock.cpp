@@ -0,0 +1,106 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.hpp"
+#include "cs/vclock.hpp"
+#include <random>
+
+using namespace std;
+using namespace cs;
+
+namespace
+{
+
+/**
+ * pairs of a clock with up to @p entries peers of the 64 of a share and a clock it descends from, the
+ * ancestor lacks some entries and has lower values in others
+ */
+vector<pair<Vclock, Vclock>> descendants(size_t entries)
+{
+    mt19937 rng(entries);
+    vector<pair<Vclock, Vclock>> result;
+    for (size_t i = 0; i < 256; ++i)
+    {
+        Vclock child;
+        Vclock parent;
+        for (size_t j = 0; j < entries; ++j)
+        {
+            const PeerId id = static_cast<PeerId>(1 + rng() % 64);
+            const u64 value = 1 + rng() % 1000;
+            child.merge(id, value);
+            if (rng() % 4)
+                parent.merge(id, value - rng() % value);
+        }
+        result.emplace_back(move(child), move(parent));
+    }
+    return result;
+}
+
+/// clocks with concurrent changes, neither descends from the other
+vector<pair<Vclock, Vclock>> concurrent(size_t entries)
+{
+    auto result = descendants(entries);
+    for (auto& clocks: result)
+        clocks.second.increment(65);
+    return result;
+}
+
+size_t is_descendant(const vector<pair<Vclock, Vclock>>& clocks, bool expected, size_t iterations)
+{
+    size_t matches = 0;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        const auto& pair = clocks[i % clocks.size()];
+        matches += pair.first.is_descendant(pair.second) == expected;
+    }
+    bench::do_not_optimize(matches);
+    return 0;
+}
+
+} // end anon ns
+
+
+BENCHMARK(vclock_is_descendant_2_peers)
+{
+    static const auto clocks = descendants(2);
+    return is_descendant(clocks, true, iterations);
+}
+
+BENCHMARK(vclock_is_descendant_16_peers)
+{
+    static const auto clocks = descendants(16);
+    return is_descendant(clocks, true, iterations);
+}
+
+BENCHMARK(vclock_is_descendant_concurrent_16_peers)
+{
+    static const auto clocks = concurrent(16);
+    return is_descendant(clocks, false, iterations);
+}
+
+BENCHMARK(vclock_pack_unpack_16_peers)
+{
+    static const auto clocks = descendants(16);
+    size_t bytes = 0;
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        const string packed = clocks[i % clocks.size()].first.pack();
+        const Vclock clock = Vclock::unpack(packed.data(), packed.size());
+        bench::do_not_optimize(clock);
+        bytes += packed.size();
+    }
+    return bytes;
+}
@@ -18,9 +18,11 @@
 
 #include "cs/server.hpp"
 #include "cs/core/share.hpp"
+#include "csserver.hpp"
 #include "test_utils.hpp"
 #include "cs/core/coder.hpp"
 #include "cs/core/message.hpp"
+#include "cs/metrics.hpp"
 #include <boost/test/unit_test.hpp>
 #include <vector>
 #include <iostream>
@@ -32,64 +34,6 @@ using namespace cs;
 using namespace cs::core;
 using namespace cs::core::msg;
 
-/**
- * A local server
- */
-class CSServer: public Server
-{
-public:
-    CSServer():
-        m_out_buff()
-    {
-       m_server_info.m_name = "CS test server"; 
-       m_server_info.m_protocol = 1;
-    }
-
-    Connection& add_connection(const std::string& name)
-    {
-        auto res = m_connections.emplace(name, make_unique<Connection>(m_server_info, m_shares));
-        assert(res.second);
-        m_out_buff.emplace(name, string());
-        auto do_write = [name, this](const char* buff, size_t sz)
-        {
-            assert(m_out_buff[name].empty());
-            m_out_buff[name] = {buff,sz};
-        };
-        Connection& conn = *res.first->second;
-        conn.m_protocolstate.set_write_fun(do_write);
-        return conn;
-    }
-
-    void receive(const std::string& connection, const core::msg::Message& m)
-    {
-        auto i = m_connections.find(connection);
-        if (i == m_connections.end())
-            throw std::runtime_error(fs("Connection: " << connection << " not found"));
-        Connection& conn = *i->second;
-        conn.m_protocolstate.input(Coder().encode_msg(m));
-    }
-
-    /// @returns data and notify protocol
-    std::string tx_write(const std::string& connection)
-    {
-        auto bi = m_out_buff.find(connection);
-        if (bi == m_out_buff.end())
-            throw std::runtime_error(fs("Connection: " << connection << " not found"));
-        string res = move(bi->second);
-
-        auto ci = m_connections.find(connection);
-        assert(ci != m_connections.end());
-        Connection& conn = *ci->second;
-        if (! res.empty())
-            /// this triggers the next write and fills the buffer, so we can write while(! empty) to read everything
-            conn.m_protocolstate.on_write_finished();
-        return move(res);
-    }
-
-    std::map<std::string, std::string> m_out_buff;
-};
-
-
 /**
  * Just a class excite the Server acting as a Peer
  */
@@ -101,6 +45,7 @@ public:
         , m_id{utils::random_bytes(16)}
         , m_messages_payload{}
         , m_payload_end{true}
+        , m_payload_msg{}
         , r_server(server)
         , m_protocolstate()
         , m_coder()
@@ -128,16 +73,21 @@ public:
 
     void handle_msg(char const* msg_encoded, size_t msg_sz, char const* signature, size_t signature_sz, bool payload)
     {
-        assert(m_payload_end);
+        // control messages can come between the chunks of a payload
+        assert(m_payload_end || ! payload);
         auto msg = m_coder.decode_msg(payload, msg_encoded, msg_sz, signature, signature_sz);
         m_messages_payload.emplace_back(move(msg), string());
-        m_payload_end = ! payload;
+        if (payload)
+        {
+            m_payload_msg = m_messages_payload.size() - 1;
+            m_payload_end = false;
+        }
     }
 
     void handle_payload(const char* data, size_t len)
     {
-        assert(! m_messages_payload.empty());
-        m_messages_payload.back().second.append(data, len);
+        assert(! m_payload_end);
+        m_messages_payload.at(m_payload_msg).second.append(data, len);
     }
 
     void handle_payload_end()
@@ -159,6 +109,8 @@ public:
     std::string m_id;
     vector<pair<unique_ptr<Message>, string>> m_messages_payload;
     bool m_payload_end;
+    /// message the payload being received belongs to
+    size_t m_payload_msg;
     CSServer& r_server;
     ProtocolState m_protocolstate;
     Coder m_coder;
@@ -209,13 +161,65 @@ void server_test_01_create_tree(const bfs::path& path)
     create_file(path / "wowa" / "b2", "b2");
 }
 
-Peer init_peer(const std::string& name, CSServer& server, const std::string& share_id)
+Peer init_peer(const std::string& name, CSServer& server, const std::string& share_id, const vector<string>& features = vector<string>())
 {
     Peer peer(name, server);
-    peer.send(Start{"CS_CORE v0.1", 1, vector<string>(), share_id, "read_write", utils::bin_to_hex(utils::random_bytes(16)), "name", "time"});
+    peer.send(Start{"CS_CORE v0.1", 1, features, share_id, "read_write", utils::bin_to_hex(utils::random_bytes(16)), "name", "time"});
     return peer;
 }
 
+/// @returns the connection @param name of @param client to a peer past the handshake that advertised @param features
+Connection& connect(CSServer& client, const string& name, const vector<string>& features = vector<string>())
+{
+    Connection& conn = client.add_connection(name);
+    conn.m_protocol.set_state(cs::core::protocol::CONNECTED);
+    conn.m_protocol.m_peerinfo.m_features = features;
+    return conn;
+}
+
+/**
+ * pass what the connection @param to of @param client wrote to the connection @param from of
+ * @param server and back once, @param sent sees what the client wrote
+ * @returns whether anything was passed
+ */
+bool exchange(CSServer& client, const string& to, CSServer& server, const string& from, const function<void(const string&)>& sent = nullptr)
+{
+    const string to_server = client.tx_write(to);
+    if (! to_server.empty())
+    {
+        if (sent)
+            sent(to_server);
+        server.receive_raw(from, to_server);
+    }
+    const string to_client = server.tx_write(from);
+    if (! to_client.empty())
+        client.receive_raw(to, to_client);
+    return ! to_server.empty() || ! to_client.empty();
+}
+
+/// exchange until neither side writes anything
+void pump(CSServer& client, const string& to, CSServer& server, const string& from, const function<void(const string&)>& sent = nullptr)
+{
+    while (exchange(client, to, server, from, sent))
+        ;
+}
+
+/**
+ * replace the contents of the files of @param share with @param checksum by @param data keeping
+ * their mtime, so the share doesn't notice and serves data not matching the checksum. Without
+ * keeping it the change is only missed when the test runs within the same second.
+ */
+void rewrite_keeping_mtime(share::Share& share, const string& checksum, const string& data)
+{
+    for (const auto& copy: share.get_mfiles_by_content(checksum))
+    {
+        const bfs::path path = share.fullpath(copy.path);
+        const auto mtime = bfs::last_write_time(path);
+        create_file(path, data);
+        bfs::last_write_time(path, mtime);
+    }
+}
+
 }
 
 
@@ -254,3 +258,549 @@ BOOST_AUTO_TEST_CASE(cs_send_file)
 }
 
 
+
+
+BOOST_AUTO_TEST_CASE(cs_pipelined_get)
+{
+    using namespace cs::core::share;
+    Tmpdir tmp;
+    server_test_01_create_tree(tmp.tmpdir);
+    // larger than a block, so it's sent in several chunks interleaved with the rest
+    const string big(200000, 'z');
+    create_file(tmp.tmpdir / "big", big);
+
+    CSServer server;
+    const string share_id = server.attach_share(tmp.tmpdir.string(), tmp.dbpath.string());
+    server.add_connection("test");
+    auto& share = server.share(share_id);
+    share.fullscan();
+
+    map<string, string> checksums;
+    for (const auto& file: share)
+        checksums[file.path] = file.checksum;
+
+    Peer peer = init_peer("test", server, share_id);
+    peer.read_from(server);
+    peer.m_messages_payload.clear();
+
+    // all requested before reading any reply
+    peer.send(Get(checksums["big"], 1));
+    peer.send(Get(checksums["a0"], 2));
+    peer.send(Get("no such checksum", 3));
+    peer.send(Get(checksums["wowa/b2"], 4));
+    peer.read_from(server);
+
+    map<u32, string> contents;
+    map<u32, size_t> ended_at;
+    for (size_t i = 0; i < peer.m_messages_payload.size(); ++i)
+    {
+        if (const NoSuchFile* no_such_file = dynamic_cast<const NoSuchFile*>(peer.msg(i)))
+        {
+            BOOST_CHECK_EQUAL(no_such_file->m_stream, 3u);
+            ended_at[no_such_file->m_stream] = i;
+            continue;
+        }
+        const FileData* file_data = dynamic_cast<const FileData*>(peer.msg(i));
+        BOOST_REQUIRE(file_data);
+        BOOST_CHECK(! ended_at.count(file_data->m_stream));
+        if (peer.payload(i).empty())
+            ended_at[file_data->m_stream] = i;
+        else
+            contents[file_data->m_stream] += peer.payload(i);
+    }
+
+    BOOST_CHECK_EQUAL(ended_at.size(), 4u);
+    BOOST_CHECK(contents[1] == big);
+    BOOST_CHECK_EQUAL(contents[2], cs::utils::read_file(share.fullpath("a0")));
+    BOOST_CHECK_EQUAL(contents[4], "b2");
+    // the small files don't wait for the big one
+    BOOST_CHECK_LT(ended_at[2], ended_at[1]);
+    BOOST_CHECK_LT(ended_at[4], ended_at[1]);
+}
+
+
+BOOST_AUTO_TEST_CASE(cs_pipelined_get_file)
+{
+    Tmpdir tmp;
+    server_test_01_create_tree(tmp.tmpdir);
+    Tmpdir rx;
+
+    CSServer server;
+    const string share_id = server.attach_share(tmp.tmpdir.string(), tmp.dbpath.string());
+    Connection& server_conn = server.add_connection("test");
+    server_conn.m_protocol.set_state(cs::core::protocol::CONNECTED);
+    server_conn.m_protocol.m_share = share_id;
+    auto& share = server.share(share_id);
+    share.fullscan();
+
+    // a protocol requesting files from the server
+    CSServer client;
+    Connection& conn = connect(client, "server", {protocol::feature::pipelined_get});
+    map<u32, bool> done;
+    conn.m_protocol.m_handle_get_done = [&done](u32 stream, const string&, bool found) {
+        done[stream] = found;
+    };
+
+    vector<pair<u32, bfs::path>> requested;
+    size_t i = 0;
+    for (const auto& file: share)
+    {
+        const bfs::path path = rx.tmpdir / fs("rx" << i++);
+        requested.emplace_back(conn.m_protocol.get_file(file.checksum, path), share.fullpath(file.path));
+    }
+    const u32 missing = conn.m_protocol.get_file("no such checksum", rx.tmpdir / "missing");
+    pump(client, "server", server, "test");
+
+    BOOST_CHECK_EQUAL(done.size(), requested.size() + 1);
+    BOOST_CHECK_EQUAL(done[missing], false);
+    i = 0;
+    for (const auto& req: requested)
+    {
+        BOOST_CHECK(done[req.first]);
+        BOOST_CHECK_EQUAL(cs::utils::read_file(rx.tmpdir / fs("rx" << i++)), cs::utils::read_file(req.second));
+    }
+    BOOST_CHECK(conn.m_protocol.m_rxstreams.empty());
+    BOOST_CHECK(server_conn.m_protocol.m_txstreams.empty());
+}
+
+
+BOOST_AUTO_TEST_CASE(cs_unpipelined_get_file)
+{
+    Tmpdir tmp;
+    server_test_01_create_tree(tmp.tmpdir);
+    Tmpdir rx;
+
+    CSServer server;
+    const string share_id = server.attach_share(tmp.tmpdir.string(), tmp.dbpath.string());
+    Connection& server_conn = server.add_connection("test");
+    server_conn.m_protocol.set_state(cs::core::protocol::CONNECTED);
+    server_conn.m_protocol.m_share = share_id;
+    auto& share = server.share(share_id);
+    share.fullscan();
+
+    // the peer didn't advertise pipelining, the Gets go without a stream one at a time
+    CSServer client;
+    Connection& conn = connect(client, "server");
+    map<u32, bool> done;
+    conn.m_protocol.m_handle_get_done = [&done](u32 stream, const string&, bool found) {
+        done[stream] = found;
+    };
+
+    vector<pair<u32, bfs::path>> requested;
+    size_t i = 0;
+    for (const auto& file: share)
+    {
+        const bfs::path path = rx.tmpdir / fs("rx" << i++);
+        requested.emplace_back(conn.m_protocol.get_file(file.checksum, path), share.fullpath(file.path));
+    }
+    const u32 missing = conn.m_protocol.get_file("no such checksum", rx.tmpdir / "missing");
+    BOOST_CHECK_THROW(conn.m_protocol.get_file(share.begin()->checksum, rx.tmpdir / "range", 1, 1), std::runtime_error);
+
+    Coder coder;
+    size_t gets = 0;
+    pump(client, "server", server, "test", [&](const string& to_server) {
+        const MsgRstate msg = find_message(to_server);
+        BOOST_REQUIRE(msg.found);
+        BOOST_CHECK_EQUAL(msg.enc_sig_sz, to_server.size());
+        const auto get = coder.decode_msg(false, msg.encoded, msg.encoded_sz, msg.signature, msg.signature_sz);
+        BOOST_REQUIRE(get->type() == MType::GET);
+        BOOST_CHECK_EQUAL(static_cast<const Get&>(*get).m_stream, 0u);
+        ++gets;
+    });
+
+    BOOST_CHECK_EQUAL(gets, requested.size() + 1);
+    BOOST_CHECK_EQUAL(done.size(), requested.size() + 1);
+    BOOST_CHECK_EQUAL(done[missing], false);
+    i = 0;
+    for (const auto& req: requested)
+    {
+        BOOST_CHECK(done[req.first]);
+        BOOST_CHECK_EQUAL(cs::utils::read_file(rx.tmpdir / fs("rx" << i++)), cs::utils::read_file(req.second));
+    }
+    BOOST_CHECK(conn.m_protocol.m_rxstreams.empty());
+    BOOST_CHECK(conn.m_protocol.m_unpipelined_gets.empty());
+}
+
+
+BOOST_AUTO_TEST_CASE(cs_pipelined_get_verify)
+{
+    Tmpdir tmp;
+    server_test_01_create_tree(tmp.tmpdir);
+    Tmpdir rx;
+
+    CSServer server;
+    const string share_id = server.attach_share(tmp.tmpdir.string(), tmp.dbpath.string());
+    Connection& server_conn = server.add_connection("test");
+    server_conn.m_protocol.set_state(cs::core::protocol::CONNECTED);
+    server_conn.m_protocol.m_share = share_id;
+    auto& share = server.share(share_id);
+    share.fullscan();
+
+    CSServer client;
+    Connection& conn = connect(client, "server", {protocol::feature::pipelined_get});
+    map<u32, bool> done;
+    conn.m_protocol.m_handle_get_done = [&done](u32 stream, const string&, bool found) {
+        done[stream] = found;
+    };
+
+    // the file changes after it was scanned, the peer sends data not matching the checksum
+    const auto file = *share.begin();
+    const string content = cs::utils::read_file(share.fullpath(file.path));
+    rewrite_keeping_mtime(share, file.checksum, content + "changed");
+    const u32 changed = conn.m_protocol.get_file(file.checksum, rx.tmpdir / "changed");
+    pump(client, "server", server, "test");
+
+    BOOST_CHECK_EQUAL(done.size(), 1u);
+    BOOST_CHECK_EQUAL(done[changed], false);
+    BOOST_CHECK(conn.m_protocol.m_rxstreams.empty());
+
+    // restored, it's verified
+    rewrite_keeping_mtime(share, file.checksum, content);
+    const u32 restored = conn.m_protocol.get_file(file.checksum, rx.tmpdir / "restored");
+    pump(client, "server", server, "test");
+    BOOST_CHECK(done[restored]);
+    BOOST_CHECK_EQUAL(cs::utils::read_file(rx.tmpdir / "restored"), content);
+}
+
+
+/// a server sharing a copy of the test tree, connected to a downloading client
+struct Seeder
+{
+    Seeder(const string& big):
+        m_tmp()
+        , m_server()
+        , m_share_id()
+        , m_conn()
+    {
+        server_test_01_create_tree(m_tmp.tmpdir);
+        create_file(m_tmp.tmpdir / "big", big);
+        m_share_id = m_server.attach_share(m_tmp.tmpdir.string(), m_tmp.dbpath.string());
+        m_conn = &m_server.add_connection("client");
+        m_conn->m_protocol.set_state(cs::core::protocol::CONNECTED);
+        m_conn->m_protocol.m_share = m_share_id;
+        m_server.share(m_share_id).fullscan();
+    }
+
+    string checksum(const string& path)
+    {
+        for (const auto& file: m_server.share(m_share_id))
+            if (file.path == path)
+                return file.checksum;
+        return string();
+    }
+
+    Tmpdir m_tmp;
+    CSServer m_server;
+    string m_share_id;
+    /// to the client
+    Connection* m_conn;
+};
+
+BOOST_AUTO_TEST_CASE(cs_swarm_download)
+{
+    string big;
+    for (size_t i = 0; big.size() < 300000; ++i)
+        big += fs(i << ",");
+    Seeder a(big);
+    Seeder b(big);
+    const string checksum = a.checksum("big");
+    BOOST_REQUIRE_EQUAL(checksum, b.checksum("big"));
+    Tmpdir rx;
+
+    CSServer client;
+    Connection& to_a = connect(client, "a", {protocol::feature::pipelined_get});
+    connect(client, "b", {protocol::feature::pipelined_get});
+
+    // a range of the file, and the whole file in pieces from both meanwhile
+    bool range_done = false;
+    to_a.m_protocol.m_handle_get_done = [&range_done](u32, const string&, bool found) { range_done = found; };
+    to_a.m_protocol.get_file(checksum, rx.tmpdir / "range", 100000, 70000);
+
+    const u64 saved_piece_sz = download::Download::s_piece_sz;
+    download::Download::s_piece_sz = 32768;
+    vector<pair<string, bool>> done;
+    client.m_handle_download_done = [&done](const string& checksum, bool complete) { done.emplace_back(checksum, complete); };
+    client.download(checksum, big.size(), rx.tmpdir / "big", {"a", "b"});
+    BOOST_CHECK(client.downloading(checksum));
+    while (exchange(client, "a", a.m_server, "client") | exchange(client, "b", b.m_server, "client"))
+        ;
+    download::Download::s_piece_sz = saved_piece_sz;
+
+    // each request is reported to whoever made it
+    BOOST_CHECK(range_done);
+    BOOST_CHECK(cs::utils::read_file(rx.tmpdir / "range") == string(100000, '\0') + big.substr(100000, 70000));
+    BOOST_REQUIRE_EQUAL(done.size(), 1u);
+    BOOST_CHECK_EQUAL(done[0].first, checksum);
+    BOOST_CHECK(done[0].second);
+    BOOST_CHECK(! client.downloading(checksum));
+    BOOST_CHECK(cs::utils::read_file(rx.tmpdir / "big") == big);
+}
+
+BOOST_AUTO_TEST_CASE(cs_swarm_download_verify)
+{
+    const string big = cs::utils::random_bytes(200000);
+    Seeder seeder(big);
+    const string checksum = seeder.checksum("big");
+    // the peer sends other data than it announced, all of it in ranges
+    share::Share& share = seeder.m_server.share(seeder.m_share_id);
+    rewrite_keeping_mtime(share, checksum, cs::utils::random_bytes(big.size()));
+    Tmpdir rx;
+
+    CSServer client;
+    connect(client, "seeder", {protocol::feature::pipelined_get});
+    vector<pair<string, bool>> done;
+    client.m_handle_download_done = [&done](const string& checksum, bool complete) { done.emplace_back(checksum, complete); };
+    client.download(checksum, big.size(), rx.tmpdir / "big", {"seeder"});
+    pump(client, "seeder", seeder.m_server, "client");
+
+    BOOST_REQUIRE_EQUAL(done.size(), 1u);
+    BOOST_CHECK(! done[0].second);
+    BOOST_CHECK(! client.downloading(checksum));
+
+    // hashed by the connection that brought the last piece, reported once the hash is done
+    rewrite_keeping_mtime(share, checksum, big);
+    vector<pair<bfs::path, hash_done_t>> hashing;
+    client.connection("seeder").m_protocol.m_handle_hash_file = [&hashing](const bfs::path& path, hash_done_t done) {
+        hashing.emplace_back(path, done);
+    };
+    client.download(checksum, big.size(), rx.tmpdir / "big", {"seeder"});
+    pump(client, "seeder", seeder.m_server, "client");
+    BOOST_REQUIRE_EQUAL(hashing.size(), 1u);
+    BOOST_CHECK_EQUAL(done.size(), 1u);
+    BOOST_CHECK(client.downloading(checksum));
+    hashing[0].second(sha256_file(hashing[0].first));
+    BOOST_REQUIRE_EQUAL(done.size(), 2u);
+    BOOST_CHECK(done[1].second);
+    BOOST_CHECK(! client.downloading(checksum));
+}
+
+BOOST_AUTO_TEST_CASE(cs_recieve_file)
+{
+    const string big = cs::utils::random_bytes(200000);
+    Seeder seeder(big);
+    const string checksum = seeder.checksum("big");
+    Tmpdir rx;
+
+    // a Get without a stream whose reply goes to the file given beforehand
+    CSServer client;
+    Connection& conn = connect(client, "seeder");
+    map<u32, bool> done;
+    const u32 stream = conn.m_protocol.recieve_file(rx.tmpdir / "big", [&done](u32 stream, const string&, bool found) { done[stream] = found; });
+    conn.m_protocol.send_msg(Get(checksum));
+    pump(client, "seeder", seeder.m_server, "client");
+    BOOST_REQUIRE_EQUAL(done.size(), 1u);
+    BOOST_CHECK(done[stream]);
+    BOOST_CHECK(cs::utils::read_file(rx.tmpdir / "big") == big);
+    BOOST_CHECK(conn.m_protocol.m_rxstreams.empty());
+
+    // data not matching the checksum is reported
+    rewrite_keeping_mtime(seeder.m_server.share(seeder.m_share_id), checksum, big + "changed");
+    const u32 changed = conn.m_protocol.recieve_file(rx.tmpdir / "changed", [&done](u32 stream, const string&, bool found) { done[stream] = found; });
+    conn.m_protocol.send_msg(Get(checksum));
+    pump(client, "seeder", seeder.m_server, "client");
+    BOOST_REQUIRE_EQUAL(done.size(), 2u);
+    BOOST_CHECK(! done[changed]);
+}
+
+BOOST_AUTO_TEST_CASE(cs_cancel_get)
+{
+    const string big = cs::utils::random_bytes(1 << 20);
+    Seeder seeder(big);
+    const string checksum = seeder.checksum("big");
+    Tmpdir rx;
+
+    CSServer client;
+    Connection& conn = connect(client, "seeder", {protocol::feature::pipelined_get, protocol::feature::cancel_get});
+    map<u32, bool> done;
+    conn.m_protocol.m_handle_get_done = [&done](u32 stream, const string&, bool found) { done[stream] = found; };
+
+    const u32 stream = conn.m_protocol.get_file(checksum, rx.tmpdir / "big");
+    // ids of requests outstanding aren't given again when they wrap around
+    conn.m_protocol.m_next_stream = stream;
+    const u32 other = conn.m_protocol.get_file("no such checksum", rx.tmpdir / "missing");
+    BOOST_CHECK_NE(other, stream);
+
+    seeder.m_server.receive_raw("client", client.tx_write("seeder"));
+    BOOST_REQUIRE_EQUAL(seeder.m_conn->m_protocol.m_txstreams.size(), 1u);
+    // nor accepted twice by the sender
+    BOOST_CHECK_THROW(seeder.m_conn->m_protocol.do_get(checksum, stream), protocol::ProtocolError);
+    conn.m_protocolstate.input(seeder.m_server.tx_write("client"));
+    BOOST_REQUIRE(! conn.m_protocol.m_rxstreams.at(stream).closing);
+
+    // the sender ends the stream early, what arrives meanwhile is dropped
+    conn.m_protocol.cancel_get(stream);
+    pump(client, "seeder", seeder.m_server, "client");
+    BOOST_CHECK_EQUAL(done.size(), 1u);
+    BOOST_CHECK(done.count(other));
+    BOOST_CHECK(conn.m_protocol.m_rxstreams.empty());
+    BOOST_CHECK(seeder.m_conn->m_protocol.m_txstreams.empty());
+    BOOST_CHECK_LT(bfs::file_size(rx.tmpdir / "big"), big.size());
+}
+
+
+BOOST_AUTO_TEST_CASE(cs_download_local_copy)
+{
+    const string big = cs::utils::random_bytes(100000);
+    Seeder local(big);
+    const string checksum = local.checksum("big");
+    BOOST_REQUIRE(! checksum.empty());
+    Tmpdir rx;
+
+    // no peers are needed for content that is already in a share
+    vector<pair<string, bool>> done;
+    local.m_server.m_handle_download_done = [&done](const string& checksum, bool complete) { done.emplace_back(checksum, complete); };
+    local.m_server.download(checksum, big.size(), rx.tmpdir / "copy", {});
+    BOOST_REQUIRE_EQUAL(done.size(), 1u);
+    BOOST_CHECK(done[0].second);
+    BOOST_CHECK(! local.m_server.downloading(checksum));
+    BOOST_CHECK(cs::utils::read_file(rx.tmpdir / "copy") == big);
+
+    // copied in the background, it's being downloaded until the copy is done
+    vector<function<void()>> copies;
+    local.m_server.m_handle_clone_file = [&copies](const bfs::path& from, const bfs::path& to, cs::clone_done_t done) {
+        copies.emplace_back([from, to, done]() { cs::clone_file(from, to, done); });
+    };
+    local.m_server.download(checksum, big.size(), rx.tmpdir / "later", {});
+    BOOST_CHECK(local.m_server.downloading(checksum));
+    BOOST_CHECK_EQUAL(done.size(), 1u);
+    BOOST_REQUIRE_EQUAL(copies.size(), 1u);
+    copies[0]();
+    BOOST_REQUIRE_EQUAL(done.size(), 2u);
+    BOOST_CHECK(done[1].second);
+    BOOST_CHECK(! local.m_server.downloading(checksum));
+    BOOST_CHECK(cs::utils::read_file(rx.tmpdir / "later") == big);
+
+    // modified since the scan, it can't be trusted
+    const bfs::path path = local.m_server.share(local.m_share_id).fullpath("big");
+    create_file(path, big);
+    bfs::last_write_time(path, bfs::last_write_time(path) - 10);
+    local.m_server.download(checksum, big.size(), rx.tmpdir / "stale", {});
+    BOOST_REQUIRE_EQUAL(done.size(), 3u);
+    BOOST_CHECK(! done[2].second);
+}
+
+BOOST_AUTO_TEST_CASE(cs_update_by_peer_id)
+{
+    Tmpdir tmp;
+    server_test_01_create_tree(tmp.tmpdir);
+    CSServer server;
+    const string share_id = server.attach_share(tmp.tmpdir.string(), tmp.dbpath.string());
+    Connection& conn = connect(server, "test");
+    conn.m_protocol.m_share = share_id;
+    conn.m_protocol.m_peerinfo.m_peer = "P";
+    conn.m_protocol.m_peerinfo.m_name = "a name anyone can pick";
+    share::RemoteUpdate update;
+    conn.m_protocol.m_handle_remote_update = [&update](const share::RemoteUpdate& remote_update) { update = remote_update; };
+
+    // the peer had our version of a0 when it changed it, it's not a conflict
+    share::Share& share = server.share(share_id);
+    share.fullscan();
+    const auto a0 = share.get_file_info("a0");
+    BOOST_REQUIRE(a0);
+    share.remote_update_applied("P", {a0->to_msg_mfile()});
+    conn.m_protocol.do_update({MFile("changed", "a0", "P", 1, "", 1, false, a0->mode)});
+    BOOST_CHECK(update.conflict.empty());
+    BOOST_CHECK_EQUAL(update.download.size(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(cs_payload_metrics_by_peer_id)
+{
+    const string big = cs::utils::random_bytes(1000);
+    const string series = "cs_peer_payload_bytes_total{direction=\"out\",peer=\"metrics peer\"}";
+    CSServer client;
+    Connection& conn = connect(client, "seeder");
+    Tmpdir rx;
+    {
+        Seeder seeder(big);
+        seeder.m_conn->m_protocol.m_peerinfo.m_peer = "metrics peer";
+        seeder.m_conn->m_protocol.m_peerinfo.m_name = "a name anyone can pick";
+        conn.m_protocol.recieve_file(rx.tmpdir / "big");
+        conn.m_protocol.send_msg(Get(seeder.checksum("big")));
+        pump(client, "seeder", seeder.m_server, "client");
+        const string prometheus = cs::metrics::Registry::global().prometheus();
+        BOOST_CHECK_NE(prometheus.find(series + " 1000\n"), string::npos);
+        BOOST_CHECK_EQUAL(prometheus.find("a name anyone can pick"), string::npos);
+    }
+    // the series goes away with the connection
+    BOOST_CHECK_EQUAL(cs::metrics::Registry::global().prometheus().find(series), string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(cs_read_only_peer)
+{
+    Tmpdir tmp;
+    server_test_01_create_tree(tmp.tmpdir);
+    CSServer server;
+    const string share_id = server.attach_share(tmp.tmpdir.string(), tmp.dbpath.string());
+    // authenticated with the read only key of the share
+    Connection& conn = server.add_connection("test");
+    conn.m_protocol.m_authorized_share = share_id;
+    conn.m_protocol.m_authorized_access = "ro";
+    size_t errors = 0;
+    conn.m_protocolstate.m_handle_error = [&errors]() { ++errors; };
+
+    // it can't ask for more
+    server.receive("test", Start{"CS_CORE v0.1", 1, {}, share_id, "read_write", "P", "name", "time"});
+    BOOST_CHECK_EQUAL(errors, 1u);
+    const string refused = server.tx_write("test");
+    const MsgRstate msg = find_message(refused);
+    BOOST_REQUIRE(msg.found);
+    BOOST_CHECK(Coder().decode_msg(false, msg.encoded, msg.encoded_sz, msg.signature, msg.signature_sz)->type() == MType::CANNOT_START);
+
+    Peer peer("test", server);
+    peer.send(Start{"CS_CORE v0.1", 1, {}, share_id, "read_only", "P", "name", "time"});
+    peer.read_from(server);
+    BOOST_REQUIRE_EQUAL(peer.m_messages_payload.size(), 1u);
+    BOOST_CHECK(dynamic_cast<Go*>(peer.msg(0)));
+
+    // it reads the share but can't change it
+    bool updated = false;
+    conn.m_protocol.m_handle_remote_update = [&updated](const share::RemoteUpdate&) { updated = true; };
+    peer.send(GetUpdates());
+    peer.read_from(server);
+    BOOST_CHECK_EQUAL(peer.m_messages_payload.size(), 2u);
+    peer.send(Update(1, false, {MFile("new", "new", "P", 1, "", 1, false, 0644)}));
+    BOOST_CHECK_EQUAL(errors, 2u);
+    BOOST_CHECK(! updated);
+}
+
+BOOST_AUTO_TEST_CASE(cs_control_during_get)
+{
+    Tmpdir tmp;
+    server_test_01_create_tree(tmp.tmpdir);
+    const string big(1 << 20, 'z');
+    create_file(tmp.tmpdir / "big", big);
+
+    CSServer server;
+    const string share_id = server.attach_share(tmp.tmpdir.string(), tmp.dbpath.string());
+    server.add_connection("test");
+    auto& share = server.share(share_id);
+    share.fullscan();
+
+    string big_checksum;
+    for (const auto& file: share)
+        if (file.path == "big")
+            big_checksum = file.checksum;
+
+    // the peer parses control messages between the chunks of a payload
+    Peer peer = init_peer("test", server, share_id, {protocol::feature::interleaved_control});
+    peer.read_from(server);
+    peer.m_messages_payload.clear();
+
+    peer.send(Get(big_checksum));
+    peer.m_protocolstate.input(server.tx_write("test"));
+    peer.m_protocolstate.input(server.tx_write("test"));
+    BOOST_REQUIRE(! peer.m_payload_end);
+    // answered while the file is still being sent
+    peer.send(GetUpdates());
+    // after the chunk being written
+    peer.m_protocolstate.input(server.tx_write("test"));
+    peer.m_protocolstate.input(server.tx_write("test"));
+    BOOST_REQUIRE_EQUAL(peer.m_messages_payload.size(), 2u);
+    BOOST_CHECK(dynamic_cast<const Update*>(peer.msg(1)));
+    BOOST_CHECK(! peer.m_payload_end);
+
+    peer.read_from(server);
+    BOOST_CHECK(peer.m_payload_end);
+    BOOST_CHECK(dynamic_cast<const FileData*>(peer.msg(0)));
+    BOOST_CHECK(peer.payload(0) == big);
+}
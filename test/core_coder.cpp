@@ -122,3 +122,187 @@ BOOST_AUTO_TEST_CASE(MessageTest_type_manifest) {
     }
 }
 #endif
+
+
+namespace
+{
+
+unique_ptr<Message> decode(Coder& coder, const std::string& encoded)
+{
+    return coder.decode_msg(false, encoded.c_str(), encoded.size(), nullptr, 0);
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(coder_update_roundtrip)
+{
+    Coder coder;
+    Update update(12, true, {
+        MFile("cksum_a", "a/b", "peer_a", 3, "2014-03-01T10:00:00Z", 1024, false, 0644),
+        MFile("", "c", "peer_b", 7, "2014-03-02T10:00:00Z", 0, true, 0),
+    });
+    const string coded = coder.encode_msg(update);
+    cs::MsgRstate mrs = cs::find_message(coded);
+    BOOST_REQUIRE(mrs.found);
+
+    auto msg = coder.decode_msg(false, mrs.encoded, mrs.encoded_sz, nullptr, 0);
+    const Update* decoded = dynamic_cast<const Update*>(msg.get());
+    BOOST_REQUIRE(decoded);
+    BOOST_CHECK_EQUAL(decoded->m_revision, 12u);
+    BOOST_CHECK(decoded->m_partial);
+    BOOST_REQUIRE_EQUAL(decoded->m_files.size(), 2u);
+    for (size_t i = 0; i < update.m_files.size(); ++i)
+    {
+        const MFile& x = update.m_files[i];
+        const MFile& y = decoded->m_files[i];
+        BOOST_CHECK_EQUAL(x.checksum, y.checksum);
+        BOOST_CHECK_EQUAL(x.path, y.path);
+        BOOST_CHECK_EQUAL(x.last_changed_by, y.last_changed_by);
+        BOOST_CHECK_EQUAL(x.last_changed_rev, y.last_changed_rev);
+        BOOST_CHECK_EQUAL(x.mtime, y.mtime);
+        BOOST_CHECK_EQUAL(x.size, y.size);
+        BOOST_CHECK_EQUAL(x.deleted, y.deleted);
+        BOOST_CHECK_EQUAL(x.mode, y.mode);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coder_update_files_member_order)
+{
+    // type after files, unknown members and optional deleted are allowed
+    Coder coder;
+    auto msg = decode(coder, R"({"files":[{"mode":420,"size":3,"path":"x","extra":{"a":[1]},"checksum":"c","mtime":"t","last_changed_rev":1,"last_changed_by":"p"}],"revision":2,"type":"update"})");
+    const Update* decoded = dynamic_cast<const Update*>(msg.get());
+    BOOST_REQUIRE(decoded);
+    BOOST_CHECK(! decoded->m_partial);
+    BOOST_REQUIRE_EQUAL(decoded->m_files.size(), 1u);
+    BOOST_CHECK_EQUAL(decoded->m_files[0].path, "x");
+    BOOST_CHECK_EQUAL(decoded->m_files[0].mode, 420u);
+    BOOST_CHECK(! decoded->m_files[0].deleted);
+}
+
+BOOST_AUTO_TEST_CASE(coder_update_files_errors)
+{
+    Coder coder;
+    // missing size
+    BOOST_CHECK_THROW(decode(coder, R"({"files":[{"mode":420,"path":"x","checksum":"c","mtime":"t","last_changed_rev":1,"last_changed_by":"p"}],"revision":2,"type":"update"})"), CoderError);
+    // wrong type
+    BOOST_CHECK_THROW(decode(coder, R"({"files":[{"mode":420,"size":"3","path":"x","checksum":"c","mtime":"t","last_changed_rev":1,"last_changed_by":"p"}],"revision":2,"type":"update"})"), CoderError);
+    BOOST_CHECK_THROW(decode(coder, R"({"files":[1, 2],"revision":2,"type":"update"})"), CoderError);
+    BOOST_CHECK_THROW(decode(coder, R"({"files":{"a":1},"revision":2,"type":"update"})"), CoderError);
+    BOOST_CHECK_THROW(decode(coder, R"({"files":[{"mode":420,)"), CoderError);
+
+    // files on a message that is not an Update are not an error
+    auto msg = decode(coder, R"({"files":3,"type":"ping","timeout":5})");
+    const Ping* ping = dynamic_cast<const Ping*>(msg.get());
+    BOOST_REQUIRE(ping);
+    BOOST_CHECK_EQUAL(ping->m_timeout, 5u);
+}
+
+namespace
+{
+
+string body(const string& coded)
+{
+    cs::MsgRstate mrs = cs::find_message(coded);
+    BOOST_REQUIRE(mrs.found);
+    BOOST_CHECK_EQUAL(mrs.enc_sig_sz, coded.size());
+    return string(mrs.encoded, mrs.encoded_sz);
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(coder_encode_byte_identical)
+{
+    // expected output as produced by serializing a jsoncons DOM
+    Coder coder;
+    Update update(12, true, {
+        MFile("cksum_a", "a/\"q\"\\b/\xc3\xa9\t/x", "peer_a", 3, "2014-03-01T10:00:00Z", 1024, false, 0644),
+        MFile("", "c", "peer_b", 18446744073709551615ULL, "2014-03-02T10:00:00Z", 0, true, 0),
+    });
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(update)),
+        "{\"files\":[{\"checksum\":\"cksum_a\",\"deleted\":false,\"last_changed_by\":\"peer_a\",\"last_changed_rev\":3,\"mode\":420,\"mtime\":\"2014-03-01T10:00:00Z\",\"path\":\"a/\\\"q\\\"\\b/\xc3\xa9\\t/x\",\"size\":1024},"
+        "{\"checksum\":\"\",\"deleted\":true,\"last_changed_by\":\"peer_b\",\"last_changed_rev\":18446744073709551615,\"mode\":0,\"mtime\":\"2014-03-02T10:00:00Z\",\"path\":\"c\",\"size\":0}],\"partial\":true,\"revision\":12,\"type\":\"update\"}");
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(Update(0))), R"({"files":[],"partial":false,"revision":0,"type":"update"})");
+
+    Start start("sw", -1, {"a", "b"}, "id", "rw", "peer", "name", "time");
+    start.m_signature = "sig";
+    const string coded_start = coder.encode_msg(start);
+    BOOST_CHECK_EQUAL(coded_start[0], 's');
+    BOOST_CHECK_EQUAL(body(coded_start), R"({"access":"rw","features":["a","b"],"id":"id","name":"name","peer":"peer","protocol":-1,"software":"sw","time":"time","type":"start"})");
+    BOOST_CHECK_EQUAL(coded_start.substr(coded_start.size() - 3), "sig");
+
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(Go("sw", 1, {}, "id", "rw", "peer", "name", "time"))),
+        R"({"access":"rw","features":[],"id":"id","name":"name","peer":"peer","protocol":1,"software":"sw","time":"time","type":"go"})");
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(GetUpdates({{"b", 2}, {"a", 1}, {"B", 3}}))), R"({"since":{"B":3,"a":1,"b":2},"type":"get_updates"})");
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(GetUpdates())), R"({"since":{},"type":"get_updates"})");
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(Get("ck"))), R"({"checksum":"ck","type":"get"})");
+    const string coded_filedata = coder.encode_msg(FileData("ck"));
+    BOOST_CHECK_EQUAL(coded_filedata[0], '!');
+    BOOST_CHECK_EQUAL(body(coded_filedata), R"({"checksum":"ck","type":"file_data"})");
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(NoSuchFile("ck"))), R"({"checksum":"ck","type":"no_such_file"})");
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(Get("ck", 7))), R"({"checksum":"ck","stream":7,"type":"get"})");
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(FileData("ck", 7))), R"({"checksum":"ck","stream":7,"type":"file_data"})");
+    const string coded_get = body(coder.encode_msg(Get("ck", 7)));
+    unique_ptr<Message> get = coder.decode_msg(false, coded_get.c_str(), coded_get.size(), nullptr, 0);
+    BOOST_CHECK_EQUAL(static_cast<Get*>(get.get())->m_stream, 7u);
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(Get("ck", 7, 0, 10))), R"({"checksum":"ck","length":10,"offset":0,"stream":7,"type":"get"})");
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(FileData("ck", 7, 65536))), R"({"checksum":"ck","offset":65536,"stream":7,"type":"file_data"})");
+    const string coded_range = body(coder.encode_msg(Get("ck", 7, 1ull << 33, 4096)));
+    unique_ptr<Message> range = coder.decode_msg(false, coded_range.c_str(), coded_range.size(), nullptr, 0);
+    BOOST_CHECK_EQUAL(static_cast<Get*>(range.get())->m_offset, 1ull << 33);
+    BOOST_CHECK_EQUAL(static_cast<Get*>(range.get())->m_length, 4096u);
+    const string coded_cancel = body(coder.encode_msg(Cancel("ck", 7)));
+    BOOST_CHECK_EQUAL(coded_cancel, R"({"checksum":"ck","stream":7,"type":"cancel"})");
+    unique_ptr<Message> cancel = coder.decode_msg(false, coded_cancel.c_str(), coded_cancel.size(), nullptr, 0);
+    BOOST_REQUIRE(cancel->type() == MType::CANCEL);
+    BOOST_CHECK_EQUAL(static_cast<Cancel*>(cancel.get())->m_stream, 7u);
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(CannotStart())), R"({"type":"cannot_start"})");
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(Ping())), R"({"timeout":60,"type":"ping"})");
+}
+
+BOOST_AUTO_TEST_CASE(coder_encode_append)
+{
+    // encoding appends to the given buffer, several frames can be batched
+    Coder coder;
+    string out = "prefix";
+    coder.encode_msg(Get("a"), out);
+    coder.encode_msg(Get("b"), out);
+    BOOST_REQUIRE_EQUAL(out.substr(0, 6), "prefix");
+    const string frames = out.substr(6);
+    cs::MsgRstate first = cs::find_message(frames);
+    BOOST_REQUIRE(first.found);
+    BOOST_CHECK_EQUAL(string(first.encoded, first.encoded_sz), R"({"checksum":"a","type":"get"})");
+    const string rest = frames.substr(first.enc_sig_sz);
+    BOOST_CHECK_EQUAL(body(rest), R"({"checksum":"b","type":"get"})");
+    BOOST_CHECK(coder.encode_msg(Get("a")) + coder.encode_msg(Get("b")) == frames);
+}
+
+namespace
+{
+
+/// an Update whose encoding fails once its body is written
+class FailingUpdate: public Update
+{
+public:
+    using Update::accept;
+
+    void accept(ConstMessageVisitor& v) const override
+    {
+        v.visit(static_cast<const Update&>(*this));
+        throw std::runtime_error("encoding failed");
+    }
+};
+
+} // end anon ns
+
+BOOST_AUTO_TEST_CASE(coder_encode_error)
+{
+    // a failed encode leaves the buffer as it was and the next messages are well formed
+    Coder coder;
+    string out = "prefix";
+    BOOST_CHECK_THROW(coder.encode_msg(FailingUpdate(), out), std::runtime_error);
+    BOOST_CHECK_EQUAL(out, "prefix");
+    coder.encode_msg(Get("a"), out);
+    BOOST_CHECK_EQUAL(body(out.substr(6)), R"({"checksum":"a","type":"get"})");
+    BOOST_CHECK_EQUAL(body(coder.encode_msg(Ping())), R"({"timeout":60,"type":"ping"})");
+}
@@ -0,0 +1,202 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include "cs/core/download.hpp"
+#include <tuple>
+
+using namespace cs;
+using namespace cs::core::download;
+using namespace std;
+
+namespace
+{
+
+/// records the requests of a Download and the ones it cancels
+struct Requests
+{
+    Requests():
+        m_next_id(1)
+        , m_log()
+        , m_cancelled()
+    {}
+
+    Download::request_t fun()
+    {
+        return [this](const string& peer, u64 offset, u64 length)
+        {
+            m_log.emplace_back(peer, offset, length, m_next_id);
+            return m_next_id++;
+        };
+    }
+
+    Download::cancel_t cancel_fun()
+    {
+        return [this](const string& peer, u32 request)
+        {
+            m_cancelled.emplace_back(peer, request);
+        };
+    }
+
+    /// @returns the requests to @param peer
+    vector<tuple<string, u64, u64, u32>> to(const string& peer) const
+    {
+        vector<tuple<string, u64, u64, u32>> result;
+        for (const auto& req: m_log)
+            if (get<0>(req) == peer)
+                result.push_back(req);
+        return result;
+    }
+
+    u32 m_next_id;
+    vector<tuple<string, u64, u64, u32>> m_log;
+    vector<pair<string, u32>> m_cancelled;
+};
+
+/// sets small pieces for the duration of a test
+struct PieceSize
+{
+    PieceSize(u64 sz):
+        m_saved(Download::s_piece_sz)
+    {
+        Download::s_piece_sz = sz;
+    }
+
+    ~PieceSize()
+    {
+        Download::s_piece_sz = m_saved;
+    }
+
+    u64 m_saved;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(download_spread)
+{
+    PieceSize piece_sz(100);
+    Requests requests;
+    const auto t0 = Download::clock::now();
+    Download download("ck", 1050, requests.fun());
+    BOOST_CHECK_EQUAL(download.pieces(), 11u);
+    download.add_peer("a", t0);
+    download.add_peer("b", t0);
+    download.add_peer("c", t0);
+    BOOST_CHECK_EQUAL(requests.m_log.size(), 11u);
+    BOOST_CHECK_EQUAL(download.requests("a"), Download::s_max_requests);
+    BOOST_CHECK_EQUAL(download.requests("b"), Download::s_max_requests);
+    BOOST_CHECK_EQUAL(download.requests("c"), 3u);
+    // the last piece is short
+    u64 total = 0;
+    for (const auto& req: requests.m_log)
+        total += get<2>(req);
+    BOOST_CHECK_EQUAL(total, 1050u);
+
+    auto log = requests.m_log;
+    for (const auto& req: log)
+        download.request_done(get<0>(req), get<3>(req), true, t0 + chrono::milliseconds(10));
+    BOOST_CHECK(download.done());
+    BOOST_CHECK_EQUAL(requests.m_log.size(), 11u);
+}
+
+BOOST_AUTO_TEST_CASE(download_empty)
+{
+    Requests requests;
+    Download download("ck", 0, requests.fun());
+    download.add_peer("a");
+    BOOST_CHECK(download.done());
+    BOOST_CHECK(requests.m_log.empty());
+}
+
+BOOST_AUTO_TEST_CASE(download_peer_without_file)
+{
+    PieceSize piece_sz(100);
+    Requests requests;
+    const auto t0 = Download::clock::now();
+    Download download("ck", 400, requests.fun());
+    download.add_peer("a", t0);
+    download.add_peer("b", t0);
+    const auto to_a = requests.to("a");
+    BOOST_REQUIRE(! to_a.empty());
+    // a doesn't have it, all its pieces go to b
+    download.request_done("a", get<3>(to_a[0]), false, t0);
+    BOOST_CHECK_EQUAL(download.peers(), 1u);
+    BOOST_CHECK_EQUAL(download.requests("b"), 4u);
+    // late replies of a are ignored
+    for (const auto& req: to_a)
+        download.request_done("a", get<3>(req), true, t0);
+    BOOST_CHECK_EQUAL(download.pieces_done(), 0u);
+    for (const auto& req: requests.to("b"))
+        download.request_done("b", get<3>(req), true, t0);
+    BOOST_CHECK(download.done());
+}
+
+BOOST_AUTO_TEST_CASE(download_slow_peer)
+{
+    PieceSize piece_sz(100);
+    Requests requests;
+    const auto t0 = Download::clock::now();
+    Download download("ck", 2000, requests.fun(), requests.cancel_fun());
+    download.add_peer("fast", t0);
+    download.add_peer("slow", t0);
+    const u32 first_fast = get<3>(requests.to("fast")[0]);
+    const u32 first_slow = get<3>(requests.to("slow")[0]);
+    download.request_done("fast", first_fast, true, t0 + chrono::milliseconds(10));
+    download.request_done("slow", first_slow, true, t0 + chrono::seconds(1));
+    BOOST_CHECK_GT(download.rate("fast"), download.rate("slow") * Download::s_slow_factor);
+
+    // the slow peer gets no new pieces, the fast one takes over those it holds at the end
+    const size_t slow_requests = requests.to("slow").size();
+    auto now = t0 + chrono::seconds(1);
+    for (size_t i = 0; i < 100 && ! download.done(); ++i)
+    {
+        now += chrono::milliseconds(10);
+        for (const auto& req: requests.to("fast"))
+            download.request_done("fast", get<3>(req), true, now);
+    }
+    BOOST_CHECK(download.done());
+    BOOST_CHECK_EQUAL(requests.to("slow").size(), slow_requests);
+    // the requests it still held were cancelled when the fast one sent their pieces
+    BOOST_CHECK_EQUAL(download.requests("slow"), 0u);
+    BOOST_CHECK_EQUAL(requests.m_cancelled.size(), slow_requests - 1);
+    for (const auto& cancelled: requests.m_cancelled)
+        BOOST_CHECK_EQUAL(cancelled.first, "slow");
+}
+
+BOOST_AUTO_TEST_CASE(download_timeout)
+{
+    PieceSize piece_sz(100);
+    Requests requests;
+    const auto t0 = Download::clock::now();
+    Download download("ck", 100, requests.fun(), requests.cancel_fun());
+    download.add_peer("a", t0);
+    BOOST_REQUIRE_EQUAL(requests.m_log.size(), 1u);
+    download.add_peer("b", t0);
+    BOOST_CHECK_EQUAL(requests.m_log.size(), 1u);
+
+    // the request to a times out and the piece goes to b too
+    download.tick(t0 + Download::s_request_timeout + chrono::seconds(1));
+    BOOST_REQUIRE_EQUAL(requests.to("b").size(), 1u);
+    BOOST_CHECK_GT(download.rate("a"), 0);
+    // whichever arrives first completes it, the other one is cancelled
+    download.request_done("a", get<3>(requests.to("a")[0]), true, t0 + Download::s_request_timeout + chrono::seconds(2));
+    BOOST_CHECK(download.done());
+    BOOST_REQUIRE_EQUAL(requests.m_cancelled.size(), 1u);
+    BOOST_CHECK(requests.m_cancelled[0] == make_pair(string("b"), get<3>(requests.to("b")[0])));
+    BOOST_CHECK_EQUAL(download.requests("b"), 0u);
+    download.request_done("b", get<3>(requests.to("b")[0]), true, t0 + Download::s_request_timeout + chrono::seconds(2));
+    BOOST_CHECK(download.done());
+}
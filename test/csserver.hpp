@@ -0,0 +1,98 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "cs/server.hpp"
+#include "cs/utils.hpp"
+#include "cs/core/coder.hpp"
+#include <cassert>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+/**
+ * A local server, its connections write to memory buffers the test moves to the peers
+ */
+class CSServer: public cs::server::Server
+{
+public:
+    CSServer():
+        m_out_buff()
+    {
+       m_server_info.m_name = "CS test server"; 
+       m_server_info.m_protocol = 1;
+    }
+
+    cs::server::Connection& add_connection(const std::string& name)
+    {
+        auto res = m_connections.emplace(name, std::make_unique<cs::server::Connection>(m_server_info, m_shares));
+        assert(res.second);
+        m_out_buff.emplace(name, std::string());
+        auto do_write = [name, this](const cs::OutputSlice* slices, size_t count)
+        {
+            std::string& out = m_out_buff[name];
+            assert(out.empty());
+            for (size_t i = 0; i < count; ++i)
+                out.append(slices[i].data, slices[i].size);
+        };
+        cs::server::Connection& conn = *res.first->second;
+        conn.m_protocolstate.set_write_fun(do_write);
+        return conn;
+    }
+
+    /// @returns the connection @param name @throws out_of_range if there's none
+    cs::server::Connection& connection(const std::string& name)
+    {
+        return *m_connections.at(name);
+    }
+
+    void receive(const std::string& connection, const cs::core::msg::Message& m)
+    {
+        auto i = m_connections.find(connection);
+        if (i == m_connections.end())
+            throw std::runtime_error(fs("Connection: " << connection << " not found"));
+        cs::server::Connection& conn = *i->second;
+        conn.m_protocolstate.input(cs::core::msg::Coder().encode_msg(m));
+    }
+
+    /// feed @param data written by a peer to @param connection
+    void receive_raw(const std::string& connection, const std::string& data)
+    {
+        auto i = m_connections.find(connection);
+        if (i == m_connections.end())
+            throw std::runtime_error(fs("Connection: " << connection << " not found"));
+        i->second->m_protocolstate.input(data);
+    }
+
+    /// @returns data and notify protocol
+    std::string tx_write(const std::string& connection)
+    {
+        auto bi = m_out_buff.find(connection);
+        if (bi == m_out_buff.end())
+            throw std::runtime_error(fs("Connection: " << connection << " not found"));
+        std::string res = std::move(bi->second);
+
+        auto ci = m_connections.find(connection);
+        assert(ci != m_connections.end());
+        cs::server::Connection& conn = *ci->second;
+        if (! res.empty())
+            /// this triggers the next write and fills the buffer, so we can write while(! empty) to read everything
+            conn.m_protocolstate.on_write_finished();
+        return res;
+    }
+
+    std::map<std::string, std::string> m_out_buff;
+};
@@ -18,10 +18,179 @@
 #include "cs/daemon/daemon.hpp"
 #include "cs/config.hpp"
 #include "cs/utils.hpp"
+#include "cs/core/coder.hpp"
+#include "cs/core/message.hpp"
+#include "cs/file.hpp"
+#include "csserver.hpp"
+#include "test_utils.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
 using namespace std;
 using namespace cs::daemon;
 
+BOOST_AUTO_TEST_CASE(daemon_async_file_writer)
+{
+    cs::utils::Tmpdir tmp;
+    const bfs::path path = tmp.path / "f";
+    uvpp::loop l;
+    auto backlog = make_shared<WriteBacklog>();
+    size_t pauses = 0;
+    size_t resumes = 0;
+    backlog->pause = [&pauses]() { ++pauses; };
+    backlog->resume = [&resumes]() { ++resumes; };
+    const size_t saved_max_pending = WriteBacklog::s_max_pending;
+    WriteBacklog::s_max_pending = 300000;
+
+    const string content = cs::utils::random_bytes(1000000);
+    bool done = false;
+    bool ok = false;
+    {
+        AsyncFileWriter writer(l, path, true, backlog);
+        writer.preallocate(0, content.size());
+        // the second half first, then the first in small pieces
+        writer.write(500000, content.data() + 500000, 500000);
+        for (size_t offset = 0; offset < 500000; offset += 1000)
+            writer.write(offset, content.data() + offset, 1000);
+        BOOST_CHECK_EQUAL(pauses, 1u);
+        writer.close([&](bool result) { done = true; ok = result; });
+        BOOST_CHECK(! done);
+        l.run();
+    }
+    WriteBacklog::s_max_pending = saved_max_pending;
+    BOOST_CHECK(done);
+    BOOST_CHECK(ok);
+    BOOST_CHECK_EQUAL(resumes, 1u);
+    BOOST_CHECK_EQUAL(backlog->pending, 0u);
+    BOOST_CHECK(cs::utils::read_file(path) == content);
+
+    // destroyed before its writes finish, they finish in the background
+    {
+        AsyncFileWriter writer(l, path, false, backlog);
+        writer.write(0, "abc", 3);
+    }
+    l.run();
+    BOOST_CHECK(cs::utils::read_file(path).substr(0, 4) == "abc" + content.substr(3, 1));
+    BOOST_CHECK_THROW(AsyncFileWriter(l, tmp.path / "no" / "f", true, backlog), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(daemon_file_reader)
+{
+    cs::utils::Tmpdir tmp;
+    const bfs::path path = tmp.path / "f";
+    const string content = cs::utils::random_bytes(25);
+    cs::utils::create_file(path, content);
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    BOOST_REQUIRE(fd != -1);
+    auto close_fd = cs::utils::make_scope_guard([fd]() { ::close(fd); });
+
+    uvpp::loop l;
+    FileReader reader(l);
+    vector<string> chunks;
+    auto done = [&chunks](bool ok, string&& data) {
+        BOOST_CHECK(ok);
+        chunks.push_back(move(data));
+    };
+    reader.read(fd, 1, 0, 10, 10, done);
+    l.run();
+    BOOST_REQUIRE_EQUAL(chunks.size(), 1u);
+    // the next chunk was read ahead and is there right away
+    reader.read(fd, 1, 10, 10, 5, done);
+    BOOST_REQUIRE_EQUAL(chunks.size(), 2u);
+    l.run();
+    reader.read(fd, 1, 20, 5, 0, done);
+    BOOST_REQUIRE_EQUAL(chunks.size(), 3u);
+    BOOST_CHECK(chunks[0] + chunks[1] + chunks[2] == content);
+
+    // another file with the same fd isn't served what was read ahead of the previous one
+    chunks.clear();
+    reader.read(fd, 2, 0, 10, 10, done);
+    l.run();
+    reader.read(fd, 3, 10, 10, 0, done);
+    BOOST_CHECK_EQUAL(chunks.size(), 1u);
+    l.run();
+    BOOST_CHECK_EQUAL(chunks.size(), 2u);
+    // nor is a file closed and opened again with the same id
+    reader.read(fd, 4, 0, 10, 10, done);
+    l.run();
+    reader.forget(4);
+    reader.read(fd, 4, 10, 10, 0, done);
+    BOOST_CHECK_EQUAL(chunks.size(), 3u);
+    l.run();
+    BOOST_CHECK_EQUAL(chunks.size(), 4u);
+
+    // a file shorter than the range fails
+    bool short_ok = true;
+    reader.read(fd, 5, 20, 10, 0, [&short_ok](bool ok, string&& data) { short_ok = ok || ! data.empty(); });
+    l.run();
+    BOOST_CHECK(! short_ok);
+
+    // reads in flight don't call back once the reader is gone
+    bool called = false;
+    {
+        FileReader gone(l);
+        gone.read(fd, 1, 0, 10, 10, [&called](bool, string&&) { called = true; });
+    }
+    l.run();
+    BOOST_CHECK(! called);
+}
+
+BOOST_AUTO_TEST_CASE(daemon_hash_file)
+{
+    cs::utils::Tmpdir tmp;
+    const bfs::path path = tmp.path / "f";
+    cs::utils::create_file(path, "abc");
+
+    uvpp::loop l;
+    vector<string> digests;
+    auto done = [&digests](const string& sha256) { digests.push_back(sha256); };
+    hash_file(l, path, done);
+    // on the threadpool, the digest comes on the loop thread
+    BOOST_CHECK(digests.empty());
+    l.run();
+    BOOST_REQUIRE_EQUAL(digests.size(), 1u);
+    BOOST_CHECK_EQUAL(digests[0], "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+    // empty when it can't be read
+    hash_file(l, tmp.path / "missing", done);
+    l.run();
+    BOOST_REQUIRE_EQUAL(digests.size(), 2u);
+    BOOST_CHECK(digests[1].empty());
+}
+
+BOOST_AUTO_TEST_CASE(daemon_clone_file)
+{
+    cs::utils::Tmpdir tmp;
+    const string content = cs::utils::random_bytes(300000);
+    cs::utils::create_file(tmp.path / "from", content);
+
+    uvpp::loop l;
+    vector<bool> copied;
+    auto done = [&copied](bool ok) { copied.push_back(ok); };
+    clone_file(l, tmp.path / "from", tmp.path / "to", done);
+    // on the threadpool, the result comes on the loop thread
+    BOOST_CHECK(copied.empty());
+    l.run();
+    BOOST_REQUIRE_EQUAL(copied.size(), 1u);
+    BOOST_CHECK(copied[0]);
+    BOOST_CHECK(cs::utils::read_file(tmp.path / "to") == content);
+
+    clone_file(l, tmp.path / "missing", tmp.path / "to", done);
+    l.run();
+    BOOST_REQUIRE_EQUAL(copied.size(), 2u);
+    BOOST_CHECK(! copied[1]);
+}
+
 #if 0
 
 BOOST_AUTO_TEST_CASE(daemon_test_01)
@@ -35,3 +204,645 @@ BOOST_AUTO_TEST_CASE(daemon_test_01)
 }
 
 #endif
+
+namespace
+{
+
+/// connects to the daemon, starts the share and @returns the reply
+unique_ptr<cs::core::msg::Message> start_share(int port, const string& share_id)
+{
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    BOOST_REQUIRE(fd != -1);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    BOOST_REQUIRE(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+
+    cs::core::msg::Coder coder;
+    const string start = coder.encode_msg(cs::core::msg::Start{"CS_CORE v0.1", 1, vector<string>(), share_id, "read_write", "peer", "name", "time"});
+    BOOST_REQUIRE(::write(fd, start.data(), start.size()) == static_cast<ssize_t>(start.size()));
+
+    string input;
+    cs::MsgRstate msg;
+    char buf[4096];
+    while (! msg.found)
+    {
+        const ssize_t len = ::read(fd, buf, sizeof(buf));
+        BOOST_REQUIRE(len > 0);
+        input.append(buf, len);
+        msg = cs::find_message(input);
+    }
+    ::close(fd);
+    return coder.decode_msg(false, msg.encoded, msg.encoded_sz, msg.signature, msg.signature_sz);
+}
+
+} // end anon ns
+
+BOOST_AUTO_TEST_CASE(daemon_multi_loop)
+{
+    Tmpdir tmpdir;
+    Daemon d;
+    const string share_id = d.attach_share(tmpdir.tmpdir.string());
+    d.set_port(0);
+    d.set_loops(4);
+    thread t([&d]() { d.start(); });
+    while (d.listen_port() == 0)
+        this_thread::yield();
+    BOOST_CHECK_THROW(d.set_loops(2), std::runtime_error);
+
+    for (size_t i = 0; i < 16; ++i)
+        BOOST_CHECK(start_share(d.listen_port(), share_id)->type() == cs::core::msg::MType::GO);
+
+    d.stop();
+    t.join();
+    BOOST_CHECK_EQUAL(d.listen_port(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(daemon_stop_during_start)
+{
+    // stops that come while start sets up the loops, or after, aren't lost
+    for (size_t i = 0; i < 20; ++i)
+    {
+        Tmpdir tmpdir;
+        Daemon d;
+        d.attach_share(tmpdir.tmpdir.string());
+        d.set_port(0);
+        d.set_loops(2);
+        atomic<bool> returned(false);
+        thread t([&d, &returned]() {
+            d.start();
+            returned = true;
+        });
+        thread stopper([&d, &returned]() {
+            while (! returned)
+            {
+                d.stop();
+                this_thread::yield();
+            }
+        });
+        t.join();
+        stopper.join();
+        BOOST_CHECK_EQUAL(d.listen_port(), 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(daemon_utp_loopback)
+{
+    uvpp::loop l;
+    UTPContext server_ctx(l);
+    UTPContext client_ctx(l);
+    const int port = server_ctx.bind("127.0.0.1", 0);
+    BOOST_REQUIRE(port != 0);
+    BOOST_REQUIRE(client_ctx.bind("127.0.0.1", 0) != 0);
+
+    const size_t pings = 100;
+    const size_t bulk_sz = 32 << 20;
+    const string block = cs::utils::random_bytes(64 << 10);
+    static const char ping = 'p';
+    const uv_buf_t ping_buf = uv_buf_init(const_cast<char*>(&ping), 1);
+
+    auto ping_start = chrono::steady_clock::now();
+    auto bulk_start = ping_start;
+    auto bulk_end = ping_start;
+
+    // the server echoes the pings and checks the bulk data that follows
+    unique_ptr<UTPStream> server;
+    size_t received = 0;
+    bool intact = true;
+    size_t closed = 0;
+    auto finish = [&]() {
+        if (++closed < 2)
+            return;
+        server_ctx.close();
+        client_ctx.close();
+    };
+    UTPStream client;
+    server_ctx.listen([&](utp_socket* s) {
+        server = make_unique<UTPStream>();
+        server->attach(s);
+        server->set_read_callback([&](const char* data, ssize_t len) {
+            if (len < 0)
+            {
+                // the client is done
+                BOOST_CHECK_EQUAL(len, UV_EOF);
+                server->close(finish);
+                return;
+            }
+            for (ssize_t i = 0; i < len; ++i, ++received)
+            {
+                if (received < pings)
+                    server->write(&ping_buf, 1);
+                else if (data[i] != block[(received - pings) % block.size()])
+                    intact = false;
+            }
+            if (received == pings + bulk_sz)
+            {
+                bulk_end = chrono::steady_clock::now();
+                client.close(finish);
+            }
+        });
+    });
+
+    size_t echoed = 0;
+    size_t sent = 0;
+    double rtt_us = 0;
+    const uv_buf_t block_buf = uv_buf_init(const_cast<char*>(block.data()), block.size());
+    client.set_connect_callback([&](uvpp::error error) {
+        BOOST_REQUIRE(! error);
+        ping_start = chrono::steady_clock::now();
+        client.write(&ping_buf, 1);
+    });
+    client.set_read_callback([&](const char*, ssize_t len) {
+        BOOST_REQUIRE(len > 0);
+        echoed += len;
+        if (echoed < pings)
+            client.write(&ping_buf, 1);
+        else
+        {
+            rtt_us = chrono::duration<double, micro>(chrono::steady_clock::now() - ping_start).count() / pings;
+            bulk_start = chrono::steady_clock::now();
+            sent = block.size();
+            client.write(&block_buf, 1);
+        }
+    });
+    client.set_write_callback([&](uvpp::error error) {
+        BOOST_REQUIRE(! error);
+        if (echoed == pings && sent < bulk_sz)
+        {
+            sent += block.size();
+            client.write(&block_buf, 1);
+        }
+    });
+    client_ctx.connect(client, "127.0.0.1", port);
+    l.run();
+
+    BOOST_CHECK_EQUAL(closed, 2u);
+    BOOST_CHECK_EQUAL(echoed, pings);
+    BOOST_CHECK_EQUAL(received, pings + bulk_sz);
+    BOOST_CHECK(intact);
+    // an idle connection answers right away, LEDBAT only delays bulk data
+    BOOST_CHECK(rtt_us < 100000);
+    const double secs = chrono::duration<double>(bulk_end - bulk_start).count();
+    BOOST_TEST_MESSAGE("uTP loopback: round trip " << rtt_us << " us, " << bulk_sz / secs / (1 << 20) << " MiB/s");
+}
+
+namespace
+{
+
+/// starts the share over uTP, @returns the reply
+unique_ptr<cs::core::msg::Message> start_share_utp(int port, const string& share_id)
+{
+    uvpp::loop l;
+    UTPContext ctx(l);
+    BOOST_REQUIRE(ctx.bind("127.0.0.1", 0) != 0);
+
+    cs::core::msg::Coder coder;
+    const string start = coder.encode_msg(cs::core::msg::Start{"CS_CORE v0.1", 1, vector<string>(), share_id, "read_write", "peer", "name", "time"});
+    const uv_buf_t start_buf = uv_buf_init(const_cast<char*>(start.data()), start.size());
+    string input;
+    cs::MsgRstate msg;
+    UTPStream sock;
+    sock.set_connect_callback([&](uvpp::error error) {
+        BOOST_REQUIRE(! error);
+        sock.write(&start_buf, 1);
+    });
+    sock.set_read_callback([&](const char* data, ssize_t len) {
+        BOOST_REQUIRE(len > 0);
+        input.append(data, len);
+        msg = cs::find_message(input);
+        if (msg.found)
+            sock.close([&ctx]() { ctx.close(); });
+    });
+    ctx.connect(sock, "127.0.0.1", port);
+    l.run();
+    BOOST_REQUIRE(msg.found);
+    return coder.decode_msg(false, msg.encoded, msg.encoded_sz, msg.signature, msg.signature_sz);
+}
+
+} // end anon ns
+
+BOOST_AUTO_TEST_CASE(daemon_utp)
+{
+    Tmpdir tmpdir;
+    Daemon d;
+    const string share_id = d.attach_share(tmpdir.tmpdir.string());
+    d.set_port(0);
+    thread t([&d]() { d.start(); });
+    while (d.listen_port() == 0)
+        this_thread::yield();
+
+    for (size_t i = 0; i < 2; ++i)
+        BOOST_CHECK(start_share_utp(d.listen_port(), share_id)->type() == cs::core::msg::MType::GO);
+    // TCP still works alongside
+    BOOST_CHECK(start_share(d.listen_port(), share_id)->type() == cs::core::msg::MType::GO);
+
+    d.stop();
+    t.join();
+}
+
+
+namespace
+{
+
+/**
+ * starts the share over TLS authenticating as @param identity with @param psk and asking for
+ * @param access, @returns the reply or null when the daemon closes the connection
+ */
+unique_ptr<cs::core::msg::Message> start_share_tls(int port, const string& share_id, cs::tls::Context& ctx, const string& identity, const string& psk, bool& resumed, const string& access = "read_write")
+{
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    BOOST_REQUIRE(fd != -1);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    BOOST_REQUIRE(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+
+    cs::tls::Stream stream(ctx, identity, psk, "daemon");
+    bool wrote = false;
+    bool failed = false;
+    string input;
+    cs::MsgRstate msg;
+    stream.set_write_fun([fd, &wrote](const char* data, size_t len) {
+        BOOST_REQUIRE(::write(fd, data, len) == static_cast<ssize_t>(len));
+        wrote = true;
+    });
+    stream.m_handle_input = [&input, &msg](const char* data, size_t len) {
+        input.append(data, len);
+        msg = cs::find_message(input);
+    };
+    stream.m_handle_write_finished = []() {};
+    stream.m_handle_error = [&failed]() { failed = true; };
+
+    cs::core::msg::Coder coder;
+    const string start = coder.encode_msg(cs::core::msg::Start{"CS_CORE v0.1", 1, vector<string>(), share_id, access, "peer", "name", "time"});
+    const cs::OutputSlice slice = { start.data(), start.size() };
+    stream.start();
+    stream.write(&slice, 1);
+    char buf[4096];
+    while (! msg.found && ! failed)
+    {
+        while (wrote)
+        {
+            wrote = false;
+            stream.on_write_finished();
+        }
+        const ssize_t len = ::read(fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        stream.input(buf, len);
+    }
+    ::close(fd);
+    resumed = stream.resumed();
+    if (! msg.found)
+        return nullptr;
+    return coder.decode_msg(false, msg.encoded, msg.encoded_sz, msg.signature, msg.signature_sz);
+}
+
+} // end anon ns
+
+BOOST_AUTO_TEST_CASE(daemon_tls)
+{
+    Tmpdir tmpdir;
+    Tmpdir other_tmpdir;
+    Daemon d;
+    const string share_id = d.attach_share(tmpdir.tmpdir.string());
+    const string other_share_id = d.attach_share(other_tmpdir.tmpdir.string());
+    const string identity = cs::server::psk_identity(share_id, "rw");
+    const string psk = cs::utils::hex_to_bin<string>(d.share(share_id).m_psk_rw);
+    d.set_port(0);
+    d.set_tls(true);
+    thread t([&d]() { d.start(); });
+    while (d.listen_port() == 0)
+        this_thread::yield();
+
+    cs::tls::Context ctx;
+    bool resumed = true;
+    auto reply = start_share_tls(d.listen_port(), share_id, ctx, identity, psk, resumed);
+    BOOST_REQUIRE(reply);
+    BOOST_CHECK(reply->type() == cs::core::msg::MType::GO);
+    BOOST_CHECK(! resumed);
+
+    // reconnecting resumes the session with the ticket
+    reply = start_share_tls(d.listen_port(), share_id, ctx, identity, psk, resumed);
+    BOOST_REQUIRE(reply);
+    BOOST_CHECK(reply->type() == cs::core::msg::MType::GO);
+    BOOST_CHECK(resumed);
+
+    // the key of a share doesn't give access to the others
+    reply = start_share_tls(d.listen_port(), other_share_id, ctx, identity, psk, resumed);
+    BOOST_CHECK(! reply || reply->type() == cs::core::msg::MType::CANNOT_START);
+    // nor the read write key to the read only identity
+    BOOST_CHECK(! start_share_tls(d.listen_port(), share_id, ctx, cs::server::psk_identity(share_id, "ro"), psk, resumed));
+
+    // the read only key starts the share read only, and is refused read write access
+    const string ro_identity = cs::server::psk_identity(share_id, "ro");
+    const string ro_psk = cs::utils::hex_to_bin<string>(d.share(share_id).m_psk_ro);
+    reply = start_share_tls(d.listen_port(), share_id, ctx, ro_identity, ro_psk, resumed, "read_write");
+    BOOST_CHECK(! reply || reply->type() == cs::core::msg::MType::CANNOT_START);
+    reply = start_share_tls(d.listen_port(), share_id, ctx, ro_identity, ro_psk, resumed, "read_only");
+    BOOST_REQUIRE(reply);
+    BOOST_CHECK(reply->type() == cs::core::msg::MType::GO);
+
+    d.stop();
+    t.join();
+}
+
+BOOST_AUTO_TEST_CASE(daemon_upload_limit)
+{
+    Tmpdir tmpdir;
+    // several blocks, the first goes with the burst and each of the others waits for the debt of the last
+    const size_t size = 3 * 1024 * 1024;
+    create_file(tmpdir.tmpdir / "big", string(size, 'z'));
+    Daemon d;
+    const string share_id = d.attach_share(tmpdir.tmpdir.string());
+    auto& share = d.share(share_id);
+    share.fullscan();
+    string checksum;
+    for (const auto& file: share)
+        checksum = file.checksum;
+    BOOST_REQUIRE(! checksum.empty());
+    d.governor().set_global_limit(cs::ratelimit::Direction::UPLOAD, 4 * 1024 * 1024, 256 * 1024);
+    d.set_port(0);
+    thread t([&d]() { d.start(); });
+    while (d.listen_port() == 0)
+        this_thread::yield();
+
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    BOOST_REQUIRE(fd != -1);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(d.listen_port());
+    BOOST_REQUIRE(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    cs::core::msg::Coder coder;
+    const string start = coder.encode_msg(cs::core::msg::Start{"CS_CORE v0.1", 1, vector<string>(), share_id, "read_write", "peer", "name", "time"});
+    const string get = coder.encode_msg(cs::core::msg::Get(checksum));
+    BOOST_REQUIRE(::write(fd, start.data(), start.size()) == static_cast<ssize_t>(start.size()));
+    BOOST_REQUIRE(::write(fd, get.data(), get.size()) == static_cast<ssize_t>(get.size()));
+
+    const auto begin = chrono::steady_clock::now();
+    size_t received = 0;
+    char buf[64 * 1024];
+    while (received < size)
+    {
+        const ssize_t len = ::read(fd, buf, sizeof(buf));
+        BOOST_REQUIRE(len > 0);
+        received += len;
+    }
+    const double secs = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    ::close(fd);
+    // the last block waits for the debt of the other two, about 0.45 s
+    BOOST_CHECK_GT(secs, 0.3);
+
+    d.stop();
+    t.join();
+}
+
+BOOST_AUTO_TEST_CASE(daemon_peer_gone_during_send)
+{
+    Tmpdir tmpdir;
+    const size_t size = 16 * 1024 * 1024;
+    create_file(tmpdir.tmpdir / "big", string(size, 'z'));
+    Daemon d;
+    const string share_id = d.attach_share(tmpdir.tmpdir.string());
+    auto& share = d.share(share_id);
+    share.fullscan();
+    string checksum;
+    for (const auto& file: share)
+        checksum = file.checksum;
+    BOOST_REQUIRE(! checksum.empty());
+    d.set_port(0);
+    struct sigaction before;
+    ::sigaction(SIGPIPE, nullptr, &before);
+    bool blocked_after = true;
+    thread t([&d, &blocked_after]() {
+        d.start();
+        sigset_t mask;
+        pthread_sigmask(SIG_BLOCK, nullptr, &mask);
+        blocked_after = sigismember(&mask, SIGPIPE);
+    });
+    while (d.listen_port() == 0)
+        this_thread::yield();
+
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    BOOST_REQUIRE(fd != -1);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(d.listen_port());
+    BOOST_REQUIRE(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    cs::core::msg::Coder coder;
+    const string start = coder.encode_msg(cs::core::msg::Start{"CS_CORE v0.1", 1, vector<string>(), share_id, "read_write", "peer", "name", "time"});
+    const string get = coder.encode_msg(cs::core::msg::Get(checksum));
+    BOOST_REQUIRE(::write(fd, start.data(), start.size()) == static_cast<ssize_t>(start.size()));
+    BOOST_REQUIRE(::write(fd, get.data(), get.size()) == static_cast<ssize_t>(get.size()));
+    char buf[64 * 1024];
+    BOOST_REQUIRE(::read(fd, buf, sizeof(buf)) > 0);
+    // reset the connection while the file is being sent
+    linger reset = {1, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    ::close(fd);
+
+    // the send fails and the daemon goes on
+    BOOST_CHECK(start_share(d.listen_port(), share_id)->type() == cs::core::msg::MType::GO);
+    d.stop();
+    t.join();
+
+    // the thread that ran it gets its signal mask back and the disposition of the process is untouched
+    BOOST_CHECK(! blocked_after);
+    struct sigaction after;
+    ::sigaction(SIGPIPE, nullptr, &after);
+    BOOST_CHECK(after.sa_handler == before.sa_handler);
+}
+
+namespace
+{
+
+/**
+ * a peer with @param big in its share that connects to the daemon on @param port and serves what
+ * it's asked until @param stop, @param started counts the handshakes done and @param sent what it
+ * wrote past the handshake
+ */
+void seed(int port, const string& share_id, const string& peer_id, const string& big, const atomic<bool>& stop, atomic<int>& started, atomic<size_t>& sent)
+{
+    Tmpdir tmp;
+    create_file(tmp.tmpdir / "big", big);
+    CSServer server;
+    const string seeder_share = server.attach_share(tmp.tmpdir.string(), tmp.dbpath.string());
+    server.share(seeder_share).fullscan();
+    cs::server::Connection& conn = server.add_connection("daemon");
+    conn.m_protocol.set_state(cs::core::protocol::CONNECTED);
+    conn.m_protocol.m_share = seeder_share;
+
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    BOOST_REQUIRE(fd != -1);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    BOOST_REQUIRE(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    cs::core::msg::Coder coder;
+    const string start = coder.encode_msg(cs::core::msg::Start{"CS_CORE v0.1", 1, {cs::core::protocol::feature::pipelined_get}, share_id, "read_write", peer_id, "name", "time"});
+    BOOST_REQUIRE(::write(fd, start.data(), start.size()) == static_cast<ssize_t>(start.size()));
+
+    // the Go is read here, what comes after it goes to the protocol
+    string input;
+    cs::MsgRstate msg;
+    char buf[64 * 1024];
+    while (! msg.found)
+    {
+        const ssize_t len = ::read(fd, buf, sizeof(buf));
+        BOOST_REQUIRE(len > 0);
+        input.append(buf, len);
+        msg = cs::find_message(input);
+    }
+    BOOST_REQUIRE(coder.decode_msg(false, msg.encoded, msg.encoded_sz, msg.signature, msg.signature_sz)->type() == cs::core::msg::MType::GO);
+    input.erase(0, msg.enc_sig_sz);
+    if (! input.empty())
+        server.receive_raw("daemon", input);
+    ++started;
+
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    while (! stop)
+    {
+        for (string out = server.tx_write("daemon"); ! out.empty(); out = server.tx_write("daemon"))
+        {
+            sent += out.size();
+            for (size_t done = 0; done < out.size();)
+            {
+                const ssize_t len = ::write(fd, out.data() + done, out.size() - done);
+                if (len > 0)
+                    done += len;
+                else
+                    BOOST_REQUIRE(len == -1 && errno == EAGAIN);
+            }
+        }
+        const ssize_t len = ::read(fd, buf, sizeof(buf));
+        if (len > 0)
+            server.receive_raw("daemon", string(buf, len));
+        else if (len == 0)
+            break;
+        else
+            this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    ::close(fd);
+}
+
+} // end anon ns
+
+BOOST_AUTO_TEST_CASE(daemon_download_two_peers)
+{
+    string big;
+    for (size_t i = 0; big.size() < 1024 * 1024; ++i)
+        big += fs(i << ",");
+    Tmpdir tmpdir;
+    Tmpdir rx;
+    Daemon d;
+    const string share_id = d.attach_share(tmpdir.tmpdir.string());
+    d.set_port(0);
+    // not in the share, it would be copied from there
+    create_file(rx.tmpdir / "expected", big);
+    const string checksum = cs::sha256_file(rx.tmpdir / "expected");
+    BOOST_CHECK_THROW(d.download(checksum, big.size(), rx.tmpdir / "big", {}), std::runtime_error);
+
+    mutex done_mutex;
+    condition_variable done_cond;
+    vector<pair<string, bool>> done;
+    d.m_handle_download_done = [&](const string& checksum, bool complete) {
+        lock_guard<mutex> lock(done_mutex);
+        done.emplace_back(checksum, complete);
+        done_cond.notify_all();
+    };
+    thread t([&d]() { d.start(); });
+    while (d.listen_port() == 0)
+        this_thread::yield();
+
+    atomic<bool> stop(false);
+    atomic<int> started(0);
+    atomic<size_t> sent_a(0);
+    atomic<size_t> sent_b(0);
+    thread a([&]() { seed(d.listen_port(), share_id, "A", big, stop, started, sent_a); });
+    thread b([&]() { seed(d.listen_port(), share_id, "B", big, stop, started, sent_b); });
+    // the features of the peers are known once they got the Go
+    while (started < 2)
+        this_thread::yield();
+    const vector<string> connections = d.connections();
+    BOOST_REQUIRE_EQUAL(connections.size(), 2u);
+
+    const auto saved_piece_sz = cs::core::download::Download::s_piece_sz;
+    const size_t piece = 64 * 1024;
+    cs::core::download::Download::s_piece_sz = piece;
+    d.download(checksum, big.size(), rx.tmpdir / "big", connections);
+    {
+        unique_lock<mutex> lock(done_mutex);
+        BOOST_CHECK(done_cond.wait_for(lock, chrono::seconds(30), [&done]() { return ! done.empty(); }));
+    }
+    cs::core::download::Download::s_piece_sz = saved_piece_sz;
+    stop = true;
+    a.join();
+    b.join();
+    d.stop();
+    t.join();
+
+    BOOST_REQUIRE_EQUAL(done.size(), 1u);
+    BOOST_CHECK_EQUAL(done[0].first, checksum);
+    BOOST_CHECK(done[0].second);
+    BOOST_CHECK(cs::utils::read_file(rx.tmpdir / "big") == big);
+    // the pieces came from both
+    BOOST_CHECK_GT(sent_a, piece);
+    BOOST_CHECK_GT(sent_b, piece);
+}
+
+BOOST_AUTO_TEST_CASE(daemon_download_local_copy)
+{
+    const string big = cs::utils::random_bytes(300000);
+    Tmpdir tmpdir;
+    Tmpdir rx;
+    create_file(tmpdir.tmpdir / "big", big);
+    Daemon d;
+    const string share_id = d.attach_share(tmpdir.tmpdir.string());
+    auto& share = d.share(share_id);
+    share.fullscan();
+    string checksum;
+    for (const auto& file: share)
+        checksum = file.checksum;
+    BOOST_REQUIRE(! checksum.empty());
+
+    mutex done_mutex;
+    condition_variable done_cond;
+    vector<pair<string, bool>> done;
+    thread::id done_thread;
+    d.m_handle_download_done = [&](const string& checksum, bool complete) {
+        lock_guard<mutex> lock(done_mutex);
+        done.emplace_back(checksum, complete);
+        done_thread = this_thread::get_id();
+        done_cond.notify_all();
+    };
+    d.set_port(0);
+    thread t([&d]() { d.start(); });
+    const thread::id loop_thread = t.get_id();
+    while (d.listen_port() == 0)
+        this_thread::yield();
+
+    // no peers are needed, it's copied from the share off the loop
+    d.download(checksum, big.size(), rx.tmpdir / "copy", {});
+    {
+        unique_lock<mutex> lock(done_mutex);
+        BOOST_CHECK(done_cond.wait_for(lock, chrono::seconds(30), [&done]() { return ! done.empty(); }));
+    }
+    d.stop();
+    t.join();
+
+    BOOST_REQUIRE_EQUAL(done.size(), 1u);
+    BOOST_CHECK_EQUAL(done[0].first, checksum);
+    BOOST_CHECK(done[0].second);
+    BOOST_CHECK(done_thread == loop_thread);
+    BOOST_CHECK(cs::utils::read_file(rx.tmpdir / "copy") == big);
+}
@@ -0,0 +1,780 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cs/daemon/daemon.hpp"
+#include "cs/core/coder.hpp"
+#include "cs/core/message.hpp"
+#include "cs/metrics.hpp"
+#include "cs/trace.hpp"
+#include "cs/protocolstate.hpp"
+#include "cs/utils.hpp"
+#include "cs/boost_fs_fwd.hpp"
+#include "uvpp/uvpp.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * @file load_bench.cpp
+ * How a Daemon copes with many peers: the Daemon runs in a child process on loopback and serves a
+ * generated share, this process opens many TCP connections to it. Each connection does the
+ * Start / Go handshake, fetches the manifest, then issues GetUpdates and Gets at random times with
+ * the given mean rates, one request at a time. Latencies are measured from the time a request was
+ * due, so a slow Daemon isn't hidden by requests that are sent late. The CPU and RSS of the Daemon
+ * process are sampled during the run.
+ */
+
+using namespace std;
+using namespace cs;
+using namespace cs::core;
+
+namespace
+{
+
+typedef chrono::steady_clock clock;
+
+struct Options
+{
+    Options():
+          connections(1000)
+        , connect_rate(1000)
+        , duration(10)
+        , updates_rate(0.2)
+        , get_rate(1)
+        , threads(1)
+        , daemon_loops(1)
+        , files(100)
+        , file_size(16 << 10)
+        , sample_ms(250)
+        , seed(1)
+        , daemon_log(false)
+        , json_path()
+        , metrics_path()
+        , trace_path()
+    {}
+
+    size_t connections;
+    /// new connections per second
+    double connect_rate;
+    /// seconds the load lasts once all the connections were started
+    double duration;
+    /// mean requests per second of each connection
+    double updates_rate;
+    double get_rate;
+    /// event loops of the load generator, the connections are spread over them
+    size_t threads;
+    size_t daemon_loops;
+    /// the share of the Daemon
+    size_t files;
+    size_t file_size;
+    unsigned sample_ms;
+    unsigned seed;
+    /// keep the stderr of the Daemon, it logs the connections that fail
+    bool daemon_log;
+    string json_path;
+    /// where the Daemon writes its metrics when it stops, Prometheus text format
+    string metrics_path;
+    /// where the Daemon writes its trace when it stops, Chrome trace format
+    string trace_path;
+};
+
+/// latencies in µs and the failures of the connections of a loop
+struct Stats
+{
+    Stats():
+          handshake()
+        , manifest()
+        , updates()
+        , get()
+        , get_bytes()
+        , connect_errors()
+        , cannot_start()
+        , closed()
+        , protocol_errors()
+        , no_such_file()
+    {}
+
+    void merge(const Stats& o)
+    {
+        handshake.insert(handshake.end(), o.handshake.begin(), o.handshake.end());
+        manifest.insert(manifest.end(), o.manifest.begin(), o.manifest.end());
+        updates.insert(updates.end(), o.updates.begin(), o.updates.end());
+        get.insert(get.end(), o.get.begin(), o.get.end());
+        get_bytes += o.get_bytes;
+        connect_errors += o.connect_errors;
+        cannot_start += o.cannot_start;
+        closed += o.closed;
+        protocol_errors += o.protocol_errors;
+        no_such_file += o.no_such_file;
+    }
+
+    size_t errors() const
+    {
+        return connect_errors + cannot_start + closed + protocol_errors + no_such_file;
+    }
+
+    /// connect until Go
+    vector<u32> handshake;
+    /// first GetUpdates, the whole manifest
+    vector<u32> manifest;
+    vector<u32> updates;
+    /// until the end of the payload
+    vector<u32> get;
+    u64 get_bytes;
+    size_t connect_errors;
+    size_t cannot_start;
+    /// by the Daemon before the end of the run
+    size_t closed;
+    /// garbage or unexpected messages
+    size_t protocol_errors;
+    size_t no_such_file;
+};
+
+class Peer;
+
+/// an event loop with its share of the connections
+class ClientLoop
+{
+public:
+    ClientLoop(const Options& options, int port, const string& share_id, size_t first, size_t count);
+    ~ClientLoop();
+
+    /// runs the loop until the end of the load
+    void run();
+
+    const Options& r_options;
+    const int m_port;
+    const string m_share_id;
+    uvpp::loop m_loop;
+    mt19937 m_rng;
+    msg::Coder m_coder;
+    Stats m_stats;
+    bool m_stopping;
+
+private:
+    vector<unique_ptr<Peer>> m_peers;
+    uvpp::Timer m_stop_timer;
+};
+
+
+class Peer
+{
+public:
+    Peer(ClientLoop& client, size_t index):
+          r_client(client)
+        , m_index(index)
+        , m_tcp(client.m_loop)
+        , m_timer(client.m_loop)
+        , m_pstate()
+        , m_write_bufs()
+        , m_state(IDLE)
+        , m_request(NONE)
+        , m_due()
+        , m_next_updates(clock::time_point::max())
+        , m_next_get(clock::time_point::max())
+        , m_checksums()
+        , m_since()
+    {
+        m_timer.set_callback([this]() { on_timer(); });
+        m_pstate.set_write_fun([this](const OutputSlice* slices, size_t count) {
+            m_write_bufs.resize(count);
+            for (size_t i = 0; i < count; ++i)
+                m_write_bufs[i] = uv_buf_init(const_cast<char*>(slices[i].data), slices[i].size);
+            m_tcp.write(m_write_bufs.data(), count);
+        });
+        m_tcp.set_write_callback([this](uvpp::error error) {
+            if (! error)
+                m_pstate.on_write_finished();
+            else
+                fail(r_client.m_stats.closed);
+        });
+        m_pstate.m_handle_empty_output_buff = []() {};
+        m_pstate.m_handle_msg = [this](const char* msg, size_t msg_sz, const char* sig, size_t sig_sz, bool payload) {
+            on_msg(r_client.m_coder.decode_msg(payload, msg, msg_sz, sig, sig_sz));
+        };
+        m_pstate.m_handle_payload = [this](const char*, size_t len) {
+            r_client.m_stats.get_bytes += len;
+        };
+        m_pstate.m_handle_payload_end = [this]() {
+            if (m_request != GET)
+                return fail(r_client.m_stats.protocol_errors);
+            finished(r_client.m_stats.get);
+        };
+        m_pstate.m_handle_error = [this]() { fail(r_client.m_stats.protocol_errors); };
+    }
+
+    /// connect after @param delay_ms
+    void start(u64 delay_ms)
+    {
+        m_timer.start(delay_ms);
+    }
+
+    void stop()
+    {
+        m_timer.close();
+        if (! m_tcp.is_closing())
+            m_tcp.close();
+    }
+
+private:
+    enum State { IDLE, CONNECTING, CONNECTED, CLOSED };
+    enum Request { NONE, HANDSHAKE, MANIFEST, UPDATES, GET };
+
+    void on_timer()
+    {
+        if (m_state == IDLE)
+            connect();
+        else
+            schedule();
+    }
+
+    void connect()
+    {
+        m_state = CONNECTING;
+        m_request = HANDSHAKE;
+        m_due = clock::now();
+        const bool ok = m_tcp.connect("127.0.0.1", r_client.m_port, [this](uvpp::error error) {
+            if (error)
+                return fail(r_client.m_stats.connect_errors);
+            m_state = CONNECTED;
+            m_tcp.nodelay(true);
+            m_tcp.read_start(
+                [this](size_t suggested_size) {
+                    const auto space = m_pstate.input_reserve(suggested_size);
+                    return uv_buf_init(space.first, space.second);
+                },
+                [this](const char*, ssize_t len) {
+                    if (len < 0)
+                        fail(r_client.m_stats.closed);
+                    else
+                        m_pstate.input_commit(static_cast<size_t>(len));
+                });
+            send(msg::Start("load_bench", 1, vector<string>(), r_client.m_share_id, "read_only",
+                fs("load" << m_index), fs("load" << m_index), utils::isotime(time(nullptr))));
+        });
+        if (! ok)
+            fail(r_client.m_stats.connect_errors);
+    }
+
+    void on_msg(unique_ptr<msg::Message> message)
+    {
+        switch (message->type())
+        {
+        case msg::MType::GO:
+            if (m_request != HANDSHAKE)
+                return fail(r_client.m_stats.protocol_errors);
+            finished(r_client.m_stats.handshake);
+            m_request = MANIFEST;
+            m_due = clock::now();
+            send(msg::GetUpdates());
+            break;
+
+        case msg::MType::CANNOT_START:
+            fail(r_client.m_stats.cannot_start);
+            break;
+
+        case msg::MType::UPDATE:
+        {
+            if (m_request != MANIFEST && m_request != UPDATES)
+                return fail(r_client.m_stats.protocol_errors);
+            const auto& update = static_cast<const msg::Update&>(*message);
+            for (const auto& file: update.m_files)
+            {
+                if (m_request == MANIFEST && ! file.deleted && file.size)
+                    m_checksums.push_back(file.checksum);
+                u64& rev = m_since[file.last_changed_by];
+                rev = max(rev, file.last_changed_rev);
+            }
+            if (update.m_partial)
+                break;
+            if (m_request == MANIFEST)
+            {
+                finished(r_client.m_stats.manifest);
+                const auto now = clock::now();
+                m_next_updates = next(now, r_client.r_options.updates_rate);
+                m_next_get = m_checksums.empty() ? clock::time_point::max() : next(now, r_client.r_options.get_rate);
+                schedule();
+            }
+            else
+                finished(r_client.m_stats.updates);
+            break;
+        }
+
+        case msg::MType::FILE_DATA:
+            // the payload follows
+            if (m_request != GET)
+                fail(r_client.m_stats.protocol_errors);
+            break;
+
+        case msg::MType::NO_SUCH_FILE:
+            ++r_client.m_stats.no_such_file;
+            m_request = NONE;
+            schedule();
+            break;
+
+        default:
+            fail(r_client.m_stats.protocol_errors);
+        }
+    }
+
+    /// @returns when the next request of a Poisson process with @param rate per second is due
+    clock::time_point next(clock::time_point from, double rate)
+    {
+        if (rate <= 0)
+            return clock::time_point::max();
+        const double secs = exponential_distribution<double>(rate)(r_client.m_rng);
+        return from + chrono::duration_cast<clock::duration>(chrono::duration<double>(secs));
+    }
+
+    /// send the request that is due, or wait for it
+    void schedule()
+    {
+        if (m_state != CONNECTED || m_request != NONE || r_client.m_stopping)
+            return;
+        const auto due = min(m_next_updates, m_next_get);
+        if (due == clock::time_point::max())
+            return;
+        const auto now = clock::now();
+        if (due > now)
+        {
+            m_timer.start(chrono::duration_cast<chrono::milliseconds>(due - now).count() + 1);
+            return;
+        }
+        m_due = due;
+        if (m_next_updates <= m_next_get)
+        {
+            m_request = UPDATES;
+            m_next_updates = next(due, r_client.r_options.updates_rate);
+            send(msg::GetUpdates(m_since));
+        }
+        else
+        {
+            m_request = GET;
+            m_next_get = next(due, r_client.r_options.get_rate);
+            send(msg::Get(m_checksums[r_client.m_rng() % m_checksums.size()]));
+        }
+    }
+
+    void send(const msg::Message& message)
+    {
+        m_pstate.send_msg(r_client.m_coder.encode_msg(message), message.m_payload);
+    }
+
+    /// the request finished, record its latency into @param latencies
+    void finished(vector<u32>& latencies)
+    {
+        latencies.push_back(chrono::duration_cast<chrono::microseconds>(clock::now() - m_due).count());
+        m_request = NONE;
+        schedule();
+    }
+
+    /// count the failure in @param counter and give up on the connection
+    void fail(size_t& counter)
+    {
+        if (m_state == CLOSED || r_client.m_stopping)
+            return;
+        ++counter;
+        m_state = CLOSED;
+        m_request = NONE;
+        m_tcp.read_stop();
+        m_timer.stop();
+    }
+
+    ClientLoop& r_client;
+    const size_t m_index;
+    uvpp::Tcp m_tcp;
+    /// connects, then fires when the next request is due
+    uvpp::Timer m_timer;
+    ProtocolState m_pstate;
+    vector<uv_buf_t> m_write_bufs;
+    State m_state;
+    Request m_request;
+    /// when the request in progress was due
+    clock::time_point m_due;
+    clock::time_point m_next_updates;
+    clock::time_point m_next_get;
+    /// files to Get, from the manifest
+    vector<string> m_checksums;
+    /// latest revision seen of each peer, for the GetUpdates after the manifest
+    map<string, u64> m_since;
+};
+
+
+ClientLoop::ClientLoop(const Options& options, int port, const string& share_id, size_t first, size_t count):
+      r_options(options)
+    , m_port(port)
+    , m_share_id(share_id)
+    , m_loop()
+    , m_rng(options.seed + first)
+    , m_coder()
+    , m_stats()
+    , m_stopping(false)
+    , m_peers()
+    , m_stop_timer(m_loop)
+{
+    // the connections of all the loops are started in the order of their index
+    for (size_t i = first; i < first + count; ++i)
+    {
+        m_peers.emplace_back(make_unique<Peer>(*this, i));
+        m_peers.back()->start(static_cast<u64>(i * 1000 / options.connect_rate));
+    }
+}
+
+ClientLoop::~ClientLoop()
+{
+}
+
+void ClientLoop::run()
+{
+    const double ramp_secs = r_options.connections / r_options.connect_rate;
+    m_stop_timer.start([this]() {
+        m_stopping = true;
+        for (auto& peer: m_peers)
+            peer->stop();
+        m_stop_timer.close();
+    }, static_cast<u64>((ramp_secs + r_options.duration) * 1000));
+    m_loop.run();
+}
+
+
+/// CPU and memory of a process, from /proc
+struct ProcSample
+{
+    /// user and system time in seconds
+    double cpu_secs;
+    long rss_kib;
+};
+
+ProcSample sample_proc(pid_t pid)
+{
+    ProcSample sample = {0, 0};
+    {
+        ifstream is(fs("/proc/" << pid << "/stat"));
+        string stat;
+        getline(is, stat);
+        // the command name can have spaces, the fields after it are space separated: state is
+        // field 3, utime and stime 14 and 15
+        const size_t end_comm = stat.rfind(')');
+        if (end_comm != string::npos)
+        {
+            istringstream fields(stat.substr(end_comm + 2));
+            string field;
+            unsigned long utime = 0;
+            unsigned long stime = 0;
+            for (size_t i = 3; i < 14 && fields >> field; ++i) {}
+            fields >> utime >> stime;
+            sample.cpu_secs = static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+    }
+    ifstream is(fs("/proc/" << pid << "/status"));
+    string line;
+    while (getline(is, line))
+        if (line.compare(0, 6, "VmRSS:") == 0)
+            sample.rss_kib = strtol(line.c_str() + 6, nullptr, 10);
+    return sample;
+}
+
+/**
+ * Run the Daemon on the share at @param share_path in a child process, the port it listens on and the
+ * share id are written to @param out_fd. It stops once @param ctl_fd is closed.
+ */
+void run_daemon(const Options& options, const string& share_path, const string& dbpath, int out_fd, int ctl_fd)
+{
+    if (! options.daemon_log)
+    {
+        const int null_fd = ::open("/dev/null", O_WRONLY);
+        ::dup2(null_fd, 2);
+        ::close(null_fd);
+    }
+    trace::set_enabled(! options.trace_path.empty());
+    daemon::Daemon d;
+    const string share_id = d.attach_share(share_path, dbpath);
+    d.share(share_id).fullscan();
+    d.set_port(0);
+    d.set_loops(options.daemon_loops);
+    thread t([&d]() { d.start(); });
+    while (d.listen_port() == 0)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    const string ready = fs(d.listen_port() << " " << share_id << "\n");
+    if (::write(out_fd, ready.data(), ready.size()) != static_cast<ssize_t>(ready.size()))
+        _exit(1);
+    char c;
+    while (::read(ctl_fd, &c, 1) > 0) {}
+    d.stop();
+    t.join();
+    if (! options.metrics_path.empty())
+    {
+        ofstream os(options.metrics_path);
+        os << metrics::Registry::global().prometheus();
+    }
+    if (! options.trace_path.empty())
+    {
+        ofstream os(options.trace_path);
+        trace::write_chrome_json(os);
+    }
+}
+
+/// @returns the @param q quantile of @param v in ms, sorts v
+double quantile_ms(vector<u32>& v, double q)
+{
+    if (v.empty())
+        return 0;
+    sort(v.begin(), v.end());
+    return v[min(v.size() - 1, static_cast<size_t>(q * v.size()))] / 1000.0;
+}
+
+const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1};
+const char* const quantile_names[] = {"p50", "p90", "p99", "p99.9", "max"};
+
+void print(const string& name, vector<u32>& latencies, double secs)
+{
+    cout << left << setw(12) << name << right << setw(9) << latencies.size() << setw(10) << fixed << setprecision(1)
+        << latencies.size() / secs;
+    for (const double q: quantiles)
+        cout << setw(9) << setprecision(2) << quantile_ms(latencies, q);
+    cout << endl;
+}
+
+void write_json(ostream& os, const string& name, vector<u32>& latencies)
+{
+    os << "    \"" << name << "\": {\"count\": " << latencies.size();
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i)
+        os << ", \"" << quantile_names[i] << "_ms\": " << fixed << setprecision(3) << quantile_ms(latencies, quantiles[i]);
+    os << "},\n";
+}
+
+void usage(const char* argv0)
+{
+    cerr << "usage: " << argv0 << " [--connections N] [--connect-rate PER_SEC] [--duration SECS] [--updates-rate PER_SEC]"
+        " [--get-rate PER_SEC] [--threads N] [--daemon-loops N] [--files N] [--file-size BYTES] [--sample-ms MS]"
+        " [--seed N] [--daemon-log 0|1] [--json FILE] [--metrics FILE] [--trace FILE]" << endl
+        << "  runs a Daemon in a child process and loads it with N peers over loopback, each issuing GetUpdates" << endl
+        << "  and Gets at the given mean rates. Exits with 1 if any request or connection failed." << endl;
+}
+
+} // end anon ns
+
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        const string arg = argv[i];
+        if (i + 1 == argc || arg.compare(0, 2, "--") != 0)
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        const char* value = argv[++i];
+        if (arg == "--connections")
+            options.connections = strtoul(value, nullptr, 10);
+        else if (arg == "--connect-rate")
+            options.connect_rate = strtod(value, nullptr);
+        else if (arg == "--duration")
+            options.duration = strtod(value, nullptr);
+        else if (arg == "--updates-rate")
+            options.updates_rate = strtod(value, nullptr);
+        else if (arg == "--get-rate")
+            options.get_rate = strtod(value, nullptr);
+        else if (arg == "--threads")
+            options.threads = max<size_t>(1, strtoul(value, nullptr, 10));
+        else if (arg == "--daemon-loops")
+            options.daemon_loops = strtoul(value, nullptr, 10);
+        else if (arg == "--files")
+            options.files = strtoul(value, nullptr, 10);
+        else if (arg == "--file-size")
+            options.file_size = strtoul(value, nullptr, 10);
+        else if (arg == "--sample-ms")
+            options.sample_ms = max(1ul, strtoul(value, nullptr, 10));
+        else if (arg == "--seed")
+            options.seed = strtoul(value, nullptr, 10);
+        else if (arg == "--daemon-log")
+            options.daemon_log = strtoul(value, nullptr, 10) != 0;
+        else if (arg == "--json")
+            options.json_path = value;
+        else if (arg == "--metrics")
+            options.metrics_path = value;
+        else if (arg == "--trace")
+            options.trace_path = value;
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (options.connections == 0 || options.connect_rate <= 0 || options.duration <= 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // each connection takes a descriptor here and one in the Daemon
+    rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max)
+    {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    if (nofile.rlim_cur < options.connections + 64)
+        cerr << "warning: the limit of open files is " << nofile.rlim_cur << ", connections will fail" << endl;
+
+    utils::Tmpdir share_dir;
+    utils::Tmpdir db_dir;
+    for (size_t i = 0; i < options.files; ++i)
+        utils::create_file(share_dir.path / fs("f" << i), utils::random_bytes(options.file_size));
+
+    // the Daemon is forked before any thread is started
+    int out_pipe[2];
+    int ctl_pipe[2];
+    if (::pipe(out_pipe) != 0 || ::pipe(ctl_pipe) != 0)
+    {
+        cerr << "can't create pipes" << endl;
+        return 2;
+    }
+    const pid_t pid = ::fork();
+    if (pid == -1)
+    {
+        cerr << "can't fork" << endl;
+        return 2;
+    }
+    if (pid == 0)
+    {
+        ::close(out_pipe[0]);
+        ::close(ctl_pipe[1]);
+        run_daemon(options, share_dir.path.string(), (db_dir.path / "share.db").string(), out_pipe[1], ctl_pipe[0]);
+        // the temporary directories belong to the parent
+        _exit(0);
+    }
+    ::close(out_pipe[1]);
+    ::close(ctl_pipe[0]);
+    string ready;
+    char c;
+    while (::read(out_pipe[0], &c, 1) == 1 && c != '\n')
+        ready += c;
+    ::close(out_pipe[0]);
+    istringstream ready_is(ready);
+    int port = 0;
+    string share_id;
+    if (! (ready_is >> port >> share_id))
+    {
+        cerr << "the Daemon didn't start" << endl;
+        ::close(ctl_pipe[1]);
+        waitpid(pid, nullptr, 0);
+        return 2;
+    }
+
+    const ProcSample idle = sample_proc(pid);
+    cout << "Daemon pid " << pid << " on port " << port << " with " << options.daemon_loops << " loops, "
+        << options.files << " files of " << options.file_size << " bytes, RSS " << fixed << setprecision(1) << idle.rss_kib / 1024.0 << " MiB" << endl;
+    cout << defaultfloat << options.connections << " connections at " << options.connect_rate << "/s for " << options.duration
+        << " s, each with " << options.updates_rate << " GetUpdates/s and " << options.get_rate << " Gets/s" << endl;
+
+    vector<unique_ptr<ClientLoop>> clients;
+    for (size_t i = 0; i < options.threads; ++i)
+    {
+        const size_t first = options.connections * i / options.threads;
+        const size_t last = options.connections * (i + 1) / options.threads;
+        clients.emplace_back(make_unique<ClientLoop>(options, port, share_id, first, last - first));
+    }
+    const auto start = clock::now();
+    vector<thread> threads;
+    for (auto& client: clients)
+        threads.emplace_back([&client]() { client->run(); });
+
+    // sample the Daemon until the load is over
+    const double total_secs = options.connections / options.connect_rate + options.duration;
+    ProcSample last = idle;
+    auto last_time = start;
+    double peak_cpu = 0;
+    long peak_rss = idle.rss_kib;
+    while (clock::now() - start < chrono::duration<double>(total_secs))
+    {
+        this_thread::sleep_for(chrono::milliseconds(options.sample_ms));
+        const auto now = clock::now();
+        const ProcSample sample = sample_proc(pid);
+        peak_cpu = max(peak_cpu, (sample.cpu_secs - last.cpu_secs) / chrono::duration<double>(now - last_time).count());
+        peak_rss = max(peak_rss, sample.rss_kib);
+        last = sample;
+        last_time = now;
+    }
+    for (auto& t: threads)
+        t.join();
+    const double secs = chrono::duration<double>(clock::now() - start).count();
+    const ProcSample end = sample_proc(pid);
+    peak_rss = max(peak_rss, end.rss_kib);
+    const double cpu = (end.cpu_secs - idle.cpu_secs) / secs;
+
+    ::close(ctl_pipe[1]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    Stats stats;
+    for (auto& client: clients)
+        stats.merge(client->m_stats);
+    clients.clear();
+
+    cout << left << setw(12) << "" << right << setw(9) << "count" << setw(10) << "per s";
+    for (const char* name: quantile_names)
+        cout << setw(9) << name;
+    cout << "  (ms)" << endl;
+    print("handshake", stats.handshake, secs);
+    print("manifest", stats.manifest, secs);
+    print("GetUpdates", stats.updates, secs);
+    print("Get", stats.get, secs);
+    cout << "Get payload " << setprecision(2) << stats.get_bytes / double(1 << 20) / secs << " MiB/s" << endl;
+    cout << "errors: " << stats.connect_errors << " connect, " << stats.cannot_start << " CannotStart, " << stats.closed
+        << " closed, " << stats.protocol_errors << " protocol, " << stats.no_such_file << " NoSuchFile" << endl;
+    cout << "Daemon CPU " << setprecision(1) << cpu * 100 << "% mean, " << peak_cpu * 100 << "% peak, RSS "
+        << peak_rss / 1024.0 << " MiB peak, " << (peak_rss - idle.rss_kib) / double(options.connections)
+        << " KiB per connection" << endl;
+    if (WIFSIGNALED(status))
+        cerr << "the Daemon was killed by signal " << WTERMSIG(status) << endl;
+    else if (WEXITSTATUS(status) != 0)
+        cerr << "the Daemon exited with " << WEXITSTATUS(status) << endl;
+
+    if (! options.json_path.empty())
+    {
+        ofstream os(options.json_path);
+        os << "{\n    \"connections\": " << options.connections << ", \"duration\": " << options.duration
+            << ", \"updates_rate\": " << options.updates_rate << ", \"get_rate\": " << options.get_rate
+            << ", \"daemon_loops\": " << options.daemon_loops << ",\n";
+        write_json(os, "handshake", stats.handshake);
+        write_json(os, "manifest", stats.manifest);
+        write_json(os, "get_updates", stats.updates);
+        write_json(os, "get", stats.get);
+        os << "    \"errors\": {\"connect\": " << stats.connect_errors << ", \"cannot_start\": " << stats.cannot_start
+            << ", \"closed\": " << stats.closed << ", \"protocol\": " << stats.protocol_errors << ", \"no_such_file\": "
+            << stats.no_such_file << "},\n"
+            << "    \"daemon\": {\"cpu_mean\": " << setprecision(3) << cpu << ", \"cpu_peak\": " << peak_cpu
+            << ", \"rss_idle_kib\": " << idle.rss_kib << ", \"rss_peak_kib\": " << peak_rss << "}\n}\n";
+        if (! os)
+        {
+            cerr << "can't write " << options.json_path << endl;
+            return 2;
+        }
+    }
+    return stats.errors() == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
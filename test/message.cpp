@@ -34,6 +34,7 @@ BOOST_AUTO_TEST_CASE(MessageTest_type_from_str)
     BOOST_CHECK(mtype_from_string("file_data") == MType::FILE_DATA);
     BOOST_CHECK(mtype_from_string("no_such_file") == MType::NO_SUCH_FILE);
     BOOST_CHECK(mtype_from_string("update") == MType::UPDATE);
+    BOOST_CHECK(mtype_from_string("cancel") == MType::CANCEL);
     BOOST_CHECK(mtype_from_string("aarsrasrasa") == MType::UNKNOWN);
 }
 
@@ -50,6 +51,7 @@ BOOST_AUTO_TEST_CASE(MessageTest_type_to_str)
     BOOST_CHECK(mtype_to_string(MType::FILE_DATA) == "file_data");
     BOOST_CHECK(mtype_to_string(MType::NO_SUCH_FILE) == "no_such_file");
     BOOST_CHECK(mtype_to_string(MType::UPDATE) == "update");
+    BOOST_CHECK(mtype_to_string(MType::CANCEL) == "cancel");
 }
 
 void check_message_defaults(const Message& m, MType type)
@@ -0,0 +1,198 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include "cs/metrics.hpp"
+#include "cs/vfs.hpp"
+#include "cs/core/share.hpp"
+#include "jsoncons/json.hpp"
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace cs::metrics;
+using cs::i64;
+using cs::u64;
+
+BOOST_AUTO_TEST_CASE(metrics_histogram_buckets)
+{
+    for (u64 v = 0; v < 16; ++v)
+        BOOST_CHECK_EQUAL(Histogram::bucket(v), v);
+    BOOST_CHECK_EQUAL(Histogram::bucket(16), 16u);
+    BOOST_CHECK_EQUAL(Histogram::bucket(31), 31u);
+    BOOST_CHECK_EQUAL(Histogram::bucket(32), 32u);
+    BOOST_CHECK_EQUAL(Histogram::bucket(33), 32u);
+    BOOST_CHECK_EQUAL(Histogram::bucket(~u64(0)), Histogram::s_buckets - 1);
+    BOOST_CHECK_EQUAL(Histogram::bucket_max(Histogram::s_buckets - 1), ~u64(0));
+
+    // every value is in the bucket below the first one it's not over the max of
+    for (u64 v: {u64(17), u64(100), u64(1000), u64(123456789), u64(1) << 40, (u64(1) << 40) + 12345})
+    {
+        const size_t b = Histogram::bucket(v);
+        BOOST_CHECK_LE(v, Histogram::bucket_max(b));
+        BOOST_CHECK_GT(v, Histogram::bucket_max(b - 1));
+        // less than 1/16 off
+        BOOST_CHECK_LT(Histogram::bucket_max(b) - v, v / 16 + 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(metrics_histogram_quantiles)
+{
+    Histogram h;
+    BOOST_CHECK_EQUAL(h.quantile(0.5), 0u);
+    for (u64 v = 1; v <= 1000; ++v)
+        h.record(v * 1000);
+    BOOST_CHECK_EQUAL(h.count(), 1000u);
+    BOOST_CHECK_EQUAL(h.sum(), 500500000u);
+    BOOST_CHECK_EQUAL(h.max(), 1000000u);
+    for (double q: {0.5, 0.9, 0.99})
+    {
+        const double exact = q * 1000000;
+        BOOST_CHECK_GE(h.quantile(q), exact);
+        BOOST_CHECK_LE(h.quantile(q), exact * 17 / 16);
+    }
+    BOOST_CHECK_EQUAL(h.quantile(1), 1000000u);
+}
+
+BOOST_AUTO_TEST_CASE(metrics_concurrent_updates)
+{
+    Counter counter;
+    Histogram h;
+    vector<thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&]() {
+            for (u64 i = 0; i < 10000; ++i)
+            {
+                counter.inc();
+                h.record(i);
+            }
+        });
+    for (auto& t: threads)
+        t.join();
+    BOOST_CHECK_EQUAL(counter.value(), 40000u);
+    BOOST_CHECK_EQUAL(h.count(), 40000u);
+    BOOST_CHECK_EQUAL(h.max(), 9999u);
+}
+
+BOOST_AUTO_TEST_CASE(metrics_contribution)
+{
+    Gauge gauge;
+    {
+        Contribution a(gauge);
+        a.set(5);
+        Contribution b(gauge);
+        b.add(3);
+        BOOST_CHECK_EQUAL(gauge.value(), 8);
+        Contribution c(move(a));
+        BOOST_CHECK_EQUAL(c.value(), 5);
+        BOOST_CHECK_EQUAL(a.value(), 0);
+        b = move(c);
+        BOOST_CHECK_EQUAL(gauge.value(), 5);
+    }
+    BOOST_CHECK_EQUAL(gauge.value(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(metrics_registry)
+{
+    Registry registry;
+    Counter& c = registry.counter("test_total", "A test", {{"kind", "a"}});
+    BOOST_CHECK_EQUAL(&c, &registry.counter("test_total", "A test", {{"kind", "a"}}));
+    BOOST_CHECK_NE(&c, &registry.counter("test_total", "A test", {{"kind", "b"}}));
+    BOOST_CHECK_THROW(registry.gauge("test_total", "Not a counter"), std::runtime_error);
+    BOOST_CHECK_THROW(registry.counter("9bad", "Bad name"), std::runtime_error);
+    BOOST_CHECK_THROW(registry.counter("test_total", "A test", {{"bad-label", "a"}}), std::runtime_error);
+    BOOST_CHECK_THROW(registry.histogram("test_seconds", "A test", {{"quantile", "a"}}), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(metrics_shared_counter)
+{
+    Registry registry;
+    shared_ptr<Counter> a = registry.shared_counter("test_total", "A test", {{"peer", "a"}});
+    shared_ptr<Counter> b = registry.shared_counter("test_total", "A test", {{"peer", "a"}});
+    BOOST_CHECK_EQUAL(a, b);
+    a->inc(2);
+    a.reset();
+    BOOST_CHECK_NE(registry.prometheus().find("test_total{peer=\"a\"} 2\n"), string::npos);
+
+    // removed with the last holder, and starts over when it's got again
+    b.reset();
+    BOOST_CHECK_EQUAL(registry.prometheus().find("peer=\"a\""), string::npos);
+    a = registry.shared_counter("test_total", "A test", {{"peer", "a"}});
+    BOOST_CHECK_EQUAL(a->value(), 0u);
+
+    // one got with counter() stays
+    Counter& c = registry.counter("test_total", "A test", {{"peer", "c"}});
+    shared_ptr<Counter> shared_c = registry.shared_counter("test_total", "A test", {{"peer", "c"}});
+    BOOST_CHECK_EQUAL(shared_c.get(), &c);
+    shared_c.reset();
+    BOOST_CHECK_EQUAL(&c, &registry.counter("test_total", "A test", {{"peer", "c"}}));
+}
+
+BOOST_AUTO_TEST_CASE(metrics_export)
+{
+    Registry registry;
+    registry.counter("test_total", "Things\ndone", {{"peer", "a\"b"}}).inc(3);
+    registry.gauge("test_queue", "Queued").set(-2);
+    Histogram& h = registry.histogram("test_seconds", "Latency", labels_t(), 1e-9);
+    h.record(2000000000);
+
+    const string prometheus = registry.prometheus();
+    BOOST_CHECK_NE(prometheus.find("# HELP test_total Things\\ndone\n# TYPE test_total counter\ntest_total{peer=\"a\\\"b\"} 3\n"), string::npos);
+    BOOST_CHECK_NE(prometheus.find("# TYPE test_queue gauge\ntest_queue -2\n"), string::npos);
+    BOOST_CHECK_NE(prometheus.find("# TYPE test_seconds summary\n"), string::npos);
+    BOOST_CHECK_NE(prometheus.find("test_seconds{quantile=\"0.5\"} 2\n"), string::npos);
+    BOOST_CHECK_NE(prometheus.find("test_seconds_sum 2\ntest_seconds_count 1\n"), string::npos);
+
+    istringstream is(registry.json());
+    const jsoncons::json json = jsoncons::json::parse(is);
+    BOOST_CHECK_EQUAL(json["test_total"]["type"].as_string(), "counter");
+    BOOST_CHECK_EQUAL(json["test_total"]["series"][0]["labels"]["peer"].as_string(), "a\"b");
+    BOOST_CHECK_EQUAL(json["test_total"]["series"][0]["value"].as_ulonglong(), 3u);
+    BOOST_CHECK_EQUAL(json["test_queue"]["series"][0]["value"].as_longlong(), -2);
+    BOOST_CHECK_EQUAL(json["test_seconds"]["series"][0]["count"].as_ulonglong(), 1u);
+    BOOST_CHECK_CLOSE(json["test_seconds"]["series"][0]["sum"].as_double(), 2.0, 1e-6);
+    BOOST_CHECK_CLOSE(json["test_seconds"]["series"][0]["quantiles"]["0.99"].as_double(), 2.0, 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE(metrics_share_scan)
+{
+    cs::vfs::SyntheticTree::Shape shape;
+    shape.files = 100;
+    shape.max_size = 4096;
+    auto tree = make_shared<cs::vfs::SyntheticTree>("/synthetic", shape);
+    Counter& scanned = counter("cs_scan_files_total", "");
+    Counter& checksummed = counter("cs_checksum_files_total", "");
+    Gauge& queue = gauge("cs_checksum_queue_files", "");
+    const u64 scanned_before = scanned.value();
+    const u64 checksummed_before = checksummed.value();
+    const i64 queue_before = queue.value();
+
+    cs::core::share::Share share("/synthetic", ":memory:", tree);
+    share.scan();
+    while (share.scan_step())
+        BOOST_CHECK_EQUAL(queue.value() - queue_before, static_cast<i64>(share.checksum_queued()));
+    BOOST_CHECK_EQUAL(share.scan_done(), 100u);
+    BOOST_CHECK_EQUAL(scanned.value() - scanned_before, 100u);
+    BOOST_CHECK_EQUAL(checksummed.value() - checksummed_before, 100u);
+    BOOST_CHECK_EQUAL(share.checksum_queued(), 0u);
+    BOOST_CHECK_EQUAL(queue.value(), queue_before);
+
+    tree->mutate(cs::vfs::SyntheticTree::Change::MODIFY, 0.1);
+    share.scan();
+    share.scan_step();
+    BOOST_CHECK_EQUAL(queue.value() - queue_before, static_cast<i64>(share.checksum_queued()));
+}
@@ -17,9 +17,13 @@
 
 #include "cs/protocolstate.hpp"
 #include "cs/core/coder.hpp"
+#include "cs/utils.hpp"
 #include <boost/test/unit_test.hpp>
 #include <vector>
+#include <tuple>
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace cs;
@@ -450,3 +454,440 @@ BOOST_AUTO_TEST_CASE(ProtocolStateTest_garbage_02)
     BOOST_CHECK(proto.m_messages[1].type() == MType::UNKNOWN);
 }
 #endif
+
+namespace
+{
+
+struct InputRecorder
+{
+    InputRecorder():
+        msgs()
+        , payload()
+        , payload_end()
+        , errors()
+    {
+        pstate.m_handle_msg = [this](const char* encoded, size_t encoded_sz, const char* signature, size_t signature_sz, bool)
+        {
+            msgs.emplace_back(string(encoded, encoded_sz), string(signature ? signature : "", signature_sz));
+        };
+        pstate.m_handle_payload = [this](const char* data, size_t len) { payload.append(data, len); };
+        pstate.m_handle_payload_end = [this]() { ++payload_end; };
+        pstate.m_handle_error = [this]() { ++errors; };
+    }
+
+    void input_fragmented(const string& input, size_t fragment)
+    {
+        for (size_t pos = 0; pos < input.size(); pos += fragment)
+            pstate.input(input.data() + pos, min(fragment, input.size() - pos));
+    }
+
+    ProtocolState pstate;
+    vector<pair<string, string>> msgs;
+    string payload;
+    size_t payload_end;
+    size_t errors;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(protocolstate_input_fragmented)
+{
+    Coder coder;
+    string input;
+    Ping ping;
+    ping.m_signature = "signed";
+    coder.encode_msg(ping, input);
+    FileData filedata("ck");
+    coder.encode_msg(filedata, input);
+    input.append(string("\x00\x00\x00\x03:abc", 8));
+    input.append(string("\x00\x00\x00\x02:de", 7));
+    input.append(string("\x00\x00\x00\x00:", 5));
+    coder.encode_msg(Get("ck"), input);
+
+    for (size_t fragment: {1u, 2u, 7u, 64u, 4096u})
+    {
+        InputRecorder rec;
+        rec.input_fragmented(input, fragment);
+        BOOST_CHECK_EQUAL(rec.errors, 0u);
+        BOOST_REQUIRE_EQUAL(rec.msgs.size(), 3u);
+        BOOST_CHECK_EQUAL(rec.msgs[0].first, R"({"timeout":60,"type":"ping"})");
+        BOOST_CHECK_EQUAL(rec.msgs[0].second, "signed");
+        BOOST_CHECK_EQUAL(rec.msgs[1].first, R"({"checksum":"ck","type":"file_data"})");
+        BOOST_CHECK_EQUAL(rec.msgs[2].first, R"({"checksum":"ck","type":"get"})");
+        BOOST_CHECK_EQUAL(rec.payload, "abcde");
+        BOOST_CHECK_EQUAL(rec.payload_end, 1u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(protocolstate_input_large_message)
+{
+    // a message much bigger than the initial buffer, arriving in socket sized reads
+    Coder coder;
+    const string checksum(1 << 20, 'x');
+    const string input = coder.encode_msg(Get(checksum)) + coder.encode_msg(Get("ck"));
+    InputRecorder rec;
+    rec.input_fragmented(input, 65536);
+    BOOST_REQUIRE_EQUAL(rec.msgs.size(), 2u);
+    BOOST_CHECK(rec.msgs[0].first.find(checksum) != string::npos);
+    BOOST_CHECK_EQUAL(rec.msgs[1].first, R"({"checksum":"ck","type":"get"})");
+}
+
+BOOST_AUTO_TEST_CASE(find_message_need)
+{
+    Coder coder;
+    Ping ping;
+    ping.m_signature = "signed";
+    const string coded = coder.encode_msg(ping);
+    const size_t body_end = 6 + string(R"({"timeout":60,"type":"ping"})").size();
+
+    BOOST_CHECK_EQUAL(find_message(coded.substr(0, 3)).need, 6u);
+    BOOST_CHECK_EQUAL(find_message(coded.substr(0, 6)).need, body_end + 5);
+    BOOST_CHECK_EQUAL(find_message(coded.substr(0, body_end + 5)).need, coded.size());
+    MsgRstate partial = find_message(coded.substr(0, coded.size() - 1));
+    BOOST_CHECK(! partial.found);
+    BOOST_CHECK(! partial.garbage);
+    BOOST_CHECK(find_message(coded).found);
+
+    BOOST_CHECK_EQUAL(find_payload(string("\x00\x00", 2)).need, 5u);
+    BOOST_CHECK_EQUAL(find_payload(string("\x00\x00\x00\x03:a", 6)).need, 8u);
+    BOOST_CHECK(find_payload(string("\x00\x00\x00\x03:abc", 8)).found);
+}
+
+namespace
+{
+
+struct OutputRecorder
+{
+    OutputRecorder():
+        writes()
+        , empty_calls()
+    {
+        pstate.set_write_fun([this](const OutputSlice* slices, size_t count)
+        {
+            writes.emplace_back();
+            for (size_t i = 0; i < count; ++i)
+                writes.back().emplace_back(slices[i].data, slices[i].size);
+        });
+        pstate.m_handle_empty_output_buff = [this]() { ++empty_calls; };
+    }
+
+    string written(size_t i) const
+    {
+        string result;
+        for (const auto& slice: writes.at(i))
+            result.append(slice);
+        return result;
+    }
+
+    ProtocolState pstate;
+    vector<vector<string>> writes;
+    size_t empty_calls;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(protocolstate_output_gather)
+{
+    Coder coder;
+    OutputRecorder rec;
+    rec.pstate.set_interleave_control(true);
+    rec.pstate.send_msg(coder.encode_msg(Get("a")), false);
+    // the first message is written right away, the rest waits for it and goes in a single write
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 1u);
+    BOOST_CHECK_EQUAL(rec.written(0), coder.encode_msg(Get("a")));
+
+    rec.pstate.send_msg(coder.encode_msg(Get("b")), false);
+    rec.pstate.send_msg(coder.encode_msg(FileData("c")), true);
+    rec.pstate.send_payload_chunk("abc");
+    const string big(ProtocolState::s_output_coalesce_size, 'x');
+    rec.pstate.send_payload_chunk(string(big));
+    rec.pstate.send_payload_chunk(string());
+    BOOST_CHECK_EQUAL(rec.writes.size(), 1u);
+
+    rec.pstate.on_write_finished();
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 2u);
+    BOOST_CHECK_EQUAL(rec.empty_calls, 0u);
+    // control messages go first in their own buffer, small messages and chunks are coalesced, the
+    // big chunk keeps its own buffer with an inline prefix
+    const vector<string>& slices = rec.writes[1];
+    BOOST_REQUIRE_EQUAL(slices.size(), 5u);
+    BOOST_CHECK_EQUAL(slices[0], coder.encode_msg(Get("b")));
+    BOOST_CHECK_EQUAL(slices[1], coder.encode_msg(FileData("c")) + string("\x00\x00\x00\x03:abc", 8));
+    BOOST_CHECK_EQUAL(slices[2].size(), 5u);
+    BOOST_CHECK_EQUAL(slices[3], big);
+    BOOST_CHECK_EQUAL(slices[4], string("\x00\x00\x00\x00:", 5));
+
+    rec.pstate.on_write_finished();
+    BOOST_CHECK_EQUAL(rec.writes.size(), 2u);
+    BOOST_CHECK_EQUAL(rec.empty_calls, 1u);
+
+    // the written stream parses back
+    InputRecorder in;
+    in.pstate.input(rec.written(0) + rec.written(1));
+    BOOST_CHECK_EQUAL(in.msgs.size(), 3u);
+    BOOST_CHECK_EQUAL(in.payload, "abc" + big);
+    BOOST_CHECK_EQUAL(in.payload_end, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(protocolstate_output_control_order)
+{
+    Coder coder;
+    OutputRecorder rec;
+    rec.pstate.send_msg(coder.encode_msg(Get("a")), false);
+    rec.pstate.send_msg(coder.encode_msg(FileData("c")), true);
+    rec.pstate.send_payload_chunk("abc");
+    rec.pstate.send_msg(coder.encode_msg(Get("b")), false);
+    rec.pstate.send_payload_chunk("def");
+
+    // without interleaving a control message waits for the end of the payload
+    rec.pstate.on_write_finished();
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 2u);
+    BOOST_CHECK_EQUAL(rec.written(1), coder.encode_msg(FileData("c")) + string("\x00\x00\x00\x03:abc\x00\x00\x00\x03:def", 16));
+    rec.pstate.send_payload_chunk(string());
+    rec.pstate.on_write_finished();
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 3u);
+    BOOST_CHECK_EQUAL(rec.written(2), string("\x00\x00\x00\x00:", 5) + coder.encode_msg(Get("b")));
+
+    // once enabled, it goes between chunks, after the control messages already queued behind the payload
+    rec.pstate.send_msg(coder.encode_msg(FileData("d")), true);
+    rec.pstate.send_payload_chunk("ghi");
+    rec.pstate.send_msg(coder.encode_msg(Get("e")), false);
+    rec.pstate.set_interleave_control(true);
+    rec.pstate.send_msg(coder.encode_msg(Get("f")), false);
+    rec.pstate.on_write_finished();
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 4u);
+    BOOST_CHECK_EQUAL(rec.written(3), coder.encode_msg(Get("e")) + coder.encode_msg(Get("f"))
+        + coder.encode_msg(FileData("d")) + string("\x00\x00\x00\x03:ghi", 8));
+    rec.pstate.send_payload_chunk("jkl");
+    rec.pstate.send_msg(coder.encode_msg(Get("g")), false);
+    rec.pstate.on_write_finished();
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 5u);
+    BOOST_CHECK_EQUAL(rec.written(4), coder.encode_msg(Get("g")) + string("\x00\x00\x00\x03:jkl", 8));
+}
+
+BOOST_AUTO_TEST_CASE(protocolstate_output_file)
+{
+    cs::utils::Tmpdir tmp;
+    const bfs::path path = tmp.path / "f";
+    cs::utils::create_file(path, "0123456789");
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    BOOST_REQUIRE(fd != -1);
+    auto close_fd = cs::utils::make_scope_guard([fd]() { ::close(fd); });
+    Coder coder;
+
+    // without a sendfile function the range is read into a chunk
+    {
+        OutputRecorder rec;
+        BOOST_CHECK(! rec.pstate.sendfile_capable());
+        rec.pstate.send_msg(coder.encode_msg(FileData("c")), true);
+        rec.pstate.send_payload_file_chunk(fd, 1, 2, 5);
+        rec.pstate.send_payload_chunk(string());
+        rec.pstate.on_write_finished();
+        BOOST_REQUIRE_EQUAL(rec.writes.size(), 2u);
+        BOOST_CHECK_EQUAL(rec.written(1), string("\x00\x00\x00\x05:23456\x00\x00\x00\x00:", 15));
+    }
+
+    // a range past the end of the file can't be sent as announced
+    {
+        OutputRecorder rec;
+        rec.pstate.send_msg(coder.encode_msg(FileData("c")), true);
+        BOOST_CHECK_THROW(rec.pstate.send_payload_file_chunk(fd, 1, 8, 5), std::runtime_error);
+    }
+
+    // with it, the prefix is written and the range handed over in order
+    {
+        OutputRecorder rec;
+        vector<tuple<int, u64, size_t>> sent;
+        rec.pstate.set_sendfile_fun([&](int fd, u64 offset, size_t size)
+        {
+            sent.emplace_back(fd, offset, size);
+            rec.writes.emplace_back();
+        });
+        BOOST_CHECK(rec.pstate.sendfile_capable());
+        rec.pstate.send_msg(coder.encode_msg(FileData("c")), true);
+        rec.pstate.send_payload_file_chunk(fd, 1, 2, 5);
+        rec.pstate.send_payload_chunk(string());
+        BOOST_CHECK_EQUAL(rec.writes.size(), 1u);
+
+        rec.pstate.on_write_finished();
+        BOOST_REQUIRE_EQUAL(rec.writes.size(), 2u);
+        BOOST_CHECK_EQUAL(rec.written(1), string("\x00\x00\x00\x05:", 5));
+        BOOST_CHECK(sent.empty());
+
+        rec.pstate.on_write_finished();
+        BOOST_REQUIRE_EQUAL(sent.size(), 1u);
+        BOOST_CHECK(sent[0] == make_tuple(fd, u64(2), size_t(5)));
+
+        rec.pstate.on_write_finished();
+        BOOST_REQUIRE_EQUAL(rec.writes.size(), 4u);
+        BOOST_CHECK_EQUAL(rec.written(3), string("\x00\x00\x00\x00:", 5));
+        rec.pstate.on_write_finished();
+        BOOST_CHECK_EQUAL(rec.empty_calls, 1u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(protocolstate_output_file_read)
+{
+    Coder coder;
+    OutputRecorder rec;
+    rec.pstate.set_interleave_control(true);
+    vector<tuple<int, u64, size_t, size_t>> reads;
+    vector<ProtocolState::read_done_t> pending;
+    rec.pstate.set_read_fun([&](int fd, u64, u64 offset, size_t size, size_t read_ahead, ProtocolState::read_done_t done)
+    {
+        reads.emplace_back(fd, offset, size, read_ahead);
+        pending.push_back(done);
+    });
+    const string filedata = coder.encode_msg(FileData("c"));
+    rec.pstate.send_msg(string(filedata), true);
+    rec.pstate.send_payload_file_chunk(7, 1, 0, 5, 5);
+    rec.pstate.send_payload_file_chunk(7, 1, 5, 5);
+    rec.pstate.send_payload_chunk(string());
+    BOOST_REQUIRE_EQUAL(reads.size(), 2u);
+    BOOST_CHECK(reads[0] == make_tuple(7, u64(0), size_t(5), size_t(5)));
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 1u);
+
+    // the output after a chunk waits for its read, control messages don't
+    Ping ping;
+    rec.pstate.send_msg(coder.encode_msg(ping), false);
+    rec.pstate.on_write_finished();
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 2u);
+    BOOST_CHECK_EQUAL(rec.written(1), coder.encode_msg(ping));
+    rec.pstate.on_write_finished();
+    BOOST_CHECK_EQUAL(rec.writes.size(), 2u);
+    BOOST_CHECK_EQUAL(rec.empty_calls, 0u);
+
+    // reads finishing out of order go out in order, a short read at the end leaves nothing
+    pending[1](true, string());
+    BOOST_CHECK_EQUAL(rec.writes.size(), 2u);
+    pending[0](true, "01234");
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 3u);
+    BOOST_CHECK_EQUAL(rec.written(2), string("\x00\x00\x00\x05:01234\x00\x00\x00\x00:", 15));
+    rec.pstate.on_write_finished();
+    BOOST_CHECK_EQUAL(rec.empty_calls, 1u);
+
+    // a failed read is an error, the output stays well framed
+    size_t errors = 0;
+    rec.pstate.m_handle_error = [&errors]() { ++errors; };
+    rec.pstate.send_msg(string(filedata), true);
+    rec.pstate.send_payload_file_chunk(7, 1, 0, 5);
+    rec.pstate.send_payload_chunk(string());
+    pending.back()(false, string());
+    BOOST_CHECK_EQUAL(errors, 1u);
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 4u);
+    rec.pstate.on_write_finished();
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 5u);
+    BOOST_CHECK_EQUAL(rec.written(3) + rec.written(4), filedata + string("\x00\x00\x00\x00:", 5));
+}
+
+
+BOOST_AUTO_TEST_CASE(protocolstate_control_between_chunks)
+{
+    cs::utils::Tmpdir tmp;
+    const bfs::path path = tmp.path / "f";
+    cs::utils::create_file(path, "0123456789");
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    BOOST_REQUIRE(fd != -1);
+    auto close_fd = cs::utils::make_scope_guard([fd]() { ::close(fd); });
+    Coder coder;
+
+    OutputRecorder rec;
+    rec.pstate.set_interleave_control(true);
+    vector<tuple<int, u64, size_t>> sent;
+    rec.pstate.set_sendfile_fun([&](int fd, u64 offset, size_t size)
+    {
+        sent.emplace_back(fd, offset, size);
+        rec.writes.emplace_back();
+    });
+    const string filedata = coder.encode_msg(FileData("c"));
+    rec.pstate.send_msg(string(filedata), true);
+    rec.pstate.send_payload_file_chunk(fd, 1, 2, 5);
+    rec.pstate.send_payload_chunk("abc");
+    rec.pstate.send_payload_chunk(string());
+    Ping ping;
+    ping.m_timeout = 1;
+    rec.pstate.send_msg(coder.encode_msg(ping), false);
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 1u);
+    BOOST_CHECK_EQUAL(rec.written(0), filedata);
+
+    // the control message goes before the pending chunks
+    rec.pstate.on_write_finished();
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 2u);
+    BOOST_CHECK_EQUAL(rec.written(1), coder.encode_msg(ping) + string("\x00\x00\x00\x05:", 5));
+
+    // but not between a chunk prefix and its data
+    ping.m_timeout = 2;
+    rec.pstate.send_msg(coder.encode_msg(ping), false);
+    rec.pstate.on_write_finished();
+    BOOST_REQUIRE_EQUAL(sent.size(), 1u);
+    BOOST_CHECK(sent[0] == make_tuple(fd, u64(2), size_t(5)));
+
+    rec.pstate.on_write_finished();
+    BOOST_REQUIRE_EQUAL(rec.writes.size(), 4u);
+    BOOST_CHECK_EQUAL(rec.written(3), coder.encode_msg(ping) + string("\x00\x00\x00\x03:abc\x00\x00\x00\x00:", 13));
+    rec.pstate.on_write_finished();
+    BOOST_CHECK_EQUAL(rec.empty_calls, 1u);
+
+    // the receiver handles the control messages without ending the payload
+    InputRecorder in;
+    in.input_fragmented(rec.written(0) + rec.written(1) + "23456" + rec.written(3), 3);
+    BOOST_CHECK_EQUAL(in.errors, 0u);
+    BOOST_REQUIRE_EQUAL(in.msgs.size(), 3u);
+    BOOST_CHECK_EQUAL(in.payload, "23456abc");
+    BOOST_CHECK_EQUAL(in.payload_end, 1u);
+
+    // the end of the payload is seen when the room past the input left from earlier data looks
+    // like a message prefix
+    InputRecorder stale;
+    stale.pstate.input(filedata);
+    stale.pstate.input(string("\x00\x00\x00\x14:", 5) + string(20, 'm'));
+    stale.pstate.input(string("\x00\x00\x00\x01:x", 6));
+    stale.pstate.input(string("\x00\x00\x00\x00:", 5));
+    BOOST_CHECK_EQUAL(stale.errors, 0u);
+    BOOST_CHECK_EQUAL(stale.payload, string(20, 'm') + "x");
+    BOOST_CHECK_EQUAL(stale.payload_end, 1u);
+
+    // a payload can't start inside another
+    InputRecorder nested;
+    nested.pstate.input(filedata + filedata);
+    BOOST_CHECK_EQUAL(nested.errors, 1u);
+    BOOST_CHECK_EQUAL(nested.msgs.size(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(protocolstate_input_in_place)
+{
+    Coder coder;
+    const string input = coder.encode_msg(Get(string(10000, 'x'))) + coder.encode_msg(Get("ck"));
+    InputRecorder rec;
+    size_t pos = 0;
+    while (pos < input.size())
+    {
+        auto space = rec.pstate.input_reserve(1000);
+        BOOST_REQUIRE(space.second >= 1000);
+        const size_t len = min<size_t>(1000, input.size() - pos);
+        copy(input.data() + pos, input.data() + pos + len, space.first);
+        rec.pstate.input_commit(len);
+        pos += len;
+    }
+    BOOST_REQUIRE_EQUAL(rec.msgs.size(), 2u);
+    BOOST_CHECK_EQUAL(rec.msgs[0].first.size(), 10000 + string(R"({"checksum":"","type":"get"})").size());
+    BOOST_CHECK_EQUAL(rec.msgs[1].first, R"({"checksum":"ck","type":"get"})");
+}
+
+BOOST_AUTO_TEST_CASE(protocolstate_input_reserve_bounded)
+{
+    // the header of a big message doesn't make room for all of it
+    InputRecorder rec;
+    const string header = string("m") + string("\x00\xff\x00\x00", 4) + ":";
+    rec.pstate.input(header);
+    BOOST_CHECK_EQUAL(rec.errors, 0u);
+    BOOST_CHECK_LE(rec.pstate.input_capacity(), ProtocolState::s_input_reserve_max + header.size());
+
+    // it grows as the message arrives
+    Coder coder;
+    const string big = coder.encode_msg(Get(string(1 << 20, 'x')));
+    InputRecorder in;
+    in.input_fragmented(big, 4096);
+    BOOST_REQUIRE_EQUAL(in.msgs.size(), 1u);
+    BOOST_CHECK_EQUAL(in.msgs[0].first.size(), (1u << 20) + string(R"({"checksum":"","type":"get"})").size());
+}
@@ -0,0 +1,104 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include "cs/ratelimit.hpp"
+
+using namespace std;
+using namespace cs::ratelimit;
+using cs::u64;
+
+namespace
+{
+
+typedef TokenBucket::clock clock;
+
+clock::time_point at(u64 ms)
+{
+    return clock::time_point() + chrono::milliseconds(ms);
+}
+
+} // end anon ns
+
+BOOST_AUTO_TEST_CASE(ratelimit_bucket)
+{
+    TokenBucket bucket;
+    BOOST_CHECK(bucket.unlimited());
+    bucket.consume(1000000, at(0));
+    BOOST_CHECK_EQUAL(bucket.wait(at(0)), 0u);
+
+    // 1000 B/s with a burst of 500, starts full
+    bucket.set_rate(1000, 500, at(0));
+    BOOST_CHECK_EQUAL(bucket.wait(at(0)), 0u);
+    bucket.consume(500, at(0));
+    BOOST_CHECK_GT(bucket.wait(at(0)), 0u);
+    BOOST_CHECK_EQUAL(bucket.wait(at(100)), 0u);
+
+    // transfers are charged after they go, a big one leaves the bucket in debt
+    bucket.consume(1100, at(100));
+    const u64 wait = bucket.wait(at(100));
+    BOOST_CHECK_GE(wait, 1000u);
+    BOOST_CHECK_LE(wait, 1002u);
+    BOOST_CHECK_GT(bucket.wait(at(1099)), 0u);
+    BOOST_CHECK_EQUAL(bucket.wait(at(1100 + 1)), 0u);
+
+    // tokens accumulate up to the burst only
+    bucket.consume(600, at(60000));
+    BOOST_CHECK_GT(bucket.wait(at(60000)), 0u);
+
+    // without a burst it's a second worth of the rate
+    bucket.set_rate(1000, 0, at(120000));
+    bucket.consume(999, at(122000));
+    BOOST_CHECK_EQUAL(bucket.wait(at(122000)), 0u);
+
+    bucket.set_rate(0, 0, at(120000));
+    bucket.consume(1000000, at(120000));
+    BOOST_CHECK_EQUAL(bucket.wait(at(120000)), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(ratelimit_governor)
+{
+    Governor governor;
+    const auto now = clock::now();
+    BOOST_CHECK_EQUAL(governor.wait(Direction::UPLOAD, "share", "peer", now), 0u);
+
+    // each limit applies to its own share or peer, in its direction
+    governor.set_share_limit("share", Direction::UPLOAD, 1000, 1000);
+    governor.set_peer_limit("peer", Direction::DOWNLOAD, 1000, 1000);
+    governor.consume(Direction::UPLOAD, "share", "peer", 2000, now);
+    BOOST_CHECK_GT(governor.wait(Direction::UPLOAD, "share", "peer", now), 0u);
+    BOOST_CHECK_GT(governor.wait(Direction::UPLOAD, "share", "other peer", now), 0u);
+    BOOST_CHECK_EQUAL(governor.wait(Direction::UPLOAD, "other share", "peer", now), 0u);
+    BOOST_CHECK_EQUAL(governor.wait(Direction::DOWNLOAD, "share", "peer", now), 0u);
+
+    governor.consume(Direction::DOWNLOAD, "other share", "peer", 2000, now);
+    BOOST_CHECK_GT(governor.wait(Direction::DOWNLOAD, "other share", "peer", now), 0u);
+    BOOST_CHECK_EQUAL(governor.wait(Direction::DOWNLOAD, "other share", "other peer", now), 0u);
+
+    // the global limit holds everything back, the longest wait wins
+    governor.set_global_limit(Direction::UPLOAD, 100, 100);
+    governor.consume(Direction::UPLOAD, "other share", "other peer", 1100, now);
+    const u64 global_wait = governor.wait(Direction::UPLOAD, "other share", "other peer", now);
+    BOOST_CHECK_GE(global_wait, 9000u);
+    BOOST_CHECK_GE(governor.wait(Direction::UPLOAD, "share", "peer", now), global_wait);
+
+    // limits change at runtime, removing them lets the transfers go right away
+    governor.set_global_limit(Direction::UPLOAD, 0);
+    governor.set_share_limit("share", Direction::UPLOAD, 0);
+    governor.set_peer_limit("peer", Direction::DOWNLOAD, 0);
+    BOOST_CHECK_EQUAL(governor.wait(Direction::UPLOAD, "share", "peer"), 0u);
+    BOOST_CHECK_EQUAL(governor.wait(Direction::DOWNLOAD, "other share", "peer"), 0u);
+}
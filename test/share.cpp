@@ -217,6 +217,34 @@ BOOST_AUTO_TEST_CASE(share_state_0)
 }
 
 
+BOOST_AUTO_TEST_CASE(share_state_changed)
+{
+    // a file changed after a scan is checksummed again on the re-scan, and it's a change of this peer
+    Tmpdir tmp;
+    Share share(tmp.tmpdir.string(), tmp.dbpath.string());
+    create_tree(tmp.tmpdir);
+    share.fullscan();
+    const MFile before = *share.begin();
+    const auto fpath = tmp.tmpdir / before.path;
+    const auto mtime = bfs::last_write_time(fpath);
+    {
+        bfs::ofstream os(fpath);
+        os << "changed";
+    }
+    bfs::last_write_time(fpath, mtime + 10);
+
+    share.fullscan();
+    const auto after = share.get_file_info(before.path);
+    BOOST_REQUIRE(after);
+    BOOST_CHECK(! after->to_checksum);
+    BOOST_CHECK(! after->checksum.empty());
+    BOOST_CHECK_NE(after->checksum, before.checksum);
+    BOOST_CHECK_EQUAL(after->size, 7u);
+    BOOST_CHECK_GT(after->last_changed_rev, before.last_changed_rev);
+    BOOST_CHECK_EQUAL(after->last_changed_by, share.m_peer_id);
+}
+
+
 BOOST_AUTO_TEST_CASE(FrozenManifest_test_0)
 {
     // We can't use std algorithms because the iterators are currently not copyable due to the
@@ -283,6 +311,39 @@ BOOST_AUTO_TEST_CASE(FrozenManifest_test_0)
 }
 
 
+BOOST_AUTO_TEST_CASE(FrozenManifest_since)
+{
+    Tmpdir tmp;
+    Share share(tmp.tmpdir.string(), tmp.dbpath.string());
+    create_tree(tmp.tmpdir);
+    share.fullscan();
+    vector<MFile> manifest;
+    for (const auto& file: share)
+        manifest.emplace_back(file);
+    BOOST_REQUIRE_EQUAL(manifest.size(), 3u);
+    const auto newest = max_element(manifest.begin(), manifest.end(), [](const MFile& a, const MFile& b) {
+        return a.last_changed_rev < b.last_changed_rev;
+    });
+
+    auto count = [&share](const map<string, cs::u64>& since) {
+        size_t result = 0;
+        auto fm = share.get_updates("peer", since);
+        for (const auto& file: *fm)
+        {
+            UNUSED(file);
+            ++result;
+        }
+        return result;
+    };
+    // the changes after the revisions seen of each peer, and all the changes of the peers not seen
+    BOOST_CHECK_EQUAL(count({{share.m_peer_id, newest->last_changed_rev}}), 0u);
+    BOOST_CHECK_EQUAL(count({{share.m_peer_id, newest->last_changed_rev - 1}}), 1u);
+    BOOST_CHECK_EQUAL(count({{"other", 7}}), 3u);
+    // the ids come from the peer
+    BOOST_CHECK_EQUAL(count({{"' OR 1 = 1 OR '", 100}, {share.m_peer_id, newest->last_changed_rev}}), 0u);
+}
+
+
 BOOST_AUTO_TEST_CASE(Share_get_mfiles_by_content_test)
 {
     Tmpdir tmp;
@@ -300,6 +361,108 @@ BOOST_AUTO_TEST_CASE(Share_get_mfiles_by_content_test)
     BOOST_CHECK(mfiles[0].up_to_date);
 }
 
+BOOST_AUTO_TEST_CASE(Share_remote_update)
+{
+    using cs::core::msg::MFile;
+    Tmpdir tmp;
+    Share share(tmp.tmpdir.string(), tmp.dbpath.string());
+    create_file(tmp.tmpdir / "a", "a content");
+    create_file(tmp.tmpdir / "b", "b content");
+    share.fullscan();
+    const auto a = share.get_file_info("a");
+    const auto b = share.get_file_info("b");
+    BOOST_REQUIRE(a && b);
+
+    auto paths = [](const vector<MFile>& files) {
+        vector<string> result;
+        for (const auto& file: files)
+            result.emplace_back(file.path);
+        return result;
+    };
+
+    // files we both created
+    auto res = share.remote_update("P", {
+        MFile(a->checksum, "a", "P", 1, "", a->size, false, a->mode),
+        MFile("other", "b", "P", 1, "", 1, false, b->mode),
+        MFile("new", "new", "P", 1, "", 1, false, 0644),
+        MFile("", "gone", "P", 2, "", 0, true, 0),
+    });
+    BOOST_CHECK_EQUAL(res.noop, 2u);
+    BOOST_CHECK(paths(res.conflict) == vector<string>{"b"});
+    BOOST_CHECK(paths(res.download) == vector<string>{"new"});
+    BOOST_CHECK(res.fast_forward.empty());
+
+    // the peer took our b, then changes it and deletes a
+    res = share.remote_update("P", { b->to_msg_mfile() });
+    BOOST_CHECK_EQUAL(res.noop, 1u);
+    const vector<MFile> changes = {
+        MFile("", "a", "P", 2, "", 0, true, 0),
+        MFile("b2", "b", "P", 3, "", 2, false, b->mode),
+    };
+    res = share.remote_update("P", changes);
+    BOOST_CHECK(paths(res.fast_forward) == vector<string>{"a"});
+    BOOST_CHECK(paths(res.download) == vector<string>{"b"});
+    BOOST_CHECK(res.conflict.empty());
+    BOOST_CHECK_EQUAL(res.download[0].checksum, "b2");
+    BOOST_CHECK_EQUAL(res.download[0].last_changed_rev, 3u);
+
+    // nothing is recorded until it's applied, the deletion may fail
+    res = share.remote_update("P", changes);
+    BOOST_CHECK_EQUAL(res.noop, 0u);
+    BOOST_CHECK(paths(res.fast_forward) == vector<string>{"a"});
+    BOOST_CHECK(paths(res.download) == vector<string>{"b"});
+    share.remote_update_applied("P", res.fast_forward);
+    res = share.remote_update("P", changes);
+    BOOST_CHECK_EQUAL(res.noop, 1u);
+    BOOST_CHECK(res.fast_forward.empty());
+    BOOST_CHECK(paths(res.download) == vector<string>{"b"});
+    share.remote_update_applied("P", res.download);
+    res = share.remote_update("P", changes);
+    BOOST_CHECK_EQUAL(res.noop, 2u);
+
+    // a large batch is a single transaction
+    vector<MFile> many;
+    for (size_t i = 0; i < 10000; ++i)
+        many.emplace_back(fs("c" << i), fs("many/" << i), "Q", i + 1, "", i, false, 0644);
+    res = share.remote_update("Q", many);
+    BOOST_CHECK_EQUAL(res.download.size(), many.size());
+    BOOST_CHECK_EQUAL(res.noop, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(Share_vclock)
+{
+    Tmpdir tmp;
+    {
+        // as the first version stored them
+        auto db = make_shared<sqlite3pp::database>(tmp.dbpath.string().c_str());
+        sqlite3pp::command(db, "CREATE TABLE files_vclock (path TEXT NOT NULL, key TEXT NOT NULL, value INTEGER DEFAULT 0)").execute();
+        sqlite3pp::command(db, "INSERT INTO files_vclock VALUES ('a', 'P', 3), ('a', 'Q', 1), ('b', 'Q', 2)").execute();
+    }
+    cs::PeerId p = 0;
+    {
+        Share share(tmp.tmpdir.string(), tmp.dbpath.string());
+        p = share.intern_peer("P");
+        const cs::PeerId q = share.intern_peer("Q");
+        BOOST_CHECK(p != q);
+        const cs::Vclock a = share.get_vclock("a");
+        BOOST_CHECK_EQUAL(a[p], 3u);
+        BOOST_CHECK_EQUAL(a[q], 1u);
+        BOOST_CHECK_EQUAL(share.get_vclock("b")[q], 2u);
+        BOOST_CHECK(share.get_vclock("c") == cs::Vclock());
+
+        cs::Vclock c;
+        c.increment(share.intern_peer("R"), 7);
+        share.set_vclock("c", c);
+    }
+    Share share(tmp.tmpdir.string(), tmp.dbpath.string());
+    BOOST_CHECK_EQUAL(share.intern_peer("P"), p);
+    BOOST_CHECK_EQUAL(share.get_vclock("c")[share.intern_peer("R")], 7u);
+    BOOST_CHECK_EQUAL(share.get_vclock("a")[p], 3u);
+
+    // reading a clock doesn't leave a statement running that keeps the frozen manifest from being dropped
+    BOOST_CHECK_NO_THROW(share.get_updates("peer"));
+}
+
 BOOST_AUTO_TEST_CASE(Share_move)
 {
     Tmpdir tmp;
@@ -0,0 +1,505 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "csserver.hpp"
+#include "cs/core/share.hpp"
+#include "cs/trace.hpp"
+#include "cs/utils.hpp"
+#include "cs/boost_fs_fwd.hpp"
+#include <boost/filesystem/fstream.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sys/resource.h>
+
+/**
+ * @file sync_bench.cpp
+ * How long a new node takes to join: a seeder server shares a generated tree, a joiner with an
+ * empty share fetches it with GetUpdates and swarming downloads, then the seeder changes some
+ * files and the joiner syncs again with the revisions it has seen. Both servers are in this process
+ * and their connections are pumped in memory, as in test/clearskiesprotocol.cpp.
+ */
+
+using namespace std;
+using namespace cs;
+using namespace cs::core;
+
+namespace
+{
+
+typedef chrono::steady_clock clock;
+
+struct Options
+{
+    Options():
+          files(1000)
+        , min_size(0)
+        , max_size(1 << 20)
+        , depth(3)
+        , fanout(4)
+        , changed(10)
+        , seed(1)
+        , json_path()
+        , trace_path()
+    {}
+
+    size_t files;
+    /// sizes are distributed log-uniformly between these
+    size_t min_size;
+    size_t max_size;
+    /// files are at a random depth up to this, in one of fanout directories at each level
+    size_t depth;
+    size_t fanout;
+    /// percent of the files changed before the incremental sync
+    size_t changed;
+    unsigned seed;
+    string json_path;
+    /// where the trace of the whole run goes, Chrome trace format
+    string trace_path;
+};
+
+/// what a sync moved and how long it took
+struct Phase
+{
+    Phase():
+          files()
+        , bytes()
+        , conflicts()
+        , secs()
+        , messages()
+        , wire_bytes()
+    {}
+
+    /// files downloaded, deleted or changed without download
+    size_t files;
+    /// content downloaded
+    u64 bytes;
+    size_t conflicts;
+    double secs;
+    size_t messages;
+    u64 wire_bytes;
+};
+
+/// a server with a share of its own, the share and its database in temporary directories
+struct Node
+{
+    Node():
+          m_dir()
+        , m_db()
+        , m_server()
+        , m_share_id(m_server.attach_share(m_dir.path.string(), (m_db.path / "share.db").string()))
+    {}
+
+    share::Share& share()
+    {
+        return m_server.share(m_share_id);
+    }
+
+    utils::Tmpdir m_dir;
+    utils::Tmpdir m_db;
+    CSServer m_server;
+    string m_share_id;
+};
+
+class Generator
+{
+public:
+    Generator(const Options& options):
+          r_options(options)
+        , m_rng(options.seed)
+        , m_next_file()
+    {}
+
+    /// @returns the size of a new file at a random path
+    u64 create(const bfs::path& root)
+    {
+        bfs::path path;
+        for (size_t level = m_rng() % (r_options.depth + 1); level; --level)
+            path /= fs("d" << m_rng() % r_options.fanout);
+        path /= fs("f" << m_next_file++);
+        return write(root / path);
+    }
+
+    /// give @param path new random content @returns its size
+    u64 write(const bfs::path& path)
+    {
+        const double lo = log(static_cast<double>(r_options.min_size + 1));
+        const double hi = log(static_cast<double>(r_options.max_size + 1));
+        const size_t size = static_cast<size_t>(exp(uniform_real_distribution<double>(lo, hi)(m_rng))) - 1;
+        string content(size, '\0');
+        for (size_t i = 0; i < size; i += sizeof(u32))
+        {
+            const u32 x = m_rng();
+            memcpy(&content[i], &x, min(sizeof(x), size - i));
+        }
+        bfs::create_directories(path.parent_path());
+        bfs::ofstream os(path, ios::binary);
+        os << content;
+        return size;
+    }
+
+    mt19937& rng()
+    {
+        return m_rng;
+    }
+
+private:
+    const Options& r_options;
+    mt19937 m_rng;
+    size_t m_next_file;
+};
+
+/// the seeder and the joiner, connected in memory
+class Sync
+{
+public:
+    /// concurrent downloads, each has a few pipelined Gets outstanding @sa download::Download::s_max_requests
+    static const size_t s_window = 32;
+
+    Sync():
+          m_seeder()
+        , m_joiner()
+        , m_seeder_conn(m_seeder.m_server.add_connection("joiner"))
+        , m_joiner_conn(m_joiner.m_server.add_connection("seeder"))
+        , m_since()
+        , m_messages()
+        , m_wire_bytes()
+    {
+        // connected to each other's share, as after Start and Go
+        m_seeder_conn.m_protocol.set_state(protocol::CONNECTED);
+        m_seeder_conn.m_protocol.m_share = m_seeder.m_share_id;
+        m_seeder_conn.m_protocol.m_peerinfo.m_peer = "joiner";
+        m_seeder_conn.m_protocol.m_peerinfo.m_name = "joiner";
+        m_joiner_conn.m_protocol.set_state(protocol::CONNECTED);
+        m_joiner_conn.m_protocol.m_share = m_joiner.m_share_id;
+        m_joiner_conn.m_protocol.m_peerinfo.m_peer = "seeder";
+        m_joiner_conn.m_protocol.m_peerinfo.m_name = "seeder";
+        for (auto* conn: {&m_seeder_conn, &m_joiner_conn})
+        {
+            conn->m_protocol.m_peerinfo.m_features = conn->m_protocol.features();
+            auto handle_msg = move(conn->m_protocolstate.m_handle_msg);
+            conn->m_protocolstate.m_handle_msg = [this, handle_msg](const char* msg, size_t msg_sz, const char* sig, size_t sig_sz, bool payload) {
+                ++m_messages;
+                handle_msg(msg, msg_sz, sig, sig_sz, payload);
+            };
+        }
+    }
+
+    /// the joiner asks for what changed since the revisions it saw and applies it
+    Phase run()
+    {
+        Phase phase;
+        const size_t messages = m_messages;
+        const u64 wire_bytes = m_wire_bytes;
+        const auto start = clock::now();
+
+        share::RemoteUpdate update;
+        bool updated = false;
+        m_joiner_conn.m_protocol.m_handle_remote_update = [&](const share::RemoteUpdate& remote_update) {
+            update = remote_update;
+            updated = true;
+        };
+        m_joiner_conn.m_protocol.send_msg(msg::GetUpdates(m_since));
+        while (pump()) {}
+        if (! updated)
+            throw runtime_error("no Update from the seeder");
+
+        vector<msg::MFile> applied;
+        share::Share& share = m_joiner.share();
+        for (const auto& file: update.fast_forward)
+        {
+            const bfs::path path = share.fullpath(file.path);
+            if (file.deleted)
+                bfs::remove(path);
+            else
+                bfs::permissions(path, static_cast<bfs::perms>(file.mode));
+            applied.push_back(file);
+        }
+        phase.conflicts = update.conflict.size();
+
+        // files with the same content are downloaded once
+        map<string, vector<msg::MFile>> by_content;
+        for (const auto& file: update.download)
+            by_content[file.checksum].push_back(file);
+        deque<string> queue;
+        for (const auto& x: by_content)
+            queue.push_back(x.first);
+
+        vector<pair<string, bool>> finished;
+        m_joiner.m_server.m_handle_download_done = [&finished](const string& checksum, bool complete) {
+            finished.emplace_back(checksum, complete);
+        };
+        size_t active = 0;
+        while (! queue.empty() || active)
+        {
+            while (active < s_window && ! queue.empty())
+            {
+                const vector<msg::MFile>& files = by_content[queue.front()];
+                const bfs::path path = share.fullpath(files.front().path);
+                bfs::create_directories(path.parent_path());
+                ++active;
+                if (files.front().size)
+                    m_joiner.m_server.download(queue.front(), files.front().size, path, {"seeder"});
+                else
+                {
+                    bfs::ofstream os(path);
+                    finished.emplace_back(queue.front(), true);
+                }
+                queue.pop_front();
+            }
+            const bool moved = pump();
+            if (! moved && finished.empty())
+                throw runtime_error("the downloads stalled");
+            for (const auto& done: finished)
+            {
+                --active;
+                if (! done.second)
+                    throw runtime_error(fs("download of " << done.first << " failed"));
+                const vector<msg::MFile>& files = by_content[done.first];
+                const bfs::path from = share.fullpath(files.front().path);
+                for (const auto& file: files)
+                {
+                    const bfs::path path = share.fullpath(file.path);
+                    if (path != from)
+                    {
+                        bfs::create_directories(path.parent_path());
+                        bfs::copy_file(from, path, bfs::copy_option::overwrite_if_exists);
+                    }
+                    phase.bytes += file.size;
+                    applied.push_back(file);
+                }
+            }
+            finished.clear();
+        }
+        share.remote_update_applied(m_joiner_conn.m_protocol.m_peerinfo.m_peer, applied);
+
+        // the next sync asks for newer revisions only
+        for (const auto* files: {&update.download, &update.fast_forward, &update.conflict})
+            for (const auto& file: *files)
+                m_since[file.last_changed_by] = max(m_since[file.last_changed_by], file.last_changed_rev);
+
+        phase.files = applied.size();
+        phase.secs = chrono::duration<double>(clock::now() - start).count();
+        phase.messages = m_messages - messages;
+        phase.wire_bytes = m_wire_bytes - wire_bytes;
+        return phase;
+    }
+
+    /// @returns the paths where the joiner's tree differs from the seeder's
+    vector<string> differences()
+    {
+        vector<string> result;
+        for (const auto& file: m_seeder.share())
+        {
+            const bfs::path joined = m_joiner.share().fullpath(file.path);
+            if (file.deleted ? bfs::exists(joined) : ! bfs::exists(joined)
+                || utils::read_file(joined) != utils::read_file(m_seeder.share().fullpath(file.path)))
+                result.push_back(file.path);
+        }
+        return result;
+    }
+
+    Node m_seeder;
+    Node m_joiner;
+
+private:
+    /// move what each side wrote to the other once @returns whether anything moved
+    bool pump()
+    {
+        const string to_joiner = m_seeder.m_server.tx_write("joiner");
+        if (! to_joiner.empty())
+            m_joiner.m_server.receive_raw("seeder", to_joiner);
+        const string to_seeder = m_joiner.m_server.tx_write("seeder");
+        if (! to_seeder.empty())
+            m_seeder.m_server.receive_raw("joiner", to_seeder);
+        m_wire_bytes += to_joiner.size() + to_seeder.size();
+        return ! to_joiner.empty() || ! to_seeder.empty();
+    }
+
+    server::Connection& m_seeder_conn;
+    server::Connection& m_joiner_conn;
+    /// latest revision seen of each peer
+    map<string, u64> m_since;
+    size_t m_messages;
+    u64 m_wire_bytes;
+};
+
+double timed(const function<void()>& f)
+{
+    const auto start = clock::now();
+    f();
+    return chrono::duration<double>(clock::now() - start).count();
+}
+
+/// @returns the peak resident set size in KiB
+long peak_rss_kib()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+const double MiB = 1 << 20;
+
+void print(const string& name, const Phase& p)
+{
+    cout << left << setw(20) << name << right << fixed << setprecision(2)
+        << setw(8) << p.files << " files" << setw(10) << p.bytes / MiB << " MiB" << setw(8) << p.secs << " s"
+        << setw(10) << setprecision(1) << p.files / p.secs << " files/s" << setw(9) << p.bytes / MiB / p.secs << " MiB/s"
+        << setw(8) << p.messages << " msgs" << setw(10) << setprecision(2) << p.wire_bytes / MiB << " MiB on the wire";
+    if (p.conflicts)
+        cout << "  " << p.conflicts << " conflicts";
+    cout << endl;
+}
+
+void write_json(ostream& os, const string& name, const Phase& p)
+{
+    os << fixed << setprecision(3)
+        << "    \"" << name << "\": {\"files\": " << p.files << ", \"bytes\": " << p.bytes << ", \"secs\": " << p.secs
+        << ", \"files_per_s\": " << p.files / p.secs << ", \"mib_per_s\": " << p.bytes / MiB / p.secs
+        << ", \"messages\": " << p.messages << ", \"wire_bytes\": " << p.wire_bytes << ", \"conflicts\": " << p.conflicts << "}";
+}
+
+void usage(const char* argv0)
+{
+    cerr << "usage: " << argv0 << " [--files N] [--min-size BYTES] [--max-size BYTES] [--depth N] [--fanout N]"
+        " [--changed PERCENT] [--seed N] [--json FILE] [--trace FILE]" << endl
+        << "  syncs a generated share of N files between two servers in this process, then syncs again" << endl
+        << "  after PERCENT of the files changed. Exits with 1 if the trees don't match after a sync." << endl;
+}
+
+} // end anon ns
+
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        const string arg = argv[i];
+        if (i + 1 == argc || arg.compare(0, 2, "--") != 0)
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        const char* value = argv[++i];
+        if (arg == "--files")
+            options.files = strtoul(value, nullptr, 10);
+        else if (arg == "--min-size")
+            options.min_size = strtoul(value, nullptr, 10);
+        else if (arg == "--max-size")
+            options.max_size = strtoul(value, nullptr, 10);
+        else if (arg == "--depth")
+            options.depth = strtoul(value, nullptr, 10);
+        else if (arg == "--fanout")
+            options.fanout = max<size_t>(1, strtoul(value, nullptr, 10));
+        else if (arg == "--changed")
+            options.changed = min<size_t>(100, strtoul(value, nullptr, 10));
+        else if (arg == "--seed")
+            options.seed = strtoul(value, nullptr, 10);
+        else if (arg == "--json")
+            options.json_path = value;
+        else if (arg == "--trace")
+            options.trace_path = value;
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (options.min_size > options.max_size)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    trace::set_enabled(! options.trace_path.empty());
+    Sync sync;
+    Generator generator(options);
+    u64 share_bytes = 0;
+    for (size_t i = 0; i < options.files; ++i)
+        share_bytes += generator.create(sync.m_seeder.m_dir.path);
+    cout << "share: " << options.files << " files, " << fixed << setprecision(2) << share_bytes / MiB << " MiB, depth "
+        << options.depth << ", seed " << options.seed << endl;
+
+    const double scan_secs = timed([&]() { sync.m_seeder.share().fullscan(); });
+    cout << left << setw(20) << "seeder scan" << right << setw(36) << setprecision(2) << scan_secs << " s" << endl;
+    const Phase initial = sync.run();
+    print("initial sync", initial);
+    bool ok = sync.differences().empty();
+
+    // some files change and some are new. Deletions aren't announced with GetUpdates yet, FrozenManifest
+    // leaves deleted files out
+    vector<bfs::path> paths;
+    for (const auto& file: sync.m_seeder.share())
+        paths.push_back(sync.m_seeder.share().fullpath(file.path));
+    shuffle(paths.begin(), paths.end(), generator.rng());
+    const size_t changed = paths.size() * options.changed / 100;
+    for (size_t i = 0; i < changed && i < paths.size(); ++i)
+    {
+        const auto mtime = bfs::last_write_time(paths[i]);
+        generator.write(paths[i]);
+        // the scan notices changes by size and mtime, which has a resolution of seconds
+        bfs::last_write_time(paths[i], mtime + 10);
+    }
+    for (size_t i = 0; i < changed / 4; ++i)
+        generator.create(sync.m_seeder.m_dir.path);
+
+    const double rescan_secs = timed([&]() { sync.m_seeder.share().fullscan(); });
+    cout << left << setw(20) << "seeder rescan" << right << setw(36) << setprecision(2) << rescan_secs << " s" << endl;
+    const Phase incremental = sync.run();
+    print("incremental sync", incremental);
+    const vector<string> differences = sync.differences();
+    ok = ok && differences.empty();
+
+    const long rss = peak_rss_kib();
+    cout << "peak RSS " << setprecision(1) << rss / 1024.0 << " MiB" << endl;
+    if (! ok)
+        cerr << "the joiner's tree differs from the seeder's" << (differences.empty() ? "" : ", " + differences.front()) << endl;
+
+    if (! options.json_path.empty())
+    {
+        ofstream os(options.json_path);
+        os << "{\n    \"files\": " << options.files << ", \"bytes\": " << share_bytes << ", \"depth\": " << options.depth
+            << ", \"seed\": " << options.seed << ",\n"
+            << "    \"scan_secs\": " << setprecision(3) << scan_secs << ", \"rescan_secs\": " << rescan_secs << ",\n";
+        write_json(os, "initial", initial);
+        os << ",\n";
+        write_json(os, "incremental", incremental);
+        os << ",\n    \"peak_rss_kib\": " << rss << ",\n    \"verified\": " << (ok ? "true" : "false") << "\n}\n";
+        if (! os)
+        {
+            cerr << "can't write " << options.json_path << endl;
+            return 2;
+        }
+    }
+    if (! options.trace_path.empty())
+    {
+        ofstream os(options.trace_path);
+        trace::write_chrome_json(os);
+        if (! os)
+        {
+            cerr << "can't write " << options.trace_path << endl;
+            return 2;
+        }
+    }
+    return ok ? 0 : 1;
+}
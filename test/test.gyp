@@ -15,6 +15,7 @@
                 "main.cpp",
                 "message.cpp",
                 "core_coder.cpp",
+                "core_download.cpp",
                 "protocolstate.cpp",
                 "share.cpp",
                 "utils.cpp",
@@ -25,6 +26,11 @@
                 "uvpp.cpp",
                 "clearskiesprotocol.cpp",
                 "bytestream.cpp",
+                "tls.cpp",
+                "ratelimit.cpp",
+                "vfs.cpp",
+                "metrics.cpp",
+                "trace.cpp",
             ],
             "include_dirs": [
                 "../src",
@@ -40,5 +46,77 @@
                 ],
             },
         },
+        {
+            "target_name": "bench",
+            "type": "executable",
+            "dependencies": [
+                "../src/cs/cs.gyp:cs",
+                "../vendor/libuv/uv.gyp:libuv",
+            ],
+            "sources": [
+                "bench.cpp",
+                "bench_coder.cpp",
+                "bench_protocolstate.cpp",
+                "bench_share.cpp",
+                "bench_trace.cpp",
+                "bench_uvpp.cpp",
+                "bench_vclock.cpp",
+            ],
+            "include_dirs": [
+                "../src",
+                "../vendor",
+            ],
+            "link_settings": {
+                "libraries": [
+                    "-lsqlite3",
+                    "-lboost_system",
+                    "-lboost_filesystem",
+                ],
+            },
+        },
+        {
+            "target_name": "sync_bench",
+            "type": "executable",
+            "dependencies": [
+                "../src/cs/cs.gyp:cs",
+                "../vendor/libuv/uv.gyp:libuv",
+            ],
+            "sources": [
+                "sync_bench.cpp",
+            ],
+            "include_dirs": [
+                "../src",
+                "../vendor",
+            ],
+            "link_settings": {
+                "libraries": [
+                    "-lsqlite3",
+                    "-lboost_system",
+                    "-lboost_filesystem",
+                ],
+            },
+        },
+        {
+            "target_name": "load_bench",
+            "type": "executable",
+            "dependencies": [
+                "../src/cs/cs.gyp:cs",
+                "../vendor/libuv/uv.gyp:libuv",
+            ],
+            "sources": [
+                "load_bench.cpp",
+            ],
+            "include_dirs": [
+                "../src",
+                "../vendor",
+            ],
+            "link_settings": {
+                "libraries": [
+                    "-lsqlite3",
+                    "-lboost_system",
+                    "-lboost_filesystem",
+                ],
+            },
+        },
     ],
 }
@@ -0,0 +1,298 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include "cs/tls.hpp"
+#include "cs/utils.hpp"
+#include "polarssl/gcm.h"
+#include <chrono>
+
+using namespace std;
+using namespace cs::tls;
+
+namespace
+{
+
+/// one end of a Pipe
+struct End
+{
+    End(unique_ptr<Stream> s):
+        stream(move(s))
+        , output()
+        , wrote()
+        , output_bytes()
+        , input()
+        , writes_finished()
+        , error()
+    {
+        stream->set_write_fun([this](const char* data, size_t len) {
+            output.assign(data, len);
+            output_bytes += len;
+            wrote = true;
+        });
+        stream->m_handle_input = [this](const char* data, size_t len) { input.append(data, len); };
+        stream->m_handle_write_finished = [this]() { ++writes_finished; };
+        stream->m_handle_error = [this]() { error = true; };
+    }
+
+    void write(const string& data)
+    {
+        const cs::OutputSlice slice = { data.data(), data.size() };
+        stream->write(&slice, 1);
+    }
+
+    unique_ptr<Stream> stream;
+    /// ciphertext of the write in progress
+    string output;
+    bool wrote;
+    size_t output_bytes;
+    /// plaintext recieved
+    string input;
+    size_t writes_finished;
+    bool error;
+};
+
+/// a client and a server stream talking in memory
+struct Pipe
+{
+    Pipe(Context& client_ctx, Context& server_ctx, const string& identity, const string& psk):
+        client(make_unique<Stream>(client_ctx, identity, psk))
+        , server(make_unique<Stream>(server_ctx))
+    {
+        client.stream->start();
+        server.stream->start();
+        pump();
+    }
+
+    /// deliver the ciphertext until both ends are idle
+    void pump()
+    {
+        bool progress = true;
+        while (progress)
+        {
+            progress = deliver(client, server) | deliver(server, client);
+        }
+    }
+
+    static bool deliver(End& from, End& to)
+    {
+        if (! from.wrote)
+            return false;
+        from.wrote = false;
+        string data;
+        data.swap(from.output);
+        to.stream->input(data.data(), data.size());
+        from.stream->on_write_finished();
+        return true;
+    }
+
+    End client;
+    End server;
+};
+
+/// a server context knowing the keys of @param keys by identity
+unique_ptr<Context> server_context(const map<string, string>& keys)
+{
+    auto ctx = make_unique<Context>();
+    ctx->m_psk_lookup = [keys](const string& identity) {
+        const auto key_i = keys.find(identity);
+        return key_i == keys.end() ? string() : key_i->second;
+    };
+    return ctx;
+}
+
+} // end anon ns
+
+BOOST_AUTO_TEST_CASE(tls_psk_handshake)
+{
+    const string psk = cs::utils::random_bytes(16);
+    auto server_ctx = server_context({{"share:rw", psk}});
+    Context client_ctx;
+    Pipe pipe(client_ctx, *server_ctx, "share:rw", psk);
+    BOOST_REQUIRE(pipe.client.stream->established());
+    BOOST_REQUIRE(pipe.server.stream->established());
+    BOOST_CHECK(! pipe.client.stream->resumed());
+    BOOST_CHECK(! pipe.server.stream->resumed());
+    BOOST_CHECK_EQUAL(pipe.server.stream->identity(), "share:rw");
+
+    const cs::OutputSlice slices[] = { { "hel", 3 }, { "lo", 2 } };
+    pipe.client.stream->write(slices, 2);
+    pipe.pump();
+    BOOST_CHECK_EQUAL(pipe.server.input, "hello");
+    BOOST_CHECK_EQUAL(pipe.client.writes_finished, 1u);
+
+    const string data = cs::utils::random_bytes(1 << 20);
+    pipe.server.write(data);
+    pipe.pump();
+    BOOST_CHECK(pipe.client.input == data);
+    BOOST_CHECK_EQUAL(pipe.server.writes_finished, 1u);
+    BOOST_CHECK(! pipe.client.error);
+    BOOST_CHECK(! pipe.server.error);
+}
+
+BOOST_AUTO_TEST_CASE(tls_write_before_handshake)
+{
+    const string psk = cs::utils::random_bytes(16);
+    auto server_ctx = server_context({{"share:rw", psk}});
+    Context client_ctx;
+    End client(make_unique<Stream>(client_ctx, "share:rw", psk));
+    End server(make_unique<Stream>(*server_ctx));
+    client.stream->start();
+    // held until the handshake is over
+    client.write("early");
+    BOOST_CHECK_EQUAL(client.writes_finished, 0u);
+    while (Pipe::deliver(client, server) | Pipe::deliver(server, client))
+        ;
+    BOOST_CHECK_EQUAL(server.input, "early");
+    BOOST_CHECK_EQUAL(client.writes_finished, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(tls_wrong_key)
+{
+    auto server_ctx = server_context({{"share:rw", cs::utils::random_bytes(16)}});
+    Context client_ctx;
+    Pipe wrong_key(client_ctx, *server_ctx, "share:rw", cs::utils::random_bytes(16));
+    BOOST_CHECK(! wrong_key.server.stream->established());
+    BOOST_CHECK(wrong_key.client.error || wrong_key.server.error);
+
+    Pipe unknown(client_ctx, *server_ctx, "other:rw", cs::utils::random_bytes(16));
+    BOOST_CHECK(! unknown.server.stream->established());
+    BOOST_CHECK(unknown.server.error);
+}
+
+BOOST_AUTO_TEST_CASE(tls_session_ticket)
+{
+    const string psk = cs::utils::random_bytes(16);
+    auto server_ctx = server_context({{"a:rw", psk}, {"b:rw", psk}});
+    Context client_ctx;
+    {
+        Pipe full(client_ctx, *server_ctx, "a:rw", psk);
+        BOOST_REQUIRE(full.server.stream->established());
+        BOOST_CHECK(! full.server.stream->resumed());
+    }
+    Pipe resumed(client_ctx, *server_ctx, "a:rw", psk);
+    BOOST_REQUIRE(resumed.server.stream->established());
+    BOOST_CHECK(resumed.client.stream->resumed());
+    BOOST_CHECK(resumed.server.stream->resumed());
+    BOOST_CHECK_EQUAL(resumed.server.stream->identity(), "a:rw");
+    resumed.client.write("resumed");
+    resumed.pump();
+    BOOST_CHECK_EQUAL(resumed.server.input, "resumed");
+
+    // a ticket is only good for its identity
+    Pipe other(client_ctx, *server_ctx, "b:rw", psk);
+    BOOST_REQUIRE(other.server.stream->established());
+    BOOST_CHECK(! other.server.stream->resumed());
+
+    // another server can't decrypt the ticket, the keys are exchanged again
+    auto other_server_ctx = server_context({{"a:rw", psk}});
+    Pipe other_server(client_ctx, *other_server_ctx, "a:rw", psk);
+    BOOST_REQUIRE(other_server.server.stream->established());
+    BOOST_CHECK(! other_server.server.stream->resumed());
+}
+
+BOOST_AUTO_TEST_CASE(tls_records)
+{
+    const string psk = cs::utils::random_bytes(16);
+    auto server_ctx = server_context({{"share:rw", psk}});
+    Context client_ctx;
+    Pipe pipe(client_ctx, *server_ctx, "share:rw", psk);
+    BOOST_REQUIRE(pipe.client.stream->established());
+
+    // a payload chunk with its frame header goes in full records, each costs its header, nonce and tag
+    const size_t record_overhead = 5 + 8 + 16;
+    const string header(5, 'h');
+    const string chunk = cs::utils::random_bytes(65536);
+    const cs::OutputSlice slices[] = { { header.data(), header.size() }, { chunk.data(), chunk.size() } };
+    const size_t before = pipe.client.output_bytes;
+    pipe.client.stream->write(slices, 2);
+    const size_t records = (header.size() + chunk.size() + Stream::s_record_size - 1) / Stream::s_record_size;
+    BOOST_CHECK_EQUAL(records, 5u);
+    BOOST_CHECK_EQUAL(pipe.client.output_bytes - before, header.size() + chunk.size() + records * record_overhead);
+    pipe.pump();
+    BOOST_CHECK(pipe.server.input == header + chunk);
+
+    // 64 MiB in chunks, encrypted and decrypted on this thread
+    const size_t total = 64 << 20;
+    pipe.server.input.clear();
+    pipe.server.input.reserve(chunk.size());
+    const auto start = chrono::steady_clock::now();
+    for (size_t sent = 0; sent < total; sent += chunk.size())
+    {
+        pipe.client.stream->write(slices, 2);
+        pipe.pump();
+        pipe.server.input.clear();
+    }
+    const double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    BOOST_TEST_MESSAGE("TLS AES-GCM: " << total / secs / (1 << 20) << " MiB/s encrypted and decrypted");
+}
+
+BOOST_AUTO_TEST_CASE(tls_gcm_known_answer)
+{
+    // AES-128 test cases 2 to 4 of the GCM specification (McGrew and Viega), through the patched
+    // CLMUL paths: a single block, four blocks at once, a partial last block with additional data
+    struct Case
+    {
+        const char* key;
+        const char* iv;
+        const char* add;
+        const char* plain;
+        const char* cipher;
+        const char* tag;
+    };
+    const Case cases[] = {
+        {"00000000000000000000000000000000", "000000000000000000000000", "",
+            "00000000000000000000000000000000",
+            "0388dace60b6a392f328c2b971b2fe78",
+            "ab6e47d42cec13bdf53a67b21257bddf"},
+        {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "",
+            "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+            "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+            "4d5c2af327cd64a62cf35abd2ba6fab4"},
+        {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+            "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+            "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+            "5bc94fbc3221a5db94fae95ae7121a47"},
+    };
+    auto bytes = [](const string& s) { return reinterpret_cast<const unsigned char*>(s.data()); };
+    for (const Case& c: cases)
+    {
+        const string key = cs::utils::hex_to_bin<string>(c.key);
+        const string iv = cs::utils::hex_to_bin<string>(c.iv);
+        const string add = cs::utils::hex_to_bin<string>(c.add);
+        const string plain = cs::utils::hex_to_bin<string>(c.plain);
+        gcm_context gcm;
+        BOOST_REQUIRE_EQUAL(gcm_init(&gcm, POLARSSL_CIPHER_ID_AES, bytes(key), 128), 0);
+
+        string cipher(plain.size(), 0);
+        string tag(16, 0);
+        BOOST_CHECK_EQUAL(gcm_crypt_and_tag(&gcm, GCM_ENCRYPT, plain.size(), bytes(iv), iv.size(), bytes(add), add.size(),
+            bytes(plain), reinterpret_cast<unsigned char*>(&cipher[0]), tag.size(), reinterpret_cast<unsigned char*>(&tag[0])), 0);
+        BOOST_CHECK_EQUAL(cs::utils::bin_to_hex(cipher), c.cipher);
+        BOOST_CHECK_EQUAL(cs::utils::bin_to_hex(tag), c.tag);
+
+        string decrypted(plain.size(), 0);
+        BOOST_CHECK_EQUAL(gcm_auth_decrypt(&gcm, cipher.size(), bytes(iv), iv.size(), bytes(add), add.size(), bytes(tag), tag.size(),
+            bytes(cipher), reinterpret_cast<unsigned char*>(&decrypted[0])), 0);
+        BOOST_CHECK(decrypted == plain);
+        // a flipped bit fails the tag
+        tag[0] ^= 1;
+        BOOST_CHECK_NE(gcm_auth_decrypt(&gcm, cipher.size(), bytes(iv), iv.size(), bytes(add), add.size(), bytes(tag), tag.size(),
+            bytes(cipher), reinterpret_cast<unsigned char*>(&decrypted[0])), 0);
+        gcm_free(&gcm);
+    }
+    BOOST_CHECK_EQUAL(gcm_self_test(0), 0);
+}
@@ -0,0 +1,148 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include "cs/trace.hpp"
+#include "cs/vfs.hpp"
+#include "cs/core/share.hpp"
+#include "jsoncons/json.hpp"
+#include <map>
+#include <sstream>
+#include <thread>
+
+#ifdef CS_TRACE
+
+using namespace std;
+using namespace cs;
+
+namespace
+{
+
+jsoncons::json parse_trace()
+{
+    istringstream is(trace::chrome_json());
+    return jsoncons::json::parse(is);
+}
+
+/// @returns the complete events of @param trace by name
+multimap<string, jsoncons::json> spans(const jsoncons::json& trace)
+{
+    multimap<string, jsoncons::json> result;
+    const jsoncons::json& events = trace["traceEvents"];
+    for (size_t i = 0; i < events.size(); ++i)
+        if (events[i]["ph"].as_string() == "X")
+            result.emplace(events[i]["name"].as_string(), events[i]);
+    return result;
+}
+
+/// stops tracing at the end of a test
+struct Tracing
+{
+    Tracing()
+    {
+        trace::clear();
+        trace::set_enabled(true);
+    }
+
+    ~Tracing()
+    {
+        trace::set_enabled(false);
+        trace::clear();
+    }
+};
+
+} // end anon ns
+
+BOOST_AUTO_TEST_CASE(trace_disabled)
+{
+    trace::clear();
+    {
+        CS_TRACE_SPAN("disabled", "test");
+    }
+    BOOST_CHECK(! trace::enabled());
+    BOOST_CHECK(spans(parse_trace()).empty());
+}
+
+BOOST_AUTO_TEST_CASE(trace_spans)
+{
+    Tracing tracing;
+    trace::set_thread_name("test \"main\"");
+    {
+        CS_TRACE_SPAN("outer", "test");
+        CS_TRACE_SPAN("inner", "test");
+    }
+    const jsoncons::json trace = parse_trace();
+    const auto events = spans(trace);
+    BOOST_REQUIRE_EQUAL(events.size(), 2u);
+    const jsoncons::json& outer = events.find("outer")->second;
+    const jsoncons::json& inner = events.find("inner")->second;
+    BOOST_CHECK_EQUAL(outer["cat"].as_string(), "test");
+    BOOST_CHECK_EQUAL(outer["tid"].as_ulonglong(), inner["tid"].as_ulonglong());
+    BOOST_CHECK_LE(outer["ts"].as_double(), inner["ts"].as_double());
+    BOOST_CHECK_GE(outer["ts"].as_double() + outer["dur"].as_double(), inner["ts"].as_double() + inner["dur"].as_double());
+
+    bool named = false;
+    const jsoncons::json& all = trace["traceEvents"];
+    for (size_t i = 0; i < all.size(); ++i)
+        named = named || (all[i]["ph"].as_string() == "M" && all[i]["args"]["name"].as_string() == "test \"main\""
+            && all[i]["tid"].as_ulonglong() == outer["tid"].as_ulonglong());
+    BOOST_CHECK(named);
+}
+
+BOOST_AUTO_TEST_CASE(trace_ring_wraps)
+{
+    Tracing tracing;
+    trace::set_buffer_events(8);
+    // a new thread gets a ring of the new size
+    thread t([]() {
+        for (u64 i = 0; i < 20; ++i)
+            trace::complete("wrap", "test", i * 1000, i * 1000 + 500);
+    });
+    t.join();
+    trace::set_buffer_events(1 << 16);
+
+    const auto events = spans(parse_trace());
+    BOOST_REQUIRE_EQUAL(events.count("wrap"), 8u);
+    double first = 1e9;
+    for (auto it = events.lower_bound("wrap"); it != events.upper_bound("wrap"); ++it)
+    {
+        first = min(first, it->second["ts"].as_double());
+        BOOST_CHECK_CLOSE(it->second["dur"].as_double(), 0.5, 1e-6);
+    }
+    BOOST_CHECK_CLOSE(first, 12.0, 1e-6);
+
+    trace::clear();
+    BOOST_CHECK(spans(parse_trace()).empty());
+}
+
+BOOST_AUTO_TEST_CASE(trace_share_scan)
+{
+    vfs::SyntheticTree::Shape shape;
+    shape.files = 50;
+    auto tree = make_shared<vfs::SyntheticTree>("/synthetic", shape);
+    core::share::Share share("/synthetic", ":memory:", tree);
+
+    Tracing tracing;
+    share.fullscan();
+    const auto events = spans(parse_trace());
+    BOOST_CHECK(events.count("scan_step"));
+    BOOST_CHECK(events.count("cksum_step"));
+    BOOST_CHECK_EQUAL(events.count("get_file_info"), 50u);
+    BOOST_CHECK_EQUAL(events.count("insert_mfile"), 50u);
+    BOOST_CHECK_EQUAL(events.find("insert_mfile")->second["cat"].as_string(), "sqlite");
+}
+
+#endif
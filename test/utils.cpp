@@ -18,6 +18,7 @@
 
 #include <boost/test/unit_test.hpp>
 #include "cs/utils.hpp"
+#include "cs/file.hpp"
 
 using namespace std;
 
@@ -99,3 +100,19 @@ BOOST_AUTO_TEST_CASE(create_file_read_file_test)
     const auto rcontent = read_file(fpath);
     BOOST_CHECK_EQUAL(content, rcontent);
 }
+
+BOOST_AUTO_TEST_CASE(clone_file_test)
+{
+    Tmpdir tmp;
+    const string content = random_bytes(300000);
+    create_file(tmp.path / "from", content);
+    create_file(tmp.path / "to", "longer than nothing");
+    clone_file(tmp.path / "from", tmp.path / "to");
+    BOOST_CHECK(read_file(tmp.path / "to") == content);
+
+    create_file(tmp.path / "empty", string());
+    clone_file(tmp.path / "empty", tmp.path / "to");
+    BOOST_CHECK(read_file(tmp.path / "to").empty());
+
+    BOOST_CHECK_THROW(clone_file(tmp.path / "missing", tmp.path / "to"), std::runtime_error);
+}
@@ -17,6 +17,10 @@
 #include <boost/test/unit_test.hpp>
 #include "cs/config.hpp"
 #include "uvpp/uvpp.hpp"
+#include "cs/utils.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 
 using namespace std;
@@ -28,3 +32,208 @@ BOOST_AUTO_TEST_CASE(test_handle)
     uv_stream_t* sp = tcp.get<uv_stream_t>();
     UNUSED(sp);
 }
+
+BOOST_AUTO_TEST_CASE(test_sendfile_some)
+{
+    cs::utils::Tmpdir tmp;
+    const bfs::path path = tmp.path / "f";
+    const string content = cs::utils::random_bytes(1 << 22);
+    cs::utils::create_file(path, content);
+    const int in_fd = ::open(path.c_str(), O_RDONLY);
+    BOOST_REQUIRE(in_fd != -1);
+    int sv[2];
+    BOOST_REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    ::fcntl(sv[0], F_SETFL, ::fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+
+    // bigger than the socket buffer, it stops when it's full
+    int64_t offset = 10;
+    size_t length = content.size() - 10;
+    BOOST_CHECK_EQUAL(internal::sendfile_some(sv[0], in_fd, offset, length), UV_EAGAIN);
+    BOOST_CHECK_GT(offset, 10);
+    BOOST_CHECK_EQUAL(offset + length, content.size());
+
+    // announced length beyond the end of the file
+    int sv2[2];
+    BOOST_REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, sv2) == 0);
+    offset = content.size() - 1;
+    length = 2;
+    BOOST_CHECK_EQUAL(internal::sendfile_some(sv2[0], in_fd, offset, length), UV_EOF);
+    ::close(sv2[0]);
+    ::close(sv2[1]);
+    ::close(sv[0]);
+    ::close(sv[1]);
+    ::close(in_fd);
+}
+
+namespace
+{
+
+/// a connected pair of Tcp on a loop
+struct TcpPair
+{
+    TcpPair():
+          loop()
+        , server(loop)
+        , conn(loop)
+        , client(loop)
+    {
+        BOOST_REQUIRE(server.bind("127.0.0.1", 0));
+        bool ip4;
+        string ip;
+        int port;
+        BOOST_REQUIRE(server.getsockname(ip4, ip, port));
+        bool accepted = false;
+        server.listen([this, &accepted](error) {
+            accepted = server.accept(conn);
+            server.close();
+        });
+        client.connect("127.0.0.1", port, [](error) {});
+        while (! accepted)
+            loop.run_once();
+    }
+
+    uvpp::loop loop;
+    Tcp server;
+    Tcp conn;
+    Tcp client;
+};
+
+} // end anon ns
+
+BOOST_AUTO_TEST_CASE(test_sendfile)
+{
+    cs::utils::Tmpdir tmp;
+    const bfs::path path = tmp.path / "f";
+    // bigger than the socket buffers so the sender has to wait for the reader
+    const string content = cs::utils::random_bytes(1 << 22);
+    cs::utils::create_file(path, content);
+    const int in_fd = ::open(path.c_str(), O_RDONLY);
+    BOOST_REQUIRE(in_fd != -1);
+
+    TcpPair p;
+    string received;
+    p.client.read_start([&](const char* buf, ssize_t len) {
+        if (len < 0)
+        {
+            p.client.close();
+            return;
+        }
+        received.append(buf, len);
+    });
+    size_t sent = 0;
+    BOOST_REQUIRE(p.conn.sendfile(in_fd, 10, content.size() - 10, [&](error err) {
+        BOOST_CHECK(! err);
+        // a second one on the same stream
+        if (++sent == 1)
+            BOOST_CHECK(p.conn.sendfile(in_fd, 0, 10));
+        else
+            p.conn.close();
+    }));
+    p.loop.run();
+    BOOST_CHECK_EQUAL(sent, 2u);
+    BOOST_CHECK(received == content.substr(10) + content.substr(0, 10));
+    ::close(in_fd);
+}
+
+BOOST_AUTO_TEST_CASE(test_sendfile_close)
+{
+    cs::utils::Tmpdir tmp;
+    const bfs::path path = tmp.path / "f";
+    const string content = cs::utils::random_bytes(1 << 24);
+    cs::utils::create_file(path, content);
+    const int in_fd = ::open(path.c_str(), O_RDONLY);
+    BOOST_REQUIRE(in_fd != -1);
+
+    // the client doesn't read, the sendfile waits until the stream is closed and doesn't call back
+    TcpPair p;
+    bool called = false;
+    BOOST_REQUIRE(p.conn.sendfile(in_fd, 0, content.size(), [&](error) { called = true; }));
+    uvpp::Timer timer(p.loop);
+    timer.start([&]() {
+        p.conn.close();
+        p.client.close();
+        timer.close();
+    }, 100);
+    p.loop.run();
+    BOOST_CHECK(! called);
+    ::close(in_fd);
+}
+
+BOOST_AUTO_TEST_CASE(test_read_in_place)
+{
+    // the data lands in the buffer given by the alloc callback
+    uvpp::loop l;
+    Tcp server(l);
+    Tcp conn(l);
+    Tcp client(l);
+    BOOST_REQUIRE(server.bind("127.0.0.1", 0));
+    bool ip4;
+    string ip;
+    int port;
+    BOOST_REQUIRE(server.getsockname(ip4, ip, port));
+
+    const string msg = "received in place, several reads";
+    char buf[7];
+    string received;
+    bool in_place = true;
+    server.listen([&](error) {
+        server.accept(conn);
+        conn.read_start(
+            [&](size_t) { return uv_buf_init(buf, sizeof(buf)); },
+            [&](const char* data, ssize_t len) {
+                if (len < 0)
+                {
+                    conn.close();
+                    server.close();
+                    return;
+                }
+                in_place = in_place && (len == 0 || data == buf);
+                received.append(data, len);
+            });
+    });
+    client.connect("127.0.0.1", port, [&](error) {
+        client.write(msg, [&](error) { client.close(); });
+    });
+    l.run();
+    BOOST_CHECK(in_place);
+    BOOST_CHECK_EQUAL(received, msg);
+}
+
+BOOST_AUTO_TEST_CASE(test_file)
+{
+    cs::utils::Tmpdir tmp;
+    const string path = (tmp.path / "f").string();
+    uvpp::loop l;
+    uvpp::file f(l);
+    BOOST_REQUIRE(! f.open(path, O_RDWR | O_CREAT | O_TRUNC));
+    BOOST_CHECK(f.is_open());
+
+    // writes at any offset, the space of the range is reserved first
+    const string content = cs::utils::random_bytes(100000);
+    bool allocated = false;
+    BOOST_REQUIRE(f.allocate(0, content.size(), [&](error) { allocated = true; }));
+    size_t writes = 0;
+    BOOST_REQUIRE(f.write(content.data() + 50000, 50000, 50000, [&](error err) { BOOST_CHECK(! err); ++writes; }));
+    BOOST_REQUIRE(f.write(content.data(), 50000, 0, [&](error err) { BOOST_CHECK(! err); ++writes; }));
+    l.run();
+    BOOST_CHECK(allocated);
+    BOOST_CHECK_EQUAL(writes, 2u);
+
+    // short at the end of the file
+    string buf(1000, 0);
+    size_t got = 0;
+    BOOST_REQUIRE(f.read(&buf[0], buf.size(), content.size() - 10, [&](error err, size_t nread) { BOOST_CHECK(! err); got = nread; }));
+    l.run();
+    BOOST_CHECK_EQUAL(got, 10u);
+    BOOST_CHECK(buf.substr(0, 10) == content.substr(content.size() - 10));
+
+    bool closed = false;
+    BOOST_REQUIRE(f.close([&](error err) { BOOST_CHECK(! err); closed = true; }));
+    BOOST_CHECK(! f.is_open());
+    l.run();
+    BOOST_CHECK(closed);
+    BOOST_CHECK(cs::utils::read_file(path) == content);
+
+    uvpp::file missing(l);
+    BOOST_CHECK(static_cast<bool>(missing.open((tmp.path / "no" / "f").string(), O_RDONLY)));
+}
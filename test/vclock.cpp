@@ -22,73 +22,77 @@ using namespace std;
 
 BOOST_AUTO_TEST_CASE(vlock_test_01)
 {
+    PeerIds ids;
     Vclock paren;
     Vclock desc;
 
-    paren.increment("a");
+    paren.increment(ids.intern("a"));
 
-    desc.increment("a");
-    desc.increment("a");
+    desc.increment(ids.intern("a"));
+    desc.increment(ids.intern("a"));
     BOOST_CHECK(desc.is_descendant(paren));
 
-    desc.increment("b");
+    desc.increment(ids.intern("b"));
     BOOST_CHECK(desc.is_descendant(paren));
 
-    desc.increment("b");
-    paren.increment("b");
+    desc.increment(ids.intern("b"));
+    paren.increment(ids.intern("b"));
     BOOST_CHECK(desc.is_descendant(paren));
 
-    desc.increment("b");
+    desc.increment(ids.intern("b"));
     BOOST_CHECK(desc.is_descendant(paren));
 
-    desc.increment("a");
-    desc.increment("c");
+    desc.increment(ids.intern("a"));
+    desc.increment(ids.intern("c"));
     BOOST_CHECK(desc.is_descendant(paren));
 }
 
 BOOST_AUTO_TEST_CASE(vlock_test_02)
 {
+    PeerIds ids;
     Vclock paren;
     Vclock desc;
 
-    desc.increment("a", std::numeric_limits<u32>::max() / 2 - 1);
+    desc.increment(ids.intern("a"), std::numeric_limits<u32>::max() / 2 - 1);
     BOOST_CHECK(desc.is_descendant(paren));
 
 
-    desc.increment("a", std::numeric_limits<u32>::max() / 2 + 3);
-    paren.increment("a", std::numeric_limits<u32>::max() - 1);
+    desc.increment(ids.intern("a"), std::numeric_limits<u32>::max() / 2 + 3);
+    paren.increment(ids.intern("a"), std::numeric_limits<u32>::max() - 1);
     BOOST_CHECK(desc.is_descendant(paren));
 
-    desc.increment("a");
+    desc.increment(ids.intern("a"));
     BOOST_CHECK(desc.is_descendant(paren));
 }
 
 BOOST_AUTO_TEST_CASE(vlock_test_03)
 {
+    PeerIds ids;
     Vclock paren;
     Vclock desc;
 
-    desc.increment("a", std::numeric_limits<u32>::max() / 2 - 1);
+    desc.increment(ids.intern("a"), std::numeric_limits<u32>::max() / 2 - 1);
     BOOST_CHECK(desc.is_descendant(paren));
 
-    desc.increment("a", 3);
-    paren.increment("a", 3);
+    desc.increment(ids.intern("a"), 3);
+    paren.increment(ids.intern("a"), 3);
     BOOST_CHECK(desc.is_descendant(paren));
 
-    desc.increment("a", 3);
+    desc.increment(ids.intern("a"), 3);
     BOOST_CHECK(desc.is_descendant(paren));
 
 }
 
 BOOST_AUTO_TEST_CASE(vlock_values)
 {
+    PeerIds ids;
     Vclock x;
 
-    x.increment("A");
-    x.increment("B");
-    x.increment("C", 2u);
+    x.increment(ids.intern("A"));
+    x.increment(ids.intern("B"));
+    x.increment(ids.intern("C"), 2u);
 
-    auto values = x.get_values();
+    auto values = x.get_values(ids);
     BOOST_CHECK_EQUAL(values.size(), 3u);
 
     BOOST_CHECK_EQUAL(values["A"], 1u);
@@ -98,12 +102,72 @@ BOOST_AUTO_TEST_CASE(vlock_values)
 
 BOOST_AUTO_TEST_CASE(vlock_construction)
 {
+    PeerIds ids;
     map<string, u64> vs;
     vs["A"] = 5;
     vs["B"] = 3;
 
-    Vclock x(vs);
-    BOOST_CHECK_EQUAL(x["A"], 5);
-    BOOST_CHECK_EQUAL(x["B"], 3);
-    BOOST_CHECK(x.get_values() == vs);
+    Vclock x(vs, ids);
+    BOOST_CHECK_EQUAL(x[ids.intern("A")], 5);
+    BOOST_CHECK_EQUAL(x[ids.intern("B")], 3);
+    BOOST_CHECK(x.get_values(ids) == vs);
+}
+
+BOOST_AUTO_TEST_CASE(vlock_conflict)
+{
+    PeerIds ids;
+    Vclock a;
+    Vclock b;
+    a.increment(ids.intern("a"));
+    b.increment(ids.intern("b"));
+    BOOST_CHECK(! a.is_descendant(b));
+    BOOST_CHECK(! b.is_descendant(a));
+
+    b.increment(ids.intern("a"));
+    BOOST_CHECK(b.is_descendant(a));
+    BOOST_CHECK(! a.is_descendant(b));
+    BOOST_CHECK(a.is_descendant(Vclock()));
+}
+
+BOOST_AUTO_TEST_CASE(vlock_peer_ids)
+{
+    PeerIds ids;
+    const PeerId a = ids.intern("a");
+    BOOST_CHECK_EQUAL(a, 1u);
+    BOOST_CHECK_EQUAL(ids.intern("b"), 2u);
+    BOOST_CHECK_EQUAL(ids.intern("a"), a);
+    BOOST_CHECK_EQUAL(ids.name(a), "a");
+    BOOST_CHECK_THROW(ids.name(3), std::out_of_range);
+
+    // loaded with gaps, new ones go after the last
+    ids.add(5, "e");
+    ids.add(5, "e");
+    BOOST_CHECK_THROW(ids.add(5, "f"), std::runtime_error);
+    BOOST_CHECK_THROW(ids.add(6, "a"), std::runtime_error);
+    BOOST_CHECK_EQUAL(ids.intern("f"), 6u);
+    PeerId id = 0;
+    BOOST_CHECK(ids.find("e", id));
+    BOOST_CHECK_EQUAL(id, 5u);
+    BOOST_CHECK(! ids.find("g", id));
+}
+
+BOOST_AUTO_TEST_CASE(vlock_pack)
+{
+    Vclock x;
+    x.increment(300, 5);
+    x.increment(2, u64(1) << 40);
+    x.merge(7, 3);
+    x.merge(7, 2);
+    BOOST_CHECK_EQUAL(x.entries().size(), 3u);
+    BOOST_CHECK_EQUAL(x.entries()[0].id, 2u);
+    BOOST_CHECK_EQUAL(x[7], 3u);
+
+    const string packed = x.pack();
+    BOOST_CHECK_EQUAL(packed.size(), 1u + 6u + 1u + 1u + 2u + 1u);
+    BOOST_CHECK(Vclock::unpack(packed.data(), packed.size()) == x);
+    BOOST_CHECK(Vclock::unpack(nullptr, 0) == Vclock());
+
+    BOOST_CHECK_THROW(Vclock::unpack(packed.data(), packed.size() - 1), std::runtime_error);
+    const string out_of_order("\x02\x01\x00\x01", 4);
+    BOOST_CHECK_THROW(Vclock::unpack(out_of_order.data(), out_of_order.size()), std::runtime_error);
 }
@@ -0,0 +1,226 @@
+/*
+ *  This file is part of clearskies_core.
+
+ *  clearskies_core is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+
+ *  clearskies_core is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with clearskies_core.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <boost/test/unit_test.hpp>
+#include "cs/vfs.hpp"
+#include "cs/core/share.hpp"
+#include "cs/utils.hpp"
+#include "sha2/sha2.h"
+#include <algorithm>
+#include <map>
+
+using namespace std;
+using namespace cs;
+using namespace cs::vfs;
+
+namespace
+{
+
+/// @returns the files of a walk of @param root by path
+map<string, Stat> walk_all(Filesystem& fs, const bfs::path& root)
+{
+    map<string, Stat> result;
+    auto walker = fs.walk(root);
+    Entry entry;
+    while (walker->next(entry))
+        result.emplace(entry.path, entry.stat);
+    return result;
+}
+
+string read_all(Filesystem& fs, const bfs::path& path)
+{
+    auto reader = fs.open(path);
+    BOOST_REQUIRE(reader);
+    string result;
+    char buf[1000];
+    while (size_t len = reader->read(buf, sizeof(buf)))
+        result.append(buf, len);
+    return result;
+}
+
+string sha256(const string& data)
+{
+    sha2::SHA256_CTX ctx;
+    sha2::SHA256_Init(&ctx);
+    sha2::SHA256_Update(&ctx, reinterpret_cast<const u8*>(data.data()), data.size());
+    string result(SHA256_DIGEST_STRING_LENGTH, 0);
+    sha2::SHA256_End(&ctx, &result[0]);
+    result.resize(result.size() - 1);
+    return result;
+}
+
+SyntheticTree::Shape small_shape()
+{
+    SyntheticTree::Shape shape;
+    shape.files = 1000;
+    shape.files_per_dir = 10;
+    shape.fanout = 4;
+    shape.depth = 2;
+    shape.max_size = 4000;
+    return shape;
+}
+
+} // end anon ns
+
+BOOST_AUTO_TEST_CASE(vfs_disk)
+{
+    utils::Tmpdir tmp;
+    utils::create_file(tmp.path / "a", "abc");
+    utils::create_file(tmp.path / "d" / "e" / "b", string(3000, 'x'));
+    bfs::create_directories(tmp.path / "empty");
+    auto disk = vfs::disk();
+
+    const auto files = walk_all(*disk, tmp.path);
+    BOOST_REQUIRE_EQUAL(files.size(), 2u);
+    BOOST_CHECK(files.at("a").type == Type::REGULAR);
+    BOOST_CHECK_EQUAL(files.at("a").size, 3u);
+    BOOST_CHECK_EQUAL(files.at("a").mtime, bfs::last_write_time(tmp.path / "a"));
+    BOOST_CHECK_EQUAL(files.at("d/e/b").size, 3000u);
+    // the walk is the same with a trailing separator
+    BOOST_CHECK(walk_all(*disk, tmp.path.string() + "/").count("d/e/b"));
+
+    BOOST_CHECK(disk->stat(tmp.path).type == Type::DIRECTORY);
+    BOOST_CHECK(disk->stat(tmp.path / "none").type == Type::NONE);
+    BOOST_CHECK_EQUAL(read_all(*disk, tmp.path / "d" / "e" / "b"), string(3000, 'x'));
+    BOOST_CHECK(! disk->open(tmp.path / "none"));
+}
+
+BOOST_AUTO_TEST_CASE(vfs_synthetic_tree)
+{
+    SyntheticTree tree("/synthetic", small_shape());
+    SyntheticTree same("/synthetic", small_shape());
+    const auto files = walk_all(tree, "/synthetic");
+    BOOST_REQUIRE_EQUAL(files.size(), 1000u);
+    BOOST_CHECK(files == walk_all(same, "/synthetic"));
+    // 100 directories of 10 files, at least 2 levels deep and 4 for the last ones
+    BOOST_CHECK(files.count("d0/d0/f0"));
+    BOOST_CHECK(files.count("d1/d2/d0/d3/f999"));
+    BOOST_CHECK_EQUAL(tree.path(999), "d1/d2/d0/d3/f999");
+
+    for (const auto& file: files)
+    {
+        BOOST_CHECK(file.second.type == Type::REGULAR);
+        BOOST_CHECK_LE(file.second.size, 4000u);
+        BOOST_CHECK_EQUAL(file.second.mode, 0644u);
+        const bfs::path path = bfs::path("/synthetic") / file.first;
+        BOOST_CHECK(tree.stat(path).mtime == file.second.mtime);
+    }
+    const string content = read_all(tree, "/synthetic/d1/d2/d0/d3/f999");
+    BOOST_CHECK_EQUAL(content.size(), files.at("d1/d2/d0/d3/f999").size);
+    BOOST_CHECK_EQUAL(content, read_all(same, "/synthetic/d1/d2/d0/d3/f999"));
+
+    BOOST_CHECK(tree.stat("/synthetic").type == Type::DIRECTORY);
+    BOOST_CHECK(tree.stat("/synthetic/d0/f0").type == Type::NONE);
+    BOOST_CHECK(tree.stat("/synthetic/d0/d0/d0/d0/f1000").type == Type::NONE);
+    BOOST_CHECK(tree.stat("/other/d0/d0/f0").type == Type::NONE);
+    BOOST_CHECK(! tree.open("/synthetic/d0/d0/x0"));
+    BOOST_CHECK_THROW(tree.walk("/other"), std::runtime_error);
+
+    auto shape = small_shape();
+    shape.seed = 2;
+    BOOST_CHECK(walk_all(*make_unique<SyntheticTree>("/synthetic", shape), "/synthetic") != files);
+    shape.fanout = 1;
+    BOOST_CHECK_THROW(SyntheticTree("/synthetic", shape), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(vfs_synthetic_mutate)
+{
+    SyntheticTree tree("/synthetic", small_shape());
+    const auto before = walk_all(tree, "/synthetic");
+    const string content = read_all(tree, "/synthetic/" + tree.path(0));
+
+    tree.mutate(SyntheticTree::Change::DELETE, 0.1, SyntheticTree::Spread::CLUSTERED);
+    tree.mutate(SyntheticTree::Change::MODIFY, 0.2);
+    tree.mutate(SyntheticTree::Change::CREATE, 0.05);
+    BOOST_CHECK_EQUAL(tree.capacity(), 1050u);
+    const auto after = walk_all(tree, "/synthetic");
+    BOOST_CHECK_EQUAL(after.size(), 950u);
+
+    size_t deleted = 0;
+    size_t modified = 0;
+    vector<u64> deleted_indices;
+    for (u64 i = 0; i < 1000; ++i)
+    {
+        const auto it = after.find(tree.path(i));
+        if (it == after.end())
+        {
+            ++deleted;
+            deleted_indices.push_back(i);
+        }
+        else if (it->second.mtime != before.at(tree.path(i)).mtime)
+            ++modified;
+    }
+    BOOST_CHECK_EQUAL(deleted, 100u);
+    // a run of consecutive files, wrapping around the end
+    BOOST_CHECK(deleted_indices.back() - deleted_indices.front() == 99 || deleted_indices.front() == 0);
+    // 20% of the files left
+    BOOST_CHECK_GT(modified, 140u);
+    BOOST_CHECK_LT(modified, 240u);
+    for (u64 i = 1000; i < 1050; ++i)
+        BOOST_CHECK(after.count(tree.path(i)));
+
+    // the mtime changes but not the content
+    SyntheticTree touched("/synthetic", small_shape());
+    touched.mutate(SyntheticTree::Change::TOUCH, 1);
+    touched.mutate(SyntheticTree::Change::CHMOD, 1);
+    BOOST_CHECK(touched.file_stat(0).mtime != before.at(tree.path(0)).mtime);
+    BOOST_CHECK_EQUAL(touched.file_stat(0).mode, 0444u);
+    BOOST_CHECK_EQUAL(read_all(touched, "/synthetic/" + tree.path(0)), content);
+}
+
+BOOST_AUTO_TEST_CASE(vfs_share_scan)
+{
+    // the scanner over a tree that is not on disk
+    auto tree = make_shared<SyntheticTree>("/synthetic", small_shape());
+    core::share::Share share("/synthetic", ":memory:", tree);
+    BOOST_CHECK_THROW(core::share::Share("/synthetic/none", ":memory:", tree), std::runtime_error);
+    share.fullscan();
+
+    map<string, core::share::MFile> files;
+    for (const auto& file: share)
+        files.emplace(file.path, file);
+    BOOST_REQUIRE_EQUAL(files.size(), 1000u);
+    const auto& f999 = files.at(tree->path(999));
+    BOOST_CHECK_EQUAL(f999.checksum, sha256(read_all(*tree, "/synthetic/" + tree->path(999))));
+    BOOST_CHECK_EQUAL(f999.size, tree->file_stat(999).size);
+
+    tree->mutate(SyntheticTree::Change::MODIFY, 0.1, SyntheticTree::Spread::CLUSTERED);
+    tree->mutate(SyntheticTree::Change::DELETE, 0.05);
+    tree->mutate(SyntheticTree::Change::CREATE, 0.02);
+    share.fullscan();
+    size_t changed = 0;
+    size_t deleted = 0;
+    size_t created = 0;
+    for (const auto& file: share)
+    {
+        const auto it = files.find(file.path);
+        if (it == files.end())
+            ++created;
+        else if (file.deleted)
+            ++deleted;
+        else if (file.checksum != it->second.checksum)
+        {
+            ++changed;
+            BOOST_CHECK_GT(file.last_changed_rev, it->second.last_changed_rev);
+        }
+        BOOST_CHECK(! file.to_checksum);
+    }
+    BOOST_CHECK_EQUAL(created, 20u);
+    BOOST_CHECK_EQUAL(deleted, 1000 - walk_all(*tree, "/synthetic").size() + created);
+    // the modified files that weren't deleted, except the few that kept the same content
+    BOOST_CHECK_GT(changed, 70u);
+    BOOST_CHECK_LE(changed, 100u);
+}